@@ -0,0 +1,139 @@
+//! What the pipeline needs from capture and from the encoder, so it runs the
+//! same on VA-API as on the CPU-only stub backend in [`crate::stub`].
+
+use std::sync::Arc;
+
+use anyhow::{Error, Result};
+use cros_codecs::backend::vaapi::surface_pool::PooledVaSurface;
+
+use crate::{
+    capture::{CaptureControl, Capturer},
+    cursor::Cursor,
+    encode_ffmpeg::{Encoder, EncoderSettings},
+    frame_buffer::FrameReader,
+    packet::Packet,
+    recovery::Stage,
+};
+
+/// A source of captured frames, read at the pace of the caller.
+pub trait FrameSource {
+    type Frame: Send + Sync + 'static;
+    type Control: CaptureReset;
+
+    /// Returns the latest frame, which may be one returned before.
+    fn read_frame(&self) -> Option<Arc<Self::Frame>>;
+    /// Returns a reader that only gets frames it hasn't seen, and can wait
+    /// for them.
+    fn subscribe(&self) -> FrameReader<Self::Frame>;
+    fn cursor(&self) -> Cursor;
+    /// Returns the error capture ran into since the last call, if any.
+    fn take_error(&self) -> Option<(Stage, Error)>;
+    /// Returns a handle for recovering capture from another thread.
+    fn control(&self) -> Self::Control;
+}
+
+pub trait CaptureReset: Send + 'static {
+    /// Rebuilds the surfaces frames are imported into.
+    fn reset(&self) -> Result<()>;
+}
+
+/// Everything needed to open an encoder session besides the first frame.
+pub trait EncoderConfig: Clone + Send + 'static {
+    fn settings(&self) -> &EncoderSettings;
+    /// Lets the pipeline change settings for the sessions it opens later.
+    fn settings_mut(&mut self) -> &mut EncoderSettings;
+}
+
+/// An encoder session for frames of a [`FrameSource`].
+pub trait FrameEncoder: Sized {
+    type Frame;
+    type Config: EncoderConfig;
+
+    fn new(config: &Self::Config, first_frame: &Arc<Self::Frame>) -> Result<Self>;
+    fn next_pts(&self) -> i64;
+    fn set_next_pts(&mut self, pts: i64);
+    fn set_cursor(&mut self, cursor: Cursor);
+    /// Switches to `bitrate` bits/s, starting a new session with an IDR.
+    fn set_bitrate(&mut self, bitrate: i64) -> Result<()>;
+    fn encode(&mut self, frame: Arc<Self::Frame>) -> Result<()>;
+    fn poll_packet(&mut self) -> Result<Option<Packet>>;
+    fn drain_packets(&mut self) -> Result<Vec<Packet>>;
+}
+
+impl FrameSource for Capturer {
+    type Frame = PooledVaSurface<()>;
+    type Control = CaptureControl;
+
+    fn read_frame(&self) -> Option<Arc<Self::Frame>> {
+        Capturer::read_frame(self)
+    }
+
+    fn subscribe(&self) -> FrameReader<Self::Frame> {
+        Capturer::subscribe(self)
+    }
+
+    fn cursor(&self) -> Cursor {
+        Capturer::cursor(self)
+    }
+
+    fn take_error(&self) -> Option<(Stage, Error)> {
+        Capturer::take_error(self)
+    }
+
+    fn control(&self) -> Self::Control {
+        Capturer::control(self)
+    }
+}
+
+impl CaptureReset for CaptureControl {
+    fn reset(&self) -> Result<()> {
+        CaptureControl::reset(self)
+    }
+}
+
+impl EncoderConfig for EncoderSettings {
+    fn settings(&self) -> &EncoderSettings {
+        self
+    }
+
+    fn settings_mut(&mut self) -> &mut EncoderSettings {
+        self
+    }
+}
+
+impl FrameEncoder for Encoder {
+    type Frame = PooledVaSurface<()>;
+    type Config = EncoderSettings;
+
+    fn new(settings: &EncoderSettings, first_frame: &Arc<Self::Frame>) -> Result<Self> {
+        Encoder::new(*settings, first_frame)
+    }
+
+    fn next_pts(&self) -> i64 {
+        Encoder::next_pts(self)
+    }
+
+    fn set_next_pts(&mut self, pts: i64) {
+        Encoder::set_next_pts(self, pts)
+    }
+
+    fn set_cursor(&mut self, cursor: Cursor) {
+        Encoder::set_cursor(self, cursor)
+    }
+
+    fn set_bitrate(&mut self, bitrate: i64) -> Result<()> {
+        Encoder::set_bitrate(self, bitrate)
+    }
+
+    fn encode(&mut self, frame: Arc<Self::Frame>) -> Result<()> {
+        Encoder::encode(self, frame)
+    }
+
+    fn poll_packet(&mut self) -> Result<Option<Packet>> {
+        Encoder::poll_packet(self)
+    }
+
+    fn drain_packets(&mut self) -> Result<Vec<Packet>> {
+        Encoder::drain_packets(self)
+    }
+}
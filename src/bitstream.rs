@@ -0,0 +1,480 @@
+//! Reusable buffers for encoded frames.
+//!
+//! Without a pool, every encoded frame lands in a newly allocated buffer.
+//! Buffers of a few hundred kilobytes come straight from mmap, so each one
+//! page-faults on first write and is unmapped again once the replay buffer
+//! lets go of the packet. Instead, packets are written into buffers taken
+//! from a pool and return to it when their last reference is dropped.
+//!
+//! A new buffer is sized for the frames it is likely to be reused for rather
+//! than the one at hand: the running average frame size, with headroom,
+//! seeded from the rate control target. Keyframes are several times larger
+//! and are tracked separately. Encoders don't flag keyframes before writing
+//! them, so they are told apart by size.
+//!
+//! Each buffer lives in a slot, boxed once when it is allocated, that also
+//! holds the packet's timestamp and a reference count. A finished packet
+//! shares its slot rather than wrapping it in a new allocation, and FFmpeg
+//! gets the slot itself as the opaque of the buffer it references.
+
+use std::{
+    ffi::c_void,
+    fmt,
+    ops::{Deref, DerefMut},
+    ptr::NonNull,
+    sync::{
+        atomic::{fence, AtomicUsize, Ordering},
+        Arc, Mutex,
+    },
+};
+
+use nix::sys::mman::{madvise, MmapAdvise};
+
+/// Free buffers kept for reuse. Most packets are held by the replay buffer
+/// and return one at a time as it evicts them, so few are free at once.
+const MAX_FREE: usize = 32;
+
+/// Buffers are allocated in whole pages.
+const PAGE_SIZE: usize = 4096;
+
+/// Buffers spanning a transparent huge page ask the kernel for one.
+const HUGE_PAGE_SIZE: usize = 2 << 20;
+
+/// Estimated size of a keyframe relative to the average frame, until one
+/// has been seen.
+const KEYFRAME_FACTOR: usize = 4;
+
+/// A frame this many times the average is counted as a keyframe.
+const KEYFRAME_THRESHOLD: usize = 2;
+
+/// Room left above the estimate, in quarters.
+const HEADROOM_QUARTERS: usize = 6;
+
+/// A buffer and what a packet written into it needs.
+struct Slot {
+    data: Vec<u8>,
+    pts: i64,
+    keyframe: bool,
+    /// Packets and FFmpeg buffer references sharing the slot.
+    refs: AtomicUsize,
+    /// Set while the slot is taken. Free slots don't keep the pool alive.
+    pool: Option<BitstreamPool>,
+}
+
+struct State {
+    free: Vec<Box<Slot>>,
+    /// Addresses of the slots lent to FFmpeg and not yet claimed back.
+    lent: Vec<usize>,
+    /// Running averages of frame and keyframe sizes, in bytes.
+    frame_size: usize,
+    keyframe_size: usize,
+    allocated: u64,
+    reused: u64,
+}
+
+impl State {
+    /// Folds `size` into the estimate of its kind, and returns the capacity
+    /// to allocate for it.
+    fn predict(&mut self, size: usize) -> usize {
+        let estimate = if size > self.frame_size * KEYFRAME_THRESHOLD {
+            &mut self.keyframe_size
+        } else {
+            &mut self.frame_size
+        };
+        *estimate = (*estimate * 7 + size) / 8;
+        let capacity = size.max(*estimate * HEADROOM_QUARTERS / 4);
+        capacity.div_ceil(PAGE_SIZE) * PAGE_SIZE
+    }
+}
+
+/// A pool of bitstream buffers, shared by an encoder and every packet it
+/// produced.
+#[derive(Clone)]
+pub struct BitstreamPool(Arc<Mutex<State>>);
+
+impl BitstreamPool {
+    /// A pool for frames encoded at `bitrate` bits/s and `framerate` fps.
+    pub fn new(bitrate: i64, framerate: i32) -> Self {
+        let pool = Self(Arc::new(Mutex::new(State {
+            free: Vec::new(),
+            lent: Vec::new(),
+            frame_size: 0,
+            keyframe_size: 0,
+            allocated: 0,
+            reused: 0,
+        })));
+        pool.retarget(bitrate, framerate);
+        pool
+    }
+
+    /// Reseeds the size estimates after the bitrate changed.
+    pub fn retarget(&self, bitrate: i64, framerate: i32) {
+        let mut state = self.0.lock().unwrap();
+        let frame_size = (bitrate.max(0) / 8 / framerate.max(1) as i64) as usize;
+        state.frame_size = frame_size.max(1);
+        state.keyframe_size = state.frame_size * KEYFRAME_FACTOR;
+    }
+
+    /// Takes an empty buffer with room for at least `size` bytes: the
+    /// smallest free one that fits, or a new one. Keyframe buffers aren't
+    /// handed out for much smaller frames, which would leave the next
+    /// keyframe without one.
+    pub fn take(&self, size: usize) -> PooledBuffer {
+        let mut state = self.0.lock().unwrap();
+        let capacity = state.predict(size);
+        let best = (state.free.iter().enumerate())
+            .filter(|(_, slot)| (size..=capacity * 2).contains(&slot.data.capacity()))
+            .min_by_key(|(_, slot)| slot.data.capacity())
+            .map(|(index, _)| index);
+        let mut slot = match best {
+            Some(index) => {
+                state.reused += 1;
+                state.free.swap_remove(index)
+            }
+            None => {
+                state.allocated += 1;
+                drop(state);
+                Box::new(Slot {
+                    data: allocate(capacity),
+                    pts: 0,
+                    keyframe: false,
+                    refs: AtomicUsize::new(0),
+                    pool: None,
+                })
+            }
+        };
+        slot.pool = Some(self.clone());
+        PooledBuffer(Some(slot))
+    }
+
+    /// Takes back a slot lent to FFmpeg with [`PooledBuffer::lend`] and
+    /// shares it as the packet FFmpeg wrote `len` bytes of into it, at
+    /// `data`. Returns None if `opaque` and `data` aren't those of a lent
+    /// slot, e.g. when the encoder allocated the packet itself.
+    ///
+    /// # Safety
+    ///
+    /// The caller must hold FFmpeg's reference to the buffer while calling,
+    /// and the encoder must be done writing into it.
+    pub unsafe fn claim(
+        &self,
+        opaque: *mut c_void,
+        data: *const u8,
+        len: usize,
+        pts: i64,
+        keyframe: bool,
+    ) -> Option<SharedBuffer> {
+        {
+            let mut state = self.0.lock().unwrap();
+            let index = state
+                .lent
+                .iter()
+                .position(|&lent| lent == opaque as usize)?;
+            state.lent.swap_remove(index);
+        }
+        // SAFETY: lent slots stay alive while FFmpeg holds its reference,
+        // and only the encode thread touches their fields.
+        let slot = &mut *(opaque as *mut Slot);
+        if slot.data.as_ptr() != data || len > slot.data.capacity() {
+            return None;
+        }
+        // The encoder wrote `len` bytes through the pointer it was given.
+        slot.data.set_len(len);
+        slot.pts = pts;
+        slot.keyframe = keyframe;
+        slot.refs.fetch_add(1, Ordering::Relaxed);
+        Some(SharedBuffer(NonNull::new_unchecked(slot)))
+    }
+
+    fn put(&self, mut slot: Box<Slot>) {
+        slot.data.clear();
+        let address = &*slot as *const Slot as usize;
+        let mut state = self.0.lock().unwrap();
+        // Released by FFmpeg without being claimed, e.g. in a dropped session.
+        state.lent.retain(|&lent| lent != address);
+        if state.free.len() < MAX_FREE {
+            state.free.push(slot);
+        }
+    }
+}
+
+/// Drops a reference to `slot`, returning it to its pool with the last.
+///
+/// # Safety
+///
+/// `slot` must come from `Box::into_raw` and the reference must be live.
+unsafe fn release(slot: NonNull<Slot>) {
+    if slot.as_ref().refs.fetch_sub(1, Ordering::Release) != 1 {
+        return;
+    }
+    fence(Ordering::Acquire);
+    let mut slot = Box::from_raw(slot.as_ptr());
+    if let Some(pool) = slot.pool.take() {
+        pool.put(slot);
+    }
+}
+
+/// FFmpeg's free callback for a buffer lent with [`PooledBuffer::lend`].
+///
+/// # Safety
+///
+/// `opaque` must be the lent slot, and this FFmpeg's only call for it.
+pub unsafe extern "C" fn release_lent(opaque: *mut c_void, _data: *mut u8) {
+    release(NonNull::new_unchecked(opaque as *mut Slot));
+}
+
+impl fmt::Display for BitstreamPool {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let state = self.0.lock().unwrap();
+        write!(
+            f,
+            "Bitstream buffers: {} allocated, {} reused, frames ~{} KiB, keyframes ~{} KiB",
+            state.allocated,
+            state.reused,
+            state.frame_size / 1024,
+            state.keyframe_size / 1024
+        )
+    }
+}
+
+fn allocate(capacity: usize) -> Vec<u8> {
+    let data = Vec::with_capacity(capacity);
+    let start = (data.as_ptr() as usize).next_multiple_of(HUGE_PAGE_SIZE);
+    let end = (data.as_ptr() as usize + capacity) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    if end > start {
+        // SAFETY: the range lies within the allocation. Advice is only a
+        // hint, so kernels without transparent huge pages just refuse it.
+        let _ = unsafe {
+            madvise(
+                NonNull::new_unchecked(start as *mut c_void),
+                end - start,
+                MmapAdvise::MADV_HUGEPAGE,
+            )
+        };
+    }
+    data
+}
+
+/// A buffer being written, which goes back to its pool when dropped.
+pub struct PooledBuffer(Option<Box<Slot>>);
+
+impl PooledBuffer {
+    /// Shares the written buffer as the packet with `pts`.
+    pub fn share(mut self, pts: i64, keyframe: bool) -> SharedBuffer {
+        let mut slot = self.0.take().unwrap();
+        slot.pts = pts;
+        slot.keyframe = keyframe;
+        *slot.refs.get_mut() = 1;
+        // SAFETY: from a Box, so not null.
+        SharedBuffer(unsafe { NonNull::new_unchecked(Box::into_raw(slot)) })
+    }
+
+    /// Lends the buffer to FFmpeg, returning the opaque for
+    /// `av_buffer_create`, with [`release_lent`] as its free callback. The
+    /// packet is taken back with [`BitstreamPool::claim`].
+    pub fn lend(mut self) -> *mut c_void {
+        let mut slot = self.0.take().unwrap();
+        *slot.refs.get_mut() = 1;
+        let pool = slot.pool.clone().unwrap();
+        let opaque = Box::into_raw(slot);
+        pool.0.lock().unwrap().lent.push(opaque as usize);
+        opaque as *mut c_void
+    }
+}
+
+impl Deref for PooledBuffer {
+    type Target = Vec<u8>;
+
+    fn deref(&self) -> &Vec<u8> {
+        &self.0.as_ref().unwrap().data
+    }
+}
+
+impl DerefMut for PooledBuffer {
+    fn deref_mut(&mut self) -> &mut Vec<u8> {
+        &mut self.0.as_mut().unwrap().data
+    }
+}
+
+impl Drop for PooledBuffer {
+    fn drop(&mut self) {
+        if let Some(mut slot) = self.0.take() {
+            let pool = slot.pool.take().unwrap();
+            pool.put(slot);
+        }
+    }
+}
+
+/// A written buffer shared by the clones of a packet, and possibly by
+/// FFmpeg. Cloning and dropping only touch its reference count.
+pub struct SharedBuffer(NonNull<Slot>);
+
+// SAFETY: the slot isn't written while shared, apart from its atomic
+// reference count.
+unsafe impl Send for SharedBuffer {}
+unsafe impl Sync for SharedBuffer {}
+
+impl SharedBuffer {
+    pub fn pts(&self) -> i64 {
+        self.slot().pts
+    }
+
+    pub fn is_keyframe(&self) -> bool {
+        self.slot().keyframe
+    }
+
+    fn slot(&self) -> &Slot {
+        // SAFETY: live while this reference is.
+        unsafe { self.0.as_ref() }
+    }
+}
+
+impl Deref for SharedBuffer {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        &self.slot().data
+    }
+}
+
+impl Clone for SharedBuffer {
+    fn clone(&self) -> Self {
+        self.slot().refs.fetch_add(1, Ordering::Relaxed);
+        Self(self.0)
+    }
+}
+
+impl Drop for SharedBuffer {
+    fn drop(&mut self) {
+        // SAFETY: this reference is live until here.
+        unsafe { release(self.0) };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{
+        alloc::{GlobalAlloc, Layout, System},
+        cell::Cell,
+    };
+
+    use super::*;
+    use crate::packet::Packet;
+
+    /// Counts the allocations made by each thread.
+    struct Counting;
+
+    thread_local! {
+        static ALLOCATIONS: Cell<usize> = const { Cell::new(0) };
+    }
+
+    unsafe impl GlobalAlloc for Counting {
+        unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+            let _ = ALLOCATIONS.try_with(|count| count.set(count.get() + 1));
+            System.alloc(layout)
+        }
+
+        unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+            System.dealloc(ptr, layout)
+        }
+    }
+
+    #[global_allocator]
+    static ALLOCATOR: Counting = Counting;
+
+    fn allocations() -> usize {
+        ALLOCATIONS.with(Cell::get)
+    }
+
+    #[test]
+    fn test_buffers_are_reused_and_sized_ahead() {
+        // 60 fps at 4.8 Mbit/s is 10 kB per frame.
+        let pool = BitstreamPool::new(4_800_000, 60);
+
+        // A small frame still gets a buffer that fits an average one.
+        let buffer = pool.take(1_000);
+        assert!(buffer.capacity() >= 10_000, "{}", buffer.capacity());
+        let address = buffer.as_ptr();
+        drop(buffer);
+        let buffer = pool.take(9_000);
+        assert_eq!(buffer.as_ptr(), address);
+        assert!(buffer.is_empty());
+
+        // Keyframes grow their own estimate, and the next one is allocated
+        // with room to spare.
+        let key = pool.take(100_000);
+        drop((buffer, key));
+        let key = pool.take(120_000);
+        assert!(key.capacity() >= 120_000);
+        let small = pool.take(5_000);
+        assert!(small.capacity() < 100_000);
+        drop((key, small));
+
+        // Once warmed up, a steady stream of frames and keyframes allocates
+        // nothing.
+        let gop = || {
+            let frames: Vec<PooledBuffer> = (0..5).map(|i| pool.take(8_000 + i * 500)).collect();
+            drop(frames);
+            drop(pool.take(110_000));
+        };
+        gop();
+        let allocated = pool.0.lock().unwrap().allocated;
+        for _ in 0..100 {
+            gop();
+        }
+        assert_eq!(pool.0.lock().unwrap().allocated, allocated);
+    }
+
+    #[test]
+    fn test_packets_share_their_slot_without_allocating() {
+        let pool = BitstreamPool::new(4_800_000, 60);
+        let gop = || {
+            // Written by the encoder into a buffer lent to FFmpeg, as
+            // get_encode_buffer and to_packet do.
+            let mut buffer = pool.take(9_000);
+            buffer.resize(8_000, 1);
+            let data = buffer.as_ptr();
+            let opaque = buffer.lend();
+            let key = unsafe { pool.claim(opaque, data, 8_000, 0, true) }.unwrap();
+            // FFmpeg unrefs its AVPacket.
+            unsafe { release_lent(opaque, data as *mut u8) };
+            let key = Packet::from_shared(key);
+            assert_eq!((key.len(), key.pts(), key.is_keyframe()), (8_000, 0, true));
+
+            // Written by hand, as the stub encoder does.
+            let mut buffer = pool.take(5_000);
+            buffer.resize(5_000, 2);
+            let frame = Packet::from_pooled(buffer, 1, false);
+            let sinks = [frame.clone(), frame.clone(), key.clone()];
+            assert_eq!(sinks[1].data()[4_999], 2);
+            assert_eq!(sinks[1].pts(), 1);
+            drop((key, frame, sinks));
+        };
+        gop();
+        gop();
+
+        let (before, allocated) = (allocations(), pool.0.lock().unwrap().allocated);
+        for _ in 0..100 {
+            gop();
+        }
+        assert_eq!(allocations(), before, "packets allocated");
+        assert_eq!(pool.0.lock().unwrap().allocated, allocated, "pool missed");
+        assert!(pool.0.lock().unwrap().lent.is_empty());
+    }
+
+    #[test]
+    fn test_unclaimed_slots_go_back_to_the_pool() {
+        let pool = BitstreamPool::new(4_800_000, 60);
+        let mut buffer = pool.take(1_000);
+        let data = buffer.as_mut_ptr();
+        let opaque = buffer.lend();
+        // Not a slot of this pool, or not where the packet's data is.
+        let other = BitstreamPool::new(4_800_000, 60);
+        assert!(unsafe { other.claim(opaque, data, 0, 0, false) }.is_none());
+        assert!(unsafe { pool.claim(opaque, data.wrapping_add(1), 0, 0, false) }.is_none());
+        unsafe { release_lent(opaque, data) };
+        assert_eq!(pool.take(1_000).as_ptr(), data as *const u8);
+        let state = pool.0.lock().unwrap();
+        assert!(state.lent.is_empty());
+    }
+}
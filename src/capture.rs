@@ -1,10 +1,17 @@
 use std::{
+    cell::Cell,
     fs::File,
-    sync::{Arc, Mutex},
+    os::fd::{AsFd, BorrowedFd, OwnedFd, RawFd},
+    path::Path,
+    rc::Rc,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc, Mutex,
+    },
     thread::{self, JoinHandle},
 };
 
-use anyhow::Result;
+use anyhow::{anyhow, Context, Result};
 use cros_codecs::{
     backend::vaapi::surface_pool::{PooledVaSurface, VaSurfacePool},
     decoder::FramePool,
@@ -15,17 +22,88 @@ use cros_codecs::{
 use libspa::{
     self as spa,
     pod::{ChoiceValue, Pod, Property, Value},
+    support::system::IoFlags,
     utils::{Choice, ChoiceEnum, ChoiceFlags},
 };
+use nix::{
+    sys::eventfd::{EfdFlags, EventFd},
+    time::{clock_gettime, ClockId},
+};
 use pipewire::{self as pw, main_loop, properties::properties};
 
-use crate::frame_buffer::FrameBuffer;
+use crate::{
+    cursor::{meta_size, Cursor, MAX_CURSOR_SIZE},
+    flight::FlightRecorder,
+    frame_buffer::{FrameBuffer, FrameReader},
+    frametime::FrameTimes,
+    handoff::{BufferRing, IntervalStats, IntervalSummary},
+    rate,
+    recovery::{fault_point, Stage},
+    trace::{TraceEvent, TraceRecorder},
+};
+
+#[derive(Debug, Clone, Copy)]
+pub struct CaptureOptions {
+    /// Dequeue buffers on PipeWire's real-time data thread (`RT_PROCESS`)
+    /// and import them on the capture thread, instead of doing both on the
+    /// capture thread.
+    pub rt_process: bool,
+    /// Rate the source is expected to present at, which sizes the surface
+    /// pool and is the preferred rate when negotiating with PipeWire.
+    pub framerate: u32,
+}
+
+impl Default for CaptureOptions {
+    fn default() -> Self {
+        Self {
+            rt_process: false,
+            framerate: 60,
+        }
+    }
+}
 
 #[allow(dead_code)]
 struct UserData {
     format: Mutex<spa::param::video::VideoInfoRaw>,
     pool: Mutex<Option<VaSurfacePool<()>>>,
-    frame_buffer: FrameBuffer<PooledVaSurface<()>>,
+    pool_size: usize,
+    frame_buffer: Arc<FrameBuffer<PooledVaSurface<()>>>,
+    /// First error hit on the PipeWire thread since the last `take_error()`.
+    error: Mutex<Option<(Stage, anyhow::Error)>>,
+    cursor: Mutex<Cursor>,
+    /// Buffers dequeued on the data thread, waiting to be imported. Only
+    /// used with `rt_process`.
+    handoff: BufferRing<pw::sys::pw_buffer>,
+    /// Signalled by the data thread when it pushes to `handoff`.
+    wakeup: EventFd,
+    /// Buffers the data thread queued straight back because `handoff` was full.
+    handoff_dropped: AtomicU64,
+    dequeue_intervals: IntervalStats,
+    frame_times: Arc<FrameTimes>,
+    /// Where buffer timing goes, see [`Capturer::record_trace`].
+    trace: Mutex<Option<TraceRecorder>>,
+    /// The last format negotiated, which a trace started later begins with.
+    trace_format: Mutex<Option<TraceEvent>>,
+    /// Told about dropped buffers, see [`Capturer::set_flight_recorder`].
+    flight: Mutex<Option<Arc<FlightRecorder>>>,
+}
+
+impl UserData {
+    fn set_error(&self, stage: Stage, error: anyhow::Error) {
+        self.error.lock().unwrap().get_or_insert((stage, error));
+    }
+
+    fn trace(&self, event: TraceEvent) {
+        if let Some(trace) = self.trace.lock().unwrap().as_mut() {
+            trace.record(event);
+        }
+    }
+
+    fn dropped(&self, cause: &'static str) {
+        if let Some(flight) = &*self.flight.lock().unwrap() {
+            flight.capture_dropped(cause);
+        }
+    }
 }
 
 struct Terminate;
@@ -38,14 +116,26 @@ pub struct Capturer {
 }
 
 impl Capturer {
-    pub fn new() -> Result<Self> {
+    pub fn new(options: CaptureOptions) -> Result<Self> {
         let user_data = Arc::new(UserData {
             format: Mutex::new(Default::default()),
             pool: Mutex::new(None),
-            frame_buffer: FrameBuffer::new(),
+            pool_size: rate::pool_size(options.framerate),
+            frame_buffer: Arc::new(FrameBuffer::new()),
+            error: Mutex::new(None),
+            cursor: Mutex::new(Cursor::default()),
+            handoff: BufferRing::new(),
+            wakeup: EventFd::from_flags(EfdFlags::EFD_CLOEXEC | EfdFlags::EFD_NONBLOCK)?,
+            handoff_dropped: AtomicU64::new(0),
+            dequeue_intervals: IntervalStats::new(),
+            frame_times: Arc::new(FrameTimes::new()),
+            trace: Mutex::new(None),
+            trace_format: Mutex::new(None),
+            flight: Mutex::new(None),
         });
         let (pw_sender, pw_receiver) = pw::channel::channel();
-        let capture_thread = thread::spawn::<_, Result<()>>({
+        let builder = thread::Builder::new().name("capture".into());
+        let capture_thread = builder.spawn::<_, Result<()>>({
             let user_data = user_data.clone();
             move || {
                 let main_loop = main_loop::MainLoop::new(None)?;
@@ -64,14 +154,42 @@ impl Capturer {
                     *pw::keys::TARGET_OBJECT => "gamescope",
                 };
 
-                let stream = pw::stream::Stream::new(&core, "zeroscope", props)?;
+                let stream = Rc::new(pw::stream::Stream::new(&core, "zeroscope", props)?);
+
+                // With RT_PROCESS, buffers arrive here from the data thread.
+                let _wakeup = if options.rt_process {
+                    let wakeup = user_data.wakeup.as_fd().try_clone_to_owned()?;
+                    let stream = stream.clone();
+                    let user_data = user_data.clone();
+                    let reported = Cell::new(0);
+                    let on_wakeup = move |wakeup: &mut OwnedFd| {
+                        nix::unistd::read(&*wakeup, &mut [0; 8]).ok();
+                        // The data thread can't report its drops itself:
+                        // the flight recorder locks and allocates.
+                        let dropped = user_data.handoff_dropped.load(Ordering::Relaxed);
+                        if dropped > reported.replace(dropped) {
+                            user_data.dropped("handoff_full");
+                        }
+                        while let Some((raw, arrival_ns)) = user_data.handoff.pop() {
+                            // SAFETY: dequeued by the data thread and not
+                            // queued back yet.
+                            unsafe {
+                                handle_raw_buffer(raw, arrival_ns, &user_data);
+                                stream.queue_raw_buffer(raw);
+                            }
+                        }
+                    };
+                    Some(main_loop.loop_().add_io(wakeup, IoFlags::IN, on_wakeup))
+                } else {
+                    None
+                };
 
                 let _listener = stream
                     .add_local_listener_with_user_data(user_data.clone())
                     .state_changed(|_, _, old_state, new_state| {
                         println!("State changed: {:?} -> {:?}", old_state, new_state);
                     })
-                    .param_changed(|_, user_data, id, param| {
+                    .param_changed(|stream, user_data, id, param| {
                         println!("Param changed: id = {}", id);
                         let Some(param) = param else {
                             return;
@@ -94,7 +212,10 @@ impl Capturer {
                         println!("Got video format:");
 
                         let mut format = user_data.format.lock().unwrap();
-                        format.parse(param).expect("Failed to parse format");
+                        if let Err(e) = format.parse(param) {
+                            eprintln!("Failed to parse format: {e:?}");
+                            return;
+                        }
                         println!("got video format:");
                         println!(
                             "  format: {} ({:?})",
@@ -109,73 +230,72 @@ impl Capturer {
                         );
                         println!("  color_range: {:?}", format.color_range());
                         println!("  color_matrix: {:?}", format.color_matrix());
+                        let event = TraceEvent::Format {
+                            time_ns: monotonic_ns(),
+                            width: format.size().width,
+                            height: format.size().height,
+                            format: format.format().as_raw(),
+                            framerate: (format.framerate().num, format.framerate().denom),
+                        };
+                        *user_data.trace_format.lock().unwrap() = Some(event);
+                        user_data.trace(event);
 
-                        let display = Display::open().unwrap();
-                        let mut pool = VaSurfacePool::new(
-                            display.clone(),
-                            VA_RT_FORMAT_YUV420,
-                            Some(UsageHint::USAGE_HINT_VPP_WRITE | UsageHint::USAGE_HINT_VPP_READ),
-                            Resolution {
-                                width: format.size().width,
-                                height: format.size().height,
-                            },
-                        );
-                        pool.add_frames(vec![(); 16])
-                            .expect("Failed to add frames to pool");
-                        user_data.pool.lock().unwrap().replace(pool);
-                    })
-                    .process(|stream, user_data| match stream.dequeue_buffer() {
-                        None => println!("out of buffers"),
-                        Some(mut buffer) => {
-                            let datas = buffer.datas_mut();
-                            if datas.is_empty() {
-                                eprintln!("No data in pipewire buffer");
-                                return;
+                        match create_pool(
+                            format.size().width,
+                            format.size().height,
+                            user_data.pool_size,
+                        ) {
+                            Ok(pool) => {
+                                user_data.pool.lock().unwrap().replace(pool);
                             }
-                            let data = &mut datas[0];
-                            let fd: std::os::unix::prelude::BorrowedFd<'_> =
-                                data.fd().expect("Failed to get fd from buffer data");
-                            let file = File::from(fd.try_clone_to_owned().unwrap());
-
-                            let fourcc = Fourcc::from(b"NV12");
-                            let (width, height) = {
-                                let format = user_data.format.lock().unwrap().size();
-                                (format.width, format.height)
-                            };
-                            let frame_layout = FrameLayout {
-                                format: (fourcc, 0),
-                                size: Resolution { width, height },
-                                planes: vec![
-                                    PlaneLayout {
-                                        buffer_index: 0,
-                                        offset: 0,
-                                        stride: width as usize,
-                                    },
-                                    PlaneLayout {
-                                        buffer_index: 0,
-                                        offset: width as usize * height as usize,
-                                        stride: width as usize,
-                                    },
-                                ],
-                            };
+                            Err(e) => user_data.set_error(Stage::Capture, e),
+                        }
 
-                            let dma_frame = GenericDmaVideoFrame::new(vec![file], frame_layout)
-                                .expect("Failed to create GenericDmaVideoFrame");
-
-                            let pooled_surface = user_data
-                                .pool
-                                .lock()
-                                .unwrap()
-                                .as_mut()
-                                .unwrap()
-                                .get_surface()
-                                .expect("Failed to get surface from pool");
-
-                            dma_frame
-                                .copy_to_surface(std::borrow::Borrow::borrow(&pooled_surface))
-                                .unwrap();
-                            user_data.frame_buffer.write(Arc::new(pooled_surface));
-                            // println!("Captured frame: {}x{}", width, height);
+                        // Ask for the cursor as metadata rather than drawn
+                        // into the frame, and for the presentation time.
+                        let cursor = cursor_meta_param();
+                        let header = header_meta_param();
+                        let mut params = [
+                            Pod::from_bytes(&cursor).unwrap(),
+                            Pod::from_bytes(&header).unwrap(),
+                        ];
+                        if let Err(e) = stream.update_params(&mut params) {
+                            eprintln!("Failed to request buffer metadata: {e:?}");
+                        }
+                    })
+                    .process(move |stream, user_data| {
+                        // The safe buffer wrapper doesn't expose metadata, so
+                        // the buffer is dequeued raw and queued back below.
+                        // SAFETY: a dequeued buffer stays valid until queued.
+                        let raw = unsafe { stream.dequeue_raw_buffer() };
+                        if raw.is_null() {
+                            if !options.rt_process {
+                                println!("out of buffers");
+                            }
+                            return;
+                        }
+                        user_data.dequeue_intervals.record();
+                        // Stamped here rather than at import, which with
+                        // rt_process waits for the main loop.
+                        let arrival_ns = monotonic_ns();
+                        if options.rt_process {
+                            // On the data thread: only lock-free handoff and
+                            // an eventfd write, the import waits for the
+                            // capture thread.
+                            match user_data.handoff.push(raw, arrival_ns) {
+                                Ok(()) => {
+                                    user_data.wakeup.write(1).ok();
+                                }
+                                Err(raw) => {
+                                    user_data.handoff_dropped.fetch_add(1, Ordering::Relaxed);
+                                    unsafe { stream.queue_raw_buffer(raw) };
+                                }
+                            }
+                            return;
+                        }
+                        unsafe {
+                            handle_raw_buffer(raw, arrival_ns, user_data);
+                            stream.queue_raw_buffer(raw);
                         }
                     })
                     .register()?;
@@ -230,7 +350,10 @@ impl Capturer {
                         Choice,
                         Range,
                         Fraction,
-                        spa::utils::Fraction { num: 25, denom: 1 },
+                        spa::utils::Fraction {
+                            num: options.framerate,
+                            denom: 1
+                        },
                         spa::utils::Fraction { num: 0, denom: 1 },
                         spa::utils::Fraction {
                             num: 1000,
@@ -272,18 +395,20 @@ impl Capturer {
 
                 let mut params = [Pod::from_bytes(&values).unwrap()];
 
-                stream.connect(
-                    spa::utils::Direction::Input,
-                    None,
-                    pw::stream::StreamFlags::AUTOCONNECT,
-                    &mut params,
-                )?;
+                // MAP_BUFFERS isn't set along with RT_PROCESS: frames are
+                // DMABUFs that are only ever read by the GPU, and metadata
+                // is always mapped.
+                let mut flags = pw::stream::StreamFlags::AUTOCONNECT;
+                if options.rt_process {
+                    flags |= pw::stream::StreamFlags::RT_PROCESS;
+                }
+                stream.connect(spa::utils::Direction::Input, None, flags, &mut params)?;
 
                 main_loop.run();
 
                 Ok(())
             }
-        });
+        })?;
 
         if capture_thread.is_finished() {
             return Err(anyhow::anyhow!("Capture thread finished prematurely"));
@@ -299,11 +424,305 @@ impl Capturer {
     pub fn read_frame(&self) -> Option<Arc<PooledVaSurface<()>>> {
         self.user_data.frame_buffer.read()
     }
+
+    /// Returns an independent reader of new frames, e.g. for a consumer on
+    /// another thread. Adding readers doesn't slow down capture.
+    pub fn subscribe(&self) -> FrameReader<PooledVaSurface<()>> {
+        self.user_data.frame_buffer.subscribe()
+    }
+
+    /// Returns the latest cursor position and image.
+    pub fn cursor(&self) -> Cursor {
+        self.user_data.cursor.lock().unwrap().clone()
+    }
+
+    /// Statistics of the time between dequeued buffers, to compare the
+    /// scheduling jitter with and without `rt_process`.
+    pub fn dequeue_intervals(&self) -> IntervalSummary {
+        self.user_data.dequeue_intervals.summary()
+    }
+
+    /// Frame times of the game, from the buffers it presented.
+    pub fn frame_times(&self) -> Arc<FrameTimes> {
+        self.user_data.frame_times.clone()
+    }
+
+    /// Starts recording when each buffer arrives, and format changes, to a
+    /// trace at `path` that `--replay-trace` plays back.
+    pub fn record_trace(&self, path: &Path) -> Result<()> {
+        let mut trace = TraceRecorder::create(path)?;
+        if let Some(format) = *self.user_data.trace_format.lock().unwrap() {
+            trace.record(format);
+        }
+        *self.user_data.trace.lock().unwrap() = Some(trace);
+        Ok(())
+    }
+
+    /// Reports buffers dropped from now on to `flight` as incidents.
+    pub fn set_flight_recorder(&self, flight: Arc<FlightRecorder>) {
+        *self.user_data.flight.lock().unwrap() = Some(flight);
+    }
+
+    /// Stops recording the trace, if one was started, and writes it out.
+    pub fn finish_trace(&self) -> Result<()> {
+        match self.user_data.trace.lock().unwrap().take() {
+            Some(trace) => trace.finish(),
+            None => Ok(()),
+        }
+    }
+
+    /// Returns the error the capture thread ran into, if any. Frames that
+    /// failed to import are dropped, so capture keeps going regardless.
+    pub fn take_error(&self) -> Option<(Stage, anyhow::Error)> {
+        self.control().take_error()
+    }
+
+    /// Returns a handle for recovering capture from another thread.
+    pub fn control(&self) -> CaptureControl {
+        CaptureControl {
+            user_data: self.user_data.clone(),
+        }
+    }
+}
+
+/// The part of a [`Capturer`] that recovery needs, which can be handed to
+/// the thread that runs the encoder.
+#[derive(Clone)]
+pub struct CaptureControl {
+    user_data: Arc<UserData>,
+}
+
+impl CaptureControl {
+    pub fn take_error(&self) -> Option<(Stage, anyhow::Error)> {
+        self.user_data.error.lock().unwrap().take()
+    }
+
+    /// Replaces the surface pool with one on a freshly opened VA display and
+    /// forgets frames imported through the old one.
+    pub fn reset(&self) -> Result<()> {
+        let size = self.user_data.format.lock().unwrap().size();
+        if size.width == 0 || size.height == 0 {
+            // No format negotiated yet, nothing to rebuild.
+            return Ok(());
+        }
+        let pool = create_pool(size.width, size.height, self.user_data.pool_size)?;
+        self.user_data.pool.lock().unwrap().replace(pool);
+        self.user_data.frame_buffer.clear();
+        Ok(())
+    }
+}
+
+fn create_pool(width: u32, height: u32, size: usize) -> Result<VaSurfacePool<()>> {
+    let display = Display::open().context("Failed to open VA display")?;
+    let mut pool = VaSurfacePool::new(
+        display,
+        VA_RT_FORMAT_YUV420,
+        Some(UsageHint::USAGE_HINT_VPP_WRITE | UsageHint::USAGE_HINT_VPP_READ),
+        Resolution { width, height },
+    );
+    pool.add_frames(vec![(); size])
+        .map_err(|e| anyhow!("Failed to add frames to pool: {e:?}"))?;
+    Ok(pool)
+}
+
+fn header_meta_param() -> Vec<u8> {
+    let obj = pw::spa::pod::object!(
+        pw::spa::utils::SpaTypes::ObjectParamMeta,
+        pw::spa::param::ParamType::Meta,
+        Property::new(
+            pw::spa::sys::SPA_PARAM_META_type,
+            Value::Id(pw::spa::utils::Id(pw::spa::sys::SPA_META_Header)),
+        ),
+        Property::new(
+            pw::spa::sys::SPA_PARAM_META_size,
+            Value::Int(std::mem::size_of::<pw::spa::sys::spa_meta_header>() as i32),
+        ),
+    );
+    pw::spa::pod::serialize::PodSerializer::serialize(
+        std::io::Cursor::new(Vec::new()),
+        &pw::spa::pod::Value::Object(obj),
+    )
+    .expect("Failed to serialize pod")
+    .0
+    .into_inner()
+}
+
+fn monotonic_ns() -> u64 {
+    clock_gettime(ClockId::CLOCK_MONOTONIC)
+        .map(|now| now.tv_sec() as u64 * 1_000_000_000 + now.tv_nsec() as u64)
+        .unwrap_or(0)
+}
+
+/// Returns when the frame of `buffer` was presented according to the
+/// producer, if it sets a PTS.
+///
+/// # Safety
+///
+/// `buffer` must be dequeued and not yet queued back.
+unsafe fn presentation_time(buffer: &pw::spa::sys::spa_buffer) -> Option<u64> {
+    let header = (!buffer.metas.is_null())
+        .then(|| std::slice::from_raw_parts(buffer.metas, buffer.n_metas as usize))
+        .and_then(|metas| {
+            metas.iter().find(|meta| {
+                meta.type_ == pw::spa::sys::SPA_META_Header
+                    && meta.size as usize >= std::mem::size_of::<pw::spa::sys::spa_meta_header>()
+            })
+        })
+        .map(|meta| &*(meta.data as *const pw::spa::sys::spa_meta_header));
+    header
+        .filter(|header| header.pts > 0)
+        .map(|header| header.pts as u64)
+}
+
+fn cursor_meta_param() -> Vec<u8> {
+    let obj = pw::spa::pod::object!(
+        pw::spa::utils::SpaTypes::ObjectParamMeta,
+        pw::spa::param::ParamType::Meta,
+        Property::new(
+            pw::spa::sys::SPA_PARAM_META_type,
+            Value::Id(pw::spa::utils::Id(pw::spa::sys::SPA_META_Cursor)),
+        ),
+        Property::new(
+            pw::spa::sys::SPA_PARAM_META_size,
+            Value::Choice(ChoiceValue::Int(Choice(
+                ChoiceFlags::empty(),
+                ChoiceEnum::Range {
+                    default: meta_size(64, 64),
+                    min: meta_size(1, 1),
+                    max: meta_size(MAX_CURSOR_SIZE, MAX_CURSOR_SIZE),
+                },
+            ))),
+        ),
+    );
+    pw::spa::pod::serialize::PodSerializer::serialize(
+        std::io::Cursor::new(Vec::new()),
+        &pw::spa::pod::Value::Object(obj),
+    )
+    .expect("Failed to serialize pod")
+    .0
+    .into_inner()
+}
+
+/// Reads the cursor metadata of a dequeued buffer and imports its frame,
+/// which was dequeued at `arrival_ns`. Runs on the capture thread, as both
+/// can lock and allocate, and the import waits for the GPU copy.
+///
+/// # Safety
+///
+/// `raw` must be dequeued and not yet queued back.
+unsafe fn handle_raw_buffer(raw: *mut pw::sys::pw_buffer, arrival_ns: u64, user_data: &UserData) {
+    let buffer = &*(*raw).buffer;
+    let cursor_changed = user_data.cursor.lock().unwrap().update(buffer);
+    if let Err((stage, e)) = import_raw_buffer(buffer, arrival_ns, cursor_changed, user_data) {
+        user_data.set_error(stage, e);
+    }
+}
+
+/// Imports the frame of a raw PipeWire buffer. One that only carries a
+/// cursor update republishes the latest frame if the cursor changed, so it
+/// is encoded again with the cursor blended in and counts as activity for
+/// the idle check. The trace and the frame times without a PTS use
+/// `arrival_ns`, when the buffer was dequeued.
+///
+/// # Safety
+///
+/// `buffer` must be dequeued and not yet queued back.
+unsafe fn import_raw_buffer(
+    buffer: &pw::spa::sys::spa_buffer,
+    arrival_ns: u64,
+    cursor_changed: bool,
+    user_data: &UserData,
+) -> Result<(), (Stage, anyhow::Error)> {
+    if buffer.n_datas == 0 || buffer.datas.is_null() {
+        eprintln!("No data in pipewire buffer");
+        return Ok(());
+    }
+    let data = &*buffer.datas;
+    // Like OBS, treat an empty chunk as a metadata-only update: the cursor
+    // moved but the frame didn't change.
+    if !data.chunk.is_null() && (*data.chunk).size == 0 {
+        user_data.trace(TraceEvent::Metadata {
+            time_ns: arrival_ns,
+        });
+        if cursor_changed {
+            user_data.frame_buffer.repeat();
+        }
+        return Ok(());
+    }
+    let pts = presentation_time(buffer);
+    user_data.trace(TraceEvent::Buffer {
+        time_ns: arrival_ns,
+        pts_ns: pts,
+    });
+    user_data.frame_times.record(pts.unwrap_or(arrival_ns));
+    if data.fd < 0 {
+        return Err((Stage::Capture, anyhow!("PipeWire buffer has no fd")));
+    }
+    import_buffer(BorrowedFd::borrow_raw(data.fd as RawFd), user_data)
+}
+
+/// Copies a PipeWire DMABUF into a surface from the pool and publishes it.
+fn import_buffer(fd: BorrowedFd, user_data: &UserData) -> Result<(), (Stage, anyhow::Error)> {
+    let capture = |e| (Stage::Capture, e);
+    fault_point(Stage::Capture).map_err(capture)?;
+    let file = File::from(fd.try_clone_to_owned().map_err(|e| capture(e.into()))?);
+
+    let fourcc = Fourcc::from(b"NV12");
+    let (width, height) = {
+        let format = user_data.format.lock().unwrap().size();
+        (format.width, format.height)
+    };
+    let frame_layout = FrameLayout {
+        format: (fourcc, 0),
+        size: Resolution { width, height },
+        planes: vec![
+            PlaneLayout {
+                buffer_index: 0,
+                offset: 0,
+                stride: width as usize,
+            },
+            PlaneLayout {
+                buffer_index: 0,
+                offset: width as usize * height as usize,
+                stride: width as usize,
+            },
+        ],
+    };
+
+    let import = |e| (Stage::Import, e);
+    let dma_frame = GenericDmaVideoFrame::new(vec![file], frame_layout)
+        .map_err(|e| import(anyhow!("Failed to create GenericDmaVideoFrame: {e:?}")))?;
+
+    let Some(pooled_surface) = user_data
+        .pool
+        .lock()
+        .unwrap()
+        .as_mut()
+        .and_then(|pool| pool.get_surface())
+    else {
+        // The encoder still holds every surface, which is not an error:
+        // this frame is simply dropped.
+        eprintln!("No free surface, dropping frame");
+        user_data.dropped("no_free_surface");
+        return Ok(());
+    };
+
+    fault_point(Stage::Import).map_err(import)?;
+    dma_frame
+        .copy_to_surface(std::borrow::Borrow::borrow(&pooled_surface))
+        .map_err(|e| import(anyhow!("Failed to copy frame to surface: {e:?}")))?;
+    user_data.frame_buffer.write(Arc::new(pooled_surface));
+    Ok(())
 }
 
 impl Drop for Capturer {
     fn drop(&mut self) {
         self.pw_sender.send(Terminate).ok();
         self.capture_thread.take().unwrap().join().ok();
+        println!("Dequeue timing: {}", self.dequeue_intervals());
+        let dropped = self.user_data.handoff_dropped.load(Ordering::Relaxed);
+        if dropped > 0 {
+            println!("Dropped {dropped} buffers waiting for the capture thread");
+        }
     }
 }
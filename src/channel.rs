@@ -0,0 +1,416 @@
+//! Bounded single-producer single-consumer channel connecting pipeline
+//! stages.
+//!
+//! Passing an item is lock-free. A stage only takes a lock and parks when it
+//! has to wait, i.e. when the channel is empty for the receiver or full for a
+//! sender that chose to block. Either way the wait is counted, so the
+//! occupancy of each edge shows which stage is the bottleneck.
+
+use std::{
+    cell::{Cell, UnsafeCell},
+    fmt,
+    marker::PhantomData,
+    mem::MaybeUninit,
+    sync::{
+        atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering},
+        Arc, Mutex,
+    },
+    thread::{self, Thread},
+};
+
+/// A stage waiting for the other end of a channel.
+struct Waiter {
+    parked: AtomicBool,
+    thread: Mutex<Option<Thread>>,
+}
+
+impl Waiter {
+    fn new() -> Self {
+        Self {
+            parked: AtomicBool::new(false),
+            thread: Mutex::new(None),
+        }
+    }
+
+    fn wait_until(&self, ready: impl Fn() -> bool) {
+        while !ready() {
+            *self.thread.lock().unwrap() = Some(thread::current());
+            self.parked.store(true, Ordering::SeqCst);
+            // Checked again after announcing ourselves, so a wake between the
+            // first check and parking isn't lost.
+            if !ready() {
+                thread::park();
+            }
+            self.parked.store(false, Ordering::SeqCst);
+        }
+    }
+
+    fn wake(&self) {
+        if self.parked.load(Ordering::SeqCst) {
+            if let Some(thread) = &*self.thread.lock().unwrap() {
+                thread.unpark();
+            }
+        }
+    }
+}
+
+struct Shared<T> {
+    slots: Box<[UnsafeCell<MaybeUninit<T>>]>,
+    // Both only ever increase; their difference is the number of queued items.
+    head: AtomicUsize,
+    tail: AtomicUsize,
+    closed: AtomicBool,
+    receiver: Waiter,
+    sender: Waiter,
+    sent: AtomicU64,
+    dropped: AtomicU64,
+    blocked: AtomicU64,
+    starved: AtomicU64,
+    occupancy_sum: AtomicU64,
+    max_occupancy: AtomicUsize,
+}
+
+// SAFETY: a slot is only accessed by the sender between tail and the end of
+// the free space, and by the receiver between head and tail, which the
+// atomics keep apart.
+unsafe impl<T: Send> Send for Shared<T> {}
+unsafe impl<T: Send> Sync for Shared<T> {}
+
+impl<T> Shared<T> {
+    fn len(&self) -> usize {
+        // Head first: it never passes tail, so this can't underflow.
+        let head = self.head.load(Ordering::SeqCst);
+        self.tail.load(Ordering::SeqCst) - head
+    }
+
+    fn is_closed(&self) -> bool {
+        self.closed.load(Ordering::SeqCst)
+    }
+}
+
+impl<T> Drop for Shared<T> {
+    fn drop(&mut self) {
+        for index in *self.head.get_mut()..*self.tail.get_mut() {
+            let slot = &mut self.slots[index % self.slots.len()];
+            // SAFETY: slots between head and tail hold items.
+            unsafe { slot.get_mut().assume_init_drop() };
+        }
+    }
+}
+
+/// Counters of a channel, for reporting how busy each edge is.
+#[derive(Debug, Clone, Copy, Default, PartialEq)]
+pub struct ChannelStats {
+    pub capacity: usize,
+    pub len: usize,
+    pub sent: u64,
+    /// Items rejected by `try_send` because the channel was full.
+    pub dropped: u64,
+    /// Times `send` waited for room, i.e. backpressure was applied.
+    pub blocked: u64,
+    /// Times the receiver waited for an item.
+    pub starved: u64,
+    /// Average number of queued items right after a send.
+    pub mean_occupancy: f64,
+    pub max_occupancy: usize,
+}
+
+impl fmt::Display for ChannelStats {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        write!(
+            f,
+            "{} sent, occupancy mean {:.1} max {}/{}, {} blocked, {} dropped, {} starved",
+            self.sent,
+            self.mean_occupancy,
+            self.max_occupancy,
+            self.capacity,
+            self.blocked,
+            self.dropped,
+            self.starved
+        )
+    }
+}
+
+trait Occupancy: Send + Sync {
+    fn stats(&self) -> ChannelStats;
+}
+
+impl<T: Send> Occupancy for Shared<T> {
+    fn stats(&self) -> ChannelStats {
+        let sent = self.sent.load(Ordering::Relaxed);
+        ChannelStats {
+            capacity: self.slots.len(),
+            len: self.len(),
+            sent,
+            dropped: self.dropped.load(Ordering::Relaxed),
+            blocked: self.blocked.load(Ordering::Relaxed),
+            starved: self.starved.load(Ordering::Relaxed),
+            mean_occupancy: self.occupancy_sum.load(Ordering::Relaxed) as f64 / sent.max(1) as f64,
+            max_occupancy: self.max_occupancy.load(Ordering::Relaxed),
+        }
+    }
+}
+
+/// A handle to read the counters of a channel from anywhere.
+#[derive(Clone)]
+pub struct Probe(Arc<dyn Occupancy>);
+
+impl Probe {
+    pub fn stats(&self) -> ChannelStats {
+        self.0.stats()
+    }
+}
+
+pub enum TrySendError<T> {
+    Full(T),
+    Closed(T),
+}
+
+/// The receiver is gone; the item is handed back.
+#[derive(Debug)]
+pub struct Closed<T>(pub T);
+
+/// The sending end. It can be moved to another stage but not shared, since
+/// only one thread at a time may push:
+///
+/// ```compile_fail
+/// fn assert_sync<T: Sync>() {}
+/// assert_sync::<gamescope_recorder::channel::Sender<Vec<u8>>>();
+/// ```
+pub struct Sender<T> {
+    shared: Arc<Shared<T>>,
+    _unsync: PhantomData<Cell<()>>,
+}
+
+/// The receiving end; like the sender, `Send` but not `Sync`:
+///
+/// ```compile_fail
+/// fn assert_sync<T: Sync>() {}
+/// assert_sync::<gamescope_recorder::channel::Receiver<Vec<u8>>>();
+/// ```
+pub struct Receiver<T> {
+    shared: Arc<Shared<T>>,
+    _unsync: PhantomData<Cell<()>>,
+}
+
+pub fn bounded<T: Send + 'static>(capacity: usize) -> (Sender<T>, Receiver<T>) {
+    assert!(capacity > 0, "A channel needs room for at least one item");
+    let shared = Arc::new(Shared {
+        slots: (0..capacity)
+            .map(|_| UnsafeCell::new(MaybeUninit::uninit()))
+            .collect(),
+        head: AtomicUsize::new(0),
+        tail: AtomicUsize::new(0),
+        closed: AtomicBool::new(false),
+        receiver: Waiter::new(),
+        sender: Waiter::new(),
+        sent: AtomicU64::new(0),
+        dropped: AtomicU64::new(0),
+        blocked: AtomicU64::new(0),
+        starved: AtomicU64::new(0),
+        occupancy_sum: AtomicU64::new(0),
+        max_occupancy: AtomicUsize::new(0),
+    });
+    (
+        Sender {
+            shared: shared.clone(),
+            _unsync: PhantomData,
+        },
+        Receiver {
+            shared,
+            _unsync: PhantomData,
+        },
+    )
+}
+
+impl<T: Send + 'static> Sender<T> {
+    /// Queues `item` if there is room, without ever waiting. For stages that
+    /// must keep their own pace, like capture, and drop what can't be kept up
+    /// with.
+    pub fn try_send(&self, item: T) -> Result<(), TrySendError<T>> {
+        let result = self.push(item);
+        if let Err(TrySendError::Full(_)) = result {
+            self.shared.dropped.fetch_add(1, Ordering::Relaxed);
+        }
+        result
+    }
+
+    fn push(&self, item: T) -> Result<(), TrySendError<T>> {
+        let shared = &*self.shared;
+        if shared.is_closed() {
+            return Err(TrySendError::Closed(item));
+        }
+        let tail = shared.tail.load(Ordering::Relaxed);
+        if tail - shared.head.load(Ordering::SeqCst) == shared.slots.len() {
+            return Err(TrySendError::Full(item));
+        }
+        // SAFETY: the slot at tail is free and only the sender writes it.
+        unsafe { (*shared.slots[tail % shared.slots.len()].get()).write(item) };
+        shared.tail.store(tail + 1, Ordering::SeqCst);
+
+        let len = shared.len();
+        shared.sent.fetch_add(1, Ordering::Relaxed);
+        shared
+            .occupancy_sum
+            .fetch_add(len as u64, Ordering::Relaxed);
+        shared.max_occupancy.fetch_max(len, Ordering::Relaxed);
+        shared.receiver.wake();
+        Ok(())
+    }
+
+    /// Queues `item`, waiting for room if the channel is full, so a slow
+    /// stage slows down the ones feeding it.
+    pub fn send(&self, item: T) -> Result<(), Closed<T>> {
+        let mut item = item;
+        loop {
+            match self.push(item) {
+                Ok(()) => return Ok(()),
+                Err(TrySendError::Closed(rejected)) => return Err(Closed(rejected)),
+                Err(TrySendError::Full(rejected)) => {
+                    let shared = &*self.shared;
+                    shared.blocked.fetch_add(1, Ordering::Relaxed);
+                    shared
+                        .sender
+                        .wait_until(|| shared.len() < shared.slots.len() || shared.is_closed());
+                    item = rejected;
+                }
+            }
+        }
+    }
+
+    pub fn probe(&self) -> Probe {
+        Probe(self.shared.clone())
+    }
+}
+
+impl<T> Drop for Sender<T> {
+    fn drop(&mut self) {
+        self.shared.closed.store(true, Ordering::SeqCst);
+        self.shared.receiver.wake();
+    }
+}
+
+impl<T: Send + 'static> Receiver<T> {
+    /// Takes the oldest item without waiting.
+    pub fn try_recv(&self) -> Option<T> {
+        let shared = &*self.shared;
+        let head = shared.head.load(Ordering::Relaxed);
+        if head == shared.tail.load(Ordering::SeqCst) {
+            return None;
+        }
+        // SAFETY: slots between head and tail hold items, and only the
+        // receiver reads them.
+        let item = unsafe { (*shared.slots[head % shared.slots.len()].get()).assume_init_read() };
+        shared.head.store(head + 1, Ordering::SeqCst);
+        shared.sender.wake();
+        Some(item)
+    }
+
+    /// Takes the oldest item, waiting for one if needed. Returns `None` once
+    /// the sender is gone and everything it sent has been received.
+    pub fn recv(&self) -> Option<T> {
+        loop {
+            if let Some(item) = self.try_recv() {
+                return Some(item);
+            }
+            let shared = &*self.shared;
+            if shared.is_closed() {
+                // The sender may have sent right before closing.
+                return self.try_recv();
+            }
+            shared.starved.fetch_add(1, Ordering::Relaxed);
+            shared
+                .receiver
+                .wait_until(|| shared.len() > 0 || shared.is_closed());
+        }
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = T> + '_ {
+        std::iter::from_fn(|| self.recv())
+    }
+
+    pub fn probe(&self) -> Probe {
+        Probe(self.shared.clone())
+    }
+}
+
+impl<T> Drop for Receiver<T> {
+    fn drop(&mut self) {
+        self.shared.closed.store(true, Ordering::SeqCst);
+        self.shared.sender.wake();
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::time::Duration;
+
+    #[test]
+    fn test_try_send_drops_when_full() {
+        let (sender, receiver) = bounded(2);
+        assert!(sender.try_send(1).is_ok());
+        assert!(sender.try_send(2).is_ok());
+        assert!(matches!(sender.try_send(3), Err(TrySendError::Full(3))));
+        assert_eq!(receiver.try_recv(), Some(1));
+        assert!(sender.try_send(4).is_ok());
+        let stats = sender.probe().stats();
+        assert_eq!((stats.sent, stats.dropped, stats.max_occupancy), (3, 1, 2));
+
+        drop(sender);
+        assert_eq!(receiver.iter().collect::<Vec<_>>(), vec![2, 4]);
+    }
+
+    #[test]
+    fn test_send_applies_backpressure() {
+        let (sender, receiver) = bounded(4);
+        let probe = receiver.probe();
+        let consumer = thread::spawn(move || {
+            let mut expected = 0;
+            for item in receiver.iter() {
+                assert_eq!(item, expected);
+                expected += 1;
+                if expected % 1000 == 0 {
+                    thread::sleep(Duration::from_millis(1));
+                }
+            }
+            expected
+        });
+        for i in 0..10_000 {
+            sender.send(i).unwrap();
+        }
+        drop(sender);
+        assert_eq!(consumer.join().unwrap(), 10_000);
+        let stats = probe.stats();
+        assert_eq!((stats.sent, stats.dropped, stats.len), (10_000, 0, 0));
+        assert!(stats.max_occupancy <= 4);
+    }
+
+    #[test]
+    fn test_ends_are_send_but_not_sync() {
+        fn assert_send<T: Send>() {}
+        assert_send::<Sender<Vec<u8>>>();
+        assert_send::<Receiver<Vec<u8>>>();
+
+        // Only resolves to a single impl when the type isn't `Sync`.
+        trait AmbiguousIfSync<A> {
+            fn check() {}
+        }
+        impl<T: ?Sized> AmbiguousIfSync<()> for T {}
+        impl<T: ?Sized + Sync> AmbiguousIfSync<u8> for T {}
+        <Sender<Vec<u8>> as AmbiguousIfSync<_>>::check();
+        <Receiver<Vec<u8>> as AmbiguousIfSync<_>>::check();
+    }
+
+    #[test]
+    fn test_closed_ends() {
+        let (sender, receiver) = bounded::<Arc<()>>(1);
+        let item = Arc::new(());
+        sender.send(item.clone()).unwrap();
+        drop(receiver);
+        assert!(sender.send(item.clone()).is_err());
+        drop(sender);
+        // The queued item was dropped with the channel.
+        assert_eq!(Arc::strong_count(&item), 1);
+    }
+}
@@ -0,0 +1,243 @@
+use std::{
+    fs,
+    io::{self, BufRead, BufReader, Write},
+    os::unix::net::{UnixListener, UnixStream},
+    path::{Path, PathBuf},
+    str::FromStr,
+    sync::mpsc,
+    thread::{self, JoinHandle},
+    time::Duration,
+};
+
+use anyhow::{anyhow, bail, Context, Result};
+
+/// How long a client waits for the recorder loop to act on a command.
+/// The loop runs once per frame interval, so this is generous.
+const REPLY_TIMEOUT: Duration = Duration::from_secs(2);
+
+/// A command received over the control socket.
+///
+/// The protocol is line based: one command per line, answered with a single
+/// `ok [detail]` or `error <message>` line.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub enum Command {
+    /// Start writing a new recording, optionally to the given path.
+    Start(Option<PathBuf>),
+    Stop,
+    Pause,
+    Resume,
+    /// Write the replay buffer to disk, optionally to the given path.
+    SaveReplay(Option<PathBuf>),
+    ForceKeyframe,
+    SetBitrate(i64),
+    /// Write a JPEG thumbnail of the latest frame, optionally to the given path.
+    Thumbnail(Option<PathBuf>),
+}
+
+impl FromStr for Command {
+    type Err = anyhow::Error;
+
+    fn from_str(line: &str) -> Result<Self> {
+        let mut words = line.split_whitespace();
+        let name = words.next().ok_or_else(|| anyhow!("empty command"))?;
+        let arg = words.next();
+        if words.next().is_some() {
+            bail!("too many arguments for '{name}'");
+        }
+
+        let no_arg = |command: Command| match arg {
+            None => Ok(command),
+            Some(_) => Err(anyhow!("'{name}' takes no argument")),
+        };
+
+        match name {
+            "start" => Ok(Command::Start(arg.map(PathBuf::from))),
+            "stop" => no_arg(Command::Stop),
+            "pause" => no_arg(Command::Pause),
+            "resume" => no_arg(Command::Resume),
+            "save-replay" => Ok(Command::SaveReplay(arg.map(PathBuf::from))),
+            "force-keyframe" => no_arg(Command::ForceKeyframe),
+            "thumbnail" => Ok(Command::Thumbnail(arg.map(PathBuf::from))),
+            "set-bitrate" => {
+                let arg = arg.ok_or_else(|| anyhow!("'set-bitrate' needs a value in bits/s"))?;
+                let bitrate = parse_bitrate(arg)?;
+                Ok(Command::SetBitrate(bitrate))
+            }
+            _ => bail!("unknown command '{name}'"),
+        }
+    }
+}
+
+/// The highest bitrate the encoder accepts: its rate control buffer holds two
+/// seconds and is an `i32` in bits.
+pub const MAX_BITRATE: i64 = i32::MAX as i64 / 2;
+
+/// Parses a bitrate in bits/s, accepting the `K`/`M` suffixes used in the Justfile.
+pub fn parse_bitrate(value: &str) -> Result<i64> {
+    let (digits, multiplier) = match value.as_bytes().last() {
+        Some(b'k' | b'K') => (&value[..value.len() - 1], 1_000),
+        Some(b'm' | b'M') => (&value[..value.len() - 1], 1_000_000),
+        _ => (value, 1),
+    };
+    let bitrate: i64 = digits
+        .parse()
+        .with_context(|| format!("invalid bitrate '{value}'"))?;
+    if bitrate <= 0 {
+        bail!("bitrate must be positive");
+    }
+    match bitrate.checked_mul(multiplier) {
+        Some(bitrate) if bitrate <= MAX_BITRATE => Ok(bitrate),
+        _ => bail!("bitrate '{value}' is above the maximum of {MAX_BITRATE} bits/s"),
+    }
+}
+
+/// A command together with the channel its reply must be sent on.
+pub struct Request {
+    pub command: Command,
+    reply: mpsc::Sender<Result<String, String>>,
+}
+
+impl Request {
+    pub fn reply(self, result: Result<String>) {
+        // The client may have hung up already, that's fine.
+        self.reply.send(result.map_err(|e| format!("{e:#}"))).ok();
+    }
+}
+
+/// Listens on a Unix socket and forwards commands to the recorder loop.
+///
+/// Clients are served one at a time on a dedicated thread, so the recorder
+/// loop only has to call [`ControlServer::try_recv`] once per iteration.
+pub struct ControlServer {
+    path: PathBuf,
+    receiver: mpsc::Receiver<Request>,
+    _thread: JoinHandle<()>,
+}
+
+impl ControlServer {
+    pub fn bind(path: &Path) -> Result<Self> {
+        // A stale socket from a run that died would make bind() fail. Only a
+        // socket nobody listens on is stale; one that answers is a live daemon.
+        match UnixStream::connect(path) {
+            Ok(_) => bail!("A daemon is already running on {}", path.display()),
+            Err(e) if e.kind() == io::ErrorKind::ConnectionRefused => fs::remove_file(path)
+                .with_context(|| format!("Failed to remove stale socket {}", path.display()))?,
+            Err(_) => {}
+        }
+        let listener = UnixListener::bind(path)
+            .with_context(|| format!("Failed to bind control socket {}", path.display()))?;
+        println!("Listening for commands on {}", path.display());
+
+        let (sender, receiver) = mpsc::channel();
+        let thread = thread::Builder::new()
+            .name("control".into())
+            .spawn(move || {
+                for stream in listener.incoming() {
+                    let stream = match stream {
+                        Ok(stream) => stream,
+                        Err(e) => {
+                            eprintln!("Control socket accept failed: {e}");
+                            continue;
+                        }
+                    };
+                    if let Err(e) = serve_client(stream, &sender) {
+                        eprintln!("Control client error: {e:#}");
+                    }
+                }
+            })?;
+
+        Ok(Self {
+            path: path.to_owned(),
+            receiver,
+            _thread: thread,
+        })
+    }
+
+    /// Returns the next pending request without blocking.
+    pub fn try_recv(&self) -> Option<Request> {
+        self.receiver.try_recv().ok()
+    }
+}
+
+impl Drop for ControlServer {
+    fn drop(&mut self) {
+        fs::remove_file(&self.path).ok();
+    }
+}
+
+fn serve_client(stream: UnixStream, sender: &mpsc::Sender<Request>) -> Result<()> {
+    let mut writer = stream.try_clone()?;
+    for line in BufReader::new(stream).lines() {
+        let line = line?;
+        if line.trim().is_empty() {
+            continue;
+        }
+        let response = match line.parse::<Command>() {
+            Ok(command) => {
+                let (reply, reply_receiver) = mpsc::channel();
+                sender
+                    .send(Request { command, reply })
+                    .map_err(|_| anyhow!("recorder loop has exited"))?;
+                match reply_receiver.recv_timeout(REPLY_TIMEOUT) {
+                    Ok(Ok(detail)) if detail.is_empty() => "ok".to_string(),
+                    Ok(Ok(detail)) => format!("ok {detail}"),
+                    Ok(Err(e)) => format!("error {e}"),
+                    Err(_) => "error recorder did not respond".to_string(),
+                }
+            }
+            Err(e) => format!("error {e:#}"),
+        };
+        writeln!(writer, "{response}")?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_commands() {
+        assert_eq!("start".parse::<Command>().unwrap(), Command::Start(None));
+        assert_eq!(
+            "start /tmp/a.h264".parse::<Command>().unwrap(),
+            Command::Start(Some(PathBuf::from("/tmp/a.h264")))
+        );
+        assert_eq!(" stop ".parse::<Command>().unwrap(), Command::Stop);
+        assert_eq!(
+            "thumbnail /tmp/a.jpg".parse::<Command>().unwrap(),
+            Command::Thumbnail(Some(PathBuf::from("/tmp/a.jpg")))
+        );
+        assert_eq!(
+            "set-bitrate 4M".parse::<Command>().unwrap(),
+            Command::SetBitrate(4_000_000)
+        );
+        assert_eq!(
+            "set-bitrate 500k".parse::<Command>().unwrap(),
+            Command::SetBitrate(500_000)
+        );
+        assert!("set-bitrate".parse::<Command>().is_err());
+        assert!("set-bitrate -1".parse::<Command>().is_err());
+        assert!("set-bitrate 10000000000000M".parse::<Command>().is_err());
+        assert!("set-bitrate 5000M".parse::<Command>().is_err());
+        assert_eq!(
+            "set-bitrate 1000M".parse::<Command>().unwrap(),
+            Command::SetBitrate(1_000_000_000)
+        );
+        assert!("pause now".parse::<Command>().is_err());
+        assert!("rewind".parse::<Command>().is_err());
+    }
+
+    #[test]
+    fn test_bind_replaces_only_stale_sockets() {
+        let path = std::env::temp_dir().join(format!("control-{}.sock", std::process::id()));
+        // Left behind by a run that died.
+        drop(UnixListener::bind(&path).unwrap());
+        let server = ControlServer::bind(&path).unwrap();
+        let error = ControlServer::bind(&path).err().unwrap();
+        assert!(error.to_string().contains("already running"), "{error}");
+        // The live daemon kept its socket.
+        assert!(UnixStream::connect(&path).is_ok());
+        drop(server);
+    }
+}
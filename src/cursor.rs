@@ -0,0 +1,301 @@
+//! Cursor received as PipeWire metadata and blended into frames on the GPU.
+//!
+//! With `SPA_META_Cursor` negotiated, Gamescope leaves the cursor out of the
+//! frame and sends its position and bitmap alongside. Moving the cursor then
+//! doesn't damage the frame: the last frame is encoded again with the cursor
+//! blended in at its new position, which the encoder codes as a few changed
+//! macroblocks.
+
+use std::{mem, slice, sync::Arc};
+
+use anyhow::{anyhow, Result};
+use cros_codecs::libva::{Surface, UsageHint, VARectangle, VASurfaceID, VA_RT_FORMAT_RGB32};
+use libspa::sys as spa_sys;
+
+use crate::va::{image_format, write_packed};
+
+/// Largest cursor bitmap we make room for in the metadata.
+pub const MAX_CURSOR_SIZE: u32 = 256;
+
+/// Bytes of metadata needed for a cursor bitmap of `width` x `height`.
+pub fn meta_size(width: u32, height: u32) -> i32 {
+    (mem::size_of::<spa_sys::spa_meta_cursor>()
+        + mem::size_of::<spa_sys::spa_meta_bitmap>()
+        + width as usize * height as usize * 4) as i32
+}
+
+/// A cursor bitmap, converted to premultiplied BGRA (VA's ARGB fourcc).
+pub struct CursorImage {
+    pub width: u32,
+    pub height: u32,
+    pub pixels: Vec<u8>,
+}
+
+#[derive(Clone, Default)]
+pub struct Cursor {
+    pub visible: bool,
+    /// Top-left corner of the image in the frame, i.e. the position minus
+    /// the hotspot.
+    pub x: i32,
+    pub y: i32,
+    pub image: Option<Arc<CursorImage>>,
+}
+
+impl Cursor {
+    /// Updates the cursor from the `SPA_META_Cursor` of a PipeWire buffer.
+    /// Buffers without the metadata leave it unchanged. Returns whether the
+    /// cursor moved, appeared, disappeared or changed its image.
+    ///
+    /// # Safety
+    ///
+    /// `buffer` must be a buffer dequeued from the stream, whose metadata
+    /// stays valid until it is queued again.
+    pub unsafe fn update(&mut self, buffer: &spa_sys::spa_buffer) -> bool {
+        let before = self.state();
+        self.apply(buffer);
+        self.state() != before
+    }
+
+    /// What a frame with this cursor blended in depends on.
+    fn state(&self) -> (bool, i32, i32, Option<*const CursorImage>) {
+        let image = self.image.as_ref().map(Arc::as_ptr);
+        (self.visible, self.x, self.y, image)
+    }
+
+    unsafe fn apply(&mut self, buffer: &spa_sys::spa_buffer) {
+        if buffer.metas.is_null() {
+            return;
+        }
+        let metas = slice::from_raw_parts(buffer.metas, buffer.n_metas as usize);
+        let Some(meta) = metas.iter().find(|meta| {
+            meta.type_ == spa_sys::SPA_META_Cursor
+                && meta.size as usize >= mem::size_of::<spa_sys::spa_meta_cursor>()
+        }) else {
+            return;
+        };
+        let cursor = &*(meta.data as *const spa_sys::spa_meta_cursor);
+        // An id of 0 means there is no cursor to show.
+        self.visible = cursor.id != 0;
+        if !self.visible {
+            return;
+        }
+
+        // The bitmap is only sent when the cursor image changes.
+        let bitmap_offset = cursor.bitmap_offset as usize;
+        if bitmap_offset >= mem::size_of::<spa_sys::spa_meta_cursor>()
+            && bitmap_offset + mem::size_of::<spa_sys::spa_meta_bitmap>() <= meta.size as usize
+        {
+            let base = (meta.data as *const u8).add(bitmap_offset);
+            let bitmap = &*(base as *const spa_sys::spa_meta_bitmap);
+            let (width, height) = (bitmap.size.width, bitmap.size.height);
+            let stride = bitmap.stride as usize;
+            let len = stride * height.saturating_sub(1) as usize + width as usize * 4;
+            let fits = bitmap_offset + bitmap.offset as usize + len <= meta.size as usize;
+            if width > 0 && height > 0 && stride >= width as usize * 4 && fits {
+                let data = slice::from_raw_parts(base.add(bitmap.offset as usize), len);
+                if let Some(pixels) =
+                    to_premultiplied_bgra(bitmap.format, data, stride, width, height)
+                {
+                    self.image = Some(Arc::new(CursorImage {
+                        width,
+                        height,
+                        pixels,
+                    }));
+                }
+            }
+        }
+        self.x = cursor.position.x - cursor.hotspot.x;
+        self.y = cursor.position.y - cursor.hotspot.y;
+    }
+}
+
+/// Converts a 32-bit RGB bitmap to premultiplied BGRA, the memory layout of
+/// VA's ARGB fourcc. Returns `None` for formats we don't handle.
+fn to_premultiplied_bgra(
+    format: u32,
+    data: &[u8],
+    stride: usize,
+    width: u32,
+    height: u32,
+) -> Option<Vec<u8>> {
+    // Byte positions of B, G, R and A in the source pixel.
+    let order = match format {
+        spa_sys::SPA_VIDEO_FORMAT_BGRA => [0, 1, 2, 3],
+        spa_sys::SPA_VIDEO_FORMAT_RGBA => [2, 1, 0, 3],
+        spa_sys::SPA_VIDEO_FORMAT_ARGB => [3, 2, 1, 0],
+        spa_sys::SPA_VIDEO_FORMAT_ABGR => [1, 2, 3, 0],
+        _ => return None,
+    };
+    let mut pixels = Vec::with_capacity(width as usize * height as usize * 4);
+    for row in data.chunks(stride).take(height as usize) {
+        for pixel in row[..width as usize * 4].chunks_exact(4) {
+            let alpha = pixel[order[3]] as u32;
+            let premultiply = |c: u8| ((c as u32 * alpha + 127) / 255) as u8;
+            pixels.extend_from_slice(&[
+                premultiply(pixel[order[0]]),
+                premultiply(pixel[order[1]]),
+                premultiply(pixel[order[2]]),
+                alpha as u8,
+            ]);
+        }
+    }
+    Some(pixels)
+}
+
+/// Clips a `width` x `height` image at (`x`, `y`) to a frame. Returns the
+/// visible part as source and destination rectangles `(x, y, width, height)`.
+fn clip(
+    (x, y): (i32, i32),
+    (width, height): (u32, u32),
+    (frame_width, frame_height): (u32, u32),
+) -> Option<((u32, u32, u32, u32), (u32, u32, u32, u32))> {
+    let left = x.max(0);
+    let top = y.max(0);
+    let right = (x + width as i32).min(frame_width as i32);
+    let bottom = (y + height as i32).min(frame_height as i32);
+    if right <= left || bottom <= top {
+        return None;
+    }
+    let size = ((right - left) as u32, (bottom - top) as u32);
+    Some((
+        ((left - x) as u32, (top - y) as u32, size.0, size.1),
+        (left as u32, top as u32, size.0, size.1),
+    ))
+}
+
+/// Where to blend the cursor surface into a frame.
+pub struct Blend {
+    pub surface: VASurfaceID,
+    pub src: VARectangle,
+    pub dst: VARectangle,
+}
+
+impl Blend {
+    /// Moves the destination from a `from` sized frame to the same place in
+    /// a `to` sized one, for frames that are scaled while blending.
+    pub fn scaled(mut self, from: (u32, u32), to: (u32, u32)) -> Self {
+        if from != to {
+            let scale = |v: i32, to: u32, from: u32| (v as i64 * to as i64 / from as i64) as i32;
+            let dst = &mut self.dst;
+            let right = scale(dst.x as i32 + dst.width as i32, to.0, from.0);
+            let bottom = scale(dst.y as i32 + dst.height as i32, to.1, from.1);
+            dst.x = scale(dst.x as i32, to.0, from.0) as i16;
+            dst.y = scale(dst.y as i32, to.1, from.1) as i16;
+            dst.width = (right - dst.x as i32).max(1) as u16;
+            dst.height = (bottom - dst.y as i32).max(1) as u16;
+        }
+        self
+    }
+}
+
+fn rectangle((x, y, width, height): (u32, u32, u32, u32)) -> VARectangle {
+    VARectangle {
+        x: x as i16,
+        y: y as i16,
+        width: width as u16,
+        height: height as u16,
+    }
+}
+
+/// The cursor image uploaded to a VA surface, re-uploaded when it changes.
+#[derive(Default)]
+pub struct CursorOverlay {
+    surface: Option<Surface<()>>,
+    image: Option<Arc<CursorImage>>,
+}
+
+impl CursorOverlay {
+    /// Returns how to blend `cursor` into `frame`, or `None` when it is
+    /// hidden or off screen. The cursor surface lives on the frame's display.
+    pub fn prepare(&mut self, frame: &Surface<()>, cursor: &Cursor) -> Result<Option<Blend>> {
+        let Some(image) = cursor.image.as_ref().filter(|_| cursor.visible) else {
+            return Ok(None);
+        };
+        let Some((src, dst)) = clip(
+            (cursor.x, cursor.y),
+            (image.width, image.height),
+            frame.size(),
+        ) else {
+            return Ok(None);
+        };
+
+        if !self
+            .image
+            .as_ref()
+            .is_some_and(|old| Arc::ptr_eq(old, image))
+        {
+            let display = frame.display();
+            let size = (image.width, image.height);
+            if self.surface.as_ref().map(|s| s.size()) != Some(size) {
+                let surface = display
+                    .create_surfaces(
+                        VA_RT_FORMAT_RGB32,
+                        Some(u32::from_le_bytes(*b"ARGB")),
+                        image.width,
+                        image.height,
+                        Some(UsageHint::USAGE_HINT_VPP_READ),
+                        vec![()],
+                    )
+                    .map_err(|e| anyhow!("Failed to create cursor surface: {e:?}"))?
+                    .pop()
+                    .ok_or_else(|| anyhow!("No cursor surface created"))?;
+                self.surface = Some(surface);
+            }
+            let surface = self.surface.as_ref().unwrap();
+            write_packed(surface, image_format(display, b"ARGB")?, 4, &image.pixels)?;
+            self.image = Some(image.clone());
+        }
+
+        Ok(Some(Blend {
+            surface: self.surface.as_ref().unwrap().id(),
+            src: rectangle(src),
+            dst: rectangle(dst),
+        }))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_clip() {
+        let frame = (1280, 720);
+        assert_eq!(
+            clip((10, 20), (32, 32), frame),
+            Some(((0, 0, 32, 32), (10, 20, 32, 32)))
+        );
+        // Partly off the top left and bottom right corners.
+        assert_eq!(
+            clip((-8, -4), (32, 32), frame),
+            Some(((8, 4, 24, 28), (0, 0, 24, 28)))
+        );
+        assert_eq!(
+            clip((1270, 700), (32, 32), frame),
+            Some(((0, 0, 10, 20), (1270, 700, 10, 20)))
+        );
+        assert_eq!(clip((1280, 0), (32, 32), frame), None);
+        assert_eq!(clip((-32, 0), (32, 32), frame), None);
+    }
+
+    #[test]
+    fn test_blend_follows_downscale() {
+        let blend = Blend {
+            surface: 0,
+            src: rectangle((0, 0, 64, 64)),
+            dst: rectangle((1920, 1080, 64, 64)),
+        };
+        let dst = blend.scaled((3840, 2160), (1920, 1080)).dst;
+        assert_eq!((dst.x, dst.y, dst.width, dst.height), (960, 540, 32, 32));
+    }
+
+    #[test]
+    fn test_premultiplies_and_swizzles() {
+        // Two RGBA pixels with a padded stride: opaque red, half-transparent white.
+        let data = [255, 0, 0, 255, 255, 255, 255, 128, 0, 0];
+        let pixels =
+            to_premultiplied_bgra(spa_sys::SPA_VIDEO_FORMAT_RGBA, &data, 10, 2, 1).unwrap();
+        assert_eq!(pixels, vec![0, 0, 255, 255, 128, 128, 128, 128]);
+        assert!(to_premultiplied_bgra(spa_sys::SPA_VIDEO_FORMAT_NV12, &data, 10, 2, 1).is_none());
+    }
+}
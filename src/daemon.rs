@@ -0,0 +1,479 @@
+use std::{
+    fs::File,
+    path::PathBuf,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc,
+    },
+    thread,
+    time::{Duration, Instant, SystemTime, UNIX_EPOCH},
+};
+
+use anyhow::{bail, Context, Result};
+
+use crate::{
+    capture::{CaptureOptions, Capturer},
+    control::{Command, ControlServer},
+    encode_ffmpeg::{Encoder, EncoderSettings},
+    fanout::{FanOut, FileSink, SinkId},
+    packet::Packet,
+    preview::{PreviewOptions, Previewer},
+    recovery::{encode_frame, prepare_encoder, recover, Recovery, Stage},
+    replay::ReplayBuffer,
+};
+
+pub struct DaemonOptions {
+    pub socket: PathBuf,
+    pub output_dir: PathBuf,
+    pub replay_seconds: u32,
+    pub settings: EncoderSettings,
+    pub capture: CaptureOptions,
+    pub preview: PreviewOptions,
+}
+
+/// A recording being written to a file.
+///
+/// Packets come out of the encoder a few frames after the frame was submitted,
+/// so a recording is described by the timestamp ranges it covers rather than
+/// by whether it is active when a packet arrives.
+struct Recording {
+    path: PathBuf,
+    sink: SinkId,
+    /// `[start, end)` timestamp ranges. The last one is open while recording.
+    ranges: Vec<(i64, Option<i64>)>,
+    stopped: bool,
+}
+
+impl Recording {
+    fn is_running(&self) -> bool {
+        matches!(self.ranges.last(), Some((_, None)))
+    }
+
+    fn wants(&self, pts: i64) -> bool {
+        self.ranges
+            .iter()
+            .any(|&(start, end)| pts >= start && end.map_or(true, |end| pts < end))
+    }
+
+    /// Whether no packet at or after `pts` can belong to this recording anymore.
+    fn is_complete(&self, pts: i64) -> bool {
+        self.stopped
+            && self
+                .ranges
+                .last()
+                .map_or(true, |&(_, end)| end <= Some(pts))
+    }
+}
+
+/// Keeps capture and encoder warm and records on demand.
+///
+/// While the daemon runs, every captured frame is encoded into the replay
+/// buffer (if enabled), and recordings are just sinks that pick up the packets
+/// they cover. The encoder session is opened from the first captured frame
+/// either way, so starting a recording only forces an IDR on the next frame
+/// instead of paying for PipeWire negotiation and encoder creation.
+pub fn run(options: DaemonOptions, running: Arc<AtomicBool>) -> Result<()> {
+    let control = ControlServer::bind(&options.socket)?;
+    let capturer = Capturer::new(options.capture)?;
+    let previewer = Previewer::start(capturer.subscribe(), options.preview.clone())?;
+    let framerate = options.settings.framerate;
+    let mut settings = options.settings;
+    let mut encoder: Option<Encoder> = None;
+    let mut replay = (options.replay_seconds > 0)
+        .then(|| ReplayBuffer::new(options.replay_seconds as i64 * framerate as i64));
+    let mut recordings: Vec<Recording> = Vec::new();
+    // Why the active recording ended on its own, for its client's next command.
+    let mut failed: Option<anyhow::Error> = None;
+    let mut fanout = FanOut::new();
+    let mut names = FileNames::new(options.output_dir.clone());
+    let mut recovery = Recovery::new();
+    // Where the next encoder session continues after a rebuild.
+    let mut next_pts = 0;
+
+    let frame_duration = Duration::from_secs_f64(1.0 / framerate as f64);
+    let mut next_frame_time = Instant::now() + frame_duration;
+    while running.load(Ordering::SeqCst) {
+        while let Some(request) = control.try_recv() {
+            // Answered by the preview thread, so taking it doesn't delay frames.
+            if let Command::Thumbnail(path) = &request.command {
+                let path = path
+                    .clone()
+                    .unwrap_or_else(|| names.next("thumbnail", "jpg"));
+                previewer.snapshot(path, request);
+                continue;
+            }
+            // Before the first frame has been captured there is no encoder
+            // yet, and its first frame will be an IDR anyway.
+            let pts = encoder.as_ref().map_or(next_pts, |e| e.next_pts());
+            let result = handle_command(
+                &request.command,
+                &mut names,
+                &mut settings,
+                encoder.as_mut(),
+                pts,
+                &mut recordings,
+                &mut failed,
+                &mut fanout,
+                replay.as_ref(),
+            );
+            request.reply(result);
+        }
+
+        // Paused recordings don't need frames, but stopped ones do until their
+        // last packets have come out of the encoder.
+        let wants_frames =
+            replay.is_some() || recordings.iter().any(|r| r.stopped || r.is_running());
+        let mut failure = capturer.take_error();
+        // The encoder is created from the first frame even when nothing
+        // needs frames yet, so the first recording doesn't wait for it.
+        if wants_frames || encoder.is_none() {
+            if let Some(frame) = capturer.read_frame() {
+                let result = if wants_frames {
+                    let cursor = capturer.cursor();
+                    encode_frame(&mut encoder, &settings, next_pts, frame, cursor)
+                } else {
+                    prepare_encoder(&mut encoder, &settings, next_pts, &frame).map(|_| ())
+                };
+                match result {
+                    Ok(()) => recovery.on_success(),
+                    Err(e) => failure = failure.or(Some((Stage::Encode, e))),
+                }
+            }
+        }
+
+        if let Some(encoder) = &mut encoder {
+            loop {
+                match encoder.poll_packet() {
+                    Ok(Some(packet)) => dispatch_packet(
+                        &packet,
+                        replay.as_mut(),
+                        &mut recordings,
+                        &mut failed,
+                        &mut fanout,
+                    ),
+                    Ok(None) => break,
+                    Err(e) => {
+                        failure = failure.or(Some((Stage::Encode, e)));
+                        break;
+                    }
+                }
+            }
+        }
+
+        if let Some((stage, error)) = failure {
+            let salvaged = recover(
+                &mut recovery,
+                stage,
+                error,
+                &capturer.control(),
+                &mut encoder,
+                &mut next_pts,
+            )?;
+            for packet in salvaged {
+                dispatch_packet(
+                    &packet,
+                    replay.as_mut(),
+                    &mut recordings,
+                    &mut failed,
+                    &mut fanout,
+                );
+            }
+        }
+
+        let now = Instant::now();
+        if next_frame_time >= now {
+            thread::sleep(next_frame_time - now);
+            next_frame_time += frame_duration;
+        } else {
+            next_frame_time = now + frame_duration;
+        }
+    }
+
+    println!("\nDraining encoder...");
+    if let Some(mut encoder) = encoder {
+        for recording in &mut recordings {
+            stop_recording(recording, encoder.next_pts());
+        }
+        for packet in encoder.drain_packets()? {
+            dispatch_packet(
+                &packet,
+                replay.as_mut(),
+                &mut recordings,
+                &mut failed,
+                &mut fanout,
+            );
+        }
+    }
+    fanout.finish()?;
+    for recording in recordings {
+        println!("Finished recording {}", recording.path.display());
+    }
+    previewer.finish()
+}
+
+fn handle_command(
+    command: &Command,
+    names: &mut FileNames,
+    settings: &mut EncoderSettings,
+    encoder: Option<&mut Encoder>,
+    next_pts: i64,
+    recordings: &mut Vec<Recording>,
+    failed: &mut Option<anyhow::Error>,
+    fanout: &mut FanOut,
+    replay: Option<&ReplayBuffer>,
+) -> Result<String> {
+    let active = recordings.iter_mut().find(|r| !r.stopped);
+    // A recording that failed is gone; the next command about it says why.
+    if active.is_none() && matches!(command, Command::Stop | Command::Pause | Command::Resume) {
+        if let Some(error) = failed.take() {
+            return Err(error);
+        }
+    }
+
+    match command {
+        Command::Start(path) => {
+            if active.is_some() {
+                bail!("already recording");
+            }
+            // Already logged, and the client moved on.
+            *failed = None;
+            let path = path
+                .clone()
+                .unwrap_or_else(|| names.next("recording", "h264"));
+            // A recording must not lose packets: with two seconds of them
+            // queued, the daemon waits for its file to catch up.
+            let queue = 2 * settings.framerate as usize;
+            let sink = fanout.add_primary("recording", queue, FileSink::create(&path)?)?;
+            if let Some(encoder) = encoder {
+                encoder.force_keyframe();
+            }
+            recordings.push(Recording {
+                path: path.clone(),
+                sink,
+                ranges: vec![(next_pts, None)],
+                stopped: false,
+            });
+            Ok(path.display().to_string())
+        }
+        Command::Stop => {
+            let Some(recording) = active else {
+                bail!("not recording");
+            };
+            stop_recording(recording, next_pts);
+            Ok(recording.path.display().to_string())
+        }
+        Command::Pause => {
+            let Some(recording) = active.filter(|r| r.is_running()) else {
+                bail!("not recording");
+            };
+            recording.ranges.last_mut().unwrap().1 = Some(next_pts);
+            Ok(String::new())
+        }
+        Command::Resume => {
+            let Some(recording) = active.filter(|r| !r.is_running()) else {
+                bail!("not paused");
+            };
+            recording.ranges.push((next_pts, None));
+            if let Some(encoder) = encoder {
+                encoder.force_keyframe();
+            }
+            Ok(String::new())
+        }
+        Command::SaveReplay(path) => {
+            let Some(replay) = replay else {
+                bail!("replay buffer is disabled");
+            };
+            let path = path.clone().unwrap_or_else(|| names.next("replay", "h264"));
+            let mut file = File::create(&path)
+                .with_context(|| format!("Failed to create {}", path.display()))?;
+            let frames = replay.write_to(&mut file)?;
+            Ok(format!("{} ({frames} frames)", path.display()))
+        }
+        Command::ForceKeyframe => {
+            if let Some(encoder) = encoder {
+                encoder.force_keyframe();
+            }
+            Ok(String::new())
+        }
+        Command::SetBitrate(bitrate) => {
+            settings.bitrate = *bitrate;
+            if let Some(encoder) = encoder {
+                encoder.set_bitrate(*bitrate)?;
+            }
+            Ok(String::new())
+        }
+        Command::Thumbnail(_) => unreachable!("handled by the preview thread"),
+    }
+}
+
+fn stop_recording(recording: &mut Recording, next_pts: i64) {
+    if let Some(range) = recording.ranges.last_mut() {
+        range.1.get_or_insert(next_pts);
+    }
+    recording.stopped = true;
+}
+
+/// Hands a packet to the replay buffer and to every recording that covers it.
+/// None of them copy it, and file writes happen on the auxiliary executor.
+///
+/// A recording whose file fails, e.g. when the disk is full, is dropped
+/// without taking the daemon down. If it was still active, the error is kept
+/// in `failed` for its client.
+fn dispatch_packet(
+    packet: &Packet,
+    replay: Option<&mut ReplayBuffer>,
+    recordings: &mut Vec<Recording>,
+    failed: &mut Option<anyhow::Error>,
+    fanout: &mut FanOut,
+) {
+    if let Some(replay) = replay {
+        replay.push(packet);
+    }
+    recordings.retain(|recording| {
+        let mut result = Ok(());
+        if recording.wants(packet.pts()) {
+            result = fanout.send_to(recording.sink, packet);
+        }
+        let done = result.is_err() || recording.is_complete(packet.pts());
+        if done {
+            result = result.and(fanout.remove(recording.sink));
+        }
+        match result {
+            Ok(()) if done => println!("Finished recording {}", recording.path.display()),
+            Ok(()) => {}
+            Err(e) => {
+                let e = e.context(format!("Recording {} failed", recording.path.display()));
+                eprintln!("{e:#}");
+                if !recording.stopped {
+                    *failed = Some(e);
+                }
+            }
+        }
+        !done
+    });
+}
+
+/// Names the files of commands given without a path after the time, in
+/// milliseconds.
+///
+/// Two commands in the same millisecond get consecutive ones, and names of
+/// files already in the directory are skipped, so no command truncates
+/// another's file.
+struct FileNames {
+    dir: PathBuf,
+    last_millis: u64,
+}
+
+impl FileNames {
+    fn new(dir: PathBuf) -> Self {
+        Self {
+            dir,
+            last_millis: 0,
+        }
+    }
+
+    fn next(&mut self, prefix: &str, extension: &str) -> PathBuf {
+        let now = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .map(|d| d.as_millis() as u64)
+            .unwrap_or_default();
+        let mut millis = now.max(self.last_millis + 1);
+        loop {
+            let (secs, millis_part) = (millis / 1000, millis % 1000);
+            let path = self
+                .dir
+                .join(format!("{prefix}-{secs}.{millis_part:03}.{extension}"));
+            if !path.exists() {
+                self.last_millis = millis;
+                return path;
+            }
+            millis += 1;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::fanout::Sink;
+
+    struct Full;
+
+    impl Sink for Full {
+        fn write(&mut self, _packet: &Packet) -> Result<()> {
+            bail!("No space left on device")
+        }
+    }
+
+    #[test]
+    fn test_failed_recording_is_dropped_and_reported() {
+        let mut fanout = FanOut::new();
+        let sink = fanout.add_primary("recording", 4, Full).unwrap();
+        let mut recordings = vec![Recording {
+            path: PathBuf::from("full.h264"),
+            sink,
+            ranges: vec![(0, None)],
+            stopped: false,
+        }];
+        let mut failed = None;
+        let mut pts = 0;
+        // The write fails on the executor; a later send finds out.
+        while !recordings.is_empty() {
+            assert!(pts < 1000, "the failure was never noticed");
+            let packet = Packet::from_bytes(vec![0; 10], pts, true);
+            dispatch_packet(&packet, None, &mut recordings, &mut failed, &mut fanout);
+            pts += 1;
+            thread::sleep(Duration::from_millis(1));
+        }
+
+        let mut settings = EncoderSettings::default();
+        let mut names = FileNames::new(PathBuf::from("/nonexistent"));
+        let stop = handle_command(
+            &Command::Stop,
+            &mut names,
+            &mut settings,
+            None,
+            pts,
+            &mut recordings,
+            &mut failed,
+            &mut fanout,
+            None,
+        );
+        let error = format!("{:#}", stop.unwrap_err());
+        assert!(
+            error.contains("full.h264") && error.contains("No space"),
+            "{error}"
+        );
+        // Reported once.
+        let stop = handle_command(
+            &Command::Stop,
+            &mut names,
+            &mut settings,
+            None,
+            pts,
+            &mut recordings,
+            &mut failed,
+            &mut fanout,
+            None,
+        );
+        assert_eq!(stop.unwrap_err().to_string(), "not recording");
+    }
+
+    #[test]
+    fn test_file_names_are_unique() {
+        let dir = std::env::temp_dir().join(format!("names-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let mut names = FileNames::new(dir.clone());
+        let first = names.next("replay", "h264");
+        File::create(&first).unwrap();
+        let second = names.next("replay", "h264");
+        assert_ne!(first, second);
+        // An existing file from another run isn't reused either.
+        let mut fresh = FileNames::new(dir.clone());
+        fresh.last_millis = names.last_millis - 2;
+        File::create(&second).unwrap();
+        let third = fresh.next("replay", "h264");
+        assert!(third != first && third != second);
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
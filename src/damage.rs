@@ -0,0 +1,453 @@
+//! Static region detection, for producers that send no damage regions.
+//!
+//! Capture doesn't negotiate `SPA_META_VideoDamage`, and most producers
+//! wouldn't fill it in, so the encoder can't tell what changed from the
+//! frame alone. Here each frame is scaled down 4x by VPP, like thumbnails
+//! are, and only the luma of that small copy is read back and compared with
+//! the previous one in 16x16 tiles, each covering 64x64 pixels of the frame.
+//!
+//! Tiles that stayed the same for a few frames become regions of interest
+//! with a higher QP, so the encoder spends its bits on what moves, and a
+//! frame where nothing changed is coded almost entirely as skipped
+//! macroblocks. Every other frame is checked, and on content where nothing
+//! stays still, checks back off to every 8th frame to keep the cost of a
+//! readback off frames it can't help. Once the encoder has timed enough
+//! frames with and without regions, detection turns itself off if its
+//! checks took longer than the encode time the regions saved.
+
+use std::time::{Duration, Instant};
+
+use anyhow::{anyhow, Context, Result};
+use cros_codecs::libva::{Surface, UsageHint, VAImageFormat, VA_RT_FORMAT_YUV420};
+
+use crate::{
+    encode_ffmpeg::VppContext,
+    nv12::row_sad,
+    va::{nv12_image_format, read_nv12},
+};
+
+/// Downscale factor of the compared luma plane.
+const SCALE: u32 = 4;
+
+/// Side of a tile on the downscaled plane.
+const TILE: usize = 16;
+
+/// Sum of absolute differences up to which a tile is unchanged: half a
+/// level per pixel, so dithering doesn't count but the averaging of the
+/// downscale still leaves a blinking caret well above it.
+const SAD_THRESHOLD: u32 = (TILE * TILE / 2) as u32;
+
+/// Frames a tile must stay unchanged before it counts as static, so the
+/// encoder still refines a region that just stopped moving.
+const SETTLE_FRAMES: u32 = 8;
+
+/// Frames per check. Ages count frames, so tiles settle just as fast.
+const CHECK_STEP: u32 = 2;
+
+/// Checks without a static tile after which only every `BACKOFF_STEP`th
+/// frame is checked, until a static tile shows up again.
+const BACKOFF_AFTER: u32 = 120;
+const BACKOFF_STEP: u32 = 8;
+
+/// Frames of each kind the encoder times before detection is weighed
+/// against the encode time it saves.
+const MIN_TIMED_FRAMES: u64 = 300;
+
+/// Regions handed to the encoder per frame. Drivers take only a few and
+/// FFmpeg passes the first ones, so the largest come first.
+const MAX_REGIONS: usize = 8;
+
+/// A rectangle in pixels, right and bottom exclusive.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Region {
+    pub left: i32,
+    pub top: i32,
+    pub right: i32,
+    pub bottom: i32,
+}
+
+/// A rectangle of tiles.
+#[derive(Debug, Clone, Copy, PartialEq)]
+struct TileRect {
+    x: usize,
+    y: usize,
+    width: usize,
+    height: usize,
+}
+
+/// How many frames each tile has stayed unchanged for.
+struct TileAges {
+    /// Size of the luma plane the tiles cover.
+    size: (usize, usize),
+    columns: usize,
+    rows: usize,
+    ages: Vec<u32>,
+}
+
+impl TileAges {
+    fn new(width: usize, height: usize) -> Self {
+        let (columns, rows) = (width.div_ceil(TILE), height.div_ceil(TILE));
+        Self {
+            size: (width, height),
+            columns,
+            rows,
+            ages: vec![0; columns * rows],
+        }
+    }
+
+    /// Compares two luma planes of `width` bytes per row, `frames` apart,
+    /// and ages the tiles that didn't change.
+    fn update(&mut self, previous: &[u8], current: &[u8], width: usize, frames: u32) {
+        for (index, age) in self.ages.iter_mut().enumerate() {
+            let (x, y) = (index % self.columns * TILE, index / self.columns * TILE);
+            let tile_width = TILE.min(width - x);
+            let mut sad = 0;
+            for row in y..(y + TILE).min(current.len() / width) {
+                let start = row * width + x;
+                let end = start + tile_width;
+                sad += row_sad(&previous[start..end], &current[start..end]);
+                if sad > SAD_THRESHOLD {
+                    break;
+                }
+            }
+            *age = if sad > SAD_THRESHOLD {
+                0
+            } else {
+                age.saturating_add(frames)
+            };
+        }
+    }
+
+    fn is_static(&self, x: usize, y: usize) -> bool {
+        self.ages[y * self.columns + x] >= SETTLE_FRAMES
+    }
+
+    /// Returns up to `max` disjoint rectangles covering static tiles,
+    /// largest first.
+    fn static_rects(&self, max: usize) -> Vec<TileRect> {
+        let mut free: Vec<bool> = (0..self.ages.len())
+            .map(|i| self.is_static(i % self.columns, i / self.columns))
+            .collect();
+        let mut rects = Vec::new();
+        while rects.len() < max {
+            let Some(rect) = largest_rect(&free, self.columns, self.rows) else {
+                break;
+            };
+            for y in rect.y..rect.y + rect.height {
+                free[y * self.columns + rect.x..][..rect.width].fill(false);
+            }
+            rects.push(rect);
+        }
+        rects
+    }
+}
+
+/// Finds the largest rectangle of set cells in a grid, with the histogram
+/// of set cells ending at each row and a stack of rising heights.
+fn largest_rect(cells: &[bool], columns: usize, rows: usize) -> Option<TileRect> {
+    let mut heights = vec![0; columns];
+    let mut best: Option<TileRect> = None;
+    let mut stack: Vec<usize> = Vec::with_capacity(columns);
+    for y in 0..rows {
+        for (x, height) in heights.iter_mut().enumerate() {
+            *height = if cells[y * columns + x] {
+                *height + 1
+            } else {
+                0
+            };
+        }
+        stack.clear();
+        for x in 0..=columns {
+            let height = heights.get(x).copied().unwrap_or(0);
+            while let Some(&top) = stack.last() {
+                if heights[top] < height {
+                    break;
+                }
+                stack.pop();
+                let left = stack.last().map_or(0, |&i| i + 1);
+                let rect = TileRect {
+                    x: left,
+                    y: y + 1 - heights[top],
+                    width: x - left,
+                    height: heights[top],
+                };
+                if rect.height > 0
+                    && best.map_or(true, |b| rect.width * rect.height > b.width * b.height)
+                {
+                    best = Some(rect);
+                }
+            }
+            stack.push(x);
+        }
+    }
+    best
+}
+
+/// Time the encoder took for a kind of frame.
+#[derive(Default)]
+struct EncodeTimes {
+    total: Duration,
+    frames: u64,
+}
+
+impl EncodeTimes {
+    fn mean(&self) -> Duration {
+        self.total / self.frames.max(1) as u32
+    }
+}
+
+/// Finds the static regions of frames in the encode stage.
+pub struct StaticDetector {
+    /// Kept between checks. Declared before `surface`, which it renders
+    /// into, so it goes first.
+    vpp: Option<VppContext>,
+    surface: Option<Surface<()>>,
+    format: Option<VAImageFormat>,
+    previous: Vec<u8>,
+    current: Vec<u8>,
+    ages: Option<TileAges>,
+    /// Frames since the last check.
+    since_check: u32,
+    checks_without_static: u32,
+    checks: u64,
+    unchanged: u64,
+    static_tiles: u64,
+    tiles: u64,
+    busy: Duration,
+    /// Frames encoded with static regions, and without, keyframes aside.
+    with_regions: EncodeTimes,
+    without_regions: EncodeTimes,
+}
+
+impl StaticDetector {
+    pub fn new() -> Self {
+        Self {
+            vpp: None,
+            surface: None,
+            format: None,
+            previous: Vec::new(),
+            current: Vec::new(),
+            ages: None,
+            since_check: 0,
+            checks_without_static: 0,
+            checks: 0,
+            unchanged: 0,
+            static_tiles: 0,
+            tiles: 0,
+            busy: Duration::ZERO,
+            with_regions: EncodeTimes::default(),
+            without_regions: EncodeTimes::default(),
+        }
+    }
+
+    /// Returns the static regions of `frame` in pixels of an encoded frame
+    /// of `size`, or none on frames that aren't checked.
+    pub fn detect(&mut self, frame: &Surface<()>, size: (u32, u32)) -> Result<Vec<Region>> {
+        self.since_check += 1;
+        let step = if self.checks_without_static >= BACKOFF_AFTER {
+            BACKOFF_STEP
+        } else {
+            CHECK_STEP
+        };
+        if self.since_check < step {
+            return Ok(Vec::new());
+        }
+        let frames = std::mem::take(&mut self.since_check);
+
+        let start = Instant::now();
+        let (width, height) = self.read_luma(frame)?;
+        let (width, height) = (width as usize, height as usize);
+        let ages = match &mut self.ages {
+            Some(ages) if ages.size == (width, height) => ages,
+            // First frame or a new size, which may be a rotation of the old
+            // one: nothing to compare with yet.
+            _ => {
+                self.ages = Some(TileAges::new(width, height));
+                std::mem::swap(&mut self.previous, &mut self.current);
+                return Ok(Vec::new());
+            }
+        };
+        ages.update(&self.previous, &self.current, width, frames);
+        std::mem::swap(&mut self.previous, &mut self.current);
+        let rects = ages.static_rects(MAX_REGIONS);
+
+        let static_tiles = (0..ages.ages.len())
+            .filter(|&i| ages.is_static(i % ages.columns, i / ages.columns))
+            .count();
+        self.checks += 1;
+        self.tiles += ages.ages.len() as u64;
+        self.static_tiles += static_tiles as u64;
+        if static_tiles == ages.ages.len() {
+            self.unchanged += 1;
+        }
+        self.checks_without_static = if static_tiles == 0 {
+            self.checks_without_static + 1
+        } else {
+            0
+        };
+        self.busy += start.elapsed();
+
+        // Tile edges on the small plane, scaled to the encoded frame.
+        let to_x = |x: usize| ((x * TILE).min(width) as u64 * size.0 as u64 / width as u64) as i32;
+        let to_y =
+            |y: usize| ((y * TILE).min(height) as u64 * size.1 as u64 / height as u64) as i32;
+        Ok(rects
+            .into_iter()
+            .map(|rect| Region {
+                left: to_x(rect.x),
+                top: to_y(rect.y),
+                right: to_x(rect.x + rect.width),
+                bottom: to_y(rect.y + rect.height),
+            })
+            .collect())
+    }
+
+    /// Scales `frame` down into the detector's surface and reads its luma
+    /// plane into `current`. Returns the size of the plane.
+    fn read_luma(&mut self, frame: &Surface<()>) -> Result<(u32, u32)> {
+        let (frame_width, frame_height) = frame.size();
+        let width = (frame_width / SCALE).max(2) & !1;
+        let height = (frame_height / SCALE).max(2) & !1;
+        let display = frame.display();
+        if self.surface.as_ref().map(|s| s.size()) != Some((width, height)) {
+            self.vpp = None;
+            let surface = display
+                .create_surfaces(
+                    VA_RT_FORMAT_YUV420,
+                    Some(u32::from_le_bytes(*b"NV12")),
+                    width,
+                    height,
+                    Some(UsageHint::USAGE_HINT_VPP_WRITE),
+                    vec![()],
+                )
+                .map_err(|e| anyhow!("Failed to create detection surface: {e:?}"))?
+                .pop()
+                .ok_or_else(|| anyhow!("No detection surface created"))?;
+            self.vpp = Some(VppContext::new(
+                display.handle(),
+                surface.id(),
+                width as i32,
+                height as i32,
+            )?);
+            self.surface = Some(surface);
+        }
+        let surface = self.surface.as_ref().unwrap();
+        let vpp = self.vpp.as_ref().unwrap();
+        vpp.copy(frame.id(), surface.id(), None)
+            .context("Failed to scale frame for static detection")?;
+
+        let format = match self.format {
+            Some(format) => format,
+            None => *self.format.insert(nv12_image_format(display)?),
+        };
+        let luma_size = width as usize * height as usize;
+        self.current.clear();
+        // The chroma rows come after the luma ones and aren't needed.
+        read_nv12(surface, format, |row| {
+            if self.current.len() < luma_size {
+                self.current.extend_from_slice(row);
+            }
+        })?;
+        Ok((width, height))
+    }
+
+    /// Notes how long the encoder took for a frame other than a keyframe,
+    /// and whether it was given static regions.
+    pub fn encoded(&mut self, with_regions: bool, took: Duration) {
+        let times = if with_regions {
+            &mut self.with_regions
+        } else {
+            &mut self.without_regions
+        };
+        times.total += took;
+        times.frames += 1;
+    }
+
+    /// Whether the checks took less time than the regions they found saved
+    /// the encoder. True until enough frames of both kinds were timed.
+    pub fn pays_off(&self) -> bool {
+        let (with, without) = (&self.with_regions, &self.without_regions);
+        if with.frames < MIN_TIMED_FRAMES || without.frames < MIN_TIMED_FRAMES {
+            return true;
+        }
+        let saved = without.mean().saturating_sub(with.mean()) * with.frames as u32;
+        self.busy <= saved
+    }
+
+    pub fn report(&self) {
+        if self.checks == 0 {
+            return;
+        }
+        println!(
+            "Static detection: {} checks, {:.0}% of tiles static, {} unchanged frames, {:.0}µs per check",
+            self.checks,
+            self.static_tiles as f64 * 100.0 / self.tiles as f64,
+            self.unchanged,
+            self.busy.as_secs_f64() * 1e6 / self.checks as f64
+        );
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_static_tiles_become_regions() {
+        // Three by two tiles, the right column a partial one.
+        let (width, height) = (40, 32);
+        let previous = vec![50u8; width * height];
+        let mut current = previous.clone();
+        // A change in the top right tile, and dithering in the bottom left.
+        for y in 2..6 {
+            current[y * width + 36..y * width + 40].fill(200);
+        }
+        current[20 * width + 3] = 51;
+
+        let mut ages = TileAges::new(width, height);
+        ages.update(&previous, &current, width, SETTLE_FRAMES);
+        assert_eq!(ages.ages, [8, 8, 0, 8, 8, 8]);
+        assert_eq!(
+            ages.static_rects(MAX_REGIONS),
+            [
+                TileRect {
+                    x: 0,
+                    y: 0,
+                    width: 2,
+                    height: 2
+                },
+                TileRect {
+                    x: 2,
+                    y: 1,
+                    width: 1,
+                    height: 1
+                },
+            ]
+        );
+        ages.update(&current, &previous, width, 1);
+        assert_eq!(ages.ages, [9, 9, 0, 9, 9, 9]);
+        assert_eq!(ages.static_rects(1).len(), 1);
+    }
+
+    #[test]
+    fn test_detection_is_weighed_against_encode_time() {
+        let mut detector = StaticDetector::new();
+        detector.busy = Duration::from_millis(300);
+        let ms = Duration::from_millis;
+        for _ in 0..MIN_TIMED_FRAMES {
+            detector.encoded(false, ms(4));
+            detector.encoded(true, ms(3));
+        }
+        // 1 ms saved on each of 300 frames pays for 300 ms of checks.
+        assert!(detector.pays_off());
+        detector.encoded(true, ms(4));
+        detector.busy += ms(2);
+        assert!(!detector.pays_off());
+
+        // Not judged before enough frames of each kind.
+        let mut detector = StaticDetector::new();
+        detector.busy = Duration::from_secs(1);
+        detector.encoded(false, ms(4));
+        assert!(detector.pays_off());
+    }
+}
@@ -18,6 +18,8 @@ use cros_codecs::{
     BlockingMode, FrameLayout, PlaneLayout, Resolution,
 };
 
+use crate::packet::Packet;
+
 pub struct Encoder {
     encoder: StatelessEncoder<H264, PooledVaSurface<()>, VaapiBackend<(), PooledVaSurface<()>>>,
     pub frame_layout: FrameLayout,
@@ -119,10 +121,10 @@ impl Encoder {
         Ok(())
     }
 
-    pub fn poll(&mut self) -> Result<Option<cros_codecs::encoder::CodedBitstreamBuffer>> {
+    pub fn poll(&mut self) -> Result<Option<Packet>> {
         // FIXME: implement Error for EncodeError
         let bitstream_buffer = self.encoder.poll().expect("Failed to poll encoder");
-        Ok(bitstream_buffer)
+        Ok(bitstream_buffer.map(Packet::from))
     }
 }
 
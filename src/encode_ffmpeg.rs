@@ -1,10 +1,10 @@
 use std::{
-    ffi::{c_uint, c_void, CString},
-    fs::File,
-    io::Write,
-    slice,
+    collections::VecDeque,
+    ffi::{c_int, c_uint, c_void, CString},
+    mem, ptr,
     str::FromStr,
     sync::Arc,
+    time::{Duration, Instant},
 };
 
 use anyhow::{bail, Context, Result};
@@ -13,7 +13,7 @@ use cros_codecs::{
     libva::{Surface, VADisplay, VASurfaceID},
 };
 use rsmpeg::{
-    avcodec::{AVCodec, AVCodecContext},
+    avcodec::{AVCodec, AVCodecContext, AVPacket},
     avutil::{ra, AVDictionary, AVFrame, AVHWDeviceContext},
     error::RsmpegError,
     ffi::{
@@ -22,26 +22,95 @@ use rsmpeg::{
     },
 };
 
+use crate::{
+    bitstream::{self, BitstreamPool},
+    cursor::{Blend, Cursor, CursorOverlay},
+    damage::{Region, StaticDetector},
+    level::{encoder_size, h264_level},
+    packet::Packet,
+    rate,
+    recovery::{fault_point, Stage},
+    va,
+};
+
 #[repr(C)]
 pub struct AVVAAPIDeviceContext {
     pub display: *mut c_void, // VADisplay is typically a void pointer
     pub driver_quirks: c_uint,
 }
 
+/// Encoder parameters chosen by the caller.
+#[derive(Debug, Clone, Copy)]
+pub struct EncoderSettings {
+    pub framerate: i32,
+    /// Target bitrate in bits/s.
+    pub bitrate: i64,
+    /// Find regions that didn't change and spend fewer bits on them.
+    pub static_detection: bool,
+}
+
+impl Default for EncoderSettings {
+    fn default() -> Self {
+        Self {
+            framerate: 60,
+            bitrate: 9_000_000,
+            static_detection: true,
+        }
+    }
+}
+
 pub struct Encoder {
-    _counter: u64,
+    counter: i64,
+    settings: EncoderSettings,
+    width: i32,
+    height: i32,
+    hw_device_ctx: AVHWDeviceContext,
     avctx: AVCodecContext,
+    /// Boxed so its address, which the codec contexts keep, doesn't change.
+    /// Declared after `avctx` so it outlives it.
+    bitstreams: Box<BitstreamPool>,
+    force_keyframe: bool,
+    /// Frames since the last IDR, which the codec restarts its GOP at,
+    /// including forced ones.
+    frames_since_idr: i64,
+    // Whether end of stream has been sent to the current codec session.
+    flushed: bool,
+    // Packets flushed out of a previous codec session, returned before any new ones.
+    pending: VecDeque<AVPacket>,
+    cursor: Cursor,
+    overlay: CursorOverlay,
+    detector: Option<StaticDetector>,
+    /// Whether frames sent to the current session were given static
+    /// regions, oldest first, or None for keyframes. For timing the
+    /// detector's benefit as their packets come out.
+    region_frames: VecDeque<Option<bool>>,
 }
 
+/// QP offset of static regions, about +10 QP on H.264.
+const STATIC_QOFFSET: (i32, i32) = (1, 5);
+
 impl Encoder {
     // FIXME: size changes will break this encoder
-    pub fn new(framerate: i32, first_frame: &Arc<PooledVaSurface<()>>) -> Result<Self> {
+    pub fn new(settings: EncoderSettings, first_frame: &Arc<PooledVaSurface<()>>) -> Result<Self> {
         println!("Encoder::new - Starting encoder initialization");
         let surface: &Surface<()> = std::borrow::Borrow::borrow(first_frame.as_ref());
-        let width = surface.size().0 as i32;
-        let height = surface.size().1 as i32;
-        println!("Encoder::new - Surface size: {}x{}", width, height);
+        println!(
+            "Encoder::new - Surface size: {}x{}",
+            surface.size().0,
+            surface.size().1
+        );
         let display = surface.display().clone();
+        // Frames the encoder can't take, or that no level allows at this rate,
+        // are scaled down by the VPP copy.
+        let max_size = va::max_encode_size(&display).unwrap_or((4096, 4096));
+        let (width, height) = encoder_size(surface.size(), settings.framerate as u32, max_size);
+        if (width, height) != surface.size() {
+            println!(
+                "Encoder::new - Scaling down to {width}x{height}, the encoder takes up to {}x{}",
+                max_size.0, max_size.1
+            );
+        }
+        let (width, height) = (width as i32, height as i32);
         let mut hw_device_ctx = AVHWDeviceContext::alloc(AV_HWDEVICE_TYPE_VAAPI);
         let device_ctx = unsafe { *hw_device_ctx.as_mut_ptr() }.data as *mut ffi::AVHWDeviceContext;
         let vaapi_ctx = unsafe { *device_ctx }.hwctx as *mut AVVAAPIDeviceContext;
@@ -53,56 +122,83 @@ impl Encoder {
             .init()
             .context("Failed to initialize VAAPI device context")?;
 
-        let codec =
-            AVCodec::find_encoder_by_name(c"h264_vaapi").context("Could not find encoder.")?;
-        let mut avctx = AVCodecContext::new(&codec);
+        let bitstreams = Box::new(BitstreamPool::new(settings.bitrate, settings.framerate));
+        let avctx = open_codec(&mut hw_device_ctx, width, height, &settings, &bitstreams)?;
 
-        avctx.set_width(width);
-        avctx.set_height(height);
-        avctx.set_time_base(ra(1, framerate));
-        avctx.set_framerate(ra(framerate, 1));
-        avctx.set_sample_aspect_ratio(ra(1, 1));
-        avctx.set_pix_fmt(AV_PIX_FMT_VAAPI);
+        println!("Encoder::new - Encoder created successfully");
+        Ok(Encoder {
+            counter: 0,
+            settings,
+            width,
+            height,
+            hw_device_ctx,
+            avctx,
+            bitstreams,
+            force_keyframe: false,
+            frames_since_idr: 0,
+            flushed: false,
+            pending: VecDeque::new(),
+            cursor: Cursor::default(),
+            overlay: CursorOverlay::default(),
+            detector: settings.static_detection.then(StaticDetector::new),
+            region_frames: VecDeque::new(),
+        })
+    }
 
-        // WebRTC settings
-        avctx.set_bit_rate(9_000_000);
-        avctx.set_rc_max_rate(11_000_000);
-        avctx.set_rc_buffer_size(9_000_000 * 2);
-        avctx.set_max_b_frames(0);
-        avctx.set_gop_size(framerate);
-        avctx.set_keyint_min(framerate);
-        avctx.set_refs(1);
-        avctx.set_qmin(20);
-        avctx.set_qmax(32);
-        avctx.set_profile(FF_PROFILE_H264_CONSTRAINED_BASELINE as i32);
-
-        let opts = AVDictionary::new_int(CString::from_str("rc_mode").unwrap().as_c_str(), 3, 0)
-            .set_int(CString::from_str("quality").unwrap().as_c_str(), 4, 0);
-
-        let mut hw_frames_ref = hw_device_ctx.hwframe_ctx_alloc();
-        hw_frames_ref.data().format = AV_PIX_FMT_VAAPI;
-        hw_frames_ref.data().sw_format = AV_PIX_FMT_NV12;
-        hw_frames_ref.data().width = width as i32;
-        hw_frames_ref.data().height = height as i32;
-        hw_frames_ref.data().initial_pool_size = 16;
-
-        hw_frames_ref
-            .init()
-            .context("Failed to initialize VAAPI frame context")?;
-        avctx.set_hw_frames_ctx(hw_frames_ref);
+    /// Timestamp that the next encoded frame will get.
+    pub fn next_pts(&self) -> i64 {
+        self.counter
+    }
 
-        avctx
-            .open(Some(opts))
-            .context("Cannot open video encoder codec")?;
+    /// Continues the timestamps of a previous session, e.g. one that was torn
+    /// down after a device error.
+    pub fn set_next_pts(&mut self, pts: i64) {
+        self.counter = pts;
+    }
 
-        println!("Encoder::new - Encoder created successfully");
-        Ok(Encoder { _counter: 0, avctx })
+    /// Sets the cursor blended into the frames encoded from now on.
+    pub fn set_cursor(&mut self, cursor: Cursor) {
+        self.cursor = cursor;
+    }
+
+    /// Makes the next encoded frame an IDR.
+    pub fn force_keyframe(&mut self) {
+        self.force_keyframe = true;
+    }
+
+    /// Changes the target bitrate.
+    ///
+    /// h264_vaapi can't reconfigure rate control on an open session, so the
+    /// current one is flushed into the pending packets and a new one is opened
+    /// on the same VA display. The new session starts with an IDR and in-band
+    /// SPS/PPS, so the output remains a single valid stream.
+    pub fn set_bitrate(&mut self, bitrate: i64) -> Result<()> {
+        self.settings.bitrate = bitrate;
+        self.bitstreams.retarget(bitrate, self.settings.framerate);
+        self.restart_at(self.counter)
+    }
+
+    /// Finishes the current codec session and starts a new one whose first
+    /// frame is an IDR with timestamp `pts`. Used to encode independent chunks.
+    pub fn restart_at(&mut self, pts: i64) -> Result<()> {
+        self.flush_into_pending()?;
+        self.avctx = open_codec(
+            &mut self.hw_device_ctx,
+            self.width,
+            self.height,
+            &self.settings,
+            &self.bitstreams,
+        )?;
+        self.flushed = false;
+        self.counter = pts;
+        self.frames_since_idr = 0;
+        Ok(())
     }
 
     pub fn encode(&mut self, input_surface: Arc<PooledVaSurface<()>>) -> Result<()> {
+        fault_point(Stage::Encode)?;
         let surface: &Surface<()> = std::borrow::Borrow::borrow(input_surface.as_ref());
-        let width = surface.size().0 as i32;
-        let height = surface.size().1 as i32;
+        let size = (self.width as u32, self.height as u32);
 
         let mut pooled_frame = AVFrame::new();
         self.avctx
@@ -111,11 +207,57 @@ impl Encoder {
             .get_buffer(&mut pooled_frame)
             .context("Get buffer failed")?;
 
+        let blend = self
+            .overlay
+            .prepare(surface, &self.cursor)
+            .context("Failed to prepare cursor")?
+            .map(|blend| blend.scaled(surface.size(), size));
         let dpy = surface.display().handle();
         let src_surface = surface.id();
         let dst_surface = pooled_frame.data_mut()[3] as u32;
-        copy_surfaces(dpy, src_surface, dst_surface, width, height)
-            .context("Failed to copy surfaces")?;
+        copy_surfaces(
+            dpy,
+            src_surface,
+            dst_surface,
+            self.width,
+            self.height,
+            blend.as_ref(),
+        )
+        .context("Failed to copy surfaces")?;
+
+        // Checked on IDRs too, so tiles keep their age, but an IDR at a
+        // higher QP would blur static regions for the whole GOP.
+        // The GOP is a second long, see open_codec.
+        let keyframe = self.force_keyframe
+            || self.frames_since_idr % self.settings.framerate.max(1) as i64 == 0;
+        let regions = match self.detector.as_mut().map(|d| d.detect(surface, size)) {
+            Some(Ok(regions)) => regions,
+            Some(Err(e)) => {
+                eprintln!("Static detection failed, turning it off: {e:#}");
+                self.detector = None;
+                Vec::new()
+            }
+            None => Vec::new(),
+        };
+        if !keyframe && !regions.is_empty() {
+            let (num, den) = STATIC_QOFFSET;
+            set_regions_of_interest(&mut pooled_frame, &regions, ra(num, den))?;
+        }
+        if self.detector.is_some() {
+            self.region_frames
+                .push_back((!keyframe).then_some(!regions.is_empty()));
+        }
+
+        let frame = unsafe { &mut *pooled_frame.as_mut_ptr() };
+        frame.pts = self.counter;
+        if std::mem::take(&mut self.force_keyframe) {
+            // h264_vaapi turns a forced I picture into an IDR and starts
+            // its GOP over from there.
+            frame.pict_type = ffi::AV_PICTURE_TYPE_I;
+            self.frames_since_idr = 0;
+        }
+        self.counter += 1;
+        self.frames_since_idr += 1;
 
         self.avctx
             .send_frame(Some(&pooled_frame))
@@ -124,134 +266,517 @@ impl Encoder {
         Ok(())
     }
 
-    pub fn drain_write(&mut self, file: &mut File) -> Result<()> {
-        println!("Encoder::drain_write - Starting drain");
+    /// Flushes the encoder and returns every remaining packet.
+    pub fn drain_packets(&mut self) -> Result<Vec<Packet>> {
+        self.flush_into_pending()?;
+        if let Some(detector) = &self.detector {
+            detector.report();
+        }
+        println!("{}", self.bitstreams);
+        let pool = &self.bitstreams;
+        let packets: Vec<Packet> = (self.pending.drain(..))
+            .map(|packet| to_packet(pool, packet))
+            .collect();
+        println!(
+            "Encoder::drain_packets - Drain complete, {} packets",
+            packets.len()
+        );
+        Ok(packets)
+    }
+
+    /// Returns the next encoded packet, if one is ready.
+    pub fn poll_packet(&mut self) -> Result<Option<Packet>> {
+        if let Some(packet) = self.pending.pop_front() {
+            return Ok(Some(to_packet(&self.bitstreams, packet)));
+        }
+        // h264_vaapi encodes and waits for the bitstream in receive_packet.
+        let start = Instant::now();
+        match self.avctx.receive_packet() {
+            Ok(mut packet) => {
+                packet.set_stream_index(0);
+                self.weigh_detection(start.elapsed());
+                Ok(Some(to_packet(&self.bitstreams, packet)))
+            }
+            Err(RsmpegError::EncoderDrainError) | Err(RsmpegError::EncoderFlushedError) => Ok(None),
+            Err(e) => Err(e).context("Receive packet failed."),
+        }
+    }
+
+    /// Tells the static detector how long the frame whose packet came out
+    /// took to encode, and turns detection off once its checks cost more
+    /// than that saves.
+    fn weigh_detection(&mut self, took: Duration) {
+        let region_frame = self.region_frames.pop_front().flatten();
+        let Some(detector) = &mut self.detector else {
+            return;
+        };
+        if let Some(with_regions) = region_frame {
+            detector.encoded(with_regions, took);
+        }
+        if !detector.pays_off() {
+            println!("Static detection costs more than the encode time it saves, turning it off");
+            detector.report();
+            self.detector = None;
+            self.region_frames.clear();
+        }
+    }
+
+    /// Signals end of stream to the codec session and moves every remaining
+    /// packet into `pending`.
+    fn flush_into_pending(&mut self) -> Result<()> {
+        if std::mem::replace(&mut self.flushed, true) {
+            return Ok(());
+        }
+        // Flushed packets come out all at once, without telling frames
+        // apart by time.
+        self.region_frames.clear();
         self.avctx.send_frame(None).context("Send frame failed")?;
-        let mut packet_count = 0;
         loop {
-            let mut packet = match self.avctx.receive_packet() {
-                Ok(packet) => packet,
+            match self.avctx.receive_packet() {
+                Ok(mut packet) => {
+                    packet.set_stream_index(0);
+                    self.pending.push_back(packet);
+                }
                 Err(RsmpegError::EncoderDrainError) | Err(RsmpegError::EncoderFlushedError) => {
                     break;
                 }
                 Err(e) => {
-                    println!("Encoder::drain_write - Error receiving packet: {:?}", e);
+                    println!("Encoder::drain_packets - Error receiving packet: {:?}", e);
                     Err(e).context("Receive packet failed.")?
                 }
-            };
-            packet.set_stream_index(0);
-            let data = unsafe { slice::from_raw_parts(packet.data, packet.size as usize) };
-            file.write_all(data).context("Write output frame failed.")?;
-            packet_count += 1;
+            }
         }
-        println!(
-            "Encoder::drain_write - Drain complete, wrote {} packets",
-            packet_count
-        );
         Ok(())
     }
+}
 
-    pub fn poll_write(&mut self, file: &mut File) -> Result<usize> {
-        let mut num_packets = 0;
-        let mut packet = match self.avctx.receive_packet() {
-            Ok(packet) => {
-                num_packets += 1;
-                packet
-            }
-            Err(RsmpegError::EncoderDrainError) | Err(RsmpegError::EncoderFlushedError) => {
-                return Ok(num_packets);
+/// Attaches `regions` to the frame as regions of interest coded at
+/// `qoffset`. Drivers without ROI support ignore them, with a warning from
+/// FFmpeg.
+fn set_regions_of_interest(
+    frame: &mut AVFrame,
+    regions: &[Region],
+    qoffset: ffi::AVRational,
+) -> Result<()> {
+    let entry = mem::size_of::<ffi::AVRegionOfInterest>();
+    // SAFETY: the side data is allocated for `regions.len()` entries, which
+    // are all written before the frame is sent.
+    unsafe {
+        let side_data = ffi::av_frame_new_side_data(
+            frame.as_mut_ptr(),
+            ffi::AV_FRAME_DATA_REGIONS_OF_INTEREST,
+            regions.len() * entry,
+        );
+        if side_data.is_null() {
+            bail!("Failed to allocate regions of interest");
+        }
+        let rois = std::slice::from_raw_parts_mut(
+            (*side_data).data as *mut ffi::AVRegionOfInterest,
+            regions.len(),
+        );
+        for (roi, region) in rois.iter_mut().zip(regions) {
+            *roi = ffi::AVRegionOfInterest {
+                self_size: entry as u32,
+                top: region.top,
+                bottom: region.bottom,
+                left: region.left,
+                right: region.right,
+                qoffset,
+            };
+        }
+    }
+    Ok(())
+}
+
+/// libx264 encoder fed with tightly packed NV12 frames from system memory.
+///
+/// Only used offline, where raw clips are already in memory and spreading
+/// chunks over CPU cores is an alternative to the GPU encoder.
+pub struct SoftwareEncoder {
+    avctx: AVCodecContext,
+    /// Backs the packets, like `Encoder::bitstreams`.
+    bitstreams: Box<BitstreamPool>,
+    width: i32,
+    height: i32,
+    counter: i64,
+}
+
+impl SoftwareEncoder {
+    /// `first_pts` is the timestamp of the first frame, so chunks encoded by
+    /// separate sessions keep continuous timestamps.
+    pub fn new(settings: EncoderSettings, width: u32, height: u32, first_pts: i64) -> Result<Self> {
+        let codec =
+            AVCodec::find_encoder_by_name(c"libx264").context("Could not find libx264 encoder.")?;
+        let mut avctx = AVCodecContext::new(&codec);
+        let framerate = settings.framerate;
+        avctx.set_width(width as i32);
+        avctx.set_height(height as i32);
+        avctx.set_time_base(ra(1, framerate));
+        avctx.set_framerate(ra(framerate, 1));
+        avctx.set_pix_fmt(AV_PIX_FMT_NV12);
+        avctx.set_bit_rate(settings.bitrate);
+        avctx.set_max_b_frames(0);
+        avctx.set_gop_size(framerate);
+        avctx.set_keyint_min(framerate);
+        // One thread per session, parallelism comes from running several sessions.
+        avctx.set_thread_count(1);
+
+        let bitstreams = Box::new(BitstreamPool::new(settings.bitrate, framerate));
+        // SAFETY: as for the VAAPI encoder, the pool outlives the context.
+        unsafe { use_bitstream_pool(&mut avctx, &bitstreams) };
+
+        let opts = AVDictionary::new(c"preset", c"ultrafast", 0).set(c"tune", c"zerolatency", 0);
+        avctx
+            .open(Some(opts))
+            .context("Cannot open libx264 encoder")?;
+
+        Ok(Self {
+            avctx,
+            bitstreams,
+            width: width as i32,
+            height: height as i32,
+            counter: first_pts,
+        })
+    }
+
+    pub fn encode_nv12(&mut self, data: &[u8]) -> Result<()> {
+        let mut frame = AVFrame::new();
+        frame.set_width(self.width);
+        frame.set_height(self.height);
+        frame.set_format(AV_PIX_FMT_NV12);
+        frame.alloc_buffer().context("Failed to allocate frame")?;
+
+        let (width, height) = (self.width as usize, self.height as usize);
+        let raw = unsafe { &mut *frame.as_mut_ptr() };
+        for (plane, rows, src_offset) in [(0, height, 0), (1, height / 2, width * height)] {
+            let stride = raw.linesize[plane] as usize;
+            for row in 0..rows {
+                let src = &data[src_offset + row * width..][..width];
+                unsafe {
+                    std::ptr::copy_nonoverlapping(
+                        src.as_ptr(),
+                        raw.data[plane].add(row * stride),
+                        width,
+                    );
+                }
             }
-            Err(e) => Err(e).context("Receive packet failed.")?,
-        };
-        packet.set_stream_index(0);
-        let data = unsafe { slice::from_raw_parts(packet.data, packet.size as usize) };
-        file.write_all(data)
-            .context("Failed to write packet data to file")?;
-        Ok(num_packets)
+        }
+        raw.pts = self.counter;
+        self.counter += 1;
+
+        self.avctx
+            .send_frame(Some(&frame))
+            .context("Send frame failed")?;
+        Ok(())
+    }
+
+    pub fn poll_packet(&mut self) -> Result<Option<Packet>> {
+        match self.avctx.receive_packet() {
+            Ok(packet) => Ok(Some(to_packet(&self.bitstreams, packet))),
+            Err(RsmpegError::EncoderDrainError) | Err(RsmpegError::EncoderFlushedError) => Ok(None),
+            Err(e) => Err(e).context("Receive packet failed."),
+        }
+    }
+
+    pub fn drain_packets(&mut self) -> Result<Vec<Packet>> {
+        self.avctx.send_frame(None).context("Send frame failed")?;
+        let mut packets = Vec::new();
+        while let Some(packet) = self.poll_packet()? {
+            packets.push(packet);
+        }
+        Ok(packets)
+    }
+}
+
+fn open_codec(
+    hw_device_ctx: &mut AVHWDeviceContext,
+    width: i32,
+    height: i32,
+    settings: &EncoderSettings,
+    bitstreams: &BitstreamPool,
+) -> Result<AVCodecContext> {
+    let framerate = settings.framerate;
+    let codec = AVCodec::find_encoder_by_name(c"h264_vaapi").context("Could not find encoder.")?;
+    let mut avctx = AVCodecContext::new(&codec);
+
+    avctx.set_width(width);
+    avctx.set_height(height);
+    avctx.set_time_base(ra(1, framerate));
+    avctx.set_framerate(ra(framerate, 1));
+    avctx.set_sample_aspect_ratio(ra(1, 1));
+    avctx.set_pix_fmt(AV_PIX_FMT_VAAPI);
+
+    // WebRTC settings
+    let max_rate = settings.bitrate * 11 / 9;
+    avctx.set_bit_rate(settings.bitrate);
+    avctx.set_rc_max_rate(max_rate);
+    let buffer_size = i32::try_from(settings.bitrate * 2)
+        .with_context(|| format!("{} bits/s is too high to encode", settings.bitrate))?;
+    avctx.set_rc_buffer_size(buffer_size);
+    avctx.set_max_b_frames(0);
+    avctx.set_gop_size(framerate);
+    avctx.set_keyint_min(framerate);
+    avctx.set_refs(1);
+    avctx.set_qmin(20);
+    avctx.set_qmax(32);
+    avctx.set_profile(FF_PROFILE_H264_CONSTRAINED_BASELINE as i32);
+    match h264_level(
+        width as u32,
+        height as u32,
+        framerate as u32,
+        max_rate as u64,
+    ) {
+        // SAFETY: a plain field of a codec context that isn't open yet.
+        Some(level) => unsafe { (*avctx.as_mut_ptr()).level = level.idc as i32 },
+        None => eprintln!("{max_rate} bits/s exceeds H.264 level 5.2"),
+    }
+
+    let opts = AVDictionary::new_int(CString::from_str("rc_mode").unwrap().as_c_str(), 3, 0)
+        .set_int(CString::from_str("quality").unwrap().as_c_str(), 4, 0);
+
+    let mut hw_frames_ref = hw_device_ctx.hwframe_ctx_alloc();
+    hw_frames_ref.data().format = AV_PIX_FMT_VAAPI;
+    hw_frames_ref.data().sw_format = AV_PIX_FMT_NV12;
+    hw_frames_ref.data().width = width as i32;
+    hw_frames_ref.data().height = height as i32;
+    hw_frames_ref.data().initial_pool_size = rate::pool_size(framerate as u32) as i32;
+
+    hw_frames_ref
+        .init()
+        .context("Failed to initialize VAAPI frame context")?;
+    avctx.set_hw_frames_ctx(hw_frames_ref);
+    // SAFETY: the Encoder keeps the pool boxed and drops the context first.
+    unsafe { use_bitstream_pool(&mut avctx, bitstreams) };
+
+    avctx
+        .open(Some(opts))
+        .context("Cannot open video encoder codec")?;
+
+    Ok(avctx)
+}
+
+/// Makes the encoder write packets into buffers from `pool` instead of
+/// allocating one per packet. Encoders without AV_CODEC_CAP_DR1 ignore it.
+///
+/// # Safety
+///
+/// `pool` must stay at the same address until `avctx` is dropped.
+unsafe fn use_bitstream_pool(avctx: &mut AVCodecContext, pool: &BitstreamPool) {
+    let raw = avctx.as_mut_ptr();
+    (*raw).opaque = pool as *const BitstreamPool as *mut c_void;
+    (*raw).get_encode_buffer = Some(get_encode_buffer);
+}
+
+/// FFmpeg's `get_encode_buffer` callback: backs the packet with a pooled
+/// buffer, lending FFmpeg the pool slot itself as the buffer's opaque. It
+/// goes back to the pool once FFmpeg and every [`Packet`] sharing it are
+/// done with it.
+unsafe extern "C" fn get_encode_buffer(
+    avctx: *mut ffi::AVCodecContext,
+    packet: *mut ffi::AVPacket,
+    _flags: c_int,
+) -> c_int {
+    let pool = &*((*avctx).opaque as *const BitstreamPool);
+    let size = (*packet).size as usize;
+    let padded = size + ffi::AV_INPUT_BUFFER_PADDING_SIZE as usize;
+    let mut buffer = pool.take(padded);
+    // The encoder writes the payload through the pointer, so only the
+    // padding needs zeroing.
+    let data = buffer.as_mut_ptr();
+    ptr::write_bytes(data.add(size), 0, padded - size);
+    let opaque = buffer.lend();
+    let buf = ffi::av_buffer_create(data, padded, Some(bitstream::release_lent), opaque, 0);
+    if buf.is_null() {
+        bitstream::release_lent(opaque, data);
+        return -nix::libc::ENOMEM;
+    }
+    (*packet).buf = buf;
+    (*packet).data = data;
+    0
+}
+
+/// Wraps an encoded packet, sharing the pool slot it was written into when
+/// [`get_encode_buffer`] backed it, so the packet allocates nothing.
+fn to_packet(pool: &BitstreamPool, packet: AVPacket) -> Packet {
+    let keyframe = packet.flags & ffi::AV_PKT_FLAG_KEY as i32 != 0;
+    let shared = unsafe {
+        if packet.buf.is_null() || packet.size < 0 {
+            None
+        } else {
+            // SAFETY: the packet holds its buffer reference until dropped
+            // below, and the encoder has finished writing it.
+            let opaque = ffi::av_buffer_get_opaque(packet.buf);
+            pool.claim(
+                opaque,
+                packet.data,
+                packet.size as usize,
+                packet.pts,
+                keyframe,
+            )
+        }
+    };
+    match shared {
+        Some(buffer) => Packet::from_shared(buffer),
+        None => packet.into(),
     }
 }
 
+/// Copies `src_surface` into `dst_surface` with VPP, converting the format
+/// and scaling to the `width`x`height` of `dst_surface` if needed, and
+/// blends the cursor on top in the same pass when given one.
 pub fn copy_surfaces(
     raw_display: VADisplay,
     src_surface: VASurfaceID,
-    mut dst_surface: VASurfaceID,
+    dst_surface: VASurfaceID,
     width: i32,
     height: i32,
+    cursor: Option<&Blend>,
 ) -> Result<()> {
-    use cros_codecs::libva::{VAProfile::VAProfileNone, *};
+    VppContext::new(raw_display, dst_surface, width, height)?.copy(src_surface, dst_surface, cursor)
+}
 
-    // TODO: implement proper bindings in cros-libva
-    let mut vpp_config = Default::default();
-    let mut vpp_context = Default::default();
+/// A VPP config and context for copies into surfaces of one size, kept by
+/// callers that copy often rather than created for each copy.
+pub struct VppContext {
+    raw_display: VADisplay,
+    config: cros_codecs::libva::VAConfigID,
+    context: cros_codecs::libva::VAContextID,
+}
 
-    let ret = unsafe {
-        vaCreateConfig(
-            raw_display,
-            VAProfileNone,
-            VAEntrypoint::VAEntrypointVideoProc,
-            std::ptr::null_mut(),
-            0,
-            &mut vpp_config,
-        )
-    };
-    if ret != VA_STATUS_SUCCESS as i32 {
-        bail!("Error creating VPP config: {ret:?}");
-    }
+impl VppContext {
+    /// Creates a context rendering `width`x`height` surfaces like `target`.
+    pub fn new(
+        raw_display: VADisplay,
+        mut target: VASurfaceID,
+        width: i32,
+        height: i32,
+    ) -> Result<Self> {
+        use cros_codecs::libva::{VAProfile::VAProfileNone, *};
+
+        // TODO: implement proper bindings in cros-libva
+        let mut vpp_config = Default::default();
+        let mut vpp_context = Default::default();
 
-    let ret = unsafe {
-        vaCreateContext(
+        let ret = unsafe {
+            vaCreateConfig(
+                raw_display,
+                VAProfileNone,
+                VAEntrypoint::VAEntrypointVideoProc,
+                std::ptr::null_mut(),
+                0,
+                &mut vpp_config,
+            )
+        };
+        if ret != VA_STATUS_SUCCESS as i32 {
+            bail!("Error creating VPP config: {ret:?}");
+        }
+
+        let ret = unsafe {
+            vaCreateContext(
+                raw_display,
+                vpp_config,
+                width,
+                height,
+                VA_PROGRESSIVE as i32,
+                &mut target,
+                1,
+                &mut vpp_context,
+            )
+        };
+        if ret != VA_STATUS_SUCCESS as i32 {
+            unsafe { vaDestroyConfig(raw_display, vpp_config) };
+            bail!("Error creating VPP context: {ret:?}");
+        }
+        Ok(Self {
             raw_display,
-            vpp_config,
-            width,
-            height,
-            VA_PROGRESSIVE as i32,
-            &mut dst_surface,
-            1,
-            &mut vpp_context,
-        )
-    };
-    if ret != VA_STATUS_SUCCESS as i32 {
-        unsafe { vaDestroyConfig(raw_display, vpp_config) };
-        bail!("Error creating VPP context: {ret:?}");
+            config: vpp_config,
+            context: vpp_context,
+        })
     }
 
-    let pipeline_param = VAProcPipelineParameterBuffer {
-        surface: src_surface,
-        ..Default::default()
-    };
-    let mut params = [pipeline_param];
+    /// Copies `src_surface` into `dst_surface`, as [`copy_surfaces`] does.
+    pub fn copy(
+        &self,
+        src_surface: VASurfaceID,
+        dst_surface: VASurfaceID,
+        cursor: Option<&Blend>,
+    ) -> Result<()> {
+        use cros_codecs::libva::*;
 
-    let mut pipeline_buf = Default::default();
-    let ret = unsafe {
-        vaCreateBuffer(
-            raw_display,
-            vpp_context,
-            VABufferType::VAProcPipelineParameterBufferType,
-            std::mem::size_of::<VAProcPipelineParameterBuffer>() as u32,
-            1,
-            params.as_mut_ptr() as *mut _,
-            &mut pipeline_buf,
-        )
-    };
+        let (raw_display, vpp_context) = (self.raw_display, self.context);
+        let mut params = vec![VAProcPipelineParameterBuffer {
+            surface: src_surface,
+            ..Default::default()
+        }];
+        // The cursor surface holds premultiplied alpha.
+        let blend_state = VABlendState {
+            flags: VA_BLEND_PREMULTIPLIED_ALPHA,
+            global_alpha: 1.0,
+            min_luma: 0.0,
+            max_luma: 1.0,
+        };
+        if let Some(cursor) = cursor {
+            params.push(VAProcPipelineParameterBuffer {
+                surface: cursor.surface,
+                surface_region: &cursor.src,
+                output_region: &cursor.dst,
+                blend_state: &blend_state,
+                ..Default::default()
+            });
+        }
 
-    if ret != VA_STATUS_SUCCESS as i32 {
-        unsafe {
-            vaDestroyContext(raw_display, vpp_context);
-            vaDestroyConfig(raw_display, vpp_config);
+        let mut pipeline_bufs = Vec::with_capacity(params.len());
+        for param in &mut params {
+            let mut pipeline_buf = Default::default();
+            let ret = unsafe {
+                vaCreateBuffer(
+                    raw_display,
+                    vpp_context,
+                    VABufferType::VAProcPipelineParameterBufferType,
+                    std::mem::size_of::<VAProcPipelineParameterBuffer>() as u32,
+                    1,
+                    param as *mut _ as *mut _,
+                    &mut pipeline_buf,
+                )
+            };
+            if ret != VA_STATUS_SUCCESS as i32 {
+                unsafe {
+                    for buf in pipeline_bufs {
+                        vaDestroyBuffer(raw_display, buf);
+                    }
+                }
+                bail!("Error creating VPP pipeline buffer: {ret:?}");
+            }
+            pipeline_bufs.push(pipeline_buf);
         }
-        bail!("Error creating VPP pipeline buffer: {ret:?}");
+
+        unsafe {
+            vaBeginPicture(raw_display, vpp_context, dst_surface);
+            vaRenderPicture(
+                raw_display,
+                vpp_context,
+                pipeline_bufs.as_mut_ptr(),
+                pipeline_bufs.len() as i32,
+            );
+            vaEndPicture(raw_display, vpp_context);
+            vaSyncSurface(raw_display, dst_surface);
+
+            for buf in pipeline_bufs {
+                vaDestroyBuffer(raw_display, buf);
+            }
+        };
+
+        Ok(())
     }
+}
 
-    unsafe {
-        vaBeginPicture(raw_display, vpp_context, dst_surface);
-        vaRenderPicture(raw_display, vpp_context, &mut pipeline_buf, 1);
-        vaEndPicture(raw_display, vpp_context);
-        vaSyncSurface(raw_display, dst_surface);
-
-        vaDestroyBuffer(raw_display, pipeline_buf);
-        vaDestroyContext(raw_display, vpp_context);
-        vaDestroyConfig(raw_display, vpp_config);
-    };
+impl Drop for VppContext {
+    fn drop(&mut self) {
+        use cros_codecs::libva::{vaDestroyConfig, vaDestroyContext};
 
-    Ok(())
+        unsafe {
+            vaDestroyContext(self.raw_display, self.context);
+            vaDestroyConfig(self.raw_display, self.config);
+        }
+    }
 }
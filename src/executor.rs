@@ -0,0 +1,777 @@
+//! One bounded pool of worker threads for the recorder's auxiliary CPU work.
+//!
+//! Capture and encoding keep their own threads: they are the hot path, and
+//! the VA objects they hold can't move between threads. Everything else that
+//! only needs CPU, like sink writes, JPEG compression of previews, the frame
+//! time timeline and usage reports, runs as tasks on a fixed number of
+//! workers, optionally pinned to cores the game doesn't use. The recorder's
+//! CPU use then stays within that many cores however many features are on.
+//!
+//! Tasks wait in one queue per priority class, and idle workers take the
+//! most urgent one. A task spawned by a task goes to its worker's own deque
+//! for its class, which the worker pops from the back while idle workers
+//! steal from the front. Every class is served before the next one, wherever
+//! its tasks wait. Timed tasks wait in a heap until due. How long tasks waited in the
+//! queues and how busy the workers were is reported at exit.
+
+use std::{
+    cell::Cell,
+    cmp::Ordering as CmpOrdering,
+    collections::{BinaryHeap, VecDeque},
+    panic::{self, AssertUnwindSafe},
+    sync::{
+        atomic::{AtomicU64, AtomicUsize, Ordering},
+        Arc, Condvar, Mutex, OnceLock,
+    },
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, bail, Context, Result};
+
+/// Tasks a strand runs before letting other queued work go first.
+const STRAND_BATCH: usize = 32;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Priority {
+    /// Someone is waiting on the result, e.g. a control client.
+    Interactive,
+    /// Work that falls behind if it waits, like writing packets to sinks.
+    Normal,
+    /// Work that can be late, like previews and reports.
+    Background,
+}
+
+const CLASSES: [Priority; 3] = [
+    Priority::Interactive,
+    Priority::Normal,
+    Priority::Background,
+];
+
+impl Priority {
+    fn index(self) -> usize {
+        self as usize
+    }
+
+    fn name(self) -> &'static str {
+        match self {
+            Priority::Interactive => "interactive",
+            Priority::Normal => "normal",
+            Priority::Background => "background",
+        }
+    }
+}
+
+#[derive(Debug, Clone)]
+pub struct ExecutorOptions {
+    /// Number of worker threads, at least one.
+    pub threads: usize,
+    /// Cores to pin the workers to, or empty to run them anywhere.
+    pub cpus: Vec<usize>,
+}
+
+impl Default for ExecutorOptions {
+    fn default() -> Self {
+        Self {
+            threads: 2,
+            cpus: Vec::new(),
+        }
+    }
+}
+
+/// Parses a CPU list like `2-3,6`, as used by `taskset -c`.
+pub fn parse_cpus(s: &str) -> Result<Vec<usize>> {
+    let mut cpus = Vec::new();
+    for range in s.split(',') {
+        let (first, last) = range.split_once('-').unwrap_or((range, range));
+        let parse = |cpu: &str| {
+            cpu.trim()
+                .parse::<usize>()
+                .with_context(|| format!("Invalid CPU {cpu:?}"))
+        };
+        let (first, last) = (parse(first)?, parse(last)?);
+        if first > last || last >= nix::libc::CPU_SETSIZE as usize {
+            bail!("Invalid CPU range {range:?}");
+        }
+        cpus.extend(first..=last);
+    }
+    Ok(cpus)
+}
+
+type Job = Box<dyn FnOnce() + Send>;
+
+struct Task {
+    job: Job,
+    priority: Priority,
+    queued: Instant,
+}
+
+impl Task {
+    fn new(priority: Priority, job: Job) -> Self {
+        Self {
+            job,
+            priority,
+            queued: Instant::now(),
+        }
+    }
+}
+
+struct Timer {
+    due: Instant,
+    /// Keeps timers due at the same time in order.
+    seq: u64,
+    task: Task,
+}
+
+impl PartialEq for Timer {
+    fn eq(&self, other: &Self) -> bool {
+        (self.due, self.seq) == (other.due, other.seq)
+    }
+}
+
+impl Eq for Timer {}
+
+impl PartialOrd for Timer {
+    fn partial_cmp(&self, other: &Self) -> Option<CmpOrdering> {
+        Some(self.cmp(other))
+    }
+}
+
+impl Ord for Timer {
+    // Reversed, so the heap's top is the earliest timer.
+    fn cmp(&self, other: &Self) -> CmpOrdering {
+        (other.due, other.seq).cmp(&(self.due, self.seq))
+    }
+}
+
+#[derive(Default)]
+struct Queues {
+    classes: [VecDeque<Task>; 3],
+    timers: BinaryHeap<Timer>,
+    next_seq: u64,
+    /// Live [`TimerPause`]s. Timers don't come due while there are any.
+    timers_paused: usize,
+    shutdown: bool,
+}
+
+impl Queues {
+    /// Moves due timers to their queues, returning how many moved.
+    fn take_due(&mut self, now: Instant) -> usize {
+        if self.timers_paused > 0 {
+            return 0;
+        }
+        let mut moved = 0;
+        while self.timers.peek().is_some_and(|timer| timer.due <= now) {
+            let mut task = self.timers.pop().unwrap().task;
+            task.queued = now;
+            self.classes[task.priority.index()].push_back(task);
+            moved += 1;
+        }
+        moved
+    }
+}
+
+#[derive(Default)]
+struct ClassStats {
+    tasks: AtomicU64,
+    wait_us: AtomicU64,
+    max_wait_us: AtomicU64,
+}
+
+struct Shared {
+    queues: Mutex<Queues>,
+    wake: Condvar,
+    /// Each worker's own deques, one per class.
+    locals: Vec<Mutex<[VecDeque<Task>; 3]>>,
+    /// Tasks in the queues and deques, not counting timers. Workers only
+    /// sleep when it is zero, checked with `queues` locked.
+    pending: AtomicUsize,
+    classes: [ClassStats; 3],
+    busy_us: AtomicU64,
+    start: Instant,
+    cpus: Vec<usize>,
+}
+
+thread_local! {
+    /// The pool and index of the worker running on this thread.
+    static WORKER: Cell<Option<(usize, usize)>> = const { Cell::new(None) };
+}
+
+impl Shared {
+    fn id(self: &Arc<Self>) -> usize {
+        Arc::as_ptr(self) as usize
+    }
+
+    /// Queues `task` on the calling worker's own deque, or in its class
+    /// queue if called from elsewhere or `shared` is set.
+    fn push(self: &Arc<Self>, task: Task, shared: bool) {
+        let local = WORKER
+            .get()
+            .filter(|&(pool, _)| pool == self.id() && !shared)
+            .map(|(_, index)| index);
+        let class = task.priority.index();
+        let mut queues = self.queues.lock().unwrap();
+        match local {
+            Some(index) => self.locals[index].lock().unwrap()[class].push_back(task),
+            None => queues.classes[class].push_back(task),
+        }
+        self.pending.fetch_add(1, Ordering::SeqCst);
+        drop(queues);
+        self.wake.notify_one();
+    }
+
+    fn schedule(&self, due: Instant, task: Task) {
+        let mut queues = self.queues.lock().unwrap();
+        let seq = queues.next_seq;
+        queues.next_seq += 1;
+        queues.timers.push(Timer { due, seq, task });
+        drop(queues);
+        // A sleeping worker may be waiting for a later timer.
+        self.wake.notify_one();
+    }
+
+    /// Takes a task of the most urgent class there is one of: the oldest
+    /// in its queue, else the newest this worker spawned, else one stolen
+    /// from another worker.
+    fn find(&self, index: usize) -> Option<Task> {
+        let mut queues = self.queues.lock().unwrap();
+        let moved = queues.take_due(Instant::now());
+        self.pending.fetch_add(moved, Ordering::SeqCst);
+        let task = CLASSES.iter().find_map(|class| {
+            let class = class.index();
+            queues.classes[class]
+                .pop_front()
+                .or_else(|| self.locals[index].lock().unwrap()[class].pop_back())
+                .or_else(|| {
+                    (1..self.locals.len())
+                        .map(|offset| (index + offset) % self.locals.len())
+                        .find_map(|victim| self.locals[victim].lock().unwrap()[class].pop_front())
+                })
+        })?;
+        self.pending.fetch_sub(1, Ordering::SeqCst);
+        Some(task)
+    }
+
+    fn run(&self, task: Task) {
+        let start = Instant::now();
+        let wait_us = start.saturating_duration_since(task.queued).as_micros() as u64;
+        let class = &self.classes[task.priority.index()];
+        class.tasks.fetch_add(1, Ordering::Relaxed);
+        class.wait_us.fetch_add(wait_us, Ordering::Relaxed);
+        class.max_wait_us.fetch_max(wait_us, Ordering::Relaxed);
+        if panic::catch_unwind(AssertUnwindSafe(task.job)).is_err() {
+            eprintln!("An auxiliary task panicked");
+        }
+        self.busy_us
+            .fetch_add(start.elapsed().as_micros() as u64, Ordering::Relaxed);
+    }
+}
+
+fn work(shared: Arc<Shared>, index: usize) {
+    WORKER.set(Some((shared.id(), index)));
+    if !shared.cpus.is_empty() {
+        if let Err(e) = pin(&shared.cpus) {
+            eprintln!("Failed to pin auxiliary worker: {e:#}");
+        }
+    }
+    loop {
+        if let Some(task) = shared.find(index) {
+            shared.run(task);
+            continue;
+        }
+        let mut queues = shared.queues.lock().unwrap();
+        let now = Instant::now();
+        let moved = queues.take_due(now);
+        shared.pending.fetch_add(moved, Ordering::SeqCst);
+        if shared.pending.load(Ordering::SeqCst) > 0 {
+            continue;
+        }
+        if queues.shutdown {
+            return;
+        }
+        let next_timer = queues.timers.peek().filter(|_| queues.timers_paused == 0);
+        match next_timer.map(|timer| timer.due - now) {
+            Some(timeout) => drop(shared.wake.wait_timeout(queues, timeout).unwrap()),
+            None => drop(shared.wake.wait(queues).unwrap()),
+        }
+    }
+}
+
+fn pin(cpus: &[usize]) -> Result<()> {
+    use nix::libc::{cpu_set_t, sched_setaffinity, CPU_SET, CPU_ZERO};
+
+    // SAFETY: cpu_set_t is plain data, CPU_SET is given CPUs below
+    // CPU_SETSIZE as checked by parse_cpus, and sched_setaffinity only
+    // changes the calling thread.
+    unsafe {
+        let mut set: cpu_set_t = std::mem::zeroed();
+        CPU_ZERO(&mut set);
+        for &cpu in cpus {
+            CPU_SET(cpu, &mut set);
+        }
+        if sched_setaffinity(0, std::mem::size_of::<cpu_set_t>(), &set) != 0 {
+            return Err(std::io::Error::last_os_error()).context("sched_setaffinity failed");
+        }
+    }
+    Ok(())
+}
+
+/// Queue latency of one priority class.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct ClassSummary {
+    pub priority: Priority,
+    pub tasks: u64,
+    pub mean_wait_ms: f64,
+    pub max_wait_ms: f64,
+}
+
+#[derive(Debug, Clone, PartialEq)]
+pub struct ExecutorSummary {
+    pub threads: usize,
+    /// Share of the workers' time spent running tasks, 0 to 1.
+    pub utilization: f64,
+    pub classes: Vec<ClassSummary>,
+}
+
+impl std::fmt::Display for ExecutorSummary {
+    fn fmt(&self, f: &mut std::fmt::Formatter) -> std::fmt::Result {
+        write!(
+            f,
+            "Auxiliary workers: {} threads, {:.1}% busy",
+            self.threads,
+            self.utilization * 100.0
+        )?;
+        for class in self.classes.iter().filter(|class| class.tasks > 0) {
+            write!(
+                f,
+                ", {} {} tasks waited {:.2} ms on average, {:.1} ms max",
+                class.tasks,
+                class.priority.name(),
+                class.mean_wait_ms,
+                class.max_wait_ms
+            )?;
+        }
+        Ok(())
+    }
+}
+
+/// A pool of worker threads. The process-wide one is reached through the
+/// functions of this module; dropping another runs what is queued and stops
+/// its workers, discarding timers that aren't due.
+pub struct Executor {
+    shared: Arc<Shared>,
+    workers: Vec<JoinHandle<()>>,
+}
+
+impl Executor {
+    pub fn new(options: &ExecutorOptions) -> Result<Self> {
+        let threads = options.threads.max(1);
+        let shared = Arc::new(Shared {
+            queues: Mutex::default(),
+            wake: Condvar::new(),
+            locals: (0..threads).map(|_| Mutex::default()).collect(),
+            pending: AtomicUsize::new(0),
+            classes: Default::default(),
+            busy_us: AtomicU64::new(0),
+            start: Instant::now(),
+            cpus: options.cpus.clone(),
+        });
+        let workers = (0..threads)
+            .map(|index| {
+                let shared = shared.clone();
+                thread::Builder::new()
+                    .name(format!("aux-{index}"))
+                    .spawn(move || work(shared, index))
+            })
+            .collect::<Result<_, _>>()?;
+        Ok(Self { shared, workers })
+    }
+
+    pub fn spawn(&self, priority: Priority, task: impl FnOnce() + Send + 'static) {
+        self.shared.push(Task::new(priority, Box::new(task)), false);
+    }
+
+    /// Runs `task` once `due` has passed.
+    pub fn schedule(&self, due: Instant, priority: Priority, task: impl FnOnce() + Send + 'static) {
+        self.shared.schedule(
+            due,
+            Task {
+                job: Box::new(task),
+                priority,
+                queued: due,
+            },
+        );
+    }
+
+    /// Holds timers back until the returned guard is dropped.
+    pub fn pause_timers(&self) -> TimerPause {
+        self.shared.queues.lock().unwrap().timers_paused += 1;
+        TimerPause {
+            shared: self.shared.clone(),
+        }
+    }
+
+    pub fn summary(&self) -> ExecutorSummary {
+        let shared = &self.shared;
+        let wall = shared.start.elapsed().as_micros().max(1) as f64;
+        let classes = CLASSES
+            .iter()
+            .map(|&priority| {
+                let class = &shared.classes[priority.index()];
+                let tasks = class.tasks.load(Ordering::Relaxed);
+                ClassSummary {
+                    priority,
+                    tasks,
+                    mean_wait_ms: class.wait_us.load(Ordering::Relaxed) as f64
+                        / tasks.max(1) as f64
+                        / 1000.0,
+                    max_wait_ms: class.max_wait_us.load(Ordering::Relaxed) as f64 / 1000.0,
+                }
+            })
+            .collect();
+        ExecutorSummary {
+            threads: self.workers.len(),
+            utilization: shared.busy_us.load(Ordering::Relaxed) as f64
+                / (wall * self.workers.len() as f64),
+            classes,
+        }
+    }
+}
+
+/// Keeps timers from coming due while alive, so that nothing wakes up on a
+/// schedule, e.g. while recording is suspended. Timers that came due in the
+/// meantime run once it is dropped.
+pub struct TimerPause {
+    shared: Arc<Shared>,
+}
+
+impl Drop for TimerPause {
+    fn drop(&mut self) {
+        self.shared.queues.lock().unwrap().timers_paused -= 1;
+        self.shared.wake.notify_all();
+    }
+}
+
+impl Drop for Executor {
+    fn drop(&mut self) {
+        self.shared.queues.lock().unwrap().shutdown = true;
+        self.shared.wake.notify_all();
+        for worker in self.workers.drain(..) {
+            worker.join().ok();
+        }
+    }
+}
+
+static EXECUTOR: OnceLock<Executor> = OnceLock::new();
+
+/// Sets up the process-wide executor. Without a call, it starts with
+/// `ExecutorOptions::default()` on first use.
+pub fn configure(options: ExecutorOptions) -> Result<()> {
+    let mut result = Ok(());
+    EXECUTOR.get_or_init(|| {
+        Executor::new(&options).unwrap_or_else(|e| {
+            result = Err(e);
+            Executor::new(&ExecutorOptions::default()).expect("Failed to start auxiliary workers")
+        })
+    });
+    result
+}
+
+fn global() -> &'static Executor {
+    EXECUTOR.get_or_init(|| {
+        Executor::new(&ExecutorOptions::default()).expect("Failed to start auxiliary workers")
+    })
+}
+
+/// Runs `task` on the process-wide executor.
+pub fn spawn(priority: Priority, task: impl FnOnce() + Send + 'static) {
+    global().spawn(priority, task);
+}
+
+/// Runs `task` once, `delay` from now.
+pub fn after(delay: Duration, priority: Priority, task: impl FnOnce() + Send + 'static) {
+    global().schedule(Instant::now() + delay, priority, task);
+}
+
+/// Runs `task` every `period`, starting one period from now, until it
+/// returns false. Late runs don't shift the ones after them, and runs
+/// missed entirely, e.g. while timers were paused, are skipped.
+pub fn every(period: Duration, priority: Priority, task: impl FnMut() -> bool + Send + 'static) {
+    repeat(&global().shared, period, priority, task);
+}
+
+/// Holds timers of the process-wide executor back while the guard lives.
+pub fn pause_timers() -> TimerPause {
+    global().pause_timers()
+}
+
+fn repeat(
+    shared: &Arc<Shared>,
+    period: Duration,
+    priority: Priority,
+    task: impl FnMut() -> bool + Send + 'static,
+) {
+    fn next<F: FnMut() -> bool + Send + 'static>(
+        shared: Arc<Shared>,
+        due: Instant,
+        period: Duration,
+        priority: Priority,
+        mut task: F,
+    ) {
+        let task = Task {
+            job: Box::new({
+                let shared = shared.clone();
+                move || {
+                    if task() {
+                        let now = Instant::now();
+                        let mut due = due + period;
+                        if due <= now {
+                            let missed = (now - due).as_nanos() / period.as_nanos().max(1);
+                            due += period * (missed as u32 + 1);
+                        }
+                        next(shared, due, period, priority, task);
+                    }
+                }
+            }),
+            priority,
+            queued: due,
+        };
+        shared.schedule(due, task);
+    }
+    next(
+        shared.clone(),
+        Instant::now() + period,
+        period,
+        priority,
+        task,
+    );
+}
+
+/// Queue latency and utilization of the process-wide executor, if it ran.
+pub fn summary() -> Option<ExecutorSummary> {
+    EXECUTOR.get().map(Executor::summary)
+}
+
+#[derive(Default)]
+struct StrandState {
+    tasks: VecDeque<Job>,
+    running: bool,
+    panicked: bool,
+}
+
+struct StrandInner {
+    executor: Arc<Shared>,
+    priority: Priority,
+    state: Mutex<StrandState>,
+    /// Notified as tasks are taken off the queue and when it goes idle.
+    progress: Condvar,
+}
+
+/// Runs tasks one at a time, in the order they were pushed, on the
+/// process-wide executor. Used for work with state, like a sink, that
+/// would otherwise need a thread of its own.
+#[derive(Clone)]
+pub struct Strand {
+    inner: Arc<StrandInner>,
+}
+
+impl Strand {
+    pub fn new(priority: Priority) -> Self {
+        Self::on(global(), priority)
+    }
+
+    fn on(executor: &Executor, priority: Priority) -> Self {
+        Self {
+            inner: Arc::new(StrandInner {
+                executor: executor.shared.clone(),
+                priority,
+                state: Mutex::default(),
+                progress: Condvar::new(),
+            }),
+        }
+    }
+
+    pub fn push(&self, task: impl FnOnce() + Send + 'static) {
+        let mut state = self.inner.state.lock().unwrap();
+        state.tasks.push_back(Box::new(task));
+        if !state.running {
+            state.running = true;
+            let inner = self.inner.clone();
+            let task = Task::new(inner.priority, Box::new(move || drain(inner)));
+            self.inner.executor.push(task, false);
+        }
+    }
+
+    /// Number of tasks waiting to run.
+    pub fn len(&self) -> usize {
+        self.inner.state.lock().unwrap().tasks.len()
+    }
+
+    /// Waits until fewer than `len` tasks are waiting to run.
+    pub fn wait_below(&self, len: usize) {
+        let mut state = self.inner.state.lock().unwrap();
+        while state.tasks.len() >= len.max(1) {
+            state = self.inner.progress.wait(state).unwrap();
+        }
+    }
+
+    /// Waits until every task pushed so far has run, failing if any of them
+    /// panicked.
+    pub fn wait_idle(&self) -> Result<()> {
+        let mut state = self.inner.state.lock().unwrap();
+        while state.running {
+            state = self.inner.progress.wait(state).unwrap();
+        }
+        if state.panicked {
+            return Err(anyhow!("task panicked"));
+        }
+        Ok(())
+    }
+}
+
+fn drain(inner: Arc<StrandInner>) {
+    for _ in 0..STRAND_BATCH {
+        let task = {
+            let mut state = inner.state.lock().unwrap();
+            inner.progress.notify_all();
+            match state.tasks.pop_front() {
+                Some(task) => task,
+                None => {
+                    state.running = false;
+                    return;
+                }
+            }
+        };
+        if panic::catch_unwind(AssertUnwindSafe(task)).is_err() {
+            inner.state.lock().unwrap().panicked = true;
+        }
+    }
+    // Let other queued work run before the rest: through the class queue,
+    // as the worker's own deque would hand it straight back.
+    let executor = inner.executor.clone();
+    let priority = inner.priority;
+    executor.push(Task::new(priority, Box::new(move || drain(inner))), true);
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::mpsc;
+
+    #[test]
+    fn test_priorities_timers_and_strands() {
+        assert_eq!(parse_cpus("2-3,6").unwrap(), vec![2, 3, 6]);
+        assert!(parse_cpus("3-2").is_err());
+
+        // With one worker held up, queued tasks run most urgent first.
+        let executor = Executor::new(&ExecutorOptions {
+            threads: 1,
+            cpus: Vec::new(),
+        })
+        .unwrap();
+        let (started, wait_started) = mpsc::channel();
+        let (release, released) = mpsc::channel::<()>();
+        executor.spawn(Priority::Normal, move || {
+            started.send(()).unwrap();
+            released.recv().ok();
+        });
+        wait_started.recv().unwrap();
+        let (order, ran) = mpsc::channel();
+        for priority in [
+            Priority::Background,
+            Priority::Normal,
+            Priority::Interactive,
+        ] {
+            let order = order.clone();
+            executor.spawn(priority, move || order.send(priority).unwrap());
+        }
+        let order_timer = order.clone();
+        executor.schedule(
+            Instant::now() + Duration::from_millis(20),
+            Priority::Interactive,
+            move || order_timer.send(Priority::Interactive).unwrap(),
+        );
+        release.send(()).unwrap();
+        let ran: Vec<_> = ran.iter().take(4).collect();
+        assert_eq!(
+            ran,
+            [
+                Priority::Interactive,
+                Priority::Normal,
+                Priority::Background,
+                Priority::Interactive
+            ]
+        );
+        let summary = executor.summary();
+        assert_eq!(summary.classes[Priority::Interactive.index()].tasks, 2);
+        assert!(summary.classes[Priority::Background.index()].max_wait_ms > 0.0);
+
+        // A strand keeps order across workers.
+        let strand = Strand::new(Priority::Normal);
+        let seen = Arc::new(Mutex::new(Vec::new()));
+        for i in 0..100 {
+            let seen = seen.clone();
+            strand.push(move || seen.lock().unwrap().push(i));
+        }
+        strand.wait_idle().unwrap();
+        assert_eq!(*seen.lock().unwrap(), (0..100).collect::<Vec<_>>());
+        strand.push(|| panic!("test"));
+        assert!(strand.wait_idle().is_err());
+
+        // A long strand lets more urgent work, and work of its own class,
+        // run between its batches.
+        let strand = Strand::on(&executor, Priority::Background);
+        let (order, ran) = mpsc::channel();
+        let (release, released) = mpsc::channel::<()>();
+        let (started, wait_started) = mpsc::channel();
+        strand.push(move || {
+            started.send(()).unwrap();
+            released.recv().ok();
+        });
+        for i in 0..100 {
+            let order = order.clone();
+            strand.push(move || order.send(format!("strand {i}")).unwrap());
+        }
+        wait_started.recv().unwrap();
+        for priority in [Priority::Normal, Priority::Background] {
+            let order = order.clone();
+            executor.spawn(priority, move || {
+                order.send(format!("{priority:?}")).unwrap()
+            });
+        }
+        release.send(()).unwrap();
+        strand.wait_idle().unwrap();
+        drop(order);
+        let ran: Vec<_> = ran.iter().collect();
+        let position = |name: &str| ran.iter().position(|task| task == name).unwrap();
+        assert!(position("Normal") < STRAND_BATCH, "{ran:?}");
+        assert!(position("Background") <= STRAND_BATCH, "{ran:?}");
+    }
+
+    #[test]
+    fn test_paused_timers_skip_missed_runs() {
+        let executor = Executor::new(&ExecutorOptions {
+            threads: 1,
+            cpus: Vec::new(),
+        })
+        .unwrap();
+        let (tick, ticks) = mpsc::channel();
+        let pause = executor.pause_timers();
+        repeat(
+            &executor.shared,
+            Duration::from_millis(5),
+            Priority::Normal,
+            move || tick.send(()).is_ok(),
+        );
+        thread::sleep(Duration::from_millis(100));
+        assert!(ticks.try_recv().is_err());
+
+        // The twenty runs missed are one late run, not a burst.
+        drop(pause);
+        ticks.recv_timeout(Duration::from_secs(5)).unwrap();
+        let start = Instant::now();
+        ticks.recv_timeout(Duration::from_secs(5)).unwrap();
+        ticks.recv_timeout(Duration::from_secs(5)).unwrap();
+        assert!(start.elapsed() >= Duration::from_millis(5));
+    }
+}
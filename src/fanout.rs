@@ -0,0 +1,332 @@
+use std::{
+    fs::File,
+    io::{BufWriter, Write},
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Mutex,
+    },
+};
+
+use anyhow::{anyhow, Context, Result};
+
+use crate::{
+    executor::{Priority, Strand},
+    packet::Packet,
+};
+
+/// A consumer of encoded packets, run one packet at a time on the auxiliary
+/// executor by [`FanOut`].
+pub trait Sink: Send + 'static {
+    fn write(&mut self, packet: &Packet) -> Result<()>;
+
+    /// Called once after the last packet.
+    fn finish(&mut self) -> Result<()> {
+        Ok(())
+    }
+}
+
+pub type SinkId = usize;
+
+/// A sink and the first error it returned, shared with the tasks writing to
+/// it.
+struct Target {
+    sink: Mutex<Box<dyn Sink>>,
+    error: Mutex<Option<anyhow::Error>>,
+    failed: AtomicBool,
+    finished: AtomicBool,
+}
+
+impl Target {
+    fn run(&self, f: impl FnOnce(&mut dyn Sink) -> Result<()>) {
+        if self.failed.load(Ordering::Relaxed) {
+            return;
+        }
+        // Poisoned by a panic, which is reported when the sink is finished.
+        let Ok(mut sink) = self.sink.lock() else {
+            return;
+        };
+        if let Err(e) = f(sink.as_mut()) {
+            *self.error.lock().unwrap() = Some(e);
+            self.failed.store(true, Ordering::Relaxed);
+        }
+    }
+
+    fn finish(&self) {
+        self.finished.store(true, Ordering::Relaxed);
+        self.run(|sink| sink.finish());
+    }
+}
+
+impl Drop for Target {
+    // A fan-out dropped without finishing still lets its sinks finish, once
+    // their last packet is written.
+    fn drop(&mut self) {
+        if !self.finished.load(Ordering::Relaxed) {
+            self.finish();
+            if let Some(e) = self.error.lock().unwrap().take() {
+                eprintln!("Sink failed: {e:#}");
+            }
+        }
+    }
+}
+
+struct SinkHandle {
+    id: SinkId,
+    name: String,
+    strand: Strand,
+    target: Arc<Target>,
+    capacity: usize,
+    /// Gets every packet: sending waits for room in its queue, and fails
+    /// once the sink has.
+    primary: bool,
+    dropped: u64,
+    // After a drop, skip until the next keyframe so the sink's stream stays
+    // decodable.
+    waiting_for_keyframe: bool,
+}
+
+/// Distributes encoded packets to any number of sinks.
+///
+/// Each sink has its own bounded queue, a strand on the auxiliary executor
+/// that writes its packets in order. Packets are shared, not copied, and
+/// sending to a secondary sink never blocks: when its queue is full the
+/// packet is dropped for that sink only, along with everything up to the
+/// next keyframe, so one slow sink never stalls the encoder or the others.
+/// The primary sink, a recording's output file, must not lose packets:
+/// sending waits for room in its queue, and fails as soon as it has.
+#[derive(Default)]
+pub struct FanOut {
+    sinks: Vec<SinkHandle>,
+    next_id: SinkId,
+}
+
+impl FanOut {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Starts a secondary sink with room for `capacity` queued packets.
+    pub fn add(&mut self, name: &str, capacity: usize, sink: impl Sink) -> Result<SinkId> {
+        self.start(name, capacity, false, sink)
+    }
+
+    /// Starts a primary sink with room for `capacity` queued packets.
+    pub fn add_primary(&mut self, name: &str, capacity: usize, sink: impl Sink) -> Result<SinkId> {
+        self.start(name, capacity, true, sink)
+    }
+
+    fn start(
+        &mut self,
+        name: &str,
+        capacity: usize,
+        primary: bool,
+        sink: impl Sink,
+    ) -> Result<SinkId> {
+        let id = self.next_id;
+        self.next_id += 1;
+        self.sinks.push(SinkHandle {
+            id,
+            name: name.to_string(),
+            strand: Strand::new(Priority::Normal),
+            target: Arc::new(Target {
+                sink: Mutex::new(Box::new(sink)),
+                error: Mutex::new(None),
+                failed: AtomicBool::new(false),
+                finished: AtomicBool::new(false),
+            }),
+            capacity,
+            primary,
+            dropped: 0,
+            waiting_for_keyframe: false,
+        });
+        Ok(id)
+    }
+
+    /// Sends a packet to every sink, failing if a primary one has.
+    pub fn send(&mut self, packet: &Packet) -> Result<()> {
+        for sink in &mut self.sinks {
+            offer(sink, packet)?;
+        }
+        Ok(())
+    }
+
+    /// Sends a packet to one sink, failing if it is a primary one and has.
+    pub fn send_to(&mut self, id: SinkId, packet: &Packet) -> Result<()> {
+        match self.sinks.iter_mut().find(|s| s.id == id) {
+            Some(sink) => offer(sink, packet),
+            None => Ok(()),
+        }
+    }
+
+    /// Lets a sink write out what it has queued and stops it.
+    pub fn remove(&mut self, id: SinkId) -> Result<()> {
+        let Some(index) = self.sinks.iter().position(|s| s.id == id) else {
+            return Ok(());
+        };
+        finish_sink(self.sinks.remove(index))
+    }
+
+    /// Stops every sink, returning the first error any of them hit.
+    pub fn finish(self) -> Result<()> {
+        let mut result = Ok(());
+        for sink in self.sinks {
+            let finished = finish_sink(sink);
+            if result.is_ok() {
+                result = finished;
+            }
+        }
+        result
+    }
+}
+
+fn offer(sink: &mut SinkHandle, packet: &Packet) -> Result<()> {
+    if sink.target.failed.load(Ordering::Relaxed) {
+        if sink.primary {
+            let error = sink.target.error.lock().unwrap().take();
+            let error = error.unwrap_or_else(|| anyhow!("already failed"));
+            return Err(error).with_context(|| format!("Sink {} failed", sink.name));
+        }
+        // Reported when the sink is finished.
+        sink.dropped += 1;
+        return Ok(());
+    }
+    if sink.primary {
+        sink.strand.wait_below(sink.capacity);
+    }
+    if sink.waiting_for_keyframe {
+        if !packet.is_keyframe() {
+            sink.dropped += 1;
+            return Ok(());
+        }
+        sink.waiting_for_keyframe = false;
+    }
+    if sink.strand.len() >= sink.capacity {
+        sink.dropped += 1;
+        sink.waiting_for_keyframe = true;
+        return Ok(());
+    }
+    let (target, packet) = (sink.target.clone(), packet.clone());
+    sink.strand
+        .push(move || target.run(|sink| sink.write(&packet)));
+    Ok(())
+}
+
+fn finish_sink(sink: SinkHandle) -> Result<()> {
+    let target = sink.target.clone();
+    sink.strand.push(move || target.finish());
+    let finished = sink.strand.wait_idle();
+    if sink.dropped > 0 {
+        eprintln!(
+            "Sink {} fell behind and dropped {} packets",
+            sink.name, sink.dropped
+        );
+    }
+    finished.map_err(|_| anyhow!("Sink {} panicked", sink.name))?;
+    match sink.target.error.lock().unwrap().take() {
+        Some(e) => Err(e).with_context(|| format!("Sink {} failed", sink.name)),
+        None => Ok(()),
+    }
+}
+
+/// Writes packets back to back, i.e. a raw Annex B stream.
+pub struct FileSink {
+    path: PathBuf,
+    writer: BufWriter<File>,
+}
+
+impl FileSink {
+    pub fn create(path: &Path) -> Result<Self> {
+        let file =
+            File::create(path).with_context(|| format!("Failed to create {}", path.display()))?;
+        Ok(Self {
+            path: path.to_owned(),
+            writer: BufWriter::new(file),
+        })
+    }
+}
+
+impl Sink for FileSink {
+    fn write(&mut self, packet: &Packet) -> Result<()> {
+        self.writer
+            .write_all(packet.data())
+            .with_context(|| format!("Failed to write {}", self.path.display()))
+    }
+
+    fn finish(&mut self) -> Result<()> {
+        self.writer.flush()?;
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::{thread, time::Duration};
+
+    use anyhow::bail;
+
+    use super::*;
+
+    /// Takes `delay` over every packet, and runs out of space after `room`
+    /// of them.
+    struct Slow {
+        written: Arc<Mutex<Vec<i64>>>,
+        delay: Duration,
+        room: usize,
+    }
+
+    fn slow(written: &Arc<Mutex<Vec<i64>>>, delay_ms: u64, room: usize) -> Slow {
+        Slow {
+            written: written.clone(),
+            delay: Duration::from_millis(delay_ms),
+            room,
+        }
+    }
+
+    impl Sink for Slow {
+        fn write(&mut self, packet: &Packet) -> Result<()> {
+            thread::sleep(self.delay);
+            let mut written = self.written.lock().unwrap();
+            if written.len() == self.room {
+                bail!("No space left on device");
+            }
+            written.push(packet.pts());
+            Ok(())
+        }
+    }
+
+    #[test]
+    fn test_primary_sink_waits_and_fails_fast() {
+        let mut fanout = FanOut::new();
+        let primary = Arc::new(Mutex::new(Vec::new()));
+        let secondary = Arc::new(Mutex::new(Vec::new()));
+        fanout
+            .add_primary("primary", 2, slow(&primary, 1, 1000))
+            .unwrap();
+        fanout
+            .add("secondary", 2, slow(&secondary, 5, 1000))
+            .unwrap();
+        for pts in 0..50 {
+            let packet = Packet::from_bytes(vec![0; 4], pts, pts % 10 == 0);
+            fanout.send(&packet).unwrap();
+        }
+        fanout.finish().unwrap();
+        assert_eq!(*primary.lock().unwrap(), (0..50).collect::<Vec<_>>());
+        // The secondary sink fell behind, and resumed on keyframes.
+        let secondary = secondary.lock().unwrap();
+        assert!(secondary.len() < 50);
+        let resumed = secondary.windows(2).filter(|pair| pair[1] != pair[0] + 1);
+        assert!(resumed.map(|pair| pair[1]).all(|pts| pts % 10 == 0));
+
+        // The first write error comes out of the next send.
+        let mut fanout = FanOut::new();
+        let written = Arc::new(Mutex::new(Vec::new()));
+        fanout.add_primary("full", 2, slow(&written, 1, 3)).unwrap();
+        let failed = (0..50).find_map(|pts| {
+            let packet = Packet::from_bytes(vec![0; 4], pts, false);
+            fanout.send(&packet).err()
+        });
+        let error = format!("{:#}", failed.unwrap());
+        assert!(error.contains("No space left on device"), "{error}");
+    }
+}
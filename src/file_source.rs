@@ -0,0 +1,165 @@
+use std::{ffi::c_void, fs::File, num::NonZeroUsize, path::Path, ptr::NonNull, slice};
+
+use anyhow::{bail, Context, Result};
+use nix::sys::mman::{madvise, mmap, munmap, MapFlags, MmapAdvise, ProtFlags};
+
+/// Frames read ahead of the one being uploaded.
+const READAHEAD_FRAMES: usize = 4;
+
+/// A raw NV12 clip (as written by `--raw-output`) mapped read-only into memory.
+///
+/// Frames are handed out as slices of the mapping, so they can be uploaded to
+/// the GPU without being read into an intermediate buffer first.
+pub struct FileSource {
+    ptr: NonNull<c_void>,
+    len: usize,
+    width: u32,
+    height: u32,
+    frame_size: usize,
+}
+
+// SAFETY: the mapping is read-only and owned by this struct.
+unsafe impl Send for FileSource {}
+unsafe impl Sync for FileSource {}
+
+impl FileSource {
+    pub fn open(path: &Path, width: u32, height: u32) -> Result<Self> {
+        let file =
+            File::open(path).with_context(|| format!("Failed to open {}", path.display()))?;
+        let frame_size = width as usize * height as usize * 3 / 2;
+        let len = file.metadata()?.len() as usize;
+        if len < frame_size {
+            bail!(
+                "{} is smaller than one {width}x{height} NV12 frame",
+                path.display()
+            );
+        }
+        if len % frame_size != 0 {
+            eprintln!(
+                "{} has a trailing partial frame, ignoring it",
+                path.display()
+            );
+        }
+
+        // SAFETY: a fresh private read-only mapping. Truncating the file while
+        // it is mapped would fault, which is fine for a benchmark input.
+        let ptr = unsafe {
+            mmap(
+                None,
+                NonZeroUsize::new(len).unwrap(),
+                ProtFlags::PROT_READ,
+                MapFlags::MAP_PRIVATE,
+                &file,
+                0,
+            )?
+        };
+        // Sequential access lets the kernel read ahead aggressively and drop
+        // pages behind us. Huge pages cut TLB misses on large clips, but they
+        // are only honored with CONFIG_READ_ONLY_THP_FOR_FS, so errors are ignored.
+        unsafe {
+            madvise(ptr, len, MmapAdvise::MADV_SEQUENTIAL)?;
+            madvise(ptr, len, MmapAdvise::MADV_HUGEPAGE).ok();
+        }
+
+        Ok(Self {
+            ptr,
+            len,
+            width,
+            height,
+            frame_size,
+        })
+    }
+
+    pub fn size(&self) -> (u32, u32) {
+        (self.width, self.height)
+    }
+
+    pub fn frame_size(&self) -> usize {
+        self.frame_size
+    }
+
+    pub fn frame_count(&self) -> usize {
+        self.len / self.frame_size
+    }
+
+    /// Returns frame `index`, wrapping around at the end of the clip.
+    pub fn frame(&self, index: usize) -> &[u8] {
+        let offset = (index % self.frame_count()) * self.frame_size;
+        // SAFETY: offset + frame_size is within the mapping.
+        unsafe {
+            slice::from_raw_parts(
+                (self.ptr.as_ptr() as *const u8).add(offset),
+                self.frame_size,
+            )
+        }
+    }
+
+    /// Asks the kernel to start reading the frames after `index`.
+    pub fn prefetch(&self, index: usize) {
+        let first = (index + 1) % self.frame_count();
+        let frames = READAHEAD_FRAMES.min(self.frame_count() - first);
+        let offset = first * self.frame_size;
+        // SAFETY: the range is within the mapping; madvise offsets must be
+        // page aligned, so round down.
+        unsafe {
+            let page = offset & !4095;
+            let addr = NonNull::new_unchecked((self.ptr.as_ptr() as *mut u8).add(page));
+            madvise(
+                addr.cast(),
+                offset - page + frames * self.frame_size,
+                MmapAdvise::MADV_WILLNEED,
+            )
+            .ok();
+        }
+    }
+}
+
+impl Drop for FileSource {
+    fn drop(&mut self) {
+        // SAFETY: mapped in open() with this length.
+        unsafe { munmap(self.ptr, self.len).ok() };
+    }
+}
+
+/// Parses a `WIDTHxHEIGHT` frame size.
+pub fn parse_size(value: &str) -> Result<(u32, u32)> {
+    let Some((width, height)) = value.split_once('x') else {
+        bail!("expected WIDTHxHEIGHT, got '{value}'");
+    };
+    let width: u32 = width.parse().context("invalid width")?;
+    let height: u32 = height.parse().context("invalid height")?;
+    if width == 0 || height == 0 || width % 2 != 0 || height % 2 != 0 {
+        bail!("NV12 frame sizes must be even and non-zero");
+    }
+    Ok((width, height))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Write;
+
+    #[test]
+    fn test_parse_size() {
+        assert_eq!(parse_size("1280x720").unwrap(), (1280, 720));
+        assert!(parse_size("1280").is_err());
+        assert!(parse_size("1281x720").is_err());
+        assert!(parse_size("0x0").is_err());
+    }
+
+    #[test]
+    fn test_frames_wrap_around() {
+        let path = std::env::temp_dir().join(format!("file-source-{}.nv12", std::process::id()));
+        // Two 4x2 frames (12 bytes each) and a partial one.
+        let data: Vec<u8> = (0..30).collect();
+        File::create(&path).unwrap().write_all(&data).unwrap();
+
+        let source = FileSource::open(&path, 4, 2).unwrap();
+        std::fs::remove_file(&path).unwrap();
+        assert_eq!(source.frame_count(), 2);
+        assert_eq!(source.frame(0), &data[0..12]);
+        assert_eq!(source.frame(1), &data[12..24]);
+        assert_eq!(source.frame(2), &data[0..12]);
+        source.prefetch(1);
+    }
+}
@@ -0,0 +1,478 @@
+//! A flight recorder for rare hitches in the pipeline.
+//!
+//! The hitches that matter in the field seldom reproduce with tracing
+//! turned on. So the pipeline always logs what happens to every frame into
+//! a fixed-size ring in memory: a frame handed to the encoder or dropped,
+//! by capture or before the encoder, how long it took until its packet came
+//! out, each packet, and failures, suspends and resumes. Logging an event
+//! is a short uncontended lock and a copy, with no allocation.
+//!
+//! When a frame is dropped, or takes longer than the latency budget from
+//! capture until its packet comes out, the ring is left to run a little
+//! longer. Then the seconds around the incident are written to a CSV file
+//! with a timestamped name, on the auxiliary executor. Incidents during a
+//! cooldown after a dump are only counted, so a bad stretch doesn't flood
+//! the disk.
+
+use std::{
+    collections::VecDeque,
+    fmt,
+    fs::File,
+    io::{BufWriter, Write},
+    path::{Path, PathBuf},
+    sync::{Arc, Mutex},
+    time::{Duration, Instant, SystemTime, UNIX_EPOCH},
+};
+
+use anyhow::{Context, Result};
+
+use crate::{
+    executor::{self, Priority},
+    packet::Packet,
+    recovery::Stage,
+};
+
+/// Events kept, over 30 s at 120 fps.
+const RING_EVENTS: usize = 16 * 1024;
+
+/// Time before and after an incident that goes into its dump.
+const BEFORE: Duration = Duration::from_secs(5);
+const AFTER: Duration = Duration::from_secs(1);
+
+/// Incidents this soon after the last dump aren't dumped.
+const COOLDOWN: Duration = Duration::from_secs(30);
+
+/// Dumps written at most, per recording.
+const MAX_DUMPS: usize = 20;
+
+/// Frames the encoder holds at most before their packets come out, with
+/// room to spare.
+const IN_FLIGHT: usize = 64;
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub enum FlightEvent {
+    /// Capture handed a frame to the encoder.
+    Captured,
+    /// The frames edge was full, so capture dropped a frame.
+    Dropped,
+    /// Capture dropped a buffer before it became a frame.
+    CaptureDropped {
+        cause: &'static str,
+    },
+    /// A new encoder session opened on this frame.
+    SessionOpened {
+        pts: i64,
+    },
+    /// The packet of frame `pts` came out of the encoder, `latency` after
+    /// capture handed the frame over, of which `encode` was spent from
+    /// submitting it.
+    Encoded {
+        pts: i64,
+        latency: Duration,
+        encode: Duration,
+    },
+    Packet {
+        pts: i64,
+        bytes: usize,
+        keyframe: bool,
+    },
+    Failure {
+        stage: Stage,
+    },
+    Suspended,
+    Resumed,
+}
+
+impl fmt::Display for FlightEvent {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let ms = |time: Duration| time.as_secs_f64() * 1000.0;
+        match *self {
+            FlightEvent::Captured => write!(f, "captured,"),
+            FlightEvent::Dropped => write!(f, "dropped,"),
+            FlightEvent::CaptureDropped { cause } => write!(f, "capture_dropped,cause={cause}"),
+            FlightEvent::SessionOpened { pts } => write!(f, "session_opened,pts={pts}"),
+            FlightEvent::Encoded {
+                pts,
+                latency,
+                encode,
+            } => write!(
+                f,
+                "encoded,pts={pts} latency_ms={:.2} encode_ms={:.2}",
+                ms(latency),
+                ms(encode)
+            ),
+            FlightEvent::Packet {
+                pts,
+                bytes,
+                keyframe,
+            } => write!(f, "packet,pts={pts} bytes={bytes} keyframe={keyframe}"),
+            FlightEvent::Failure { stage } => write!(f, "failure,stage={stage}"),
+            FlightEvent::Suspended => write!(f, "suspended,"),
+            FlightEvent::Resumed => write!(f, "resumed,"),
+        }
+    }
+}
+
+#[derive(Debug, Clone)]
+pub struct FlightOptions {
+    /// Dumps are written to `<prefix>.incident-<unix time>.csv`.
+    pub prefix: PathBuf,
+    /// Longest time from capture until a frame's packet comes out that
+    /// isn't an incident.
+    pub latency_budget: Duration,
+}
+
+/// A frame submitted to the encoder whose packet hasn't come out yet.
+struct InFlight {
+    pts: i64,
+    captured: Instant,
+    submitted: Instant,
+    /// Opened a session, which is slow by nature rather than a hitch.
+    opened: bool,
+}
+
+#[derive(Clone, Copy)]
+struct Entry {
+    /// Since the recorder started.
+    time: Duration,
+    event: FlightEvent,
+}
+
+/// An incident waiting for the events after it before being dumped.
+struct Pending {
+    time: Duration,
+    reasons: Vec<String>,
+}
+
+struct Ring {
+    entries: Vec<Entry>,
+    /// Where the next entry goes once the ring is full.
+    next: usize,
+    pending: Option<Pending>,
+    last_dump: Option<Duration>,
+    incidents: u64,
+    dumps: Vec<PathBuf>,
+}
+
+impl Ring {
+    fn push(&mut self, entry: Entry) {
+        if self.entries.len() < RING_EVENTS {
+            self.entries.push(entry);
+        } else {
+            self.entries[self.next] = entry;
+            self.next = (self.next + 1) % RING_EVENTS;
+        }
+    }
+
+    /// Entries from `start` on, oldest first.
+    fn since(&self, start: Duration) -> Vec<Entry> {
+        let (newer, older) = self.entries.split_at(self.next);
+        (older.iter().chain(newer))
+            .filter(|entry| entry.time >= start)
+            .copied()
+            .collect()
+    }
+}
+
+pub struct FlightRecorder {
+    options: FlightOptions,
+    start: Instant,
+    ring: Mutex<Ring>,
+    /// Oldest first. Only the encode stage uses it.
+    in_flight: Mutex<VecDeque<InFlight>>,
+}
+
+impl FlightRecorder {
+    pub fn new(options: FlightOptions) -> Arc<Self> {
+        Self::starting_at(options, Instant::now())
+    }
+
+    fn starting_at(options: FlightOptions, start: Instant) -> Arc<Self> {
+        Arc::new(Self {
+            options,
+            start,
+            ring: Mutex::new(Ring {
+                entries: Vec::with_capacity(RING_EVENTS),
+                next: 0,
+                pending: None,
+                last_dump: None,
+                incidents: 0,
+                dumps: Vec::new(),
+            }),
+            in_flight: Mutex::new(VecDeque::with_capacity(IN_FLIGHT)),
+        })
+    }
+
+    pub fn record(&self, event: FlightEvent) {
+        let time = self.start.elapsed();
+        self.ring.lock().unwrap().push(Entry { time, event });
+    }
+
+    /// Records a dropped frame, which is always an incident.
+    pub fn dropped(self: &Arc<Self>) {
+        self.record(FlightEvent::Dropped);
+        self.incident("frame dropped".into());
+    }
+
+    /// Records a buffer capture dropped, which is always an incident.
+    pub fn capture_dropped(self: &Arc<Self>, cause: &'static str) {
+        self.record(FlightEvent::CaptureDropped { cause });
+        self.incident(format!("capture dropped a buffer: {cause}"));
+    }
+
+    /// Notes frame `pts` going into the encoder, `captured` being when
+    /// capture handed it over. Its latency is taken once its packet comes
+    /// out, see [`FlightRecorder::packet`].
+    pub fn submitted(&self, pts: i64, captured: Instant, submitted: Instant, opened: bool) {
+        if opened {
+            self.record(FlightEvent::SessionOpened { pts });
+        }
+        let mut in_flight = self.in_flight.lock().unwrap();
+        if in_flight.len() == IN_FLIGHT {
+            // Packets stopped coming out; the oldest won't be stamped.
+            in_flight.pop_front();
+        }
+        in_flight.push_back(InFlight {
+            pts,
+            captured,
+            submitted,
+            opened,
+        });
+    }
+
+    /// Records a packet leaving the encoder, and the end of its frame's
+    /// encode. Frames before it that never got a packet, e.g. lost to a
+    /// recovery, are forgotten.
+    pub fn packet(self: &Arc<Self>, packet: &Packet) {
+        let pts = packet.pts();
+        self.record(FlightEvent::Packet {
+            pts,
+            bytes: packet.len(),
+            keyframe: packet.is_keyframe(),
+        });
+        let frame = {
+            let mut in_flight = self.in_flight.lock().unwrap();
+            while in_flight.front().is_some_and(|frame| frame.pts < pts) {
+                in_flight.pop_front();
+            }
+            match in_flight.front() {
+                Some(frame) if frame.pts == pts => in_flight.pop_front(),
+                _ => None,
+            }
+        };
+        let Some(frame) = frame else {
+            return;
+        };
+        let (latency, encode) = (frame.captured.elapsed(), frame.submitted.elapsed());
+        if frame.opened {
+            self.record(FlightEvent::Encoded {
+                pts,
+                latency,
+                encode,
+            });
+        } else {
+            self.encoded(pts, latency, encode);
+        }
+    }
+
+    /// Records an encoded frame, and an incident if it went over budget.
+    fn encoded(self: &Arc<Self>, pts: i64, latency: Duration, encode: Duration) {
+        self.record(FlightEvent::Encoded {
+            pts,
+            latency,
+            encode,
+        });
+        if latency > self.options.latency_budget {
+            self.incident(format!(
+                "frame {pts} took {:.1} ms",
+                latency.as_secs_f64() * 1000.0
+            ));
+        }
+    }
+
+    fn incident(self: &Arc<Self>, reason: String) {
+        let time = self.start.elapsed();
+        let mut ring = self.ring.lock().unwrap();
+        ring.incidents += 1;
+        if let Some(pending) = &mut ring.pending {
+            pending.reasons.push(reason);
+            return;
+        }
+        let cooling = ring.last_dump.is_some_and(|last| time < last + COOLDOWN);
+        if cooling || ring.dumps.len() >= MAX_DUMPS {
+            return;
+        }
+        ring.pending = Some(Pending {
+            time,
+            reasons: vec![reason],
+        });
+        ring.last_dump = Some(time);
+        let recorder = self.clone();
+        executor::after(AFTER, Priority::Background, move || {
+            if let Err(e) = recorder.dump() {
+                eprintln!("Flight recorder: {e:?}");
+            }
+        });
+    }
+
+    /// Writes the pending incident, if any.
+    fn dump(&self) -> Result<()> {
+        let (incident, entries) = {
+            let mut ring = self.ring.lock().unwrap();
+            let Some(incident) = ring.pending.take() else {
+                return Ok(());
+            };
+            let entries = ring.since(incident.time.saturating_sub(BEFORE));
+            (incident, entries)
+        };
+        let secs = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .map(|d| d.as_secs())
+            .unwrap_or_default();
+        let mut path = self.options.prefix.as_os_str().to_owned();
+        path.push(format!(".incident-{secs}.csv"));
+        let path = PathBuf::from(path);
+        write_dump(&path, &incident, &entries)
+            .with_context(|| format!("Failed to write {}", path.display()))?;
+        println!(
+            "\nFlight recorder: {}, wrote {} events to {}",
+            incident.reasons.join("; "),
+            entries.len(),
+            path.display()
+        );
+        self.ring.lock().unwrap().dumps.push(path);
+        Ok(())
+    }
+
+    /// Writes an incident still waiting for its last events, and prints how
+    /// many incidents there were.
+    pub fn finish(&self) -> Result<()> {
+        self.dump()?;
+        let ring = self.ring.lock().unwrap();
+        if ring.incidents > 0 {
+            println!(
+                "Flight recorder: {} incidents, {} dumped",
+                ring.incidents,
+                ring.dumps.len()
+            );
+        }
+        Ok(())
+    }
+}
+
+fn write_dump(path: &Path, incident: &Pending, entries: &[Entry]) -> Result<()> {
+    let mut out = BufWriter::new(File::create(path)?);
+    // Times are relative to the incident, so it is at zero.
+    writeln!(out, "# {}", incident.reasons.join("; "))?;
+    writeln!(out, "time_ms,event,details")?;
+    for entry in entries {
+        let time = entry.time.as_secs_f64() - incident.time.as_secs_f64();
+        writeln!(out, "{:.3},{}", time * 1000.0, entry.event)?;
+    }
+    out.flush()?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use std::fs;
+
+    use super::*;
+
+    #[test]
+    fn test_incident_dumps_the_seconds_around_it() {
+        let dir = std::env::temp_dir().join(format!("flight-test-{}", std::process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        let options = FlightOptions {
+            prefix: dir.join("recording"),
+            latency_budget: Duration::from_millis(20),
+        };
+        let ten_seconds_ago = Instant::now() - Duration::from_secs(10);
+        let recorder = FlightRecorder::starting_at(options, ten_seconds_ago);
+        for (secs, event) in [(1, FlightEvent::Suspended), (6, FlightEvent::Resumed)] {
+            recorder.ring.lock().unwrap().push(Entry {
+                time: Duration::from_secs(secs),
+                event,
+            });
+        }
+        for pts in 0..100 {
+            recorder.encoded(pts, Duration::from_millis(5), Duration::from_millis(2));
+        }
+        assert!(recorder.ring.lock().unwrap().pending.is_none());
+
+        recorder.encoded(100, Duration::from_millis(30), Duration::from_millis(25));
+        recorder.dropped();
+        recorder.finish().unwrap();
+        let dumps = recorder.ring.lock().unwrap().dumps.clone();
+        assert_eq!(dumps.len(), 1);
+        let dump = fs::read_to_string(&dumps[0]).unwrap();
+        assert!(dump.starts_with("# frame 100 took 30.0 ms; frame dropped\n"));
+        assert!(!dump.contains("suspended"));
+        assert!(dump.contains("resumed"));
+        assert!(dump.contains("encoded,pts=100 latency_ms=30.00 encode_ms=25.00"));
+        assert!(dump.trim_end().ends_with(",dropped,"));
+
+        // Within the cooldown, incidents are only counted.
+        recorder.dropped();
+        assert!(recorder.ring.lock().unwrap().pending.is_none());
+
+        // Captured frame drops are incidents too, once the cooldown is over.
+        recorder.ring.lock().unwrap().last_dump = None;
+        recorder.capture_dropped("no_free_surface");
+        recorder.finish().unwrap();
+        let dumps = recorder.ring.lock().unwrap().dumps.clone();
+        let dump = fs::read_to_string(&dumps[1]).unwrap();
+        assert!(dump.starts_with("# capture dropped a buffer: no_free_surface\n"));
+        assert!(dump.contains("capture_dropped,cause=no_free_surface"));
+
+        // The ring keeps the latest events, oldest first.
+        for _ in 0..RING_EVENTS {
+            recorder.record(FlightEvent::Captured);
+        }
+        let entries = recorder.ring.lock().unwrap().since(Duration::ZERO);
+        assert_eq!(entries.len(), RING_EVENTS);
+        assert!(entries.windows(2).all(|pair| pair[0].time <= pair[1].time));
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_latency_is_stamped_when_the_packet_comes_out() {
+        let options = FlightOptions {
+            prefix: std::env::temp_dir().join("flight-latency-test"),
+            latency_budget: Duration::from_millis(20),
+        };
+        let recorder = FlightRecorder::new(options);
+        let now = Instant::now();
+        let ago = |ms| now - Duration::from_millis(ms);
+        // Frame 0 opened the session, frame 1 never got a packet.
+        recorder.submitted(0, ago(50), ago(48), true);
+        recorder.submitted(1, ago(40), ago(39), false);
+        recorder.submitted(2, ago(10), ago(9), false);
+        recorder.submitted(3, ago(30), ago(28), false);
+        for pts in [0, 2, 3] {
+            recorder.packet(&Packet::from_bytes(vec![0; 8], pts, pts == 0));
+        }
+
+        let encoded: Vec<_> = (recorder.ring.lock().unwrap().since(Duration::ZERO))
+            .into_iter()
+            .filter_map(|entry| match entry.event {
+                FlightEvent::Encoded {
+                    pts,
+                    latency,
+                    encode,
+                } => Some((pts, latency, encode)),
+                _ => None,
+            })
+            .collect();
+        assert_eq!(encoded.iter().map(|e| e.0).collect::<Vec<_>>(), [0, 2, 3]);
+        // Up to the packet, so at least as long as before submitting.
+        assert!(encoded[0].1 >= Duration::from_millis(50));
+        assert!(encoded[2].2 >= Duration::from_millis(28));
+        assert!(recorder.in_flight.lock().unwrap().is_empty());
+
+        // Only frame 3 went over budget; frame 0 opened the session.
+        let pending = recorder.ring.lock().unwrap().pending.take().unwrap();
+        assert_eq!(pending.reasons.len(), 1);
+        assert!(pending.reasons[0].starts_with("frame 3 took"));
+    }
+}
@@ -1,105 +1,295 @@
 use std::ptr;
-use std::sync::atomic::{AtomicBool, Ordering};
-use std::sync::Arc;
+use std::sync::atomic::{AtomicBool, AtomicPtr, AtomicU64, AtomicUsize, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::time::Instant;
 
-/// A lock-free frame buffer that allows one writer and one reader
-/// to operate concurrently without blocking each other.
+/// Slots frames rotate through. One holds the latest frame, the others are
+/// free for the writer unless a reader is in the middle of taking a
+/// reference to an older frame, which only lasts a few instructions.
+const SLOTS: usize = 4;
+
+/// A lock-free buffer holding the latest frame, with one writer and any
+/// number of readers. Clearing it from another thread is allowed and
+/// briefly serialized with the writer.
 ///
-/// Uses double-buffering with atomic state management.
+/// The writer publishes frames into a small ring of slots and then advances
+/// a single sequence number, so its cost per frame doesn't depend on how many
+/// readers there are. Readers never block the writer or each other: they pin
+/// the slot the sequence points to, check that it is still the latest, and
+/// take a reference to its frame.
 pub struct FrameBuffer<T> {
-    // Two frame slots
-    frames: [AtomicPtr<T>; 2],
+    slots: [Slot<T>; SLOTS],
+    // Sequence number of the latest frame in the upper bits, its slot in the
+    // lowest byte. Zero until the first write.
+    latest: AtomicU64,
+    // Serializes writers. Capture is the only one in steady state; recovery
+    // clearing the buffer from another thread is rare.
+    writing: AtomicBool,
+    // Readers blocked in `FrameReader::wait_new`. The writer only takes the
+    // lock to wake them when there are any.
+    waiters: AtomicUsize,
+    wait_lock: Mutex<()>,
+    new_frame: Condvar,
+}
+
+struct Slot<T> {
+    // From Arc::into_raw, or null for no frame.
+    frame: AtomicPtr<T>,
+    // Readers currently taking a reference to this slot's frame.
+    pins: AtomicUsize,
+}
 
-    // Which buffer is currently being read from (0 or 1)
-    // The writer always writes to the opposite buffer
-    reading_buffer: AtomicBool,
+fn pack(seq: u64, slot: usize) -> u64 {
+    seq << 8 | slot as u64
 }
 
-// Wrapper to make Arc<T> work with AtomicPtr
-struct AtomicPtr<T> {
-    ptr: std::sync::atomic::AtomicPtr<T>,
+fn unpack(latest: u64) -> (u64, usize) {
+    (latest >> 8, (latest & 0xff) as usize)
 }
 
-impl<T> AtomicPtr<T> {
-    fn new() -> Self {
+impl<T> FrameBuffer<T> {
+    pub fn new() -> Self {
         Self {
-            ptr: std::sync::atomic::AtomicPtr::new(ptr::null_mut()),
+            slots: std::array::from_fn(|_| Slot {
+                frame: AtomicPtr::new(ptr::null_mut()),
+                pins: AtomicUsize::new(0),
+            }),
+            latest: AtomicU64::new(0),
+            writing: AtomicBool::new(false),
+            waiters: AtomicUsize::new(0),
+            wait_lock: Mutex::new(()),
+            new_frame: Condvar::new(),
         }
     }
 
-    fn swap(&self, frame: Option<Arc<T>>, ordering: Ordering) -> Option<Arc<T>> {
-        let new_ptr = match frame {
-            Some(arc) => Arc::into_raw(arc) as *mut T,
-            None => ptr::null_mut(),
+    /// Write a new frame. Non-blocking operation unless another thread is
+    /// clearing the buffer at the same time.
+    pub fn write(&self, frame: Arc<T>) {
+        self.publish(Arc::into_raw(frame) as *mut T);
+    }
+
+    /// Drop the latest frame. `read` returns None until the next write.
+    pub fn clear(&self) {
+        self.publish(ptr::null_mut());
+    }
+
+    /// Publishes the latest frame again under a new sequence number, so
+    /// readers take it as new, e.g. when only the cursor over it moved. Does
+    /// nothing without a frame.
+    pub fn repeat(&self) {
+        self.lock_writer();
+        let (seq, current) = unpack(self.latest.load(Ordering::SeqCst));
+        let frame = self.slots[current].frame.load(Ordering::SeqCst);
+        if seq == 0 || frame.is_null() {
+            self.writing.store(false, Ordering::Release);
+            return;
+        }
+        // SAFETY: the latest slot holds a reference to the frame, which the
+        // writer lock keeps there; the new slot gets one of its own.
+        unsafe { Arc::increment_strong_count(frame) };
+        self.publish_locked(frame);
+    }
+
+    fn lock_writer(&self) {
+        while self
+            .writing
+            .compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+            .is_err()
+        {
+            std::hint::spin_loop();
+        }
+    }
+
+    fn publish(&self, frame: *mut T) {
+        self.lock_writer();
+        self.publish_locked(frame);
+    }
+
+    /// Publishes `frame` with the writer lock held, and releases it.
+    fn publish_locked(&self, frame: *mut T) {
+        let (seq, current) = unpack(self.latest.load(Ordering::SeqCst));
+        // Any slot but the latest one is free once no reader has it pinned.
+        // Readers only pin a stale slot briefly before noticing it is stale.
+        let slot = loop {
+            let free = (1..SLOTS)
+                .map(|i| (current + i) % SLOTS)
+                .find(|&i| self.slots[i].pins.load(Ordering::SeqCst) == 0);
+            match free {
+                Some(slot) => break slot,
+                None => std::hint::spin_loop(),
+            }
         };
 
-        let old_ptr = self.ptr.swap(new_ptr, ordering);
+        let old = self.slots[slot].frame.swap(frame, Ordering::SeqCst);
+        self.latest.store(pack(seq + 1, slot), Ordering::SeqCst);
+        if !old.is_null() {
+            // SAFETY: a reference from Arc::into_raw in write() or added in
+            // repeat(), and no reader is taking a reference to it: the slot
+            // is neither latest nor pinned.
+            unsafe { drop(Arc::from_raw(old)) };
+        }
+        self.writing.store(false, Ordering::Release);
 
-        if old_ptr.is_null() {
-            None
-        } else {
-            // SAFETY: We own this pointer from a previous Arc::into_raw
-            Some(unsafe { Arc::from_raw(old_ptr) })
+        // A waiter registers before it checks the sequence, so either it sees
+        // the new one or it is counted here and gets woken up.
+        if self.waiters.load(Ordering::SeqCst) > 0 {
+            drop(self.wait_lock.lock().unwrap());
+            self.new_frame.notify_all();
         }
     }
 
-    fn load(&self, ordering: Ordering) -> Option<Arc<T>> {
-        let ptr = self.ptr.load(ordering);
-        if ptr.is_null() {
-            None
-        } else {
-            // SAFETY: We're incrementing the Arc's reference count and we know this pointer is valid
-            unsafe {
-                Arc::increment_strong_count(ptr);
-                Some(Arc::from_raw(ptr))
+    /// Wakes the readers blocked in `FrameReader::wait_new`, so they check
+    /// their `running` flag.
+    pub fn wake(&self) {
+        drop(self.wait_lock.lock().unwrap());
+        self.new_frame.notify_all();
+    }
+
+    /// Read the latest complete frame. Non-blocking operation.
+    /// Returns None if no frame has been written yet.
+    /// Returns the same frame multiple times if no new frame is available.
+    pub fn read(&self) -> Option<Arc<T>> {
+        self.read_latest().1
+    }
+
+    /// Returns the sequence number of the latest frame along with it.
+    fn read_latest(&self) -> (u64, Option<Arc<T>>) {
+        loop {
+            let latest = self.latest.load(Ordering::SeqCst);
+            let (seq, slot) = unpack(latest);
+            if seq == 0 {
+                return (0, None);
             }
+            let slot = &self.slots[slot];
+            slot.pins.fetch_add(1, Ordering::SeqCst);
+            // While the slot is pinned and still the latest, the writer
+            // leaves it alone, so its frame can't be dropped under us.
+            let frame = if self.latest.load(Ordering::SeqCst) == latest {
+                let ptr = slot.frame.load(Ordering::SeqCst);
+                // SAFETY: ptr came from Arc::into_raw and the slot holds a
+                // reference to it, as explained above.
+                Some((!ptr.is_null()).then(|| unsafe {
+                    Arc::increment_strong_count(ptr);
+                    Arc::from_raw(ptr)
+                }))
+            } else {
+                None
+            };
+            slot.pins.fetch_sub(1, Ordering::SeqCst);
+            if let Some(frame) = frame {
+                return (seq, frame);
+            }
+        }
+    }
+
+    /// Returns a reader with its own position, for consumers that only want
+    /// frames they haven't seen yet.
+    pub fn subscribe(self: &Arc<Self>) -> FrameReader<T> {
+        FrameReader {
+            buffer: self.clone(),
+            last_seq: 0,
         }
     }
 }
 
-impl<T> Drop for AtomicPtr<T> {
+impl<T> Drop for FrameBuffer<T> {
     fn drop(&mut self) {
-        let ptr = self.ptr.load(Ordering::Relaxed);
-        if !ptr.is_null() {
-            // SAFETY: We own this pointer
-            unsafe {
-                Arc::from_raw(ptr);
+        for slot in &mut self.slots {
+            let ptr = *slot.frame.get_mut();
+            if !ptr.is_null() {
+                // SAFETY: We own this pointer
+                unsafe { drop(Arc::from_raw(ptr)) };
             }
         }
     }
 }
 
-impl<T> FrameBuffer<T> {
-    pub fn new() -> Self {
-        Self {
-            frames: [AtomicPtr::new(), AtomicPtr::new()],
-            reading_buffer: AtomicBool::new(false), // Start with buffer 0 for reading
+/// A reader of a [`FrameBuffer`] that remembers the last frame it got.
+pub struct FrameReader<T> {
+    buffer: Arc<FrameBuffer<T>>,
+    last_seq: u64,
+}
+
+impl<T> FrameReader<T> {
+    /// Returns the newest frame if one was written since the last call,
+    /// skipping any this reader was too slow to see.
+    pub fn read_new(&mut self) -> Option<Arc<T>> {
+        let (seq, frame) = self.buffer.read_latest();
+        if seq <= self.last_seq {
+            return None;
         }
+        self.last_seq = seq;
+        frame
     }
 
-    /// Write a new frame. Non-blocking operation.
-    pub fn write(&self, frame: Arc<T>) {
-        // Determine which buffer to write to (opposite of reading buffer)
-        let reading = self.reading_buffer.load(Ordering::Acquire);
-        let writing = !reading;
-        let write_idx = if writing { 1 } else { 0 };
+    /// Like `read_new`, but blocks until a frame is written. Lets an idle
+    /// consumer sleep instead of polling. Returns None once `running` is
+    /// cleared and the buffer woken with [`FrameBuffer::wake`].
+    pub fn wait_new(&mut self, running: &AtomicBool) -> Option<Arc<T>> {
+        loop {
+            // A cleared buffer counts as written but has no frame.
+            if let Some(frame) = self.read_new() {
+                return Some(frame);
+            }
+            let buffer = &self.buffer;
+            let mut guard = buffer.wait_lock.lock().unwrap();
+            buffer.waiters.fetch_add(1, Ordering::SeqCst);
+            while unpack(buffer.latest.load(Ordering::SeqCst)).0 <= self.last_seq
+                && running.load(Ordering::SeqCst)
+            {
+                guard = buffer.new_frame.wait(guard).unwrap();
+            }
+            buffer.waiters.fetch_sub(1, Ordering::SeqCst);
+            if !running.load(Ordering::SeqCst) {
+                return None;
+            }
+        }
+    }
 
-        // Store the new frame in the write buffer
-        self.frames[write_idx].swap(Some(frame), Ordering::Release);
+    /// Blocks until a frame is written or `deadline` passes, without
+    /// reading it. Returns whether one was.
+    pub fn wait_until(&self, deadline: Instant) -> bool {
+        let buffer = &self.buffer;
+        let mut guard = buffer.wait_lock.lock().unwrap();
+        buffer.waiters.fetch_add(1, Ordering::SeqCst);
+        let mut written = self.pending() > 0;
+        while !written {
+            let now = Instant::now();
+            if now >= deadline {
+                break;
+            }
+            guard = buffer
+                .new_frame
+                .wait_timeout(guard, deadline - now)
+                .unwrap()
+                .0;
+            written = self.pending() > 0;
+        }
+        buffer.waiters.fetch_sub(1, Ordering::SeqCst);
+        written
+    }
 
-        // Swap buffers by flipping the reading buffer flag
-        self.reading_buffer.store(writing, Ordering::Release);
+    /// Returns a function waking this reader from `wait_new`, for whoever
+    /// clears its `running` flag.
+    pub fn waker(&self) -> Box<dyn Fn() + Send + Sync>
+    where
+        T: Send + Sync + 'static,
+    {
+        let buffer = self.buffer.clone();
+        Box::new(move || buffer.wake())
     }
 
-    /// Read the latest complete frame. Non-blocking operation.
-    /// Returns None if no frame has been written yet.
-    /// Returns the same frame multiple times if no new frame is available.
-    pub fn read(&self) -> Option<Arc<T>> {
-        // Read from the current reading buffer
-        let reading = self.reading_buffer.load(Ordering::Acquire);
-        let read_idx = if reading { 1 } else { 0 };
+    /// Sequence number of the frame last read, counting every frame written
+    /// and every clear.
+    pub fn seq(&self) -> u64 {
+        self.last_seq
+    }
 
-        self.frames[read_idx].load(Ordering::Acquire)
+    /// Frames written since the last `read_new`. More than one means frames
+    /// were skipped.
+    pub fn pending(&self) -> u64 {
+        let (seq, _) = unpack(self.buffer.latest.load(Ordering::Acquire));
+        seq - self.last_seq
     }
 }
 
@@ -183,4 +373,104 @@ mod tests {
         writer.join().unwrap();
         reader.join().unwrap();
     }
+
+    #[test]
+    fn test_readers_only_see_new_frames() {
+        let buffer = Arc::new(FrameBuffer::new());
+        let mut fast = buffer.subscribe();
+        let mut slow = buffer.subscribe();
+        assert!(fast.read_new().is_none());
+
+        for timestamp in 1..=3 {
+            buffer.write(Arc::new(timestamp));
+            assert_eq!(fast.read_new().as_deref(), Some(&timestamp));
+            assert!(fast.read_new().is_none());
+        }
+        // The slow reader skips straight to the newest frame.
+        assert_eq!(slow.pending(), 3);
+        assert_eq!(slow.read_new().as_deref(), Some(&3));
+
+        buffer.clear();
+        assert!(buffer.read().is_none());
+        assert!(fast.read_new().is_none());
+    }
+
+    #[test]
+    fn test_repeat_republishes_latest() {
+        let buffer = Arc::new(FrameBuffer::new());
+        let mut reader = buffer.subscribe();
+        buffer.repeat();
+        assert!(reader.read_new().is_none());
+
+        let frame = Arc::new(7);
+        buffer.write(frame.clone());
+        assert_eq!(reader.read_new().as_deref(), Some(&7));
+        for _ in 0..SLOTS * 2 {
+            buffer.repeat();
+            assert!(Arc::ptr_eq(&reader.read_new().unwrap(), &frame));
+        }
+
+        // Nothing to repeat once cleared.
+        buffer.clear();
+        buffer.repeat();
+        assert!(reader.read_new().is_none());
+        drop((reader, buffer));
+        assert_eq!(Arc::strong_count(&frame), 1);
+    }
+
+    #[test]
+    fn test_many_readers() {
+        let buffer = Arc::new(FrameBuffer::new());
+        let readers: Vec<_> = (0..8)
+            .map(|_| {
+                let mut reader = buffer.subscribe();
+                thread::spawn(move || {
+                    let mut last = 0;
+                    while last < 10_000 {
+                        if let Some(frame) = reader.read_new() {
+                            assert!(*frame > last);
+                            last = *frame;
+                        }
+                    }
+                })
+            })
+            .collect();
+        for timestamp in 1..=10_000 {
+            buffer.write(Arc::new(timestamp));
+        }
+        for reader in readers {
+            reader.join().unwrap();
+        }
+        // Every frame but the latest has been released.
+        let latest = buffer.read().unwrap();
+        assert_eq!(Arc::strong_count(&latest), 2);
+    }
+
+    #[test]
+    fn test_wait_new_sleeps_until_written() {
+        let buffer = Arc::new(FrameBuffer::new());
+        let mut reader = buffer.subscribe();
+        let running = AtomicBool::new(true);
+
+        // A clear wakes the reader but isn't a frame.
+        buffer.clear();
+        thread::scope(|s| {
+            s.spawn(|| {
+                thread::sleep(Duration::from_millis(50));
+                buffer.write(Arc::new(7));
+            });
+            assert_eq!(reader.wait_new(&running).as_deref(), Some(&7));
+        });
+
+        // Clearing `running` and waking the buffer stops the wait.
+        let waker = reader.waker();
+        thread::scope(|s| {
+            s.spawn(|| {
+                thread::sleep(Duration::from_millis(50));
+                running.store(false, Ordering::SeqCst);
+                waker();
+            });
+            assert!(reader.wait_new(&running).is_none());
+        });
+    }
 }
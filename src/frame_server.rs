@@ -0,0 +1,182 @@
+use std::{
+    os::fd::{AsRawFd, OwnedFd, RawFd},
+    path::Path,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc,
+    },
+    thread,
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, Result};
+use cros_codecs::{backend::vaapi::surface_pool::PooledVaSurface, libva::Surface};
+use nix::errno::Errno;
+
+use crate::{
+    capture::{CaptureOptions, Capturer},
+    ipc::{export_read_fence, monotonic_ns, FrameHeader, FrameSocket, LatencyStats},
+};
+
+/// Frames a worker may hold at once. Beyond that, frames are skipped for that
+/// worker so a stuck worker can't drain the capture surface pool.
+const MAX_IN_FLIGHT: usize = 3;
+
+const REPORT_INTERVAL: Duration = Duration::from_secs(5);
+
+struct Worker {
+    socket: FrameSocket,
+    // Surfaces go back to the capture pool once the worker releases them.
+    in_flight: Vec<(u64, Arc<PooledVaSurface<()>>)>,
+    skipped: u64,
+}
+
+impl Worker {
+    fn collect_releases(&mut self) -> Result<()> {
+        while let Some(seq) = self.socket.try_recv_release()? {
+            self.in_flight.retain(|(s, _)| *s != seq);
+        }
+        Ok(())
+    }
+}
+
+/// Runs capture in this process and hands frames to encoder worker processes.
+///
+/// A worker crashing only closes its socket, which releases its in-flight
+/// surfaces; capture and the other workers carry on.
+pub fn run(
+    socket_path: &Path,
+    framerate: i32,
+    capture: CaptureOptions,
+    running: Arc<AtomicBool>,
+) -> Result<()> {
+    let listener = FrameSocket::listen(socket_path)?;
+    println!("Serving frames on {}", socket_path.display());
+    let capturer = Capturer::new(capture)?;
+    let mut workers: Vec<Worker> = Vec::new();
+    let mut seq = 0;
+    let mut export_stats = LatencyStats::default();
+    let mut send_stats = LatencyStats::default();
+    let mut last_report = Instant::now();
+
+    let frame_duration = Duration::from_secs_f64(1.0 / framerate as f64);
+    let mut next_frame_time = Instant::now() + frame_duration;
+    while running.load(Ordering::SeqCst) {
+        while let Some(socket) = FrameSocket::accept(&listener)? {
+            println!("Worker connected");
+            workers.push(Worker {
+                socket,
+                in_flight: Vec::new(),
+                skipped: 0,
+            });
+        }
+
+        workers.retain_mut(|worker| match worker.collect_releases() {
+            Ok(()) => true,
+            Err(e) => {
+                println!("Worker disconnected: {e:#}");
+                false
+            }
+        });
+
+        if !workers.is_empty() {
+            if let Some(frame) = capturer.read_frame() {
+                // Exported once and sent to every worker, so timed on its own.
+                let start = Instant::now();
+                let (mut header, fds) = export_frame(&frame)?;
+                export_stats.add(start.elapsed().as_nanos() as u64);
+                header.seq = seq;
+                header.pts = seq as i64;
+                seq += 1;
+                let raw_fds: Vec<RawFd> = fds.iter().map(|fd| fd.as_raw_fd()).collect();
+
+                workers.retain_mut(|worker| {
+                    if worker.in_flight.len() >= MAX_IN_FLIGHT {
+                        worker.skipped += 1;
+                        return true;
+                    }
+                    let start = Instant::now();
+                    header.send_time_ns = monotonic_ns();
+                    match worker.socket.send_frame(&header, &raw_fds) {
+                        Ok(()) => {
+                            send_stats.add(start.elapsed().as_nanos() as u64);
+                            worker.in_flight.push((header.seq, frame.clone()));
+                            true
+                        }
+                        Err(Errno::EAGAIN) => {
+                            worker.skipped += 1;
+                            true
+                        }
+                        Err(e) => {
+                            println!("Worker disconnected: {e}");
+                            false
+                        }
+                    }
+                });
+            }
+        }
+
+        if last_report.elapsed() >= REPORT_INTERVAL {
+            if let Some(summary) = export_stats.take_summary() {
+                println!("Frame export: {summary}");
+            }
+            if let Some(summary) = send_stats.take_summary() {
+                let skipped: u64 = workers.iter().map(|w| w.skipped).sum();
+                println!(
+                    "Frame send: {summary}, {} workers, {skipped} frames skipped",
+                    workers.len()
+                );
+            }
+            last_report = Instant::now();
+        }
+
+        let now = Instant::now();
+        if next_frame_time >= now {
+            thread::sleep(next_frame_time - now);
+            next_frame_time += frame_duration;
+        } else {
+            next_frame_time = now + frame_duration;
+        }
+    }
+
+    Ok(())
+}
+
+/// Exports a captured surface as DMABUF fds, followed by a read fence when the
+/// kernel supports exporting one.
+fn export_frame(frame: &Arc<PooledVaSurface<()>>) -> Result<(FrameHeader, Vec<OwnedFd>)> {
+    let surface: &Surface<()> = std::borrow::Borrow::borrow(frame.as_ref());
+    let descriptor = surface
+        .export_prime()
+        .map_err(|e| anyhow!("Failed to export surface: {e:?}"))?;
+    // Exported with composed layers, so there's a single layer with all planes.
+    let layer = descriptor
+        .layers
+        .first()
+        .ok_or_else(|| anyhow!("Exported surface has no layers"))?;
+
+    let mut header = FrameHeader {
+        width: descriptor.width,
+        height: descriptor.height,
+        fourcc: descriptor.fourcc,
+        num_planes: layer.num_planes,
+        num_objects: descriptor.objects.len() as u32,
+        modifier: descriptor
+            .objects
+            .first()
+            .map_or(0, |o| o.drm_format_modifier),
+        ..Default::default()
+    };
+    for plane in 0..layer.num_planes as usize {
+        header.object_index[plane] = layer.object_index[plane] as u32;
+        header.offsets[plane] = layer.offset[plane];
+        header.strides[plane] = layer.pitch[plane];
+    }
+
+    let mut fds: Vec<OwnedFd> = descriptor.objects.into_iter().map(|o| o.fd).collect();
+    if let Some(fence) = fds.first().and_then(|fd| export_read_fence(fd.as_raw_fd())) {
+        fds.push(fence);
+        header.has_fence = 1;
+    }
+    Ok((header, fds))
+}
@@ -0,0 +1,347 @@
+//! The game's frame times, measured from the buffers capture receives.
+//!
+//! Every frame the game presents reaches capture as a buffer, so the time
+//! between buffers is the game's frame time. The producer's PTS is used when
+//! it sets one, the time the buffer was dequeued otherwise.
+//!
+//! Frame times go into histograms of atomic counters with 16 buckets per
+//! power of two, about 4% apart. Recording a frame is a few relaxed atomic
+//! adds on the capture thread, and percentiles like the 1% lows are read from
+//! those counters on any thread without locks or stored samples. A timeline
+//! task on the auxiliary executor writes one CSV row per second next to the
+//! recording, so the numbers line up with the video.
+
+use std::{
+    fs::File,
+    io::{BufWriter, Write},
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc, Mutex,
+    },
+    time::{Duration, Instant},
+};
+
+use anyhow::{Context, Result};
+
+use crate::executor::{self, Priority};
+
+const SUB_BUCKETS: usize = 16;
+
+/// Enough buckets for frame times up to 2^21 µs, above `MAX_FRAME_TIME`.
+const BUCKETS: usize = 19 * SUB_BUCKETS;
+
+/// Longer gaps are the game not presenting, e.g. while loading, rather than
+/// slow frames, and are left out like the dequeue statistics do.
+const MAX_FRAME_TIME: Duration = Duration::from_secs(1);
+
+/// A hitch is a frame taking at least twice the recent average, and 8 ms
+/// more, so frame pacing noise at high rates doesn't count.
+const HITCH_FACTOR: u64 = 2;
+const HITCH_MIN_EXTRA_US: u64 = 8_000;
+
+/// Time between rows of the timeline.
+const TIMELINE_INTERVAL: Duration = Duration::from_secs(1);
+
+fn bucket(us: u64) -> usize {
+    if us < SUB_BUCKETS as u64 {
+        return us as usize;
+    }
+    let exp = 63 - us.leading_zeros() as usize;
+    let sub = (us >> (exp - 4)) as usize & (SUB_BUCKETS - 1);
+    ((exp - 3) * SUB_BUCKETS + sub).min(BUCKETS - 1)
+}
+
+/// Middle of the range of frame times in bucket `index`, in µs.
+fn bucket_value(index: usize) -> f64 {
+    if index < SUB_BUCKETS {
+        return index as f64;
+    }
+    let exp = index / SUB_BUCKETS + 3;
+    let width = 1u64 << (exp - 4);
+    ((SUB_BUCKETS + index % SUB_BUCKETS) as u64 * width) as f64 + width as f64 / 2.0
+}
+
+struct Histogram {
+    buckets: Vec<AtomicU64>,
+    sum_us: AtomicU64,
+    sum_sq_us: AtomicU64,
+    max_us: AtomicU64,
+    hitches: AtomicU64,
+}
+
+impl Histogram {
+    fn new() -> Self {
+        Self {
+            buckets: (0..BUCKETS).map(|_| AtomicU64::new(0)).collect(),
+            sum_us: AtomicU64::new(0),
+            sum_sq_us: AtomicU64::new(0),
+            max_us: AtomicU64::new(0),
+            hitches: AtomicU64::new(0),
+        }
+    }
+
+    fn add(&self, us: u64, hitch: bool) {
+        self.buckets[bucket(us)].fetch_add(1, Ordering::Relaxed);
+        self.sum_us.fetch_add(us, Ordering::Relaxed);
+        self.sum_sq_us.fetch_add(us * us, Ordering::Relaxed);
+        self.max_us.fetch_max(us, Ordering::Relaxed);
+        if hitch {
+            self.hitches.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    /// Reads the counters, and resets them if `reset`. A frame recorded
+    /// meanwhile may be split between this read and the next.
+    fn read(&self, reset: bool) -> FrameTimeSummary {
+        let get = |counter: &AtomicU64| {
+            if reset {
+                counter.swap(0, Ordering::Relaxed)
+            } else {
+                counter.load(Ordering::Relaxed)
+            }
+        };
+        let buckets: Vec<u64> = self.buckets.iter().map(get).collect();
+        let frames: u64 = buckets.iter().sum();
+        let sum = get(&self.sum_us) as f64;
+        let sum_sq = get(&self.sum_sq_us) as f64;
+        let mean = sum / frames.max(1) as f64;
+
+        // The 1% lows are the frame rate at the 99th percentile frame time.
+        let mut p99 = 0.0;
+        let mut seen = 0;
+        for (index, &count) in buckets.iter().enumerate() {
+            seen += count;
+            if count > 0 && seen * 100 >= frames * 99 {
+                p99 = bucket_value(index);
+                break;
+            }
+        }
+        let ms = |us: f64| us / 1000.0;
+        FrameTimeSummary {
+            frames,
+            mean_ms: ms(mean),
+            p99_ms: ms(p99),
+            max_ms: ms(get(&self.max_us) as f64),
+            stddev_ms: ms((sum_sq / frames.max(1) as f64 - mean * mean)
+                .max(0.0)
+                .sqrt()),
+            hitches: get(&self.hitches),
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct FrameTimeSummary {
+    pub frames: u64,
+    pub mean_ms: f64,
+    pub p99_ms: f64,
+    pub max_ms: f64,
+    pub stddev_ms: f64,
+    pub hitches: u64,
+}
+
+impl FrameTimeSummary {
+    pub fn fps(&self) -> f64 {
+        if self.mean_ms > 0.0 {
+            1000.0 / self.mean_ms
+        } else {
+            0.0
+        }
+    }
+
+    /// Frame rate of the slowest 1% of frames.
+    pub fn low_1_percent_fps(&self) -> f64 {
+        if self.p99_ms > 0.0 {
+            1000.0 / self.p99_ms
+        } else {
+            0.0
+        }
+    }
+}
+
+/// Frame-time statistics of the game, recorded from one thread and read
+/// from any.
+pub struct FrameTimes {
+    /// Time of the last frame in ns, plus one so zero means none.
+    last_ns: AtomicU64,
+    average_us: AtomicU64,
+    window: Histogram,
+    total: Histogram,
+}
+
+impl FrameTimes {
+    pub fn new() -> Self {
+        Self {
+            last_ns: AtomicU64::new(0),
+            average_us: AtomicU64::new(0),
+            window: Histogram::new(),
+            total: Histogram::new(),
+        }
+    }
+
+    /// Records a frame presented at `time_ns` on any monotonic clock. Only
+    /// ever called from one thread at a time.
+    pub fn record(&self, time_ns: u64) {
+        let last = self.last_ns.swap(time_ns + 1, Ordering::Relaxed);
+        if last == 0 || time_ns + 1 <= last {
+            return;
+        }
+        let us = (time_ns + 1 - last) / 1000;
+        if us > MAX_FRAME_TIME.as_micros() as u64 {
+            return;
+        }
+        let average = self.average_us.load(Ordering::Relaxed);
+        let hitch =
+            average > 0 && us >= HITCH_FACTOR * average && us >= average + HITCH_MIN_EXTRA_US;
+        // Moving average over about 16 frames.
+        let average = if average == 0 {
+            us
+        } else {
+            (average * 15 + us) / 16
+        };
+        self.average_us.store(average, Ordering::Relaxed);
+        self.window.add(us, hitch);
+        self.total.add(us, hitch);
+    }
+
+    /// Returns the statistics since the last call.
+    fn take_window(&self) -> FrameTimeSummary {
+        self.window.read(true)
+    }
+
+    pub fn total(&self) -> FrameTimeSummary {
+        self.total.read(false)
+    }
+}
+
+/// Writes the frame times of a recording to a CSV file, one row per second.
+pub struct Timeline {
+    state: Arc<Mutex<TimelineState>>,
+}
+
+struct TimelineState {
+    out: BufWriter<File>,
+    path: PathBuf,
+    frame_times: Arc<FrameTimes>,
+    start: Instant,
+    /// The first write error, which stops the timeline.
+    error: Option<anyhow::Error>,
+    stopped: bool,
+}
+
+impl TimelineState {
+    fn write_row(&mut self) -> Result<()> {
+        let row = self.frame_times.take_window();
+        writeln!(
+            self.out,
+            "{:.1},{},{:.1},{:.2},{:.1},{:.2},{:.2},{}",
+            self.start.elapsed().as_secs_f64(),
+            row.frames,
+            row.fps(),
+            row.mean_ms,
+            row.low_1_percent_fps(),
+            row.max_ms,
+            row.stddev_ms,
+            row.hitches
+        )
+        .and_then(|()| self.out.flush())
+        .with_context(|| format!("Failed to write {}", self.path.display()))
+    }
+}
+
+impl Timeline {
+    pub fn start(frame_times: Arc<FrameTimes>, path: &Path) -> Result<Self> {
+        let file =
+            File::create(path).with_context(|| format!("Failed to create {}", path.display()))?;
+        let mut out = BufWriter::new(file);
+        writeln!(
+            out,
+            "time_s,frames,fps,mean_ms,low_1_percent_fps,max_ms,stddev_ms,hitches"
+        )?;
+        let state = Arc::new(Mutex::new(TimelineState {
+            out,
+            path: path.to_owned(),
+            frame_times,
+            start: Instant::now(),
+            error: None,
+            stopped: false,
+        }));
+        executor::every(TIMELINE_INTERVAL, Priority::Background, {
+            let state = state.clone();
+            move || {
+                let mut state = state.lock().unwrap();
+                if state.stopped {
+                    return false;
+                }
+                if let Err(e) = state.write_row() {
+                    state.error = Some(e);
+                    state.stopped = true;
+                }
+                !state.stopped
+            }
+        });
+        Ok(Self { state })
+    }
+
+    /// Writes the last row and prints the totals.
+    pub fn finish(self) -> Result<()> {
+        let mut state = self.state.lock().unwrap();
+        if let Some(e) = state.error.take() {
+            return Err(e);
+        }
+        state.stopped = true;
+        state.write_row()?;
+
+        let total = state.frame_times.total();
+        println!(
+            "Game frame times: {} frames, {:.1} fps, 1% lows {:.1} fps, stddev {:.2} ms, max {:.1} ms, {} hitches",
+            total.frames,
+            total.fps(),
+            total.low_1_percent_fps(),
+            total.stddev_ms,
+            total.max_ms,
+            total.hitches
+        );
+        Ok(())
+    }
+}
+
+impl Drop for Timeline {
+    fn drop(&mut self) {
+        if let Ok(mut state) = self.state.lock() {
+            state.stopped = true;
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_frame_time_summary() {
+        for us in [0, 15, 16, 17, 100, 16_667, 999_999] {
+            let value = bucket_value(bucket(us));
+            assert!((value - us as f64).abs() <= us as f64 * 0.04 + 0.5, "{us}");
+        }
+
+        // 60 fps with a 100 ms hitch, then a pause that isn't a frame time.
+        let frame_times = FrameTimes::new();
+        let mut time = 0;
+        for i in 0..600 {
+            time += if i == 300 { 100_000_000 } else { 16_666_667 };
+            frame_times.record(time);
+        }
+        frame_times.record(time + 5_000_000_000);
+        let total = frame_times.total();
+        assert_eq!(total.frames, 599);
+        assert_eq!(total.hitches, 1);
+        assert!((total.fps() - 59.5).abs() < 0.1, "{}", total.fps());
+        assert!((58.0..62.0).contains(&total.low_1_percent_fps()));
+        assert_eq!(total.max_ms, 100.0);
+
+        assert_eq!(frame_times.take_window(), total);
+        assert_eq!(frame_times.take_window().frames, 0);
+    }
+}
@@ -0,0 +1,217 @@
+//! Lock-free pieces that are safe to use from PipeWire's real-time data
+//! thread: no locks, no allocation and no blocking system calls.
+
+use std::{
+    fmt, ptr,
+    sync::atomic::{AtomicPtr, AtomicU64, AtomicUsize, Ordering},
+    time::{Duration, Instant},
+};
+
+/// Buffers the data thread can hand over before it has to drop some. More
+/// than PipeWire ever negotiates for a video stream.
+const RING_SIZE: usize = 32;
+
+/// A single-producer single-consumer queue of raw pointers with a fixed
+/// capacity, for passing dequeued buffers out of the real-time thread along
+/// with when they were dequeued.
+pub struct BufferRing<T> {
+    slots: [AtomicPtr<T>; RING_SIZE],
+    times: [AtomicU64; RING_SIZE],
+    // Both only ever increase; their difference is the number of queued items.
+    head: AtomicUsize,
+    tail: AtomicUsize,
+}
+
+impl<T> BufferRing<T> {
+    pub fn new() -> Self {
+        Self {
+            slots: std::array::from_fn(|_| AtomicPtr::new(ptr::null_mut())),
+            times: std::array::from_fn(|_| AtomicU64::new(0)),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+        }
+    }
+
+    /// Queues `item` and the time it arrived at, or gives it back if the
+    /// ring is full. Producer only.
+    pub fn push(&self, item: *mut T, time_ns: u64) -> Result<(), *mut T> {
+        let tail = self.tail.load(Ordering::Relaxed);
+        if tail - self.head.load(Ordering::Acquire) == RING_SIZE {
+            return Err(item);
+        }
+        self.slots[tail % RING_SIZE].store(item, Ordering::Relaxed);
+        self.times[tail % RING_SIZE].store(time_ns, Ordering::Relaxed);
+        self.tail.store(tail + 1, Ordering::Release);
+        Ok(())
+    }
+
+    /// Takes the oldest item and its time. Consumer only.
+    pub fn pop(&self) -> Option<(*mut T, u64)> {
+        let head = self.head.load(Ordering::Relaxed);
+        if head == self.tail.load(Ordering::Acquire) {
+            return None;
+        }
+        let item = self.slots[head % RING_SIZE].load(Ordering::Relaxed);
+        let time_ns = self.times[head % RING_SIZE].load(Ordering::Relaxed);
+        self.head.store(head + 1, Ordering::Release);
+        Some((item, time_ns))
+    }
+}
+
+/// Gaps longer than this are the game not presenting (e.g. a static menu),
+/// not scheduling jitter, and are left out of the statistics.
+const MAX_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Statistics of the time between consecutive events, recorded from one
+/// thread with atomics only and read from any other.
+pub struct IntervalStats {
+    base: Instant,
+    // Nanoseconds since `base` of the last event, plus one so zero means none.
+    last: AtomicU64,
+    count: AtomicU64,
+    sum_us: AtomicU64,
+    sum_sq_us: AtomicU64,
+    max_us: AtomicU64,
+    gaps: AtomicU64,
+}
+
+impl IntervalStats {
+    pub fn new() -> Self {
+        Self {
+            base: Instant::now(),
+            last: AtomicU64::new(0),
+            count: AtomicU64::new(0),
+            sum_us: AtomicU64::new(0),
+            sum_sq_us: AtomicU64::new(0),
+            max_us: AtomicU64::new(0),
+            gaps: AtomicU64::new(0),
+        }
+    }
+
+    /// Records an event now. Only ever called from one thread at a time.
+    pub fn record(&self) {
+        self.record_at(Instant::now());
+    }
+
+    fn record_at(&self, now: Instant) {
+        let now = now.duration_since(self.base).as_nanos() as u64 + 1;
+        let last = self.last.swap(now, Ordering::Relaxed);
+        if last == 0 {
+            return;
+        }
+        let interval = Duration::from_nanos(now - last);
+        if interval > MAX_INTERVAL {
+            self.gaps.fetch_add(1, Ordering::Relaxed);
+            return;
+        }
+        let us = interval.as_micros() as u64;
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum_us.fetch_add(us, Ordering::Relaxed);
+        self.sum_sq_us.fetch_add(us * us, Ordering::Relaxed);
+        self.max_us.fetch_max(us, Ordering::Relaxed);
+    }
+
+    pub fn summary(&self) -> IntervalSummary {
+        let count = self.count.load(Ordering::Relaxed);
+        let sum = self.sum_us.load(Ordering::Relaxed) as f64;
+        let sum_sq = self.sum_sq_us.load(Ordering::Relaxed) as f64;
+        let mean = sum / count.max(1) as f64;
+        let variance = (sum_sq / count.max(1) as f64 - mean * mean).max(0.0);
+        IntervalSummary {
+            count,
+            mean: Duration::from_micros(mean as u64),
+            jitter: Duration::from_micros(variance.sqrt() as u64),
+            max: Duration::from_micros(self.max_us.load(Ordering::Relaxed)),
+            gaps: self.gaps.load(Ordering::Relaxed),
+        }
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct IntervalSummary {
+    pub count: u64,
+    pub mean: Duration,
+    /// Standard deviation of the intervals.
+    pub jitter: Duration,
+    pub max: Duration,
+    /// Intervals longer than `MAX_INTERVAL`, not counted in the above.
+    pub gaps: u64,
+}
+
+impl fmt::Display for IntervalSummary {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        let ms = |d: Duration| d.as_secs_f64() * 1000.0;
+        write!(
+            f,
+            "{} intervals, mean {:.2} ms, jitter {:.2} ms, max {:.2} ms, {} idle gaps",
+            self.count,
+            ms(self.mean),
+            ms(self.jitter),
+            ms(self.max),
+            self.gaps
+        )
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::thread;
+
+    #[test]
+    fn test_ring_wraps_and_fills() {
+        let ring = BufferRing::<u32>::new();
+        let mut items: Vec<u32> = (0..RING_SIZE as u32 * 2).collect();
+        let ptrs: Vec<*mut u32> = items.iter_mut().map(|i| i as *mut u32).collect();
+        for chunk in ptrs.chunks(RING_SIZE / 2 + 1) {
+            for (time_ns, &p) in chunk.iter().enumerate() {
+                ring.push(p, time_ns as u64).unwrap();
+            }
+            for (time_ns, &p) in chunk.iter().enumerate() {
+                assert_eq!(ring.pop(), Some((p, time_ns as u64)));
+            }
+        }
+        assert_eq!(ring.pop(), None);
+        for &p in &ptrs[..RING_SIZE] {
+            ring.push(p, 0).unwrap();
+        }
+        assert_eq!(ring.push(ptrs[RING_SIZE], 0), Err(ptrs[RING_SIZE]));
+    }
+
+    #[test]
+    fn test_ring_across_threads() {
+        let ring = BufferRing::<u8>::new();
+        thread::scope(|s| {
+            s.spawn(|| {
+                for i in 1..=10_000usize {
+                    while ring.push(i as *mut u8, i as u64).is_err() {
+                        std::hint::spin_loop();
+                    }
+                }
+            });
+            let mut expected = 1;
+            while expected <= 10_000 {
+                if let Some((item, time_ns)) = ring.pop() {
+                    assert_eq!(item as usize, expected);
+                    assert_eq!(time_ns, expected as u64);
+                    expected += 1;
+                }
+            }
+        });
+    }
+
+    #[test]
+    fn test_interval_stats() {
+        let stats = IntervalStats::new();
+        let start = stats.base;
+        for ms in [0, 16, 34, 50, 500, 516] {
+            stats.record_at(start + Duration::from_millis(ms));
+        }
+        let summary = stats.summary();
+        assert_eq!(summary.count, 4);
+        assert_eq!(summary.gaps, 1);
+        assert_eq!(summary.mean, Duration::from_micros(16500));
+        assert_eq!(summary.jitter, Duration::from_micros(866));
+        assert_eq!(summary.max, Duration::from_millis(18));
+    }
+}
@@ -0,0 +1,406 @@
+//! Frame passing between the capture process and encoder worker processes.
+//!
+//! Frames travel as DMABUF fds over a `SOCK_SEQPACKET` Unix socket, attached
+//! with `SCM_RIGHTS` to a fixed-size [`FrameHeader`]. Workers send the frame
+//! sequence number back once they are done reading the buffer, which is when
+//! the capture side returns the surface to its pool.
+
+use std::{
+    io::{IoSlice, IoSliceMut},
+    mem,
+    os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd},
+    path::Path,
+    slice,
+    time::Duration,
+};
+
+use anyhow::{bail, Context, Result};
+use nix::{
+    cmsg_space,
+    errno::Errno,
+    poll::{poll, PollFd, PollFlags, PollTimeout},
+    sys::{
+        socket::{
+            self, AddressFamily, Backlog, ControlMessage, ControlMessageOwned, MsgFlags, SockFlag,
+            SockType, UnixAddr,
+        },
+        time::TimeSpec,
+    },
+    time::{clock_gettime, ClockId},
+};
+
+/// Upper bound of planes and DMABUF objects in one frame.
+pub const MAX_PLANES: usize = 4;
+
+/// Upper bound of fds attached to one frame: up to 4 DMABUF objects plus a fence.
+pub const MAX_FDS: usize = MAX_PLANES + 1;
+
+/// Per-frame metadata sent along with the DMABUF fds.
+///
+/// Plain old data with no padding, so it can be sent as raw bytes.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default)]
+pub struct FrameHeader {
+    pub seq: u64,
+    pub pts: i64,
+    /// `CLOCK_MONOTONIC` time at which the frame was sent, in ns.
+    pub send_time_ns: u64,
+    pub modifier: u64,
+    pub width: u32,
+    pub height: u32,
+    pub fourcc: u32,
+    pub num_planes: u32,
+    pub object_index: [u32; 4],
+    pub offsets: [u32; 4],
+    pub strides: [u32; 4],
+    /// Number of DMABUF object fds, which come first in the attached fds.
+    pub num_objects: u32,
+    /// Whether the last attached fd is a sync_file to wait on before reading.
+    pub has_fence: u32,
+}
+
+impl FrameHeader {
+    fn as_bytes(&self) -> &[u8] {
+        // SAFETY: FrameHeader is repr(C), Copy and has no padding.
+        unsafe { slice::from_raw_parts(self as *const _ as *const u8, mem::size_of::<Self>()) }
+    }
+
+    fn as_bytes_mut(&mut self) -> &mut [u8] {
+        // SAFETY: as above, and every bit pattern is a valid FrameHeader.
+        unsafe { slice::from_raw_parts_mut(self as *mut _ as *mut u8, mem::size_of::<Self>()) }
+    }
+
+    /// Checks the counts and indices a receiver uses to index the plane
+    /// arrays and the attached fds.
+    fn validate(&self) -> Result<()> {
+        if self.num_planes as usize > MAX_PLANES || self.num_objects as usize > MAX_PLANES {
+            bail!(
+                "Frame has {} planes in {} objects, at most {MAX_PLANES} are supported",
+                self.num_planes,
+                self.num_objects
+            );
+        }
+        let planes = &self.object_index[..self.num_planes as usize];
+        if let Some(index) = planes.iter().find(|&&index| index >= self.num_objects) {
+            bail!(
+                "Frame plane refers to object {index} of {}",
+                self.num_objects
+            );
+        }
+        Ok(())
+    }
+}
+
+pub fn monotonic_ns() -> u64 {
+    let now = clock_gettime(ClockId::CLOCK_MONOTONIC).unwrap_or(TimeSpec::new(0, 0));
+    now.tv_sec() as u64 * 1_000_000_000 + now.tv_nsec() as u64
+}
+
+/// A connected frame socket, on either end.
+pub struct FrameSocket(OwnedFd);
+
+impl FrameSocket {
+    /// Creates a listening socket for workers to connect to.
+    ///
+    /// The listener is non-blocking so the capture loop can poll for new
+    /// workers with [`FrameSocket::accept`].
+    pub fn listen(path: &Path) -> Result<OwnedFd> {
+        // Only a socket nobody listens on is left over from a previous run;
+        // one that answers belongs to a live capture process.
+        let fd = socket::socket(
+            AddressFamily::Unix,
+            SockType::SeqPacket,
+            SockFlag::SOCK_CLOEXEC,
+            None,
+        )?;
+        match socket::connect(fd.as_raw_fd(), &UnixAddr::new(path)?) {
+            Ok(()) => bail!("Frames are already served on {}", path.display()),
+            Err(Errno::ECONNREFUSED) => std::fs::remove_file(path)
+                .with_context(|| format!("Failed to remove stale socket {}", path.display()))?,
+            Err(_) => {}
+        }
+
+        let fd = socket::socket(
+            AddressFamily::Unix,
+            SockType::SeqPacket,
+            SockFlag::SOCK_CLOEXEC | SockFlag::SOCK_NONBLOCK,
+            None,
+        )?;
+        socket::bind(fd.as_raw_fd(), &UnixAddr::new(path)?)
+            .with_context(|| format!("Failed to bind {}", path.display()))?;
+        socket::listen(&fd, Backlog::new(8)?)?;
+        Ok(fd)
+    }
+
+    /// Accepts a pending worker connection, if any.
+    pub fn accept(listener: &OwnedFd) -> Result<Option<Self>> {
+        match socket::accept4(
+            listener.as_raw_fd(),
+            SockFlag::SOCK_CLOEXEC | SockFlag::SOCK_NONBLOCK,
+        ) {
+            // SAFETY: accept4 returned a new fd that nothing else owns.
+            Ok(fd) => Ok(Some(Self(unsafe { OwnedFd::from_raw_fd(fd) }))),
+            Err(Errno::EAGAIN) => Ok(None),
+            Err(e) => Err(e.into()),
+        }
+    }
+
+    pub fn connect(path: &Path) -> Result<Self> {
+        let fd = socket::socket(
+            AddressFamily::Unix,
+            SockType::SeqPacket,
+            SockFlag::SOCK_CLOEXEC,
+            None,
+        )?;
+        socket::connect(fd.as_raw_fd(), &UnixAddr::new(path)?)
+            .with_context(|| format!("Failed to connect to {}", path.display()))?;
+        Ok(Self(fd))
+    }
+
+    /// Sends a frame without blocking. Returns `Errno::EAGAIN` when the
+    /// worker isn't keeping up, in which case the frame is simply not sent.
+    pub fn send_frame(&self, header: &FrameHeader, fds: &[RawFd]) -> nix::Result<()> {
+        let iov = [IoSlice::new(header.as_bytes())];
+        let cmsgs = [ControlMessage::ScmRights(fds)];
+        socket::sendmsg::<()>(
+            self.0.as_raw_fd(),
+            &iov,
+            &cmsgs,
+            MsgFlags::MSG_DONTWAIT | MsgFlags::MSG_NOSIGNAL,
+            None,
+        )?;
+        Ok(())
+    }
+
+    /// Blocks until the next frame arrives. Returns `None` once the capture
+    /// side has closed the connection.
+    pub fn recv_frame(&self) -> Result<Option<(FrameHeader, Vec<OwnedFd>)>> {
+        let mut header = FrameHeader::default();
+        let mut cmsg_buffer = cmsg_space!([RawFd; MAX_FDS]);
+        let mut fds = Vec::new();
+        let bytes = {
+            let mut iov = [IoSliceMut::new(header.as_bytes_mut())];
+            let msg = socket::recvmsg::<()>(
+                self.0.as_raw_fd(),
+                &mut iov,
+                Some(&mut cmsg_buffer),
+                MsgFlags::MSG_CMSG_CLOEXEC,
+            )?;
+            for cmsg in msg.cmsgs()? {
+                if let ControlMessageOwned::ScmRights(received) = cmsg {
+                    // SAFETY: the kernel installed these fds for us.
+                    fds.extend(
+                        received
+                            .into_iter()
+                            .map(|fd| unsafe { OwnedFd::from_raw_fd(fd) }),
+                    );
+                }
+            }
+            if msg.flags.contains(MsgFlags::MSG_CTRUNC) {
+                bail!("Frame message carried more than {MAX_FDS} fds");
+            }
+            msg.bytes
+        };
+        match bytes {
+            0 => Ok(None),
+            n if n == mem::size_of::<FrameHeader>() => {
+                header.validate()?;
+                Ok(Some((header, fds)))
+            }
+            n => bail!("Unexpected frame message size {n}"),
+        }
+    }
+
+    /// Tells the capture side that the frame `seq` can be recycled.
+    pub fn send_release(&self, seq: u64) -> Result<()> {
+        socket::send(
+            self.0.as_raw_fd(),
+            &seq.to_ne_bytes(),
+            MsgFlags::MSG_NOSIGNAL,
+        )?;
+        Ok(())
+    }
+
+    /// Returns the next released frame without blocking. `Ok(None)` means
+    /// nothing is pending, an error means the worker went away.
+    pub fn try_recv_release(&self) -> Result<Option<u64>> {
+        let mut buf = [0u8; 8];
+        match socket::recv(self.0.as_raw_fd(), &mut buf, MsgFlags::MSG_DONTWAIT) {
+            Ok(8) => Ok(Some(u64::from_ne_bytes(buf))),
+            Ok(0) => bail!("worker disconnected"),
+            Ok(n) => bail!("Unexpected release message size {n}"),
+            Err(Errno::EAGAIN) => Ok(None),
+            Err(e) => Err(e.into()),
+        }
+    }
+}
+
+#[repr(C)]
+struct DmaBufExportSyncFile {
+    flags: u32,
+    fd: i32,
+}
+
+const DMA_BUF_SYNC_READ: u32 = 1 << 0;
+
+nix::ioctl_readwrite!(dma_buf_export_sync_file, b'b', 2, DmaBufExportSyncFile);
+
+/// Exports the fence a reader of `dmabuf` has to wait on as a sync_file.
+///
+/// Returns `None` on kernels without `DMA_BUF_IOCTL_EXPORT_SYNC_FILE` (< 6.0),
+/// where the importer relies on implicit synchronization instead.
+pub fn export_read_fence(dmabuf: RawFd) -> Option<OwnedFd> {
+    let mut arg = DmaBufExportSyncFile {
+        flags: DMA_BUF_SYNC_READ,
+        fd: -1,
+    };
+    // SAFETY: arg matches struct dma_buf_export_sync_file.
+    match unsafe { dma_buf_export_sync_file(dmabuf, &mut arg) } {
+        // SAFETY: the ioctl returned a new fd that nothing else owns.
+        Ok(_) => Some(unsafe { OwnedFd::from_raw_fd(arg.fd) }),
+        Err(_) => None,
+    }
+}
+
+/// Waits until a sync_file fence signals. Returns false if it didn't within
+/// `timeout`.
+pub fn wait_fence(fence: &OwnedFd, timeout: Duration) -> Result<bool> {
+    let timeout = PollTimeout::try_from(timeout).unwrap_or(PollTimeout::MAX);
+    let mut fds = [PollFd::new(
+        std::os::fd::AsFd::as_fd(fence),
+        PollFlags::POLLIN,
+    )];
+    match poll(&mut fds, timeout)? {
+        0 => Ok(false),
+        _ => Ok(true),
+    }
+}
+
+/// Running min/avg/max of a latency, reported in microseconds.
+#[derive(Default)]
+pub struct LatencyStats {
+    count: u64,
+    total_ns: u64,
+    min_ns: u64,
+    max_ns: u64,
+}
+
+impl LatencyStats {
+    pub fn add(&mut self, ns: u64) {
+        if self.count == 0 || ns < self.min_ns {
+            self.min_ns = ns;
+        }
+        self.max_ns = self.max_ns.max(ns);
+        self.total_ns += ns;
+        self.count += 1;
+    }
+
+    /// Returns a one-line summary and starts a new measurement window.
+    pub fn take_summary(&mut self) -> Option<String> {
+        if self.count == 0 {
+            return None;
+        }
+        let summary = format!(
+            "min {:.1}us avg {:.1}us max {:.1}us over {} frames",
+            self.min_ns as f64 / 1000.0,
+            self.total_ns as f64 / self.count as f64 / 1000.0,
+            self.max_ns as f64 / 1000.0,
+            self.count
+        );
+        *self = Self::default();
+        Some(summary)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_header_has_no_padding() {
+        let fields = 4 * mem::size_of::<u64>() + 18 * mem::size_of::<u32>();
+        assert_eq!(mem::size_of::<FrameHeader>(), fields);
+    }
+
+    #[test]
+    fn test_listen_replaces_only_stale_sockets() {
+        let path = std::env::temp_dir().join(format!("frames-{}.sock", std::process::id()));
+        let stale = FrameSocket::listen(&path).unwrap();
+        drop(stale);
+        let listener = FrameSocket::listen(&path).unwrap();
+        let error = FrameSocket::listen(&path).err().unwrap();
+        assert!(error.to_string().contains("already served"), "{error}");
+        assert!(FrameSocket::connect(&path).is_ok());
+        drop(listener);
+        std::fs::remove_file(&path).unwrap();
+    }
+
+    #[test]
+    fn test_frame_roundtrip_with_fds() {
+        let (a, b) = socket::socketpair(
+            AddressFamily::Unix,
+            SockType::SeqPacket,
+            None,
+            SockFlag::SOCK_CLOEXEC,
+        )
+        .unwrap();
+        let (sender, receiver) = (FrameSocket(a), FrameSocket(b));
+        let file = std::fs::File::open("/dev/null").unwrap();
+
+        let header = FrameHeader {
+            seq: 7,
+            width: 1280,
+            height: 720,
+            num_objects: 1,
+            ..Default::default()
+        };
+        sender.send_frame(&header, &[file.as_raw_fd()]).unwrap();
+        let (received, fds) = receiver.recv_frame().unwrap().unwrap();
+        assert_eq!(received.seq, 7);
+        assert_eq!((received.width, received.height), (1280, 720));
+        assert_eq!(fds.len(), 1);
+
+        receiver.send_release(7).unwrap();
+        assert_eq!(sender.try_recv_release().unwrap(), Some(7));
+        assert_eq!(sender.try_recv_release().unwrap(), None);
+
+        drop(sender);
+        assert!(receiver.recv_frame().unwrap().is_none());
+    }
+
+    #[test]
+    fn test_malformed_headers_are_rejected() {
+        let (a, b) = socket::socketpair(
+            AddressFamily::Unix,
+            SockType::SeqPacket,
+            None,
+            SockFlag::SOCK_CLOEXEC,
+        )
+        .unwrap();
+        let (sender, receiver) = (FrameSocket(a), FrameSocket(b));
+        let too_many = FrameHeader {
+            num_planes: 5,
+            num_objects: 1,
+            ..Default::default()
+        };
+        let dangling = FrameHeader {
+            num_planes: 2,
+            num_objects: 1,
+            object_index: [0, 1, 0, 0],
+            ..Default::default()
+        };
+        for header in [too_many, dangling] {
+            sender.send_frame(&header, &[]).unwrap();
+            assert!(receiver.recv_frame().is_err(), "{header:?}");
+        }
+    }
+
+    #[test]
+    fn test_wait_fence_reports_timeouts() {
+        // A pipe stands in for the sync_file: both poll readable once signaled.
+        let (read, write) = nix::unistd::pipe().unwrap();
+        assert!(!wait_fence(&read, Duration::from_millis(1)).unwrap());
+        nix::unistd::write(&write, &[1]).unwrap();
+        assert!(wait_fence(&read, Duration::from_millis(1)).unwrap());
+    }
+}
@@ -0,0 +1,143 @@
+//! H.264 level selection (Table A-1 of the spec).
+//!
+//! A level caps the macroblocks per frame and per second a decoder must
+//! handle, and the bitrate. Leaving it at a fixed value either wastes decoder
+//! capability or, at high refresh rates and resolutions, produces streams
+//! that are out of spec: 1080p at 120 fps needs level 5.1, where 1080p60
+//! fits in 4.2, and 4K60 needs 5.2.
+//!
+//! Frames too large for the highest level at the frame rate, or for the
+//! hardware encoder, are scaled down to the largest size that fits, see
+//! [`encoder_size`].
+
+/// Limits of one level.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct Level {
+    /// `level_idc`, ten times the level number.
+    pub idc: u8,
+    /// Macroblocks per second.
+    pub max_mbps: u64,
+    /// Macroblocks per frame.
+    pub max_fs: u64,
+    /// Video bitrate in kbit/s, for the Baseline and Main profiles.
+    pub max_br: u64,
+}
+
+const fn level(idc: u8, max_mbps: u64, max_fs: u64, max_br: u64) -> Level {
+    Level {
+        idc,
+        max_mbps,
+        max_fs,
+        max_br,
+    }
+}
+
+/// Up to 5.2, the highest level VA-API H.264 encoders advertise.
+const LEVELS: [Level; 15] = [
+    level(10, 1_485, 99, 64),
+    level(11, 3_000, 396, 192),
+    level(12, 6_000, 396, 384),
+    level(13, 11_880, 396, 768),
+    level(20, 11_880, 396, 2_000),
+    level(21, 19_800, 792, 4_000),
+    level(22, 20_250, 1_620, 4_000),
+    level(30, 40_500, 1_620, 10_000),
+    level(31, 108_000, 3_600, 14_000),
+    level(32, 216_000, 5_120, 20_000),
+    level(40, 245_760, 8_192, 20_000),
+    level(41, 245_760, 8_192, 50_000),
+    level(42, 522_240, 8_704, 50_000),
+    level(50, 589_824, 22_080, 135_000),
+    level(51, 983_040, 36_864, 240_000),
+];
+
+const LEVEL_5_2: Level = level(52, 2_073_600, 36_864, 240_000);
+
+/// Returns the lowest level that fits frames of `width`x`height` at
+/// `framerate` and `bitrate` bits/s, or `None` if even level 5.2 is too low.
+pub fn h264_level(width: u32, height: u32, framerate: u32, bitrate: u64) -> Option<Level> {
+    let width_mbs = width.div_ceil(16) as u64;
+    let height_mbs = height.div_ceil(16) as u64;
+    let frame_size = width_mbs * height_mbs;
+    let rate = frame_size * framerate as u64;
+    LEVELS
+        .iter()
+        .chain([&LEVEL_5_2])
+        // Neither side may exceed sqrt(8 * MaxFS) macroblocks, so very wide
+        // or very tall frames need a higher level than their area suggests.
+        .find(|level| {
+            let max_side = ((level.max_fs * 8) as f64).sqrt() as u64;
+            frame_size <= level.max_fs
+                && rate <= level.max_mbps
+                && bitrate <= level.max_br * 1000
+                && width_mbs <= max_side
+                && height_mbs <= max_side
+        })
+        .copied()
+}
+
+/// Returns the size to encode `width`x`height` frames at: the same size if
+/// it fits within the hardware limit `max_width`x`max_height` and level 5.2 at
+/// `framerate`, otherwise the largest even size with the same aspect ratio
+/// that does.
+pub fn encoder_size(
+    (width, height): (u32, u32),
+    framerate: u32,
+    (max_width, max_height): (u32, u32),
+) -> (u32, u32) {
+    let fits = |w: u32, h: u32| {
+        w <= max_width && h <= max_height && h264_level(w, h, framerate, 0).is_some()
+    };
+    if fits(width, height) {
+        return (width, height);
+    }
+    let mut scale = (max_width as f64 / width as f64).min(max_height as f64 / height as f64);
+    let frame_size = width.div_ceil(16) as f64 * height.div_ceil(16) as f64;
+    let max_frame_size = (LEVEL_5_2.max_mbps / framerate.max(1) as u64).min(LEVEL_5_2.max_fs);
+    scale = scale.min((max_frame_size as f64 / frame_size).sqrt());
+    loop {
+        // NV12 needs even dimensions.
+        let w = ((width as f64 * scale) as u32 & !1).max(2);
+        let h = ((height as f64 * scale) as u32 & !1).max(2);
+        if fits(w, h) || (w, h) == (2, 2) {
+            return (w, h);
+        }
+        // Rounding up to whole macroblocks can push it just over.
+        scale *= 0.99;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_level_follows_size_and_rate() {
+        let idc = |w, h, fps| h264_level(w, h, fps, 9_000_000).map(|level| level.idc);
+        assert_eq!(idc(1280, 720, 30), Some(31));
+        assert_eq!(idc(1280, 720, 60), Some(32));
+        assert_eq!(idc(1280, 800, 90), Some(42));
+        assert_eq!(idc(1920, 1080, 60), Some(42));
+        assert_eq!(idc(1920, 1080, 120), Some(51));
+        assert_eq!(idc(2560, 1440, 120), Some(52));
+        assert_eq!(idc(3840, 2160, 60), Some(52));
+        assert_eq!(idc(3840, 2160, 120), None);
+        // Bitrate alone can raise the level.
+        assert_eq!(h264_level(1280, 720, 60, 30_000_000).unwrap().idc, 41);
+        assert_eq!(h264_level(1280, 720, 60, 300_000_000), None);
+    }
+
+    #[test]
+    fn test_encoder_size_downscales_to_fit() {
+        let max = (4096, 4096);
+        assert_eq!(encoder_size((1920, 1080), 120, max), (1920, 1080));
+        assert_eq!(encoder_size((3840, 2160), 60, max), (3840, 2160));
+        // Over the hardware limit.
+        assert_eq!(encoder_size((5120, 2880), 30, max), (4096, 2304));
+        assert_eq!(encoder_size((3840, 2160), 60, (1920, 1088)), (1920, 1080));
+        // Over level 5.2 at this rate.
+        let (w, h) = encoder_size((3840, 2160), 120, max);
+        assert!(h264_level(w, h, 120, 0).is_some());
+        assert!(w > 2600 && (w * 9).abs_diff(h * 16) < 32, "{w}x{h}");
+    }
+}
@@ -1,84 +1,463 @@
 use std::{
-    fs::File,
-    io::Write,
-    sync::{
-        atomic::{AtomicBool, Ordering},
-        Arc,
-    },
-    time::Instant,
+    path::PathBuf,
+    sync::{atomic::AtomicBool, Arc},
 };
 
-use std::thread;
 use std::time::Duration;
 
+use clap::Parser;
+
+mod backend;
+mod bitstream;
 mod capture;
+mod channel;
+mod control;
+mod cursor;
+mod daemon;
+mod damage;
 mod encode;
 mod encode_ffmpeg;
+mod executor;
+mod fanout;
+mod file_source;
+mod flight;
 mod frame_buffer;
+mod frame_server;
+mod frametime;
+mod handoff;
+mod ipc;
+mod level;
+mod nv12;
+mod offline;
+mod packet;
+mod pipeline;
+mod preview;
+mod rate;
+mod raw_dump;
+mod record;
+mod recovery;
+mod replay;
+mod storage;
+mod stub;
+mod trace;
+mod usage;
+mod va;
+mod worker;
 
-use capture::Capturer;
-use encode_ffmpeg::Encoder;
+use capture::CaptureOptions;
+use encode_ffmpeg::EncoderSettings;
+use recovery::FaultSpec;
+use usage::UsageMonitor;
 
-const FPS: i32 = 60;
+#[derive(Parser)]
+#[command(about = "Zero-copy recorder for Gamescope")]
+struct Args {
+    /// Output file for a one-shot recording
+    #[arg(short, long, default_value = "output.h264")]
+    output: PathBuf,
 
-fn main() -> anyhow::Result<()> {
-    let mut encoder: Option<Encoder> = None;
-    let mut output_file = File::create("output.h264")?;
+    /// Stay resident and record on commands received on a Unix socket
+    #[arg(long)]
+    daemon: bool,
+
+    /// Control socket path in daemon mode [default: $XDG_RUNTIME_DIR/gamescope-recorder.sock]
+    #[arg(long)]
+    socket: Option<PathBuf>,
+
+    /// Directory for recordings and replays started without an explicit path
+    #[arg(long, default_value = ".")]
+    output_dir: PathBuf,
+
+    /// Seconds of encoded video kept in memory for save-replay (0 disables it)
+    #[arg(long, default_value_t = 30)]
+    replay_seconds: u32,
+
+    /// Write raw NV12 frames to this file instead of encoding
+    #[arg(long, value_name = "FILE", conflicts_with_all = ["daemon", "worker"])]
+    raw_output: Option<PathBuf>,
+
+    /// Encode this raw NV12 clip to --output instead of capturing, and report timings
+    #[arg(long, value_name = "FILE", requires = "size")]
+    bench_input: Option<PathBuf>,
+
+    /// Frame size of --bench-input, --bench-kernels and --stub-backend
+    #[arg(long, value_name = "WIDTHxHEIGHT", value_parser = file_source::parse_size)]
+    size: Option<(u32, u32)>,
+
+    /// Number of frames to encode from --bench-input, looping over the clip
+    #[arg(long)]
+    frames: Option<usize>,
+
+    /// Feed --bench-input at the frame rate instead of as fast as possible
+    #[arg(long)]
+    realtime: bool,
+
+    /// Transcode --bench-input in GOP-aligned chunks on this many concurrent
+    /// encoder sessions. A list such as 1,2,4 runs one pass per count and
+    /// reports the scaling
+    #[arg(long, value_delimiter = ',', requires = "bench_input")]
+    sessions: Vec<usize>,
+
+    /// Chunk length in GOPs for --sessions
+    #[arg(long, default_value_t = 4)]
+    chunk_gops: usize,
+
+    /// Use libx264 instead of VAAPI for --sessions
+    #[arg(long, requires = "sessions")]
+    software: bool,
+
+    /// Measure the CPU pixel kernels on each instruction set this machine
+    /// supports, on rows of --size (1920x1080 by default), and exit
+    #[arg(long, conflicts_with_all = ["daemon", "worker", "serve_frames", "raw_output", "bench_input", "stub_backend"])]
+    bench_kernels: bool,
+
+    /// Capture only, handing DMABUF frames to worker processes on this socket
+    #[arg(long, value_name = "SOCKET", conflicts_with_all = ["daemon", "worker"])]
+    serve_frames: Option<PathBuf>,
+
+    /// Encode frames received from a --serve-frames process, writing to --output
+    #[arg(long, value_name = "SOCKET", conflicts_with = "daemon")]
+    worker: Option<PathBuf>,
+
+    /// Render node used by a worker, e.g. /dev/dri/renderD129
+    #[arg(long, requires = "worker")]
+    render_node: Option<PathBuf>,
+
+    /// Rate the game presents at, e.g. 90 or 120 for high refresh rate
+    /// displays. Capture and encoding run at this rate unless --decimate is
+    /// given
+    #[arg(long, default_value_t = 60, value_parser = clap::value_parser!(u32).range(1..=1000))]
+    fps: u32,
+
+    /// Encode only every Nth frame, e.g. 2 to record a 120 Hz game at 60 fps.
+    /// Cursor movement over an unchanged frame counts as a frame. --fps must
+    /// be a multiple of it
+    #[arg(long, default_value_t = 1, value_parser = clap::value_parser!(u32).range(1..))]
+    decimate: u32,
+
+    /// Target bitrate in bits/s, K and M suffixes are accepted
+    #[arg(long, default_value = "9M", value_parser = control::parse_bitrate)]
+    bitrate: i64,
+
+    /// Don't look for regions of the frame that stay the same to spend fewer
+    /// bits on them
+    #[arg(long)]
+    no_static_detection: bool,
+
+    /// Simulate failures to test recovery, e.g. encode:300 fails every 300th
+    /// frame at the encoder. Stages are capture, import and encode; append
+    /// :transient for errors that shouldn't need a rebuild.
+    #[arg(long, value_delimiter = ',')]
+    inject_faults: Vec<FaultSpec>,
+
+    /// Seconds between preview thumbnails (0 disables them). A recording gets
+    /// sprite sheets of them next to the output for its timeline, the daemon
+    /// keeps preview.jpg in --output-dir up to date
+    #[arg(long, default_value_t = 0)]
+    preview_interval: u64,
+
+    /// Width of preview thumbnails, also taken on demand with the daemon's
+    /// thumbnail command
+    #[arg(long, default_value_t = 256)]
+    preview_width: u32,
+
+    /// Record to segments next to --output that together take at most this
+    /// many bytes, deleting the oldest ones. K, M, G and T suffixes are
+    /// accepted. The bitrate is lowered if the budget or the free space
+    /// would hold less than --min-retention
+    #[arg(long, value_parser = storage::parse_bytes, conflicts_with_all = ["daemon", "worker", "serve_frames", "raw_output", "bench_input"])]
+    storage_budget: Option<u64>,
+
+    /// Directory to move on to when the directory of --output fails, fills up or
+    /// can't keep up, in order. May be given more than once
+    #[arg(long, value_name = "DIR", requires = "storage_budget")]
+    fallback_dir: Vec<PathBuf>,
+
+    /// Length of --storage-budget segments in seconds
+    #[arg(long, default_value_t = 60, value_parser = clap::value_parser!(u64).range(1..))]
+    segment_seconds: u64,
+
+    /// Seconds of video --storage-budget should hold at least
+    #[arg(long, default_value_t = 120, value_parser = clap::value_parser!(u64).range(1..))]
+    min_retention: u64,
+
+    /// Seconds without a new frame, e.g. while the game is paused, after
+    /// which the encoder and capture surfaces are released until the next
+    /// frame (0 never suspends). A raw H.264 file has no timestamps, so the
+    /// idle time is cut out of it
+    #[arg(long, default_value_t = 0)]
+    idle_after: u64,
+
+    /// Don't write the game's frame times next to a one-shot recording, in
+    /// <output>.frametimes.csv
+    #[arg(long)]
+    no_frame_times: bool,
+
+    /// Don't keep the flight recorder, which dumps the events around each
+    /// dropped or late frame of a one-shot recording to
+    /// <output>.incident-<time>.csv
+    #[arg(long)]
+    no_flight_recorder: bool,
+
+    /// Time from capture until a frame's packet comes out of the encoder,
+    /// above which the flight recorder dumps an incident. Defaults to two frame intervals
+    #[arg(long, value_name = "MS", conflicts_with = "no_flight_recorder")]
+    latency_budget_ms: Option<u64>,
+
+    /// Worker threads for auxiliary work like sink writes, preview
+    /// compression and reports, which all share them
+    #[arg(long, default_value_t = 2, value_parser = clap::value_parser!(u64).range(1..=64))]
+    aux_threads: u64,
 
-    let capturer = Capturer::new()?;
-    let running = Arc::new(AtomicBool::new(true));
+    /// Cores to pin the auxiliary workers to, e.g. 2-3,6, so they stay off
+    /// the game's
+    #[arg(long, value_name = "CPUS")]
+    aux_cpus: Option<String>,
+
+    /// Record when each buffer arrives from PipeWire, with its PTS, and
+    /// format changes to this file, for --replay-trace
+    #[arg(long, value_name = "FILE", conflicts_with_all = ["daemon", "worker", "serve_frames", "raw_output", "bench_input", "stub_backend"])]
+    record_trace: Option<PathBuf>,
+
+    /// Present synthetic frames with the timing and sizes of a trace from
+    /// --record-trace, and stop at its end. --size defaults to the trace's
+    /// first format
+    #[arg(long, value_name = "FILE", requires = "stub_backend")]
+    replay_trace: Option<PathBuf>,
+
+    /// Seconds between resource usage reports (0 reports only at exit)
+    #[arg(long, default_value_t = 10)]
+    usage_interval: u64,
+
+    /// Append the resource usage of each run to this file
+    #[arg(long, value_name = "FILE")]
+    usage_log: Option<PathBuf>,
+
+    /// Dequeue PipeWire buffers on its real-time data thread rather than the
+    /// main loop. The dequeue timing jitter is reported at exit either way
+    #[arg(long)]
+    rt_process: bool,
+
+    /// Record from a fake source through a CPU-only encoder instead of
+    /// PipeWire and VA-API, to test or benchmark the pipeline without a GPU
+    #[arg(long, conflicts_with_all = ["daemon", "worker", "serve_frames", "raw_output", "bench_input"])]
+    stub_backend: bool,
+
+    /// Time the --stub-backend encoder spends on each frame, in milliseconds
+    #[arg(long, default_value_t = 2, requires = "stub_backend")]
+    stub_encode_ms: u64,
+}
+
+impl Args {
+    /// Name of the mode selected by the arguments, as dispatched in `run`.
+    fn mode(&self) -> &'static str {
+        if self.bench_kernels {
+            "kernels"
+        } else if self.bench_input.is_some() && !self.sessions.is_empty() {
+            "transcode"
+        } else if self.bench_input.is_some() {
+            "bench"
+        } else if self.raw_output.is_some() {
+            "raw"
+        } else if self.serve_frames.is_some() {
+            "serve-frames"
+        } else if self.worker.is_some() {
+            "worker"
+        } else if self.daemon {
+            "daemon"
+        } else if self.stub_backend {
+            "stub"
+        } else {
+            "record"
+        }
+    }
+}
+
+fn main() -> anyhow::Result<()> {
+    let args = Args::parse();
+    if args.fps % args.decimate != 0 {
+        anyhow::bail!(
+            "--fps {} is not a multiple of --decimate {}",
+            args.fps,
+            args.decimate
+        );
+    }
+    // Timestamps count encoded frames, so the encoder runs at the decimated
+    // rate and the stream plays back at the right speed.
+    let settings = EncoderSettings {
+        framerate: (args.fps / args.decimate) as i32,
+        bitrate: args.bitrate,
+        static_detection: !args.no_static_detection,
+    };
+    let running = record::Running::new(Arc::new(AtomicBool::new(true)));
 
     ctrlc::set_handler({
         let running = running.clone();
         move || {
             println!("Received Ctrl+C!");
-            running.store(false, Ordering::SeqCst);
+            running.stop();
         }
     })
     .expect("Error setting Ctrl+C handler");
-
-    let mut frame_count = 0;
-    let frame_duration = Duration::from_secs_f64(1.0 / FPS as f64);
-    let start = Instant::now();
-    let mut next_frame_time = start + frame_duration;
-    while running.load(Ordering::SeqCst) {
-        // Get last frame from the capturer
-        if let Some(frame) = capturer.read_frame() {
-            if encoder.is_none() {
-                encoder = Some(Encoder::new(FPS, &frame).expect("Failed to create encoder"));
+    recovery::inject_faults(args.inject_faults.clone());
+    executor::configure(executor::ExecutorOptions {
+        threads: args.aux_threads as usize,
+        cpus: match &args.aux_cpus {
+            Some(cpus) => {
+                anyhow::Context::context(executor::parse_cpus(cpus), "Invalid --aux-cpus")?
             }
-            // Encode the frame
-            let encoder = encoder.as_mut().unwrap();
-            encoder.encode(frame)?;
-        } else {
-            eprintln!("No frame captured");
-        }
+            None => Vec::new(),
+        },
+    })?;
 
-        // Write the encoded frame to the output file
-        if let Some(encoder) = &mut encoder {
-            let num_frames = encoder.poll_write(&mut output_file)?;
-            frame_count += num_frames;
-            if frame_count % 60 == 0 {
-                print!(".");
-                std::io::stdout().flush().expect("Failed to flush stdout");
-            }
-        }
+    let usage = UsageMonitor::start(args.mode(), Duration::from_secs(args.usage_interval))?;
+    let usage_log = args.usage_log.clone();
+    let result = run(args, settings, running);
+    usage.finish(usage_log.as_deref())?;
+    if let Some(summary) = executor::summary() {
+        println!("{summary}");
+    }
+    result
+}
 
-        // Wait 1/60s-processing_time before capturing the next frame
-        let now = Instant::now();
-        if next_frame_time >= now {
-            thread::sleep(next_frame_time - now);
-            next_frame_time += frame_duration;
-        } else {
-            // If we are behind schedule, skip to the next frame time
-            next_frame_time = now + frame_duration;
-        }
+fn run(args: Args, settings: EncoderSettings, running: record::Running) -> anyhow::Result<()> {
+    let capture = CaptureOptions {
+        rt_process: args.rt_process,
+        framerate: args.fps,
+    };
+    if args.bench_kernels {
+        let (width, height) = args.size.unwrap_or((1920, 1080));
+        nv12::bench(width as usize, height as usize);
+        return Ok(());
     }
-    // Drain the encoder and write any remaining frames to the output file
-    println!("\nDraining encoder...");
-    if let Some(mut encoder) = encoder {
-        encoder.drain_write(&mut output_file)?;
+    if let Some(input) = args
+        .bench_input
+        .clone()
+        .filter(|_| !args.sessions.is_empty())
+    {
+        let options = offline::TranscodeOptions {
+            input,
+            size: args.size.unwrap(),
+            output: args.output,
+            sessions: args.sessions,
+            chunk_gops: args.chunk_gops,
+            software: args.software,
+            settings,
+        };
+        return offline::transcode(options, running.flag());
+    }
+    if let Some(input) = args.bench_input {
+        let options = offline::BenchOptions {
+            input,
+            size: args.size.unwrap(),
+            output: args.output,
+            frames: args.frames,
+            realtime: args.realtime,
+            settings,
+        };
+        return offline::encode_file(options, running.flag());
+    }
+    if let Some(path) = &args.raw_output {
+        return raw_dump::run(path, settings.framerate, capture, running.flag());
+    }
+    if let Some(socket) = &args.serve_frames {
+        return frame_server::run(socket, settings.framerate, capture, running.flag());
+    }
+    if let Some(socket) = &args.worker {
+        return worker::run(
+            socket,
+            &args.output,
+            args.render_node.as_deref(),
+            settings,
+            running.flag(),
+        );
     }
 
-    Ok(())
+    if args.daemon {
+        let socket = args.socket.unwrap_or_else(|| {
+            let runtime_dir = std::env::var_os("XDG_RUNTIME_DIR").unwrap_or_else(|| "/tmp".into());
+            PathBuf::from(runtime_dir).join("gamescope-recorder.sock")
+        });
+        let preview = preview::PreviewOptions {
+            width: args.preview_width,
+            interval: Duration::from_secs(args.preview_interval),
+            live: Some(args.output_dir.join("preview.jpg")),
+            sprites: None,
+        };
+        let options = daemon::DaemonOptions {
+            socket,
+            output_dir: args.output_dir,
+            replay_seconds: args.replay_seconds,
+            settings,
+            capture,
+            preview,
+        };
+        return daemon::run(options, running.flag());
+    }
+
+    let preview = (args.preview_interval > 0).then(|| preview::PreviewOptions {
+        width: args.preview_width,
+        interval: Duration::from_secs(args.preview_interval),
+        live: None,
+        sprites: Some(args.output.with_extension("")),
+    });
+    let storage = args.storage_budget.map(|budget| {
+        let dir = match args.output.parent() {
+            Some(parent) if !parent.as_os_str().is_empty() => parent.to_path_buf(),
+            _ => PathBuf::from("."),
+        };
+        storage::StorageOptions {
+            dirs: [dir].into_iter().chain(args.fallback_dir).collect(),
+            name: args
+                .output
+                .file_stem()
+                .unwrap_or_default()
+                .to_string_lossy()
+                .into(),
+            budget,
+            segment_frames: args.segment_seconds as i64 * settings.framerate as i64,
+            bitrate: settings.bitrate,
+            min_retention: Duration::from_secs(args.min_retention),
+        }
+    });
+    let frame_times = (!args.no_frame_times).then(|| args.output.with_extension("frametimes.csv"));
+    let flight = (!args.no_flight_recorder).then(|| flight::FlightOptions {
+        prefix: args.output.with_extension(""),
+        latency_budget: args.latency_budget_ms.map_or(
+            Duration::from_secs(2) / settings.framerate as u32,
+            Duration::from_millis,
+        ),
+    });
+    let options = record::RecordOptions {
+        output: args.output,
+        frame_times,
+        trace: args.record_trace,
+        settings,
+        decimate: args.decimate,
+        capture,
+        preview,
+        storage,
+        idle_after: (args.idle_after > 0).then(|| Duration::from_secs(args.idle_after)),
+        flight,
+    };
+    if args.stub_backend {
+        let trace = args
+            .replay_trace
+            .as_deref()
+            .map(trace::read_trace)
+            .transpose()?;
+        let first_format = trace.iter().flatten().find_map(|event| match *event {
+            trace::TraceEvent::Format { width, height, .. } => Some((width, height)),
+            _ => None,
+        });
+        let (width, height) = args.size.or(first_format).unwrap_or((1280, 720));
+        let mut stub = stub::StubConfig::new(width, height, settings);
+        stub.trace = trace.map(Into::into);
+        stub.source_fps = args.fps;
+        stub.pool_size = rate::pool_size(args.fps);
+        stub.encode_latency = Duration::from_millis(args.stub_encode_ms);
+        stub.faults = Arc::new(recovery::FaultInjector::new(args.inject_faults));
+        return record::run_stub(options, stub, running);
+    }
+    record::run(options, running)
 }
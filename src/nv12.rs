@@ -0,0 +1,928 @@
+//! NV12 kernels for the paths that touch pixels on the CPU: box and bilinear
+//! downscaling, NV12 to and from I420, BGRX to NV12, luma extraction and
+//! comparison.
+//!
+//! Frame functions walk the rows and call row kernels, which come in a
+//! scalar version and SSE4.1 and AVX2 versions on x86_64. The best set the
+//! CPU supports is picked once at runtime. The SIMD kernels compute exactly
+//! what the scalar ones do, rounding included, which the tests check on
+//! random rows, so output never depends on the machine.
+//!
+//! Colour conversion is BT.709 limited range, like the encoder's VPP
+//! conversion, with 7-bit coefficients.
+
+use std::{
+    fmt,
+    sync::OnceLock,
+    time::{Duration, Instant},
+};
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Isa {
+    Scalar,
+    Sse41,
+    Avx2,
+}
+
+impl fmt::Display for Isa {
+    fn fmt(&self, f: &mut fmt::Formatter) -> fmt::Result {
+        f.write_str(match self {
+            Isa::Scalar => "scalar",
+            Isa::Sse41 => "sse4.1",
+            Isa::Avx2 => "avx2",
+        })
+    }
+}
+
+impl Isa {
+    /// The instruction sets this CPU can run, best last.
+    pub fn available() -> Vec<Isa> {
+        let mut isas = vec![Isa::Scalar];
+        #[cfg(target_arch = "x86_64")]
+        {
+            if is_x86_feature_detected!("sse4.1") {
+                isas.push(Isa::Sse41);
+            }
+            if is_x86_feature_detected!("avx2") {
+                isas.push(Isa::Avx2);
+            }
+        }
+        isas
+    }
+}
+
+/// Row kernels of one instruction set.
+#[derive(Clone, Copy)]
+struct Kernels {
+    isa: Isa,
+    /// Splits `uv` into `u` and `v`, as many pairs as `u` is long.
+    deinterleave: fn(uv: &[u8], u: &mut [u8], v: &mut [u8]),
+    /// Interleaves `u` and `v` into `uv`.
+    interleave: fn(u: &[u8], v: &[u8], uv: &mut [u8]),
+    /// Averages 2x2 blocks of luma rows `a` and `b` into `out`.
+    box_luma: fn(a: &[u8], b: &[u8], out: &mut [u8]),
+    /// Averages 2x2 blocks of interleaved chroma, per channel.
+    box_chroma: fn(a: &[u8], b: &[u8], out: &mut [u8]),
+    /// Blends row `a` towards `b` by `weight`/256.
+    lerp: fn(a: &[u8], b: &[u8], weight: u16, out: &mut [u8]),
+    /// Luma of a row of BGRX pixels.
+    bgrx_luma: fn(bgrx: &[u8], out: &mut [u8]),
+    /// Sum of absolute differences of two rows of the same length.
+    sad: fn(a: &[u8], b: &[u8]) -> u32,
+}
+
+fn avg(a: u8, b: u8) -> u8 {
+    ((a as u16 + b as u16 + 1) >> 1) as u8
+}
+
+/// BT.709 limited range, scaled by 128: (B, G, R) for Y, Cb and Cr.
+const Y_COEFFS: [i32; 3] = [8, 79, 23];
+const CB_COEFFS: [i32; 3] = [56, -43, -13];
+const CR_COEFFS: [i32; 3] = [-5, -51, 56];
+
+mod scalar {
+    use super::*;
+
+    pub fn deinterleave(uv: &[u8], u: &mut [u8], v: &mut [u8]) {
+        for ((pair, u), v) in uv.chunks_exact(2).zip(u.iter_mut()).zip(v.iter_mut()) {
+            *u = pair[0];
+            *v = pair[1];
+        }
+    }
+
+    pub fn interleave(u: &[u8], v: &[u8], uv: &mut [u8]) {
+        for ((pair, &u), &v) in uv.chunks_exact_mut(2).zip(u).zip(v) {
+            pair[0] = u;
+            pair[1] = v;
+        }
+    }
+
+    pub fn box_luma(a: &[u8], b: &[u8], out: &mut [u8]) {
+        for (i, out) in out.iter_mut().enumerate() {
+            *out = avg(avg(a[2 * i], b[2 * i]), avg(a[2 * i + 1], b[2 * i + 1]));
+        }
+    }
+
+    pub fn box_chroma(a: &[u8], b: &[u8], out: &mut [u8]) {
+        for (i, out) in out.iter_mut().enumerate() {
+            let (pair, channel) = (i / 2, i % 2);
+            let (left, right) = (4 * pair + channel, 4 * pair + 2 + channel);
+            *out = avg(avg(a[left], b[left]), avg(a[right], b[right]));
+        }
+    }
+
+    pub fn lerp(a: &[u8], b: &[u8], weight: u16, out: &mut [u8]) {
+        for ((out, &a), &b) in out.iter_mut().zip(a).zip(b) {
+            *out = ((a as u16 * (256 - weight) + b as u16 * weight + 128) >> 8) as u8;
+        }
+    }
+
+    pub fn bgrx_luma(bgrx: &[u8], out: &mut [u8]) {
+        for (pixel, out) in bgrx.chunks_exact(4).zip(out.iter_mut()) {
+            let [cb, cg, cr] = Y_COEFFS;
+            let sum = pixel[0] as i32 * cb + pixel[1] as i32 * cg + pixel[2] as i32 * cr;
+            *out = (((sum + 64) >> 7) + 16) as u8;
+        }
+    }
+
+    pub fn sad(a: &[u8], b: &[u8]) -> u32 {
+        a.iter().zip(b).map(|(&x, &y)| x.abs_diff(y) as u32).sum()
+    }
+}
+
+/// The same kernels with 128-bit and 256-bit vectors. Each handles as many
+/// whole vectors as fit and leaves the tail to the scalar kernel.
+#[cfg(target_arch = "x86_64")]
+mod x86 {
+    use std::arch::x86_64::*;
+
+    use super::{scalar, Y_COEFFS};
+
+    macro_rules! load {
+        ($slice:expr, $offset:expr) => {
+            _mm_loadu_si128($slice[$offset..$offset + 16].as_ptr() as *const __m128i)
+        };
+    }
+    macro_rules! store {
+        ($slice:expr, $offset:expr, $value:expr) => {
+            _mm_storeu_si128(
+                $slice[$offset..$offset + 16].as_mut_ptr() as *mut __m128i,
+                $value,
+            )
+        };
+    }
+    macro_rules! load256 {
+        ($slice:expr, $offset:expr) => {
+            _mm256_loadu_si256($slice[$offset..$offset + 32].as_ptr() as *const __m256i)
+        };
+    }
+    macro_rules! store256 {
+        ($slice:expr, $offset:expr, $value:expr) => {
+            _mm256_storeu_si256(
+                $slice[$offset..$offset + 32].as_mut_ptr() as *mut __m256i,
+                $value,
+            )
+        };
+    }
+
+    /// Undoes the per-lane interleaving of a 256-bit pack.
+    const PACKED_ORDER: i32 = 0b11_01_10_00;
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn deinterleave_sse41(uv: &[u8], u: &mut [u8], v: &mut [u8]) {
+        let n = u.len() / 16 * 16;
+        let low = _mm_set1_epi16(0x00ff);
+        for i in (0..n).step_by(16) {
+            let (a, b) = (load!(uv, 2 * i), load!(uv, 2 * i + 16));
+            let even = _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low));
+            let odd = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+            store!(u, i, even);
+            store!(v, i, odd);
+        }
+        scalar::deinterleave(&uv[2 * n..], &mut u[n..], &mut v[n..]);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn deinterleave_avx2(uv: &[u8], u: &mut [u8], v: &mut [u8]) {
+        let n = u.len() / 32 * 32;
+        let low = _mm256_set1_epi16(0x00ff);
+        for i in (0..n).step_by(32) {
+            let (a, b) = (load256!(uv, 2 * i), load256!(uv, 2 * i + 32));
+            let even = _mm256_packus_epi16(_mm256_and_si256(a, low), _mm256_and_si256(b, low));
+            let odd = _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+            store256!(u, i, _mm256_permute4x64_epi64(even, PACKED_ORDER));
+            store256!(v, i, _mm256_permute4x64_epi64(odd, PACKED_ORDER));
+        }
+        scalar::deinterleave(&uv[2 * n..], &mut u[n..], &mut v[n..]);
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn interleave_sse41(u: &[u8], v: &[u8], uv: &mut [u8]) {
+        let n = u.len() / 16 * 16;
+        for i in (0..n).step_by(16) {
+            let (a, b) = (load!(u, i), load!(v, i));
+            store!(uv, 2 * i, _mm_unpacklo_epi8(a, b));
+            store!(uv, 2 * i + 16, _mm_unpackhi_epi8(a, b));
+        }
+        scalar::interleave(&u[n..], &v[n..], &mut uv[2 * n..]);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn interleave_avx2(u: &[u8], v: &[u8], uv: &mut [u8]) {
+        let n = u.len() / 32 * 32;
+        for i in (0..n).step_by(32) {
+            let (a, b) = (load256!(u, i), load256!(v, i));
+            let (low, high) = (_mm256_unpacklo_epi8(a, b), _mm256_unpackhi_epi8(a, b));
+            store256!(uv, 2 * i, _mm256_permute2x128_si256(low, high, 0x20));
+            store256!(uv, 2 * i + 32, _mm256_permute2x128_si256(low, high, 0x31));
+        }
+        scalar::interleave(&u[n..], &v[n..], &mut uv[2 * n..]);
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn box_luma_sse41(a: &[u8], b: &[u8], out: &mut [u8]) {
+        let n = out.len() / 16 * 16;
+        let (low, one) = (_mm_set1_epi16(0x00ff), _mm_set1_epi16(1));
+        let pairs = |v: __m128i| {
+            let sum = _mm_add_epi16(_mm_and_si128(v, low), _mm_srli_epi16(v, 8));
+            _mm_srli_epi16(_mm_add_epi16(sum, one), 1)
+        };
+        for i in (0..n).step_by(16) {
+            let first = _mm_avg_epu8(load!(a, 2 * i), load!(b, 2 * i));
+            let second = _mm_avg_epu8(load!(a, 2 * i + 16), load!(b, 2 * i + 16));
+            store!(out, i, _mm_packus_epi16(pairs(first), pairs(second)));
+        }
+        scalar::box_luma(&a[2 * n..], &b[2 * n..], &mut out[n..]);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn box_luma_avx2(a: &[u8], b: &[u8], out: &mut [u8]) {
+        let n = out.len() / 32 * 32;
+        let (low, one) = (_mm256_set1_epi16(0x00ff), _mm256_set1_epi16(1));
+        let pairs = |v: __m256i| {
+            let sum = _mm256_add_epi16(_mm256_and_si256(v, low), _mm256_srli_epi16(v, 8));
+            _mm256_srli_epi16(_mm256_add_epi16(sum, one), 1)
+        };
+        for i in (0..n).step_by(32) {
+            let first = _mm256_avg_epu8(load256!(a, 2 * i), load256!(b, 2 * i));
+            let second = _mm256_avg_epu8(load256!(a, 2 * i + 32), load256!(b, 2 * i + 32));
+            let packed = _mm256_packus_epi16(pairs(first), pairs(second));
+            store256!(out, i, _mm256_permute4x64_epi64(packed, PACKED_ORDER));
+        }
+        scalar::box_luma(&a[2 * n..], &b[2 * n..], &mut out[n..]);
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn box_chroma_sse41(a: &[u8], b: &[u8], out: &mut [u8]) {
+        let n = out.len() / 16 * 16;
+        let low = _mm_set1_epi32(0xffff);
+        // Each 32-bit lane holds two UV pairs; average them per channel.
+        let pairs = |v: __m128i| _mm_avg_epu8(_mm_and_si128(v, low), _mm_srli_epi32(v, 16));
+        for i in (0..n).step_by(16) {
+            let first = _mm_avg_epu8(load!(a, 2 * i), load!(b, 2 * i));
+            let second = _mm_avg_epu8(load!(a, 2 * i + 16), load!(b, 2 * i + 16));
+            store!(out, i, _mm_packus_epi32(pairs(first), pairs(second)));
+        }
+        scalar::box_chroma(&a[2 * n..], &b[2 * n..], &mut out[n..]);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn box_chroma_avx2(a: &[u8], b: &[u8], out: &mut [u8]) {
+        let n = out.len() / 32 * 32;
+        let low = _mm256_set1_epi32(0xffff);
+        let pairs =
+            |v: __m256i| _mm256_avg_epu8(_mm256_and_si256(v, low), _mm256_srli_epi32(v, 16));
+        for i in (0..n).step_by(32) {
+            let first = _mm256_avg_epu8(load256!(a, 2 * i), load256!(b, 2 * i));
+            let second = _mm256_avg_epu8(load256!(a, 2 * i + 32), load256!(b, 2 * i + 32));
+            let packed = _mm256_packus_epi32(pairs(first), pairs(second));
+            store256!(out, i, _mm256_permute4x64_epi64(packed, PACKED_ORDER));
+        }
+        scalar::box_chroma(&a[2 * n..], &b[2 * n..], &mut out[n..]);
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn lerp_sse41(a: &[u8], b: &[u8], weight: u16, out: &mut [u8]) {
+        let n = out.len() / 16 * 16;
+        let zero = _mm_setzero_si128();
+        let (wa, wb) = (
+            _mm_set1_epi16((256 - weight) as i16),
+            _mm_set1_epi16(weight as i16),
+        );
+        let round = _mm_set1_epi16(128);
+        let blend = |a: __m128i, b: __m128i| {
+            let sum = _mm_add_epi16(_mm_mullo_epi16(a, wa), _mm_mullo_epi16(b, wb));
+            _mm_srli_epi16(_mm_add_epi16(sum, round), 8)
+        };
+        for i in (0..n).step_by(16) {
+            let (x, y) = (load!(a, i), load!(b, i));
+            let low = blend(_mm_unpacklo_epi8(x, zero), _mm_unpacklo_epi8(y, zero));
+            let high = blend(_mm_unpackhi_epi8(x, zero), _mm_unpackhi_epi8(y, zero));
+            store!(out, i, _mm_packus_epi16(low, high));
+        }
+        scalar::lerp(&a[n..], &b[n..], weight, &mut out[n..]);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn lerp_avx2(a: &[u8], b: &[u8], weight: u16, out: &mut [u8]) {
+        let n = out.len() / 32 * 32;
+        let zero = _mm256_setzero_si256();
+        let (wa, wb) = (
+            _mm256_set1_epi16((256 - weight) as i16),
+            _mm256_set1_epi16(weight as i16),
+        );
+        let round = _mm256_set1_epi16(128);
+        let blend = |a: __m256i, b: __m256i| {
+            let sum = _mm256_add_epi16(_mm256_mullo_epi16(a, wa), _mm256_mullo_epi16(b, wb));
+            _mm256_srli_epi16(_mm256_add_epi16(sum, round), 8)
+        };
+        for i in (0..n).step_by(32) {
+            let (x, y) = (load256!(a, i), load256!(b, i));
+            // Unpacking and packing both work per 128-bit lane, so the
+            // order comes out right.
+            let low = blend(_mm256_unpacklo_epi8(x, zero), _mm256_unpacklo_epi8(y, zero));
+            let high = blend(_mm256_unpackhi_epi8(x, zero), _mm256_unpackhi_epi8(y, zero));
+            store256!(out, i, _mm256_packus_epi16(low, high));
+        }
+        scalar::lerp(&a[n..], &b[n..], weight, &mut out[n..]);
+    }
+
+    fn luma_coeffs() -> [i8; 4] {
+        let [b, g, r] = Y_COEFFS;
+        [b as i8, g as i8, r as i8, 0]
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn bgrx_luma_sse41(bgrx: &[u8], out: &mut [u8]) {
+        let n = out.len() / 16 * 16;
+        let coeffs = _mm_set1_epi32(i32::from_le_bytes(luma_coeffs().map(|c| c as u8)));
+        let (ones, round, offset) = (_mm_set1_epi16(1), _mm_set1_epi32(64), _mm_set1_epi16(16));
+        // Four pixels per vector: B*cb + G*cg and R*cr, summed to 32 bits.
+        let luma = |v: __m128i| {
+            let sum = _mm_madd_epi16(_mm_maddubs_epi16(v, coeffs), ones);
+            _mm_srli_epi32(_mm_add_epi32(sum, round), 7)
+        };
+        for i in (0..n).step_by(16) {
+            let p = 4 * i;
+            let first = _mm_packs_epi32(luma(load!(bgrx, p)), luma(load!(bgrx, p + 16)));
+            let second = _mm_packs_epi32(luma(load!(bgrx, p + 32)), luma(load!(bgrx, p + 48)));
+            let packed =
+                _mm_packus_epi16(_mm_add_epi16(first, offset), _mm_add_epi16(second, offset));
+            store!(out, i, packed);
+        }
+        scalar::bgrx_luma(&bgrx[4 * n..], &mut out[n..]);
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn bgrx_luma_avx2(bgrx: &[u8], out: &mut [u8]) {
+        let n = out.len() / 32 * 32;
+        let coeffs = _mm256_set1_epi32(i32::from_le_bytes(luma_coeffs().map(|c| c as u8)));
+        let (ones, round, offset) = (
+            _mm256_set1_epi16(1),
+            _mm256_set1_epi32(64),
+            _mm256_set1_epi16(16),
+        );
+        let order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+        let luma = |v: __m256i| {
+            let sum = _mm256_madd_epi16(_mm256_maddubs_epi16(v, coeffs), ones);
+            _mm256_srli_epi32(_mm256_add_epi32(sum, round), 7)
+        };
+        for i in (0..n).step_by(32) {
+            let p = 4 * i;
+            let first = _mm256_packs_epi32(luma(load256!(bgrx, p)), luma(load256!(bgrx, p + 32)));
+            let second =
+                _mm256_packs_epi32(luma(load256!(bgrx, p + 64)), luma(load256!(bgrx, p + 96)));
+            let packed = _mm256_packus_epi16(
+                _mm256_add_epi16(first, offset),
+                _mm256_add_epi16(second, offset),
+            );
+            store256!(out, i, _mm256_permutevar8x32_epi32(packed, order));
+        }
+        scalar::bgrx_luma(&bgrx[4 * n..], &mut out[n..]);
+    }
+
+    #[target_feature(enable = "sse4.1")]
+    pub unsafe fn sad_sse41(a: &[u8], b: &[u8]) -> u32 {
+        let n = a.len().min(b.len()) / 16 * 16;
+        let mut acc = _mm_setzero_si128();
+        for i in (0..n).step_by(16) {
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(load!(a, i), load!(b, i)));
+        }
+        let sum = _mm_cvtsi128_si64(acc) + _mm_extract_epi64(acc, 1);
+        sum as u32 + scalar::sad(&a[n..], &b[n..])
+    }
+
+    #[target_feature(enable = "avx2")]
+    pub unsafe fn sad_avx2(a: &[u8], b: &[u8]) -> u32 {
+        let n = a.len().min(b.len()) / 32 * 32;
+        let mut acc = _mm256_setzero_si256();
+        for i in (0..n).step_by(32) {
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(load256!(a, i), load256!(b, i)));
+        }
+        let lanes = _mm_add_epi64(
+            _mm256_castsi256_si128(acc),
+            _mm256_extracti128_si256(acc, 1),
+        );
+        let sum = _mm_cvtsi128_si64(lanes) + _mm_extract_epi64(lanes, 1);
+        sum as u32 + scalar::sad(&a[n..], &b[n..])
+    }
+}
+
+const SCALAR: Kernels = Kernels {
+    isa: Isa::Scalar,
+    deinterleave: scalar::deinterleave,
+    interleave: scalar::interleave,
+    box_luma: scalar::box_luma,
+    box_chroma: scalar::box_chroma,
+    lerp: scalar::lerp,
+    bgrx_luma: scalar::bgrx_luma,
+    sad: scalar::sad,
+};
+
+/// Wraps SIMD kernels in safe functions. Only reachable through
+/// [`kernels_for`], which checks the CPU supports them.
+#[cfg(target_arch = "x86_64")]
+macro_rules! simd_kernels {
+    ($isa:expr, $deinterleave:ident, $interleave:ident, $box_luma:ident, $box_chroma:ident, $lerp:ident, $bgrx_luma:ident, $sad:ident) => {
+        Kernels {
+            isa: $isa,
+            // SAFETY: kernels_for only returns these when the CPU has the
+            // instruction set.
+            deinterleave: |uv, u, v| unsafe { x86::$deinterleave(uv, u, v) },
+            interleave: |u, v, uv| unsafe { x86::$interleave(u, v, uv) },
+            box_luma: |a, b, out| unsafe { x86::$box_luma(a, b, out) },
+            box_chroma: |a, b, out| unsafe { x86::$box_chroma(a, b, out) },
+            lerp: |a, b, weight, out| unsafe { x86::$lerp(a, b, weight, out) },
+            bgrx_luma: |bgrx, out| unsafe { x86::$bgrx_luma(bgrx, out) },
+            sad: |a, b| unsafe { x86::$sad(a, b) },
+        }
+    };
+}
+
+/// The kernels of `isa`, or `None` if this CPU can't run them.
+fn kernels_for(isa: Isa) -> Option<Kernels> {
+    if !Isa::available().contains(&isa) {
+        return None;
+    }
+    match isa {
+        Isa::Scalar => Some(SCALAR),
+        #[cfg(target_arch = "x86_64")]
+        Isa::Sse41 => Some(simd_kernels!(
+            Isa::Sse41,
+            deinterleave_sse41,
+            interleave_sse41,
+            box_luma_sse41,
+            box_chroma_sse41,
+            lerp_sse41,
+            bgrx_luma_sse41,
+            sad_sse41
+        )),
+        #[cfg(target_arch = "x86_64")]
+        Isa::Avx2 => Some(simd_kernels!(
+            Isa::Avx2,
+            deinterleave_avx2,
+            interleave_avx2,
+            box_luma_avx2,
+            box_chroma_avx2,
+            lerp_avx2,
+            bgrx_luma_avx2,
+            sad_avx2
+        )),
+        #[allow(unreachable_patterns)]
+        _ => None,
+    }
+}
+
+fn kernels() -> &'static Kernels {
+    static KERNELS: OnceLock<Kernels> = OnceLock::new();
+    KERNELS.get_or_init(|| {
+        let best = *Isa::available().last().unwrap();
+        kernels_for(best).unwrap()
+    })
+}
+
+/// The instruction set the frame functions use on this CPU.
+pub fn isa() -> Isa {
+    kernels().isa
+}
+
+/// Destination plane of `width` bytes per row, `stride` bytes apart.
+pub struct PlaneMut<'a> {
+    pub data: &'a mut [u8],
+    pub stride: usize,
+}
+
+impl PlaneMut<'_> {
+    fn row(&mut self, index: usize, width: usize) -> &mut [u8] {
+        &mut self.data[index * self.stride..][..width]
+    }
+}
+
+/// Splits the tightly packed NV12 frame `src` into I420 planes.
+pub fn nv12_to_i420(
+    src: &[u8],
+    width: usize,
+    height: usize,
+    mut y: PlaneMut,
+    mut u: PlaneMut,
+    mut v: PlaneMut,
+) {
+    let (luma, chroma) = src.split_at(width * height);
+    for (row, src) in luma.chunks_exact(width).take(height).enumerate() {
+        y.row(row, width).copy_from_slice(src);
+    }
+    let deinterleave = kernels().deinterleave;
+    for (row, src) in chroma.chunks_exact(width).take(height / 2).enumerate() {
+        deinterleave(src, u.row(row, width / 2), v.row(row, width / 2));
+    }
+}
+
+/// Joins tightly packed I420 planes into a tightly packed NV12 frame.
+pub fn i420_to_nv12(y: &[u8], u: &[u8], v: &[u8], width: usize, height: usize, dst: &mut [u8]) {
+    let (luma, chroma) = dst.split_at_mut(width * height);
+    luma.copy_from_slice(&y[..width * height]);
+    let interleave = kernels().interleave;
+    let half = width / 2;
+    for (row, dst) in chroma.chunks_exact_mut(width).take(height / 2).enumerate() {
+        interleave(&u[row * half..][..half], &v[row * half..][..half], dst);
+    }
+}
+
+/// Copies the luma plane of a frame whose rows are `stride` bytes apart,
+/// e.g. a mapped surface, into a tightly packed buffer for analysis.
+pub fn extract_luma(src: &[u8], stride: usize, width: usize, height: usize, dst: &mut [u8]) {
+    for (row, dst) in dst.chunks_exact_mut(width).take(height).enumerate() {
+        dst.copy_from_slice(&src[row * stride..][..width]);
+    }
+}
+
+/// Sum of absolute differences of two rows of the same length, e.g. of luma
+/// planes compared for changes.
+pub fn row_sad(a: &[u8], b: &[u8]) -> u32 {
+    (kernels().sad)(a, b)
+}
+
+/// Halves a tightly packed NV12 frame in both directions by averaging 2x2
+/// blocks. Both dimensions must be multiples of four.
+pub fn downscale_box(src: &[u8], width: usize, height: usize, dst: &mut [u8]) {
+    let kernels = kernels();
+    let (src_luma, src_chroma) = src.split_at(width * height);
+    let (dst_luma, dst_chroma) = dst.split_at_mut(width * height / 4);
+    for (rows, dst) in src_luma
+        .chunks_exact(2 * width)
+        .zip(dst_luma.chunks_exact_mut(width / 2))
+    {
+        let (a, b) = rows.split_at(width);
+        (kernels.box_luma)(a, b, dst);
+    }
+    for (rows, dst) in src_chroma
+        .chunks_exact(2 * width)
+        .zip(dst_chroma.chunks_exact_mut(width / 2))
+    {
+        let (a, b) = rows.split_at(width);
+        (kernels.box_chroma)(a, b, dst);
+    }
+}
+
+/// Source rows or columns and 8-bit weights for bilinear scaling from `src`
+/// to `dst` samples, with sample centres aligned like VPP does.
+fn taps(src: usize, dst: usize) -> Vec<(usize, usize, u16)> {
+    (0..dst)
+        .map(|i| {
+            // Position of the centre of sample i, in 1/256ths of a source
+            // sample.
+            let pos = (((2 * i + 1) * src * 128 / dst) as i64 - 128).max(0) as usize;
+            let first = (pos >> 8).min(src - 1);
+            (first, (first + 1).min(src - 1), (pos & 0xff) as u16)
+        })
+        .collect()
+}
+
+/// Scales one plane of `channels` interleaved channels.
+fn scale_plane(
+    src: &[u8],
+    (width, height): (usize, usize),
+    dst: &mut [u8],
+    (dst_width, dst_height): (usize, usize),
+    channels: usize,
+) {
+    let lerp = kernels().lerp;
+    let stride = width * channels;
+    let columns = taps(width, dst_width);
+    let mut blended = vec![0; stride];
+    for ((top, bottom, weight), dst) in taps(height, dst_height)
+        .into_iter()
+        .zip(dst.chunks_exact_mut(dst_width * channels))
+    {
+        // Vertically with the SIMD kernel, then horizontally per sample.
+        lerp(
+            &src[top * stride..][..stride],
+            &src[bottom * stride..][..stride],
+            weight,
+            &mut blended,
+        );
+        for (x, &(left, right, weight)) in columns.iter().enumerate() {
+            for c in 0..channels {
+                let (a, b) = (
+                    blended[left * channels + c] as u16,
+                    blended[right * channels + c] as u16,
+                );
+                dst[x * channels + c] = ((a * (256 - weight) + b * weight + 128) >> 8) as u8;
+            }
+        }
+    }
+}
+
+/// Scales a tightly packed NV12 frame with a bilinear filter, or a box
+/// filter when halving it exactly.
+pub fn scale(src: &[u8], size: (usize, usize), dst: &mut [u8], dst_size: (usize, usize)) {
+    let ((width, height), (dst_width, dst_height)) = (size, dst_size);
+    if (dst_width * 2, dst_height * 2) == size && width % 4 == 0 && height % 4 == 0 {
+        return downscale_box(src, width, height, dst);
+    }
+    let (src_luma, src_chroma) = src.split_at(width * height);
+    let (dst_luma, dst_chroma) = dst.split_at_mut(dst_width * dst_height);
+    scale_plane(src_luma, size, dst_luma, dst_size, 1);
+    scale_plane(
+        src_chroma,
+        (width / 2, height / 2),
+        dst_chroma,
+        (dst_width / 2, dst_height / 2),
+        2,
+    );
+}
+
+/// Converts BGRX pixels, rows `stride` bytes apart, to a tightly packed
+/// NV12 frame with even dimensions. Chroma is taken from the average of
+/// each 2x2 block.
+pub fn bgrx_to_nv12(src: &[u8], stride: usize, width: usize, height: usize, dst: &mut [u8]) {
+    let bgrx_luma = kernels().bgrx_luma;
+    let (luma, chroma) = dst.split_at_mut(width * height);
+    for (row, dst) in luma.chunks_exact_mut(width).enumerate() {
+        bgrx_luma(&src[row * stride..][..4 * width], dst);
+    }
+    for (row, dst) in chroma.chunks_exact_mut(width).enumerate() {
+        let (top, bottom) = (
+            &src[2 * row * stride..][..4 * width],
+            &src[(2 * row + 1) * stride..][..4 * width],
+        );
+        for (x, pair) in dst.chunks_exact_mut(2).enumerate() {
+            let channel = |c: usize| {
+                let i = 8 * x + c;
+                (top[i] as i32 + top[i + 4] as i32 + bottom[i] as i32 + bottom[i + 4] as i32 + 2)
+                    >> 2
+            };
+            let bgr = [channel(0), channel(1), channel(2)];
+            let dot =
+                |coeffs: [i32; 3]| -> i32 { bgr.iter().zip(coeffs).map(|(v, c)| v * c).sum() };
+            pair[0] = (128 + ((dot(CB_COEFFS) + 64) >> 7)).clamp(16, 240) as u8;
+            pair[1] = (128 + ((dot(CR_COEFFS) + 64) >> 7)).clamp(16, 240) as u8;
+        }
+    }
+}
+
+/// Runs `run` for a while and returns its throughput in GB/s; `run` gets
+/// an iteration number and returns the bytes it read.
+fn measure(mut run: impl FnMut(usize) -> usize) -> f64 {
+    const TIME: Duration = Duration::from_millis(200);
+    let (start, mut bytes, mut i) = (Instant::now(), 0, 0);
+    while start.elapsed() < TIME {
+        bytes += run(i);
+        i += 1;
+    }
+    bytes as f64 / start.elapsed().as_secs_f64() / 1e9
+}
+
+/// Measures every kernel of every instruction set this CPU has on rows of
+/// a `width`x`height` frame, and prints the throughput in GB/s of input.
+pub fn bench(width: usize, height: usize) {
+    let width = width.max(64) / 64 * 64;
+    let frame: Vec<u8> = (0..width * height * 4)
+        .map(|i| (i * 7 + i / 13) as u8)
+        .collect();
+    let mut out = vec![0; width];
+    println!("Kernel throughput on {width}x{height} rows, in GB/s of input:");
+    for isa in Isa::available() {
+        let k = kernels_for(isa).unwrap();
+        let row = |i: usize| &frame[(i % height) * width..][..width];
+        let results = [
+            (
+                "deinterleave",
+                measure(|i| {
+                    let (u, v) = out.split_at_mut(width / 2);
+                    (k.deinterleave)(row(i), u, v);
+                    width
+                }),
+            ),
+            (
+                "interleave",
+                measure(|i| {
+                    let (u, v) = row(i).split_at(width / 2);
+                    (k.interleave)(u, v, &mut out);
+                    width
+                }),
+            ),
+            (
+                "box_luma",
+                measure(|i| {
+                    (k.box_luma)(row(i), row(i + 1), &mut out[..width / 2]);
+                    2 * width
+                }),
+            ),
+            (
+                "box_chroma",
+                measure(|i| {
+                    (k.box_chroma)(row(i), row(i + 1), &mut out[..width / 2]);
+                    2 * width
+                }),
+            ),
+            (
+                "lerp",
+                measure(|i| {
+                    (k.lerp)(row(i), row(i + 1), 77, &mut out);
+                    2 * width
+                }),
+            ),
+            (
+                "bgrx_luma",
+                measure(|i| {
+                    (k.bgrx_luma)(&frame[(i % height) * width..][..4 * width], &mut out);
+                    4 * width
+                }),
+            ),
+            (
+                "sad",
+                measure(|i| {
+                    std::hint::black_box((k.sad)(row(i), row(i + 1)));
+                    2 * width
+                }),
+            ),
+        ];
+        let results: Vec<String> = results
+            .iter()
+            .map(|(name, rate)| format!("{name} {rate:.1}"))
+            .collect();
+        println!("  {isa}: {}", results.join(", "));
+    }
+
+    // Whole frames with the kernels picked for this CPU.
+    let height = height / 4 * 4;
+    let size = width * height * 3 / 2;
+    let (nv12, bgrx) = (&frame[..size], &frame[..4 * width * height]);
+    let mut dst = vec![0; size];
+    let (mut y, mut u, mut v) = (
+        vec![0; width * height],
+        vec![0; width * height / 4],
+        vec![0; width * height / 4],
+    );
+    let results = [
+        (
+            "nv12_to_i420",
+            measure(|_| {
+                let (half, y, u, v) = (width / 2, &mut y[..], &mut u[..], &mut v[..]);
+                nv12_to_i420(
+                    nv12,
+                    width,
+                    height,
+                    PlaneMut {
+                        data: y,
+                        stride: width,
+                    },
+                    PlaneMut {
+                        data: u,
+                        stride: half,
+                    },
+                    PlaneMut {
+                        data: v,
+                        stride: half,
+                    },
+                );
+                size
+            }),
+        ),
+        (
+            "i420_to_nv12",
+            measure(|_| {
+                i420_to_nv12(&y, &u, &v, width, height, &mut dst);
+                size
+            }),
+        ),
+        (
+            "downscale_box",
+            measure(|_| {
+                downscale_box(nv12, width, height, &mut dst[..size / 4]);
+                size
+            }),
+        ),
+        (
+            "scale 2/3",
+            measure(|_| {
+                let (w, h) = (width / 3 * 2 / 2 * 2, height / 3 * 2 / 2 * 2);
+                scale(nv12, (width, height), &mut dst[..w * h * 3 / 2], (w, h));
+                size
+            }),
+        ),
+        (
+            "bgrx_to_nv12",
+            measure(|_| {
+                bgrx_to_nv12(bgrx, 4 * width, width, height, &mut dst);
+                bgrx.len()
+            }),
+        ),
+        (
+            "extract_luma",
+            measure(|_| {
+                extract_luma(nv12, width, width, height, &mut dst[..width * height]);
+                width * height
+            }),
+        ),
+    ];
+    let results: Vec<String> = results
+        .iter()
+        .map(|(name, rate)| format!("{name} {rate:.1}"))
+        .collect();
+    println!("  frames ({}): {}", isa(), results.join(", "));
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// xorshift64, so failures reproduce.
+    struct Rng(u64);
+
+    impl Rng {
+        fn next(&mut self) -> u64 {
+            self.0 ^= self.0 << 13;
+            self.0 ^= self.0 >> 7;
+            self.0 ^= self.0 << 17;
+            self.0
+        }
+
+        fn bytes(&mut self, len: usize) -> Vec<u8> {
+            (0..len).map(|_| self.next() as u8).collect()
+        }
+    }
+
+    #[test]
+    fn test_kernels_match_scalar_and_frames_convert() {
+        // Every kernel of every instruction set gives the scalar result, on
+        // random rows with lengths that leave tails.
+        let mut rng = Rng(0x9e3779b97f4a7c15);
+        for isa in Isa::available() {
+            let k = kernels_for(isa).unwrap();
+            for _ in 0..200 {
+                let n = (rng.next() % 300) as usize * 2;
+                let (a, b) = (rng.bytes(2 * n), rng.bytes(2 * n));
+                let weight = (rng.next() % 257) as u16;
+                let bgrx = rng.bytes(4 * n);
+                let check = |run: &dyn Fn(&Kernels, &mut [u8], &mut [u8])| {
+                    let (mut x, mut y) = (vec![0; n], vec![0; n]);
+                    let (mut sx, mut sy) = (vec![0; n], vec![0; n]);
+                    run(&k, &mut x, &mut y);
+                    run(&SCALAR, &mut sx, &mut sy);
+                    assert_eq!((x, y), (sx, sy), "{isa} with {n} samples");
+                };
+                check(&|k, u, v| (k.deinterleave)(&a, u, v));
+                check(&|k, uv, _| (k.interleave)(&a[..n / 2], &b[..n / 2], uv));
+                check(&|k, out, _| (k.box_luma)(&a, &b, out));
+                check(&|k, out, _| (k.box_chroma)(&a, &b, out));
+                check(&|k, out, _| (k.lerp)(&a[..n], &b[..n], weight, out));
+                check(&|k, out, _| (k.bgrx_luma)(&bgrx, out));
+                assert_eq!((k.sad)(&a, &b), (SCALAR.sad)(&a, &b), "{isa} sad");
+            }
+        }
+
+        // NV12 to I420 and back is lossless.
+        let (width, height) = (38, 6);
+        let frame = rng.bytes(width * height * 3 / 2);
+        let (mut y, mut u, mut v) = (vec![0; 38 * 6], vec![0; 19 * 3], vec![0; 19 * 3]);
+        nv12_to_i420(
+            &frame,
+            width,
+            height,
+            PlaneMut {
+                data: &mut y,
+                stride: 38,
+            },
+            PlaneMut {
+                data: &mut u,
+                stride: 19,
+            },
+            PlaneMut {
+                data: &mut v,
+                stride: 19,
+            },
+        );
+        assert_eq!(u[19], frame[38 * 6 + 38]);
+        let mut back = vec![0; frame.len()];
+        i420_to_nv12(&y, &u, &v, width, height, &mut back);
+        assert_eq!(back, frame);
+
+        // Flat frames stay flat at any size, and halving averages blocks.
+        let mut flat = vec![50; 64 * 32];
+        flat.extend([90, 200].repeat(64 * 8));
+        let mut scaled = vec![0; 24 * 10 * 3 / 2];
+        scale(&flat, (64, 32), &mut scaled, (24, 10));
+        assert!(scaled[..240].iter().all(|&y| y == 50));
+        assert!(scaled[240..].chunks(2).all(|uv| uv == [90, 200]));
+        let mut frame = vec![0; 8 * 4 * 3 / 2];
+        frame[..8].copy_from_slice(&[10, 20, 0, 0, 0, 0, 0, 0]);
+        frame[8..16].copy_from_slice(&[30, 40, 0, 0, 0, 0, 0, 0]);
+        let mut half = vec![0; 4 * 2 * 3 / 2];
+        scale(&frame, (8, 4), &mut half, (4, 2));
+        assert_eq!(half[0], 25);
+
+        // White, black and pure red land on the BT.709 limited range values.
+        let bgrx = [255, 255, 255, 0, 0, 0, 0, 0, 0, 0, 255, 0, 0, 0, 255, 0];
+        let mut nv12 = vec![0; 4 * 2 * 3 / 2];
+        let pixels: Vec<u8> = [&bgrx[..], &bgrx[..]].concat();
+        bgrx_to_nv12(&pixels, 16, 4, 2, &mut nv12);
+        assert_eq!(&nv12[..4], &[235, 16, 62, 62]);
+        assert_eq!(&nv12[8..], &[128, 128, 102, 240]);
+
+        let a: Vec<u8> = (0..37).collect();
+        let b: Vec<u8> = (0..37).map(|x| x * 3).collect();
+        assert_eq!(row_sad(&a, &b), (0..37).map(|x| 2 * x).sum::<u32>());
+    }
+}
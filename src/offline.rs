@@ -0,0 +1,329 @@
+use std::{
+    collections::BTreeMap,
+    fs::File,
+    io::Write,
+    ops::Range,
+    path::PathBuf,
+    sync::{
+        atomic::{AtomicBool, AtomicUsize, Ordering},
+        mpsc, Arc,
+    },
+    thread,
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, Context, Result};
+use cros_codecs::{
+    backend::vaapi::surface_pool::VaSurfacePool,
+    decoder::FramePool,
+    libva::{Display, UsageHint, VA_RT_FORMAT_YUV420},
+    Resolution,
+};
+
+use crate::{
+    encode_ffmpeg::{Encoder, EncoderSettings, SoftwareEncoder},
+    fanout::{FanOut, FileSink},
+    file_source::FileSource,
+    va::{nv12_image_format, write_nv12},
+};
+
+pub struct BenchOptions {
+    pub input: PathBuf,
+    pub size: (u32, u32),
+    pub output: PathBuf,
+    /// Frames to encode, looping over the clip. Defaults to the clip length.
+    pub frames: Option<usize>,
+    /// Pace uploads at the configured frame rate instead of running flat out.
+    pub realtime: bool,
+    pub settings: EncoderSettings,
+}
+
+/// Encodes a raw NV12 clip through the same encoder as live capture, and
+/// reports upload and encode cost separately.
+pub fn encode_file(options: BenchOptions, running: Arc<AtomicBool>) -> Result<()> {
+    let (width, height) = options.size;
+    let source = FileSource::open(&options.input, width, height)?;
+    let display = Display::open().context("Failed to open VA display")?;
+    let format = nv12_image_format(&display)?;
+    let mut pool = VaSurfacePool::new(
+        display.clone(),
+        VA_RT_FORMAT_YUV420,
+        Some(UsageHint::USAGE_HINT_VPP_READ),
+        Resolution { width, height },
+    );
+    pool.add_frames(vec![(); 4])
+        .expect("Failed to add frames to pool");
+    let mut fanout = FanOut::new();
+    fanout.add_primary(
+        "output",
+        2 * options.settings.framerate as usize,
+        FileSink::create(&options.output)?,
+    )?;
+
+    let total = options.frames.unwrap_or(source.frame_count());
+    let frame_duration = Duration::from_secs_f64(1.0 / options.settings.framerate as f64);
+    let mut encoder: Option<Encoder> = None;
+    let mut upload_time = Duration::ZERO;
+    let mut encode_time = Duration::ZERO;
+    let mut frames = 0;
+
+    let start = Instant::now();
+    for index in 0..total {
+        if !running.load(Ordering::SeqCst) {
+            break;
+        }
+
+        let upload_start = Instant::now();
+        let surface = pool
+            .get_surface()
+            .ok_or_else(|| anyhow!("Failed to get surface from pool"))?;
+        write_nv12(
+            std::borrow::Borrow::borrow(&surface),
+            format,
+            source.frame(index),
+        )?;
+        source.prefetch(index);
+        upload_time += upload_start.elapsed();
+
+        let encode_start = Instant::now();
+        let frame = Arc::new(surface);
+        if encoder.is_none() {
+            encoder =
+                Some(Encoder::new(options.settings, &frame).context("Failed to create encoder")?);
+        }
+        let encoder = encoder.as_mut().unwrap();
+        encoder.encode(frame)?;
+        while let Some(packet) = encoder.poll_packet()? {
+            fanout.send(&packet)?;
+        }
+        encode_time += encode_start.elapsed();
+        frames += 1;
+
+        if options.realtime {
+            let deadline = start + frame_duration * frames as u32;
+            let now = Instant::now();
+            if deadline > now {
+                thread::sleep(deadline - now);
+            }
+        }
+    }
+
+    if let Some(mut encoder) = encoder {
+        let drain_start = Instant::now();
+        for packet in encoder.drain_packets()? {
+            fanout.send(&packet)?;
+        }
+        encode_time += drain_start.elapsed();
+    }
+    fanout.finish()?;
+    let elapsed = start.elapsed();
+
+    let bytes = (frames * source.frame_size()) as f64;
+    println!(
+        "Encoded {frames} frames in {:.2}s ({:.1} fps)",
+        elapsed.as_secs_f64(),
+        frames as f64 / elapsed.as_secs_f64()
+    );
+    println!(
+        "  upload: {:.3} ms/frame, {:.2} GB/s",
+        upload_time.as_secs_f64() * 1000.0 / frames.max(1) as f64,
+        bytes / upload_time.as_secs_f64().max(f64::EPSILON) / 1e9
+    );
+    println!(
+        "  encode: {:.3} ms/frame",
+        encode_time.as_secs_f64() * 1000.0 / frames.max(1) as f64
+    );
+    Ok(())
+}
+
+pub struct TranscodeOptions {
+    pub input: PathBuf,
+    pub size: (u32, u32),
+    pub output: PathBuf,
+    /// Session counts to run, one pass each, to report how encoding scales.
+    pub sessions: Vec<usize>,
+    /// Chunk length in GOPs.
+    pub chunk_gops: usize,
+    /// Encode with libx264 on the CPU instead of VAAPI.
+    pub software: bool,
+    pub settings: EncoderSettings,
+}
+
+/// Re-encodes a raw NV12 clip by splitting it into GOP-aligned chunks and
+/// encoding them concurrently on several encoder sessions.
+///
+/// Every chunk starts with an IDR and carries its own SPS/PPS, so the chunks
+/// are simply concatenated in order into one valid Annex B stream. Timestamps
+/// continue across chunks because each session starts counting at its
+/// chunk's first frame.
+pub fn transcode(options: TranscodeOptions, running: Arc<AtomicBool>) -> Result<()> {
+    let (width, height) = options.size;
+    let source = FileSource::open(&options.input, width, height)?;
+    // The encoder uses one GOP per second, so chunk boundaries fall on
+    // keyframes that a single session would have produced anyway.
+    let chunk_frames = options.settings.framerate as usize * options.chunk_gops.max(1);
+
+    let mut baseline_fps = None;
+    println!("sessions  frames      time      fps  speedup");
+    for &sessions in &options.sessions {
+        let start = Instant::now();
+        let frames = transcode_pass(&source, sessions, chunk_frames, &options, &running)?;
+        let elapsed = start.elapsed().as_secs_f64();
+        let fps = frames as f64 / elapsed;
+        let speedup = fps / *baseline_fps.get_or_insert(fps);
+        println!("{sessions:>8}  {frames:>6}  {elapsed:>7.2}s  {fps:>7.1}  {speedup:>6.2}x");
+    }
+    Ok(())
+}
+
+fn transcode_pass(
+    source: &FileSource,
+    sessions: usize,
+    chunk_frames: usize,
+    options: &TranscodeOptions,
+    running: &AtomicBool,
+) -> Result<usize> {
+    let total = source.frame_count();
+    let chunk_count = total.div_ceil(chunk_frames);
+    let next_chunk = AtomicUsize::new(0);
+    let mut output_file = File::create(&options.output)?;
+    let (sender, receiver) = mpsc::channel::<(usize, Vec<u8>)>();
+
+    thread::scope(|scope| {
+        let workers: Vec<_> = (0..sessions.max(1))
+            .map(|_| {
+                let sender = sender.clone();
+                let next_chunk = &next_chunk;
+                scope.spawn(move || -> Result<()> {
+                    let mut session = ChunkSession::new(options)?;
+                    loop {
+                        let chunk = next_chunk.fetch_add(1, Ordering::Relaxed);
+                        if chunk >= chunk_count || !running.load(Ordering::SeqCst) {
+                            return Ok(());
+                        }
+                        let range = chunk * chunk_frames..((chunk + 1) * chunk_frames).min(total);
+                        let data = session.encode_chunk(source, range)?;
+                        if sender.send((chunk, data)).is_err() {
+                            return Ok(());
+                        }
+                    }
+                })
+            })
+            .collect();
+        drop(sender);
+
+        // Chunks finish out of order, write them out in order as soon as the
+        // next one is available.
+        let mut finished = BTreeMap::new();
+        let mut next = 0;
+        for (chunk, data) in receiver {
+            finished.insert(chunk, data);
+            while let Some(data) = finished.remove(&next) {
+                output_file.write_all(&data)?;
+                next += 1;
+            }
+        }
+
+        for worker in workers {
+            worker
+                .join()
+                .map_err(|_| anyhow!("Encoder session panicked"))??;
+        }
+        Ok((next * chunk_frames).min(total))
+    })
+}
+
+/// One encoder session used for a sequence of chunks.
+enum ChunkSession {
+    Vaapi {
+        pool: VaSurfacePool<()>,
+        format: cros_codecs::libva::VAImageFormat,
+        encoder: Option<Encoder>,
+        settings: EncoderSettings,
+    },
+    Software(EncoderSettings, (u32, u32)),
+}
+
+impl ChunkSession {
+    fn new(options: &TranscodeOptions) -> Result<Self> {
+        if options.software {
+            return Ok(Self::Software(options.settings, options.size));
+        }
+        // Each session gets its own VA display so they don't serialize on it.
+        let display = Display::open().context("Failed to open VA display")?;
+        let format = nv12_image_format(&display)?;
+        let (width, height) = options.size;
+        let mut pool = VaSurfacePool::new(
+            display,
+            VA_RT_FORMAT_YUV420,
+            Some(UsageHint::USAGE_HINT_VPP_READ),
+            Resolution { width, height },
+        );
+        pool.add_frames(vec![(); 4])
+            .expect("Failed to add frames to pool");
+        Ok(Self::Vaapi {
+            pool,
+            format,
+            encoder: None,
+            settings: options.settings,
+        })
+    }
+
+    fn encode_chunk(&mut self, source: &FileSource, range: Range<usize>) -> Result<Vec<u8>> {
+        let mut data = Vec::new();
+        let first_pts = range.start as i64;
+        match self {
+            Self::Vaapi {
+                pool,
+                format,
+                encoder,
+                settings,
+            } => {
+                for index in range {
+                    let surface = pool
+                        .get_surface()
+                        .ok_or_else(|| anyhow!("Failed to get surface from pool"))?;
+                    write_nv12(
+                        std::borrow::Borrow::borrow(&surface),
+                        *format,
+                        source.frame(index),
+                    )?;
+                    source.prefetch(index);
+                    let frame = Arc::new(surface);
+                    if encoder.is_none() {
+                        *encoder = Some(
+                            Encoder::new(*settings, &frame).context("Failed to create encoder")?,
+                        );
+                    }
+                    let encoder = encoder.as_mut().unwrap();
+                    if index as i64 == first_pts {
+                        encoder.restart_at(first_pts)?;
+                    }
+                    encoder.encode(frame)?;
+                    while let Some(packet) = encoder.poll_packet()? {
+                        data.extend_from_slice(packet.data());
+                    }
+                }
+                if let Some(encoder) = encoder {
+                    for packet in encoder.drain_packets()? {
+                        data.extend_from_slice(packet.data());
+                    }
+                }
+            }
+            Self::Software(settings, (width, height)) => {
+                let mut encoder = SoftwareEncoder::new(*settings, *width, *height, first_pts)?;
+                for index in range {
+                    encoder.encode_nv12(source.frame(index))?;
+                    source.prefetch(index);
+                    while let Some(packet) = encoder.poll_packet()? {
+                        data.extend_from_slice(packet.data());
+                    }
+                }
+                for packet in encoder.drain_packets()? {
+                    data.extend_from_slice(packet.data());
+                }
+            }
+        }
+        Ok(data)
+    }
+}
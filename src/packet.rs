@@ -0,0 +1,141 @@
+use std::{slice, sync::Arc};
+
+use cros_codecs::encoder::CodedBitstreamBuffer;
+use rsmpeg::{avcodec::AVPacket, ffi};
+
+use crate::bitstream::{PooledBuffer, SharedBuffer};
+
+/// Where the bytes of an encoded packet live.
+enum Payload {
+    /// Owns the AVPacket and with it the reference to its encoder buffer.
+    Ffmpeg(AVPacket),
+    /// cros-codecs hands out owned bitstream buffers.
+    Cros(CodedBitstreamBuffer),
+    Bytes(Vec<u8>),
+}
+
+struct Inner {
+    payload: Payload,
+    pts: i64,
+    keyframe: bool,
+}
+
+// SAFETY: the AVPacket is never modified after construction, so sharing
+// read-only access to its buffer between threads is fine.
+unsafe impl Send for Inner {}
+unsafe impl Sync for Inner {}
+
+/// An encoded packet shared by every sink that wants it.
+///
+/// Cloning only bumps a reference count: the muxer, the replay buffer and the
+/// file writers all read the same encoder output buffer, which is released
+/// when the last of them is done with it.
+#[derive(Clone)]
+pub struct Packet(Repr);
+
+#[derive(Clone)]
+enum Repr {
+    Shared(Arc<Inner>),
+    /// Goes back to the encoder's bitstream pool when the last sink is done.
+    /// The slot carries the timestamp, so this needs no allocation.
+    Pooled(SharedBuffer),
+}
+
+impl Packet {
+    pub fn data(&self) -> &[u8] {
+        let inner = match &self.0 {
+            Repr::Shared(inner) => inner,
+            Repr::Pooled(buffer) => return buffer,
+        };
+        match &inner.payload {
+            Payload::Ffmpeg(packet) if packet.size > 0 => {
+                // SAFETY: data points to size bytes owned by the packet.
+                unsafe { slice::from_raw_parts(packet.data, packet.size as usize) }
+            }
+            Payload::Ffmpeg(_) => &[],
+            Payload::Cros(buffer) => &buffer.bitstream,
+            Payload::Bytes(bytes) => bytes,
+        }
+    }
+
+    /// Wraps a bitstream that is already in memory.
+    pub fn from_bytes(data: Vec<u8>, pts: i64, keyframe: bool) -> Self {
+        Self::shared(Payload::Bytes(data), pts, keyframe)
+    }
+
+    /// Wraps a bitstream written into a pooled buffer.
+    pub fn from_pooled(buffer: PooledBuffer, pts: i64, keyframe: bool) -> Self {
+        Self(Repr::Pooled(buffer.share(pts, keyframe)))
+    }
+
+    /// Wraps a pooled buffer that is already shared, e.g. claimed back from
+    /// FFmpeg.
+    pub fn from_shared(buffer: SharedBuffer) -> Self {
+        Self(Repr::Pooled(buffer))
+    }
+
+    fn shared(payload: Payload, pts: i64, keyframe: bool) -> Self {
+        Self(Repr::Shared(Arc::new(Inner {
+            payload,
+            pts,
+            keyframe,
+        })))
+    }
+
+    pub fn pts(&self) -> i64 {
+        match &self.0 {
+            Repr::Shared(inner) => inner.pts,
+            Repr::Pooled(buffer) => buffer.pts(),
+        }
+    }
+
+    pub fn is_keyframe(&self) -> bool {
+        match &self.0 {
+            Repr::Shared(inner) => inner.keyframe,
+            Repr::Pooled(buffer) => buffer.is_keyframe(),
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.data().len()
+    }
+}
+
+impl From<AVPacket> for Packet {
+    fn from(packet: AVPacket) -> Self {
+        let pts = packet.pts;
+        let keyframe = packet.flags & ffi::AV_PKT_FLAG_KEY as i32 != 0;
+        Self::shared(Payload::Ffmpeg(packet), pts, keyframe)
+    }
+}
+
+impl From<CodedBitstreamBuffer> for Packet {
+    fn from(buffer: CodedBitstreamBuffer) -> Self {
+        let pts = buffer.metadata.timestamp as i64;
+        let keyframe = buffer.metadata.force_keyframe || contains_idr(&buffer.bitstream);
+        Self::shared(Payload::Cros(buffer), pts, keyframe)
+    }
+}
+
+/// Whether an Annex B H.264 access unit contains an IDR slice.
+pub fn contains_idr(data: &[u8]) -> bool {
+    data.windows(4)
+        .any(|w| w[0] == 0 && w[1] == 0 && w[2] == 1 && w[3] & 0x1f == 5)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_contains_idr() {
+        // SPS, PPS, IDR slice.
+        let idr = [
+            0, 0, 0, 1, 0x67, 0x42, 0, 0, 0, 1, 0x68, 0xce, 0, 0, 1, 0x65, 0x88,
+        ];
+        assert!(contains_idr(&idr));
+        // Non-IDR slice.
+        let p = [0, 0, 0, 1, 0x41, 0x9a];
+        assert!(!contains_idr(&p));
+    }
+}
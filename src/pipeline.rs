@@ -0,0 +1,139 @@
+//! The recorder as a graph of stages, each on its own thread, connected by
+//! bounded channels.
+//!
+//! Stages only share the channels between them, so each one overlaps with
+//! the others and can be swapped out or benchmarked on its own by feeding
+//! its input channel directly. The occupancy of every edge is reported, which
+//! shows the stage holding the others back: its input channel is full and
+//! its output channel empty.
+
+use std::thread::{self, JoinHandle};
+
+use anyhow::{anyhow, Context, Result};
+
+use crate::channel::{self, ChannelStats, Probe, Receiver, Sender};
+
+struct StageHandle {
+    name: String,
+    thread: JoinHandle<Result<()>>,
+}
+
+#[derive(Default)]
+pub struct Pipeline {
+    stages: Vec<StageHandle>,
+    edges: Vec<(String, Probe)>,
+}
+
+impl Pipeline {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Creates an edge with room for `capacity` items in flight.
+    pub fn channel<T: Send + 'static>(
+        &mut self,
+        name: &str,
+        capacity: usize,
+    ) -> (Sender<T>, Receiver<T>) {
+        let (sender, receiver) = channel::bounded(capacity);
+        self.edges.push((name.to_string(), sender.probe()));
+        (sender, receiver)
+    }
+
+    /// Runs a stage on its own thread. A stage returns when its input
+    /// channel is closed, and drops its output channel on the way out, so
+    /// shutting down the first stage drains the whole pipeline in order.
+    pub fn spawn(
+        &mut self,
+        name: &str,
+        stage: impl FnOnce() -> Result<()> + Send + 'static,
+    ) -> Result<()> {
+        let thread = thread::Builder::new().name(name.to_string()).spawn(stage)?;
+        self.stages.push(StageHandle {
+            name: name.to_string(),
+            thread,
+        });
+        Ok(())
+    }
+
+    pub fn stats(&self) -> Vec<(String, ChannelStats)> {
+        self.edges
+            .iter()
+            .map(|(name, probe)| (name.clone(), probe.stats()))
+            .collect()
+    }
+
+    /// Describes the occupancy of every edge.
+    pub fn report(&self) -> String {
+        let edges: Vec<String> = self
+            .stats()
+            .iter()
+            .map(|(name, stats)| format!("  {name}: {stats}"))
+            .collect();
+        edges.join("\n")
+    }
+
+    /// Waits for every stage, returning the first error any of them hit.
+    pub fn join(&mut self) -> Result<()> {
+        let mut result = Ok(());
+        for stage in self.stages.drain(..) {
+            let finished = stage
+                .thread
+                .join()
+                .map_err(|_| anyhow!("Stage {} panicked", stage.name))
+                .and_then(|r| r.with_context(|| format!("Stage {} failed", stage.name)));
+            if result.is_ok() {
+                result = finished;
+            }
+        }
+        result
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_stages_drain_in_order() {
+        let mut pipeline = Pipeline::new();
+        let (numbers, numbers_in) = pipeline.channel("numbers", 2);
+        let (squares, squares_in) = pipeline.channel("squares", 2);
+        pipeline
+            .spawn("square", move || {
+                for n in numbers_in.iter() {
+                    squares.send(n * n).ok();
+                }
+                Ok(())
+            })
+            .unwrap();
+        let (sum, sum_in) = std::sync::mpsc::channel();
+        pipeline
+            .spawn("sum", move || {
+                sum.send(squares_in.iter().sum::<u64>())?;
+                Ok(())
+            })
+            .unwrap();
+
+        for n in 1..=100u64 {
+            numbers.send(n).unwrap();
+        }
+        drop(numbers);
+        pipeline.join().unwrap();
+        assert_eq!(sum_in.recv().unwrap(), 338_350);
+        let report = pipeline.report();
+        assert!(report.contains("numbers: 100 sent"));
+        assert!(report.contains("squares: 100 sent"));
+    }
+
+    #[test]
+    fn test_reports_failed_stage() {
+        let mut pipeline = Pipeline::new();
+        pipeline.spawn("ok", || Ok(())).unwrap();
+        pipeline
+            .spawn("broken", || Err(anyhow!("out of surfaces")))
+            .unwrap();
+        let error = pipeline.join().unwrap_err();
+        assert_eq!(format!("{error:#}"), "Stage broken failed: out of surfaces");
+    }
+}
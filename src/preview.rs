@@ -0,0 +1,559 @@
+//! Preview thumbnails and timeline sprite sheets, taken from captured frames
+//! without slowing down capture or encoding.
+//!
+//! A low-priority thread reads the latest frame like any other reader of the
+//! frame buffer, scales it down to a thumbnail with the same VPP copy the
+//! encoder uses, and only reads back those few kilobytes. JPEG compression
+//! and file writes happen on the auxiliary executor, so the cost on the hot
+//! path is one extra reference to a surface every few seconds.
+
+use std::{
+    fs,
+    path::{Path, PathBuf},
+    sync::{mpsc, Arc, Mutex},
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, bail, Context, Result};
+use cros_codecs::{
+    backend::vaapi::surface_pool::PooledVaSurface,
+    libva::{Surface, UsageHint, VAImageFormat, VA_RT_FORMAT_YUV420},
+};
+use rsmpeg::{
+    avcodec::{AVCodec, AVCodecContext},
+    avutil::{ra, AVFrame},
+    error::RsmpegError,
+    ffi::AV_PIX_FMT_YUVJ420P,
+};
+
+use crate::{
+    control::Request,
+    encode_ffmpeg::copy_surfaces,
+    executor::{self, Priority, Strand},
+    frame_buffer::FrameReader,
+    nv12,
+    va::{nv12_image_format, read_nv12},
+};
+
+/// Thumbnails per row and column of a sprite sheet.
+const SHEET_COLUMNS: usize = 8;
+const SHEET_ROWS: usize = 8;
+
+/// Nice value of the preview thread, so it only runs on idle CPU time.
+const NICE: i32 = 10;
+
+/// Periodic thumbnails waiting to be written beyond which new ones are
+/// skipped, when the executor is busy with more urgent work.
+const MAX_QUEUED: usize = 2;
+
+#[derive(Debug, Clone)]
+pub struct PreviewOptions {
+    /// Width of thumbnails; the height follows the frame's aspect ratio.
+    pub width: u32,
+    /// Time between periodic thumbnails, or zero for on-demand ones only.
+    pub interval: Duration,
+    /// Overwritten with the latest thumbnail every interval, for UIs that
+    /// show a live preview.
+    pub live: Option<PathBuf>,
+    /// Path prefix of sprite sheets of the thumbnails taken every interval,
+    /// `<prefix>-sprites-<n>.jpg`, and of their WebVTT index
+    /// `<prefix>-sprites.vtt`.
+    pub sprites: Option<PathBuf>,
+}
+
+/// A tightly packed NV12 thumbnail.
+#[derive(Clone)]
+struct Thumbnail {
+    width: usize,
+    height: usize,
+    data: Vec<u8>,
+}
+
+enum Message {
+    /// Write a thumbnail of the latest frame to the path and reply to the
+    /// control client with it.
+    Snapshot(PathBuf, Request),
+    /// Time for a periodic thumbnail. Sent by a timer of the auxiliary
+    /// executor, so that ticks stop while its timers are paused.
+    Tick,
+}
+
+/// Handle to the preview thread. Dropping it stops the thread.
+pub struct Previewer {
+    /// The only strong reference, so the thread sees the channel close when
+    /// it is dropped. The tick timer holds a weak one.
+    messages: Option<Arc<mpsc::Sender<Message>>>,
+    thread: Option<JoinHandle<Result<()>>>,
+}
+
+impl Previewer {
+    pub fn start(
+        frames: FrameReader<PooledVaSurface<()>>,
+        options: PreviewOptions,
+    ) -> Result<Self> {
+        let (messages, receiver) = mpsc::channel();
+        let messages = Arc::new(messages);
+        if !options.interval.is_zero() {
+            let messages = Arc::downgrade(&messages);
+            executor::every(options.interval, Priority::Normal, move || {
+                messages
+                    .upgrade()
+                    .is_some_and(|messages| messages.send(Message::Tick).is_ok())
+            });
+        }
+        let thread = thread::Builder::new()
+            .name("preview".into())
+            .spawn(move || {
+                // SAFETY: only changes the priority of the calling thread.
+                if unsafe { nix::libc::setpriority(nix::libc::PRIO_PROCESS, 0, NICE) } != 0 {
+                    eprintln!("Failed to lower the preview thread priority");
+                }
+                run(frames, options, receiver)
+            })?;
+        Ok(Self {
+            messages: Some(messages),
+            thread: Some(thread),
+        })
+    }
+
+    /// Takes a thumbnail of the latest frame and writes it to `path`. The
+    /// control client gets its reply once the file is written.
+    pub fn snapshot(&self, path: PathBuf, request: Request) {
+        if let Err(mpsc::SendError(Message::Snapshot(_, request))) = self
+            .messages
+            .as_ref()
+            .unwrap()
+            .send(Message::Snapshot(path, request))
+        {
+            request.reply(Err(anyhow!("preview thread has exited")));
+        }
+    }
+
+    /// Writes the last sprite sheet and stops the thread.
+    pub fn finish(mut self) -> Result<()> {
+        self.join()
+    }
+
+    fn join(&mut self) -> Result<()> {
+        self.messages.take();
+        match self.thread.take() {
+            Some(thread) => thread
+                .join()
+                .map_err(|_| anyhow!("Preview thread panicked"))?,
+            None => Ok(()),
+        }
+    }
+}
+
+impl Drop for Previewer {
+    fn drop(&mut self) {
+        if let Err(e) = self.join() {
+            eprintln!("Preview failed: {e:#}");
+        }
+    }
+}
+
+fn run(
+    mut frames: FrameReader<PooledVaSurface<()>>,
+    options: PreviewOptions,
+    messages: mpsc::Receiver<Message>,
+) -> Result<()> {
+    let mut scaler = Downscaler::default();
+    let sheets = Arc::new(Mutex::new(
+        options
+            .sprites
+            .as_deref()
+            .map(|prefix| SpriteSheets::new(prefix, options.interval)),
+    ));
+    // Writes periodic thumbnails in order, off this thread.
+    let writes = Strand::new(Priority::Background);
+    // Kept so a static screen, which writes no new frames, still has one.
+    let mut latest: Option<Thumbnail> = None;
+    let mut thumbnail = |frames: &mut FrameReader<PooledVaSurface<()>>| -> Result<Thumbnail> {
+        if let Some(frame) = frames.read_new() {
+            let surface: &Surface<()> = std::borrow::Borrow::borrow(frame.as_ref());
+            latest = Some(scaler.thumbnail(surface, options.width)?);
+        }
+        latest
+            .clone()
+            .ok_or_else(|| anyhow!("no frame captured yet"))
+    };
+
+    let start = Instant::now();
+    let mut next_slot = 0;
+    while let Ok(message) = messages.recv() {
+        match message {
+            Message::Snapshot(path, request) => match thumbnail(&mut frames) {
+                Ok(thumb) => executor::spawn(Priority::Interactive, move || {
+                    let result = write_jpeg(&path, &thumb).map(|()| path.display().to_string());
+                    request.reply(result);
+                }),
+                Err(e) => request.reply(Err(e)),
+            },
+            Message::Tick => {
+                // Ticks missed while timers were paused leave a gap, so the
+                // interval this one is for comes from the time.
+                let elapsed = start.elapsed().as_nanos() / options.interval.as_nanos();
+                let slot = (elapsed as u32).saturating_sub(1).max(next_slot);
+                next_slot = slot + 1;
+                if writes.len() >= MAX_QUEUED {
+                    eprintln!("Skipping preview: still writing the previous ones");
+                    continue;
+                }
+                let thumb = match thumbnail(&mut frames) {
+                    Ok(thumb) => thumb,
+                    Err(e) => {
+                        eprintln!("Skipping preview: {e:#}");
+                        continue;
+                    }
+                };
+                let (live, sheets) = (options.live.clone(), sheets.clone());
+                writes.push(move || {
+                    // A failed preview is skipped, it's not worth stopping for.
+                    let result = live
+                        .map_or(Ok(()), |live| write_live(&live, &thumb))
+                        .and_then(|()| match sheets.lock().unwrap().as_mut() {
+                            Some(sheets) => sheets.push(&thumb, slot),
+                            None => Ok(()),
+                        });
+                    if let Err(e) = result {
+                        eprintln!("Skipping preview: {e:#}");
+                    }
+                });
+            }
+        }
+    }
+
+    writes
+        .wait_idle()
+        .map_err(|_| anyhow!("Preview writer panicked"))?;
+    if let Some(sheets) = sheets.lock().unwrap().take() {
+        sheets.finish()?;
+    }
+    Ok(())
+}
+
+/// Replaces `path` with the thumbnail at once, so readers never see a
+/// partial file.
+fn write_live(path: &Path, thumb: &Thumbnail) -> Result<()> {
+    let partial = path.with_extension("jpg.partial");
+    write_jpeg(&partial, thumb)?;
+    fs::rename(&partial, path).with_context(|| format!("Failed to write {}", path.display()))
+}
+
+/// Scales frames down to thumbnails with VPP and reads them back.
+#[derive(Default)]
+struct Downscaler {
+    surface: Option<Surface<()>>,
+    format: Option<VAImageFormat>,
+}
+
+impl Downscaler {
+    fn thumbnail(&mut self, frame: &Surface<()>, width: u32) -> Result<Thumbnail> {
+        let (frame_width, frame_height) = frame.size();
+        let width = width.min(frame_width) & !1;
+        let height = ((frame_height as u64 * width as u64 / frame_width as u64) as u32 & !1).max(2);
+        let display = frame.display();
+        if self.surface.as_ref().map(|s| s.size()) != Some((width, height)) {
+            let surface = display
+                .create_surfaces(
+                    VA_RT_FORMAT_YUV420,
+                    Some(u32::from_le_bytes(*b"NV12")),
+                    width,
+                    height,
+                    Some(UsageHint::USAGE_HINT_VPP_WRITE),
+                    vec![()],
+                )
+                .map_err(|e| anyhow!("Failed to create thumbnail surface: {e:?}"))?
+                .pop()
+                .ok_or_else(|| anyhow!("No thumbnail surface created"))?;
+            self.surface = Some(surface);
+        }
+        let surface = self.surface.as_ref().unwrap();
+        copy_surfaces(
+            display.handle(),
+            frame.id(),
+            surface.id(),
+            width as i32,
+            height as i32,
+            None,
+        )
+        .context("Failed to scale thumbnail")?;
+
+        let format = match self.format {
+            Some(format) => format,
+            None => *self.format.insert(nv12_image_format(display)?),
+        };
+        let mut data = Vec::with_capacity(width as usize * height as usize * 3 / 2);
+        read_nv12(surface, format, |row| data.extend_from_slice(row))?;
+        Ok(Thumbnail {
+            width: width as usize,
+            height: height as usize,
+            data,
+        })
+    }
+}
+
+/// Thumbnails laid out in a grid, written out as JPEG when full, with a
+/// WebVTT index giving the tile of each stretch of the recording.
+struct SpriteSheets {
+    prefix: PathBuf,
+    interval: Duration,
+    /// The sheet being filled, allocated on its first thumbnail.
+    canvas: Option<Thumbnail>,
+    tiles: usize,
+    sheets: usize,
+    cues: Vec<Cue>,
+}
+
+/// The time range a thumbnail stands for, and where it is on its sheet.
+struct Cue {
+    start: Duration,
+    end: Duration,
+    target: String,
+}
+
+impl SpriteSheets {
+    fn new(prefix: &Path, interval: Duration) -> Self {
+        Self {
+            prefix: prefix.to_owned(),
+            interval,
+            canvas: None,
+            tiles: 0,
+            sheets: 0,
+            cues: Vec::new(),
+        }
+    }
+
+    fn sheet_path(&self, index: usize) -> PathBuf {
+        suffixed(&self.prefix, &format!("-sprites-{index}.jpg"))
+    }
+
+    /// Adds the thumbnail taken for the `slot`th interval. Intervals without
+    /// one, e.g. while recording was suspended, stay on the one before.
+    fn push(&mut self, thumb: &Thumbnail, slot: u32) -> Result<()> {
+        let canvas = self.canvas.get_or_insert_with(|| {
+            let (width, height) = (thumb.width * SHEET_COLUMNS, thumb.height * SHEET_ROWS);
+            Thumbnail {
+                width,
+                height,
+                data: vec![0; width * height * 3 / 2],
+            }
+        });
+        let (tile_width, tile_height) = (canvas.width / SHEET_COLUMNS, canvas.height / SHEET_ROWS);
+        if (thumb.width, thumb.height) != (tile_width, tile_height) {
+            bail!("Frame size changed, sprite sheets stop here");
+        }
+        let (x, y) = (
+            self.tiles % SHEET_COLUMNS * tile_width,
+            self.tiles / SHEET_COLUMNS * tile_height,
+        );
+        blit_tile(thumb, canvas, x, y);
+
+        let start = self.interval * slot;
+        if let Some(previous) = self.cues.last_mut() {
+            previous.end = start;
+        }
+        let name = self.sheet_path(self.sheets);
+        let name = name.file_name().unwrap().to_string_lossy();
+        self.cues.push(Cue {
+            start,
+            end: start + self.interval,
+            target: format!("{name}#xywh={x},{y},{tile_width},{tile_height}"),
+        });
+        self.tiles += 1;
+        if self.tiles == SHEET_COLUMNS * SHEET_ROWS {
+            self.flush()?;
+        }
+        Ok(())
+    }
+
+    /// Writes the sheet being filled and the index so far.
+    fn flush(&mut self) -> Result<()> {
+        let Some(canvas) = self.canvas.take() else {
+            return Ok(());
+        };
+        write_jpeg(&self.sheet_path(self.sheets), &canvas)?;
+        self.sheets += 1;
+        self.tiles = 0;
+        let index = suffixed(&self.prefix, "-sprites.vtt");
+        let cues: Vec<String> = self
+            .cues
+            .iter()
+            .map(|cue| {
+                format!(
+                    "{} --> {}\n{}\n",
+                    vtt_time(cue.start),
+                    vtt_time(cue.end),
+                    cue.target
+                )
+            })
+            .collect();
+        fs::write(&index, format!("WEBVTT\n\n{}", cues.join("\n")))
+            .with_context(|| format!("Failed to write {}", index.display()))
+    }
+
+    fn finish(mut self) -> Result<()> {
+        self.flush()?;
+        if self.sheets > 0 {
+            println!(
+                "Wrote {} sprite sheets with {} thumbnails",
+                self.sheets,
+                self.cues.len()
+            );
+        }
+        Ok(())
+    }
+}
+
+fn suffixed(prefix: &Path, suffix: &str) -> PathBuf {
+    let mut path = prefix.as_os_str().to_owned();
+    path.push(suffix);
+    path.into()
+}
+
+/// Copies an NV12 thumbnail into an NV12 canvas at an even (`x`, `y`).
+fn blit_tile(tile: &Thumbnail, canvas: &mut Thumbnail, x: usize, y: usize) {
+    let (tile_luma, tile_chroma) = tile.data.split_at(tile.width * tile.height);
+    let (canvas_luma, canvas_chroma) = canvas.data.split_at_mut(canvas.width * canvas.height);
+    for (row, src) in tile_luma.chunks_exact(tile.width).enumerate() {
+        let start = (y + row) * canvas.width + x;
+        canvas_luma[start..start + tile.width].copy_from_slice(src);
+    }
+    // One interleaved UV row for every two luma rows.
+    for (row, src) in tile_chroma.chunks_exact(tile.width).enumerate() {
+        let start = (y / 2 + row) * canvas.width + x;
+        canvas_chroma[start..start + tile.width].copy_from_slice(src);
+    }
+}
+
+fn vtt_time(time: Duration) -> String {
+    let millis = time.as_millis();
+    format!(
+        "{:02}:{:02}:{:02}.{:03}",
+        millis / 3_600_000,
+        millis / 60_000 % 60,
+        millis / 1000 % 60,
+        millis % 1000
+    )
+}
+
+/// Compresses an NV12 thumbnail with FFmpeg's MJPEG encoder.
+fn write_jpeg(path: &Path, thumb: &Thumbnail) -> Result<()> {
+    let codec = AVCodec::find_encoder_by_name(c"mjpeg").context("Could not find mjpeg encoder.")?;
+    let mut avctx = AVCodecContext::new(&codec);
+    avctx.set_width(thumb.width as i32);
+    avctx.set_height(thumb.height as i32);
+    avctx.set_time_base(ra(1, 1));
+    avctx.set_pix_fmt(AV_PIX_FMT_YUVJ420P);
+    avctx.open(None).context("Cannot open mjpeg encoder")?;
+
+    let mut frame = AVFrame::new();
+    frame.set_width(thumb.width as i32);
+    frame.set_height(thumb.height as i32);
+    frame.set_format(AV_PIX_FMT_YUVJ420P);
+    frame.alloc_buffer().context("Failed to allocate frame")?;
+
+    // Captured frames are limited range and JPEG is full range. Split the
+    // chroma planes with the SIMD kernel, then expand the range in place.
+    let luma_lut: [u8; 256] = std::array::from_fn(|y| ((y.clamp(16, 235) - 16) * 255 / 219) as u8);
+    let chroma_lut: [u8; 256] =
+        std::array::from_fn(|c| ((c.clamp(16, 240) as i32 - 128) * 255 / 224 + 128) as u8);
+    let (width, height) = (thumb.width, thumb.height);
+    let raw = unsafe { &mut *frame.as_mut_ptr() };
+    // SAFETY: alloc_buffer made room for `height` rows of `linesize` bytes,
+    // and half as many in the chroma planes.
+    let [y, u, v] = [(0, height), (1, height / 2), (2, height / 2)].map(|(index, rows)| unsafe {
+        let stride = raw.linesize[index] as usize;
+        (
+            std::slice::from_raw_parts_mut(raw.data[index], stride * rows),
+            stride,
+        )
+    });
+    nv12::nv12_to_i420(
+        &thumb.data,
+        width,
+        height,
+        nv12::PlaneMut {
+            data: &mut *y.0,
+            stride: y.1,
+        },
+        nv12::PlaneMut {
+            data: &mut *u.0,
+            stride: u.1,
+        },
+        nv12::PlaneMut {
+            data: &mut *v.0,
+            stride: v.1,
+        },
+    );
+    for ((data, stride), plane_width, lut) in [
+        (y, width, &luma_lut),
+        (u, width / 2, &chroma_lut),
+        (v, width / 2, &chroma_lut),
+    ] {
+        for row in data.chunks_mut(stride) {
+            for value in &mut row[..plane_width] {
+                *value = lut[*value as usize];
+            }
+        }
+    }
+
+    avctx
+        .send_frame(Some(&frame))
+        .context("Send frame failed")?;
+    avctx.send_frame(None).context("Send frame failed")?;
+    let mut jpeg = Vec::new();
+    loop {
+        match avctx.receive_packet() {
+            Ok(packet) => {
+                // SAFETY: data points to size bytes owned by the packet.
+                jpeg.extend_from_slice(unsafe {
+                    std::slice::from_raw_parts(packet.data, packet.size as usize)
+                });
+            }
+            Err(RsmpegError::EncoderDrainError) | Err(RsmpegError::EncoderFlushedError) => break,
+            Err(e) => return Err(e).context("Receive packet failed."),
+        }
+    }
+    fs::write(path, jpeg).with_context(|| format!("Failed to write {}", path.display()))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn thumbnail(width: usize, height: usize, value: u8) -> Thumbnail {
+        Thumbnail {
+            width,
+            height,
+            data: vec![value; width * height * 3 / 2],
+        }
+    }
+
+    #[test]
+    fn test_sprite_sheet_layout() {
+        let mut canvas = thumbnail(8, 4, 0);
+        blit_tile(&thumbnail(4, 2, 7), &mut canvas, 4, 2);
+        let (luma, chroma) = canvas.data.split_at(32);
+        assert_eq!(&luma[16..24], &[0, 0, 0, 0, 7, 7, 7, 7]);
+        assert!(luma[..16].iter().all(|&y| y == 0));
+        assert_eq!(chroma, &[0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 7, 7, 7]);
+        assert_eq!(vtt_time(Duration::from_millis(3_723_004)), "01:02:03.004");
+    }
+
+    #[test]
+    fn test_sprite_cues_cover_skipped_intervals() {
+        let mut sheets = SpriteSheets::new(Path::new("/nonexistent/test"), Duration::from_secs(5));
+        sheets.push(&thumbnail(4, 2, 1), 0).unwrap();
+        // Suspended for three intervals.
+        sheets.push(&thumbnail(4, 2, 2), 4).unwrap();
+        let times: Vec<_> = sheets
+            .cues
+            .iter()
+            .map(|cue| (cue.start.as_secs(), cue.end.as_secs()))
+            .collect();
+        assert_eq!(times, [(0, 20), (20, 25)]);
+    }
+}
@@ -0,0 +1,39 @@
+//! Buffer depths that scale with the frame rate.
+//!
+//! Pools and queues were sized for 60 fps. What they really need to cover is
+//! a stretch of time: the frames in flight between capture and the encoder,
+//! plus the encoder's own lookahead. At 120 Hz the same time holds twice as
+//! many frames, so sizes are given for 60 fps and scaled from there.
+
+const REFERENCE_FPS: u32 = 60;
+
+/// Surfaces in a capture or encoder pool: 16 at 60 fps, about 270 ms.
+/// Never fewer, so low rates keep the headroom they always had.
+pub fn pool_size(framerate: u32) -> usize {
+    scale(16, framerate).max(16)
+}
+
+/// Frames queued between capture and the encoder: 2 at 60 fps, so the
+/// encoder gets the same 33 ms of slack at any rate before frames are
+/// dropped.
+pub fn frame_queue(framerate: u32) -> usize {
+    scale(2, framerate).max(2)
+}
+
+fn scale(at_reference: usize, framerate: u32) -> usize {
+    (at_reference * framerate as usize).div_ceil(REFERENCE_FPS as usize)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_sizes_scale_with_framerate() {
+        assert_eq!((pool_size(30), frame_queue(30)), (16, 2));
+        assert_eq!((pool_size(60), frame_queue(60)), (16, 2));
+        assert_eq!((pool_size(90), frame_queue(90)), (24, 3));
+        assert_eq!((pool_size(120), frame_queue(120)), (32, 4));
+        assert_eq!((pool_size(144), frame_queue(144)), (39, 5));
+    }
+}
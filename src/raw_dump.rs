@@ -0,0 +1,308 @@
+use std::{
+    alloc::{self, Layout},
+    fs::{File, OpenOptions},
+    io::Write,
+    os::unix::fs::OpenOptionsExt,
+    path::Path,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        mpsc::{self, Receiver, SyncSender, TrySendError},
+        Arc,
+    },
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, Context, Result};
+use cros_codecs::{
+    backend::vaapi::surface_pool::PooledVaSurface,
+    libva::{Surface, VAImageFormat},
+};
+use nix::fcntl::{fcntl, FcntlArg, OFlag};
+
+use crate::{
+    capture::{CaptureOptions, Capturer},
+    va::{nv12_image_format, read_nv12},
+};
+
+/// O_DIRECT needs buffer addresses, sizes and file offsets aligned to the
+/// logical block size. 4 KiB covers every common filesystem.
+const IO_ALIGN: usize = 4096;
+
+/// Smallest size of each of the two write buffers. Several frames are packed
+/// into one buffer so every write() is large.
+const BUFFER_SIZE: usize = 32 << 20;
+
+/// Captured frames waiting for readback. Kept small so the dumper can't hold
+/// on to too many surfaces of the capture pool.
+const QUEUE_DEPTH: usize = 2;
+
+/// Writes captured frames as tightly packed raw NV12 (the `output.nv12` format
+/// used by the Justfile).
+///
+/// Readback and file I/O run on their own threads: the readback thread maps
+/// each surface and copies its planes straight into one of two large aligned
+/// buffers, and the writer thread flushes full buffers with O_DIRECT while the
+/// other one is being filled.
+pub struct RawDumper {
+    sender: Option<SyncSender<Arc<PooledVaSurface<()>>>>,
+    readback_thread: Option<JoinHandle<Result<u64>>>,
+    writer_thread: Option<JoinHandle<Result<u64>>>,
+    dropped: u64,
+}
+
+impl RawDumper {
+    pub fn new(path: &Path) -> Result<Self> {
+        let file = open_direct(path)?;
+        let (sender, receiver) = mpsc::sync_channel(QUEUE_DEPTH);
+        let (full_sender, full_receiver) = mpsc::channel::<(AlignedBuffer, bool)>();
+        let (free_sender, free_receiver) = mpsc::channel();
+        for _ in 0..2 {
+            free_sender.send(AlignedBuffer::new(BUFFER_SIZE)).unwrap();
+        }
+
+        let writer_thread = thread::Builder::new()
+            .name("raw-writer".into())
+            .spawn(move || write_buffers(file, full_receiver, free_sender))?;
+        let readback_thread = thread::Builder::new()
+            .name("raw-readback".into())
+            .spawn(move || readback_frames(receiver, free_receiver, full_sender))?;
+
+        Ok(Self {
+            sender: Some(sender),
+            readback_thread: Some(readback_thread),
+            writer_thread: Some(writer_thread),
+            dropped: 0,
+        })
+    }
+
+    /// Queues a frame for readback without blocking. If readback is behind the
+    /// frame is dropped and counted.
+    pub fn push(&mut self, frame: Arc<PooledVaSurface<()>>) -> Result<()> {
+        match self.sender.as_ref().unwrap().try_send(frame) {
+            Ok(()) => Ok(()),
+            Err(TrySendError::Full(_)) => {
+                self.dropped += 1;
+                Ok(())
+            }
+            Err(TrySendError::Disconnected(_)) => Err(self
+                .join()
+                .err()
+                .unwrap_or_else(|| anyhow!("Raw dump threads exited early"))),
+        }
+    }
+
+    /// Flushes everything to disk.
+    pub fn finish(mut self) -> Result<()> {
+        let (frames, bytes) = self.join()?;
+        println!(
+            "Raw dump: wrote {frames} frames ({} MiB), dropped {} frames",
+            bytes >> 20,
+            self.dropped
+        );
+        Ok(())
+    }
+
+    /// Stops both threads, returning the frames and bytes written.
+    fn join(&mut self) -> Result<(u64, u64)> {
+        self.sender.take();
+        let frames = self
+            .readback_thread
+            .take()
+            .map(|t| t.join().map_err(|_| anyhow!("Readback thread panicked"))?)
+            .unwrap_or(Ok(0));
+        let bytes = self
+            .writer_thread
+            .take()
+            .map(|t| t.join().map_err(|_| anyhow!("Writer thread panicked"))?)
+            .unwrap_or(Ok(0));
+        Ok((frames?, bytes?))
+    }
+}
+
+impl Drop for RawDumper {
+    fn drop(&mut self) {
+        self.join().ok();
+    }
+}
+
+/// Captures raw NV12 frames to `path` until `running` is cleared.
+pub fn run(
+    path: &Path,
+    framerate: i32,
+    capture: CaptureOptions,
+    running: Arc<AtomicBool>,
+) -> Result<()> {
+    let capturer = Capturer::new(capture)?;
+    let mut dumper = RawDumper::new(path)?;
+
+    let frame_duration = Duration::from_secs_f64(1.0 / framerate as f64);
+    let mut next_frame_time = Instant::now() + frame_duration;
+    while running.load(Ordering::SeqCst) {
+        if let Some(frame) = capturer.read_frame() {
+            dumper.push(frame)?;
+        }
+
+        let now = Instant::now();
+        if next_frame_time >= now {
+            thread::sleep(next_frame_time - now);
+            next_frame_time += frame_duration;
+        } else {
+            next_frame_time = now + frame_duration;
+        }
+    }
+    dumper.finish()
+}
+
+fn open_direct(path: &Path) -> Result<File> {
+    let open = |flags| {
+        OpenOptions::new()
+            .write(true)
+            .create(true)
+            .truncate(true)
+            .custom_flags(flags)
+            .open(path)
+    };
+    // tmpfs and some FUSE filesystems reject O_DIRECT, fall back to buffered I/O.
+    open(nix::libc::O_DIRECT)
+        .or_else(|_| open(0))
+        .with_context(|| format!("Failed to create {}", path.display()))
+}
+
+fn readback_frames(
+    queue: Receiver<Arc<PooledVaSurface<()>>>,
+    free_buffers: Receiver<AlignedBuffer>,
+    full_buffers: mpsc::Sender<(AlignedBuffer, bool)>,
+) -> Result<u64> {
+    let mut image_format: Option<VAImageFormat> = None;
+    let mut buffer = free_buffers.recv()?;
+    let mut frames = 0;
+
+    for frame in queue {
+        let surface: &Surface<()> = std::borrow::Borrow::borrow(frame.as_ref());
+        let (width, height) = surface.size();
+        let (width, height) = (width as usize, height as usize);
+        let frame_size = width * height * 3 / 2;
+
+        if buffer.len + frame_size > buffer.capacity {
+            // Hand over the aligned part and carry the tail into the next buffer.
+            let mut next = free_buffers.recv()?;
+            let aligned = buffer.len & !(IO_ALIGN - 1);
+            if next.capacity < buffer.len - aligned + frame_size {
+                // Frames too large for the buffer: replace it with one that
+                // fits them. The other one is replaced on its next turn.
+                next = AlignedBuffer::new(buffer_size(frame_size));
+            }
+            next.extend_from_slice(&buffer.as_slice()[aligned..]);
+            buffer.len = aligned;
+            full_buffers
+                .send((buffer, false))
+                .map_err(|_| anyhow!("Raw writer thread exited"))?;
+            buffer = next;
+        }
+
+        let format = match image_format {
+            Some(format) => format,
+            None => *image_format.insert(nv12_image_format(surface.display())?),
+        };
+        read_nv12(surface, format, |row| buffer.extend_from_slice(row))?;
+        frames += 1;
+    }
+
+    full_buffers
+        .send((buffer, true))
+        .map_err(|_| anyhow!("Raw writer thread exited"))?;
+    Ok(frames)
+}
+
+/// Size of a write buffer for frames of `frame_size` bytes: at least two of
+/// them, after the unaligned tail carried over from the previous buffer.
+fn buffer_size(frame_size: usize) -> usize {
+    BUFFER_SIZE.max((2 * frame_size + IO_ALIGN).next_multiple_of(IO_ALIGN))
+}
+
+fn write_buffers(
+    mut file: File,
+    full_buffers: Receiver<(AlignedBuffer, bool)>,
+    free_buffers: mpsc::Sender<AlignedBuffer>,
+) -> Result<u64> {
+    let mut written = 0;
+    for (mut buffer, last) in full_buffers {
+        if last && buffer.len % IO_ALIGN != 0 {
+            // The final partial block can't be written with O_DIRECT.
+            let flags = OFlag::from_bits_truncate(fcntl(&file, FcntlArg::F_GETFL)?);
+            fcntl(&file, FcntlArg::F_SETFL(flags - OFlag::O_DIRECT))?;
+        }
+        file.write_all(buffer.as_slice())
+            .context("Failed to write raw frames")?;
+        written += buffer.len as u64;
+        buffer.len = 0;
+        // The readback thread is gone after the last buffer.
+        free_buffers.send(buffer).ok();
+    }
+    file.sync_all()?;
+    Ok(written)
+}
+
+/// A heap buffer aligned for O_DIRECT.
+struct AlignedBuffer {
+    ptr: *mut u8,
+    capacity: usize,
+    len: usize,
+}
+
+// SAFETY: the buffer is uniquely owned and only moved between threads.
+unsafe impl Send for AlignedBuffer {}
+
+impl AlignedBuffer {
+    fn new(capacity: usize) -> Self {
+        let layout = Layout::from_size_align(capacity, IO_ALIGN).unwrap();
+        // SAFETY: layout has a non-zero size.
+        let ptr = unsafe { alloc::alloc(layout) };
+        if ptr.is_null() {
+            alloc::handle_alloc_error(layout);
+        }
+        Self {
+            ptr,
+            capacity,
+            len: 0,
+        }
+    }
+
+    fn as_slice(&self) -> &[u8] {
+        // SAFETY: the first len bytes have been written.
+        unsafe { std::slice::from_raw_parts(self.ptr, self.len) }
+    }
+
+    fn extend_from_slice(&mut self, data: &[u8]) {
+        assert!(self.len + data.len() <= self.capacity);
+        // SAFETY: bounds checked above, and data can't alias our allocation.
+        unsafe {
+            std::ptr::copy_nonoverlapping(data.as_ptr(), self.ptr.add(self.len), data.len());
+        }
+        self.len += data.len();
+    }
+}
+
+impl Drop for AlignedBuffer {
+    fn drop(&mut self) {
+        let layout = Layout::from_size_align(self.capacity, IO_ALIGN).unwrap();
+        // SAFETY: allocated in new() with the same layout.
+        unsafe { alloc::dealloc(self.ptr, layout) };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_buffers_fit_large_frames() {
+        assert_eq!(buffer_size(1920 * 1080 * 3 / 2), BUFFER_SIZE);
+        // 8K NV12 is about 50 MB, more than a default buffer.
+        let frame_size = 7680 * 4320 * 3 / 2;
+        let size = buffer_size(frame_size);
+        assert!(size >= IO_ALIGN - 1 + frame_size);
+        assert_eq!(size % IO_ALIGN, 0);
+    }
+}
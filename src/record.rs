@@ -0,0 +1,571 @@
+//! One-shot recording to a file, run as a pipeline of stages:
+//!
+//! ```text
+//! capture ─frames─▶ encode ─packets─▶ fanout ─▶ sinks
+//! ```
+//!
+//! Capture paces itself at the frame rate on the calling thread and never
+//! waits for the encoder: when the encoder falls behind, the frames edge
+//! fills up and frames are dropped. The DMABUF import happens earlier, on
+//! the PipeWire thread, and the VPP copy into the encoder's surface is part
+//! of the encode stage. Encoding and polling for packets share one encoder
+//! context, so they are one stage. The encoder waits for the fanout stage
+//! when the packets edge is full, but fanout never waits for its sinks.
+//!
+//! With an idle period set, capture stops ticking once no new frame came in
+//! for that long: the encoder session is released, timers of the auxiliary
+//! executor are paused, and the thread sleeps until the next frame, which
+//! starts a new session with an IDR. The capture pool and its VA display
+//! stay open, so that frame is imported as fast as any other.
+//!
+//! A flight recorder, if given, logs what happens to each frame along the
+//! way and dumps the seconds around any dropped or late frame.
+
+use std::{
+    io::Write,
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Mutex,
+    },
+    thread,
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, Error, Result};
+
+use crate::{
+    backend::{CaptureReset, EncoderConfig, FrameEncoder, FrameSource},
+    capture::{CaptureOptions, Capturer},
+    channel::{ChannelStats, Receiver, Sender, TrySendError},
+    cursor::Cursor,
+    encode_ffmpeg::{Encoder, EncoderSettings},
+    executor,
+    fanout::{FanOut, FileSink},
+    flight::{FlightEvent, FlightOptions, FlightRecorder},
+    frame_buffer::FrameReader,
+    frametime::Timeline,
+    packet::Packet,
+    pipeline::Pipeline,
+    preview::{PreviewOptions, Previewer},
+    rate,
+    recovery::{encode_frame, recover, Recovery, Stage},
+    storage::{BitrateRequest, SegmentSink, StorageOptions},
+    stub::{StubConfig, StubEncoder, StubSource},
+};
+
+pub struct RecordOptions {
+    pub output: PathBuf,
+    /// Timeline of the game's frame times.
+    pub frame_times: Option<PathBuf>,
+    /// Trace of buffer timing, for `--replay-trace`. Only on the VA-API
+    /// backend.
+    pub trace: Option<PathBuf>,
+    pub settings: EncoderSettings,
+    /// Encode only every Nth frame the game presents. A cursor update over
+    /// an unchanged frame counts as one.
+    pub decimate: u32,
+    pub capture: CaptureOptions,
+    /// Thumbnails taken while recording. Only on the VA-API backend.
+    pub preview: Option<PreviewOptions>,
+    /// Record to segments within a byte budget instead of to `output`.
+    pub storage: Option<StorageOptions>,
+    /// Time without new frames after which the pipeline is suspended.
+    pub idle_after: Option<Duration>,
+    /// Dumps of the events around dropped and late frames.
+    pub flight: Option<FlightOptions>,
+}
+
+/// What capture hands to the encode stage.
+enum Input<F> {
+    /// A frame, and when capture handed it over.
+    Frame(Arc<F>, Cursor, Instant),
+    /// An error on the capture thread, for the encode stage to recover from
+    /// since recovery rebuilds the encoder too.
+    Failure(Stage, Error),
+    /// Nothing new was captured for a while: drain and release the encoder.
+    Suspend,
+    /// Capture resumes after this many frame intervals without frames.
+    Resume(i64),
+}
+
+/// Whether a recording goes on, shared with whoever stops it, e.g. the
+/// Ctrl+C handler. Stopping also wakes the capture stage of the pipeline
+/// using it if that sleeps while suspended.
+#[derive(Clone)]
+pub struct Running {
+    flag: Arc<AtomicBool>,
+    /// Set by the capture stage while it runs.
+    waker: Arc<Mutex<Option<Box<dyn Fn() + Send + Sync>>>>,
+}
+
+impl Running {
+    /// Follows `flag`, which other modes may stop on too.
+    pub fn new(flag: Arc<AtomicBool>) -> Self {
+        Self {
+            flag,
+            waker: Arc::default(),
+        }
+    }
+
+    /// The flag alone, for modes that only poll it.
+    pub fn flag(&self) -> Arc<AtomicBool> {
+        self.flag.clone()
+    }
+
+    pub fn is_set(&self) -> bool {
+        self.flag.load(Ordering::SeqCst)
+    }
+
+    /// Clears the flag and wakes the capture stage to see it.
+    pub fn stop(&self) {
+        self.flag.store(false, Ordering::SeqCst);
+        if let Some(wake) = &*self.waker.lock().unwrap() {
+            wake();
+        }
+    }
+}
+
+/// Records until `running` is cleared, then drains every stage.
+pub fn run(options: RecordOptions, running: Running) -> Result<()> {
+    let framerate = options.settings.framerate;
+    let (fanout, bitrate) = file_output(&options.output, options.storage, framerate)?;
+    let capturer = Capturer::new(options.capture)?;
+    if let Some(path) = &options.trace {
+        capturer.record_trace(path)?;
+    }
+    let previewer = options
+        .preview
+        .map(|preview| Previewer::start(capturer.subscribe(), preview))
+        .transpose()?;
+    let timeline = options
+        .frame_times
+        .map(|path| Timeline::start(capturer.frame_times(), &path))
+        .transpose()?;
+    let flight = options.flight.map(FlightRecorder::new);
+    if let Some(flight) = &flight {
+        capturer.set_flight_recorder(flight.clone());
+    }
+    run_pipeline::<_, Encoder>(
+        &capturer,
+        options.settings,
+        framerate,
+        options.decimate,
+        fanout,
+        bitrate,
+        options.idle_after,
+        flight.clone(),
+        &running,
+    )?;
+    capturer.finish_trace()?;
+    flight.map_or(Ok(()), |flight| flight.finish())?;
+    timeline.map_or(Ok(()), Timeline::finish)?;
+    previewer.map_or(Ok(()), Previewer::finish)
+}
+
+/// Like [`run`], but on the CPU-only stub backend, to exercise the pipeline
+/// without a GPU.
+pub fn run_stub(options: RecordOptions, stub: StubConfig, running: Running) -> Result<()> {
+    let framerate = options.settings.framerate;
+    let (fanout, bitrate) = file_output(&options.output, options.storage, framerate)?;
+    let source = StubSource::start(stub.clone())?;
+    if stub.trace.is_some() {
+        source.stop_at_end(running.clone());
+    }
+    let timeline = options
+        .frame_times
+        .map(|path| Timeline::start(source.frame_times(), &path))
+        .transpose()?;
+    let flight = options.flight.map(FlightRecorder::new);
+    run_pipeline::<_, StubEncoder>(
+        &source,
+        stub,
+        framerate,
+        options.decimate,
+        fanout,
+        bitrate,
+        options.idle_after,
+        flight.clone(),
+        &running,
+    )?;
+    flight.map_or(Ok(()), |flight| flight.finish())?;
+    timeline.map_or(Ok(()), Timeline::finish)
+}
+
+/// Returns the fanout writing to `output`, or to segments if `storage` is
+/// given, and where the segment sink asks for a lower bitrate. A plain
+/// output file is the primary sink and gets every packet; segments drop to
+/// the next keyframe when the disk falls behind, and fail over instead.
+fn file_output(
+    output: &Path,
+    storage: Option<StorageOptions>,
+    framerate: i32,
+) -> Result<(FanOut, Arc<BitrateRequest>)> {
+    let mut fanout = FanOut::new();
+    let bitrate = Arc::new(BitrateRequest::default());
+    let queue = 2 * framerate as usize;
+    match storage {
+        Some(storage) => {
+            fanout.add("output", queue, SegmentSink::new(storage, bitrate.clone())?)?
+        }
+        None => fanout.add_primary("output", queue, FileSink::create(output)?)?,
+    };
+    Ok((fanout, bitrate))
+}
+
+/// Runs capture from `source` on the calling thread, and the encode and
+/// fanout stages on their own, until `running` is cleared and everything
+/// has been drained. Frames are encoded at `framerate`, every `decimate`th
+/// one presented. The encoder switches to the bitrates asked for through
+/// `bitrate`, and everything is suspended after `idle_after` without new
+/// frames. Frame events go to `flight`, if given. Returns the stats of each
+/// edge.
+pub fn run_pipeline<S, E>(
+    source: &S,
+    config: E::Config,
+    framerate: i32,
+    decimate: u32,
+    fanout: FanOut,
+    bitrate: Arc<BitrateRequest>,
+    idle_after: Option<Duration>,
+    flight: Option<Arc<FlightRecorder>>,
+    running: &Running,
+) -> Result<Vec<(String, ChannelStats)>>
+where
+    S: FrameSource,
+    E: FrameEncoder<Frame = S::Frame> + 'static,
+{
+    let mut pipeline = Pipeline::new();
+    // Kept short: each queued frame holds a surface of the capture pool.
+    let frame_queue = rate::frame_queue(framerate as u32);
+    let (frames, frames_in) = pipeline.channel("frames", frame_queue);
+    let (packets, packets_in) = pipeline.channel("packets", 2 * framerate as usize);
+    pipeline.spawn("encode", {
+        let capture = source.control();
+        let flight = flight.clone();
+        move || encode_stage::<E, _>(frames_in, packets, config, bitrate, capture, flight)
+    })?;
+    pipeline.spawn("fanout", move || fanout_stage(packets_in, fanout))?;
+
+    let start = Instant::now();
+    capture_stage(
+        source,
+        frames,
+        framerate,
+        decimate,
+        idle_after,
+        flight.as_ref(),
+        running,
+    );
+    let result = pipeline.join();
+    let elapsed = start.elapsed().as_secs_f64();
+    let stats = pipeline.stats();
+    let frames_sent = stats[0].1.sent;
+    println!(
+        "Passed {frames_sent} frames to the encoder in {elapsed:.1}s ({:.1} fps, target {framerate})",
+        frames_sent as f64 / elapsed
+    );
+    println!("Pipeline edges:\n{}", pipeline.report());
+    result.map(|()| stats)
+}
+
+/// Picks every `every`th frame the game presents by the sequence numbers of
+/// the frames read, rather than by when capture looked, so timing jitter
+/// doesn't change which frames are encoded.
+struct Decimation {
+    every: u64,
+    /// Frames from this sequence number on are encoded.
+    next: u64,
+}
+
+impl Decimation {
+    fn new(every: u32) -> Self {
+        Self {
+            every: every as u64,
+            next: 0,
+        }
+    }
+
+    /// Returns whether the new frame read at `seq` is encoded: every
+    /// `every`th one presented, or the first one read after it if it was
+    /// missed.
+    fn keep(&mut self, seq: u64) -> bool {
+        if seq < self.next {
+            return false;
+        }
+        // Counted from the first frame, so a frame read late doesn't shift
+        // which ones come after it.
+        let base = if self.next == 0 { seq } else { self.next };
+        self.next = base + ((seq - base) / self.every + 1) * self.every;
+        true
+    }
+}
+
+/// Hands the latest frame to the encoder once per frame interval, until
+/// `running` is cleared or the encoder stops. With `decimate` above one,
+/// capture instead wakes for every frame the game presents and hands over
+/// the ones [`Decimation`] picks, and only encodes the same frame again
+/// when nothing was presented for a frame interval.
+fn capture_stage<S: FrameSource>(
+    source: &S,
+    frames: Sender<Input<S::Frame>>,
+    framerate: i32,
+    decimate: u32,
+    idle_after: Option<Duration>,
+    flight: Option<&Arc<FlightRecorder>>,
+    running: &Running,
+) {
+    let frame_duration = Duration::from_secs_f64(1.0 / framerate as f64);
+    let mut next_frame_time = Instant::now() + frame_duration;
+    let mut new_frames = source.subscribe();
+    // Set before `running` is checked, so a concurrent stop is either seen
+    // or wakes the wait for the next frame.
+    *running.waker.lock().unwrap() = Some(new_frames.waker());
+    let mut decimation = (decimate > 1).then(|| Decimation::new(decimate));
+    let mut last_new_frame = Instant::now();
+    while running.is_set() {
+        if let Some((stage, error)) = source.take_error() {
+            if frames.send(Input::Failure(stage, error)).is_err() {
+                break;
+            }
+        }
+
+        if idle_after.is_some_and(|idle| last_new_frame.elapsed() >= idle) {
+            if !suspend(source, &mut new_frames, &frames, frame_duration, running) {
+                break;
+            }
+            last_new_frame = Instant::now();
+            next_frame_time = last_new_frame + frame_duration;
+            continue;
+        }
+
+        let (frame, keep) = match new_frames.read_new() {
+            Some(frame) => {
+                last_new_frame = Instant::now();
+                let seq = new_frames.seq();
+                let keep = decimation.as_mut().map_or(true, |d| d.keep(seq));
+                (Some(frame), keep)
+            }
+            // Nothing new: the same frame is encoded again.
+            None => (source.read_frame(), true),
+        };
+        match (keep, frame) {
+            (false, _) => {}
+            (true, Some(frame)) => {
+                match frames.try_send(Input::Frame(frame, source.cursor(), Instant::now())) {
+                    Ok(()) => {
+                        if let Some(flight) = flight {
+                            flight.record(FlightEvent::Captured);
+                        }
+                    }
+                    // A full edge is counted as a drop in its stats.
+                    Err(TrySendError::Full(_)) => {
+                        if let Some(flight) = flight {
+                            flight.dropped();
+                        }
+                    }
+                    // The encode stage failed, its error comes out of join().
+                    Err(TrySendError::Closed(_)) => break,
+                }
+            }
+            (true, None) => eprintln!("No frame captured"),
+        }
+
+        if decimation.is_some() {
+            // Until the next presented frame, or a frame interval without.
+            new_frames.wait_until(Instant::now() + frame_duration);
+            continue;
+        }
+        // Wait 1/60s-processing_time before capturing the next frame
+        let now = Instant::now();
+        if next_frame_time >= now {
+            thread::sleep(next_frame_time - now);
+            next_frame_time += frame_duration;
+        } else {
+            // If we are behind schedule, skip to the next frame time
+            next_frame_time = now + frame_duration;
+        }
+    }
+    running.waker.lock().unwrap().take();
+}
+
+/// Suspends the encode stage and the executor's timers, then sleeps until
+/// the next new frame and hands it over. Returns false if the pipeline
+/// stopped in the meantime.
+fn suspend<S: FrameSource>(
+    source: &S,
+    new_frames: &mut FrameReader<S::Frame>,
+    frames: &Sender<Input<S::Frame>>,
+    frame_duration: Duration,
+    running: &Running,
+) -> bool {
+    println!("\nNo new frames, suspending until the next one");
+    if frames.send(Input::Suspend).is_err() {
+        return false;
+    }
+    let start = Instant::now();
+    let frame = {
+        // Nothing wakes up on a schedule until the next frame.
+        let _timers = executor::pause_timers();
+        new_frames.wait_new(&running.flag)
+    };
+    let Some(frame) = frame else {
+        return false;
+    };
+    let idle = start.elapsed();
+    println!("Resuming after {:.1}s idle", idle.as_secs_f64());
+    let skipped = (idle.as_secs_f64() / frame_duration.as_secs_f64()) as i64;
+    frames.send(Input::Resume(skipped)).is_ok()
+        && frames
+            .send(Input::Frame(frame, source.cursor(), Instant::now()))
+            .is_ok()
+}
+
+fn encode_stage<E, C>(
+    frames: Receiver<Input<E::Frame>>,
+    packets: Sender<Packet>,
+    mut config: E::Config,
+    bitrate: Arc<BitrateRequest>,
+    capture: C,
+    flight: Option<Arc<FlightRecorder>>,
+) -> Result<()>
+where
+    E: FrameEncoder,
+    E::Frame: Send + Sync + 'static,
+    C: CaptureReset,
+{
+    let record = |event| {
+        if let Some(flight) = &flight {
+            flight.record(event);
+        }
+    };
+    let send = |packet: Packet| {
+        if let Some(flight) = &flight {
+            flight.packet(&packet);
+        }
+        packets
+            .send(packet)
+            .map_err(|_| anyhow!("Fanout stage stopped"))
+    };
+    let mut encoder: Option<E> = None;
+    let mut recovery = Recovery::new();
+    let mut next_pts = 0;
+    // Set from a resume until its first frame went into a new session.
+    let mut resuming = false;
+    for input in frames.iter() {
+        let mut failure = None;
+        if let Some(bitrate) = bitrate.take() {
+            // Also for the sessions recovery opens later.
+            config.settings_mut().bitrate = bitrate;
+            if let Some(encoder) = &mut encoder {
+                if let Err(e) = encoder.set_bitrate(bitrate) {
+                    failure = Some((Stage::Encode, e));
+                }
+            }
+        }
+        match input {
+            Input::Frame(frame, cursor, captured) => {
+                let opened = encoder.is_none();
+                let start = Instant::now();
+                match encode_frame(&mut encoder, &config, next_pts, frame, cursor) {
+                    Ok(()) => recovery.on_success(),
+                    Err(e) => failure = Some((Stage::Encode, e)),
+                }
+                if std::mem::take(&mut resuming) && failure.is_none() {
+                    report_resume(captured.elapsed(), config.settings().framerate);
+                }
+                if let (Some(flight), Some(encoder), None) = (&flight, &encoder, &failure) {
+                    flight.submitted(encoder.next_pts() - 1, captured, start, opened);
+                }
+            }
+            Input::Failure(stage, error) => failure = Some((stage, error)),
+            Input::Suspend => {
+                record(FlightEvent::Suspended);
+                // Frees the encoder's surfaces; the next frame opens a new
+                // session, which starts with an IDR.
+                if let Some(mut old) = encoder.take() {
+                    next_pts = old.next_pts();
+                    match old.drain_packets() {
+                        Ok(packets) => {
+                            for packet in packets {
+                                send(packet)?;
+                            }
+                        }
+                        Err(e) => failure = Some((Stage::Encode, e)),
+                    }
+                }
+            }
+            // Timestamps keep counting through the idle time, so the stream
+            // stays in sync with wall time for muxers and replays.
+            Input::Resume(skipped) => {
+                record(FlightEvent::Resumed);
+                next_pts += skipped;
+                resuming = true;
+            }
+        }
+
+        if let Some(encoder) = &mut encoder {
+            loop {
+                match encoder.poll_packet() {
+                    Ok(Some(packet)) => send(packet)?,
+                    Ok(None) => break,
+                    Err(e) => {
+                        failure = failure.or(Some((Stage::Encode, e)));
+                        break;
+                    }
+                }
+            }
+        }
+
+        if let Some((stage, error)) = failure {
+            record(FlightEvent::Failure { stage });
+            let salvaged = recover(
+                &mut recovery,
+                stage,
+                error,
+                &capture,
+                &mut encoder,
+                &mut next_pts,
+            )?;
+            for packet in salvaged {
+                send(packet)?;
+            }
+        }
+    }
+
+    // Drain the encoder and write any remaining frames to the output file
+    println!("\nDraining encoder...");
+    if let Some(mut encoder) = encoder {
+        for packet in encoder.drain_packets()? {
+            send(packet)?;
+        }
+    }
+    Ok(())
+}
+
+/// Reports how long the first frame after a resume took from its arrival
+/// until it was in the new session, which ideally fits in one interval.
+fn report_resume(took: Duration, framerate: i32) {
+    let target = Duration::from_secs_f64(1.0 / framerate as f64);
+    let ms = took.as_secs_f64() * 1000.0;
+    if took > target {
+        println!(
+            "Resumed in {:.1} ms, over the {:.1} ms frame interval",
+            ms,
+            target.as_secs_f64() * 1000.0
+        );
+    } else {
+        println!("Resumed in {:.1} ms", ms);
+    }
+}
+
+fn fanout_stage(packets: Receiver<Packet>, mut fanout: FanOut) -> Result<()> {
+    for (count, packet) in packets.iter().enumerate() {
+        fanout.send(&packet)?;
+        if (count + 1) % 60 == 0 {
+            print!(".");
+            std::io::stdout().flush().expect("Failed to flush stdout");
+        }
+    }
+    fanout.finish()
+}
@@ -0,0 +1,434 @@
+//! Recovery from VA and encoder failures.
+//!
+//! Errors are classified as transient (drop the frame and carry on) or as
+//! device errors, which tear down the VA display, surface pools and encoder
+//! session and rebuild them. The rebuilt encoder starts with an IDR at the
+//! next timestamp, so the output stays one decodable stream with a short gap.
+//! Only a pipeline that keeps failing right after being rebuilt is fatal.
+//!
+//! Failures can be injected at every stage with `--inject-faults` to exercise
+//! these paths without a misbehaving GPU.
+
+use std::{
+    fmt, io,
+    str::FromStr,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc, OnceLock,
+    },
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, bail, Context, Error, Result};
+use nix::errno::Errno;
+
+use crate::{
+    backend::{CaptureReset, FrameEncoder},
+    cursor::Cursor,
+    packet::Packet,
+};
+
+/// Recovery should take less than this, from failure to the first frame
+/// encoded by the rebuilt pipeline.
+pub const RECOVERY_TARGET: Duration = Duration::from_millis(100);
+/// Transient errors in a row after which the pipeline is rebuilt anyway.
+const MAX_TRANSIENT: u32 = 10;
+/// Rebuilds within [`REBUILD_WINDOW`] after which we give up.
+const MAX_REBUILDS: usize = 5;
+const REBUILD_WINDOW: Duration = Duration::from_secs(10);
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Stage {
+    /// Getting buffers from PipeWire and setting up the capture pool.
+    Capture,
+    /// Copying a DMABUF into a VA surface.
+    Import,
+    /// Submitting frames to and receiving packets from the encoder.
+    Encode,
+}
+
+impl Stage {
+    const ALL: [Stage; 3] = [Stage::Capture, Stage::Import, Stage::Encode];
+
+    fn name(self) -> &'static str {
+        match self {
+            Stage::Capture => "capture",
+            Stage::Import => "import",
+            Stage::Encode => "encode",
+        }
+    }
+}
+
+impl fmt::Display for Stage {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        f.write_str(self.name())
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Severity {
+    /// The device is fine, only this frame is lost.
+    Transient,
+    /// The display or encoder session is unusable and has to be rebuilt.
+    Device,
+}
+
+/// Classifies an error by the OS error at the root of it, if any.
+///
+/// VA and FFmpeg errors carry no reliable hint about the state of the device,
+/// so anything unrecognized is treated as a device error: rebuilding costs a
+/// few milliseconds, while reusing a broken session loses the recording.
+pub fn classify(error: &Error) -> Severity {
+    for cause in error.chain() {
+        if let Some(fault) = cause.downcast_ref::<InjectedFault>() {
+            return fault.severity;
+        }
+        let errno = cause.downcast_ref::<Errno>().copied().or_else(|| {
+            cause
+                .downcast_ref::<io::Error>()
+                .and_then(|e| e.raw_os_error())
+                .map(Errno::from_raw)
+        });
+        match errno {
+            Some(Errno::EAGAIN | Errno::EBUSY | Errno::EINTR | Errno::ETIMEDOUT) => {
+                return Severity::Transient
+            }
+            Some(_) => return Severity::Device,
+            None => {}
+        }
+    }
+    Severity::Device
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Action {
+    /// Drop the current frame and keep going.
+    Skip,
+    /// Rebuild the display, pools and encoder session.
+    Rebuild,
+}
+
+/// Decides how to react to errors and keeps track of recoveries.
+#[derive(Default)]
+pub struct Recovery {
+    transient_in_a_row: u32,
+    rebuilds: Vec<Instant>,
+    /// When the failure being recovered from happened.
+    recovering_since: Option<(Stage, Instant)>,
+}
+
+impl Recovery {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Returns what to do about `error`, or the error itself once the
+    /// pipeline has been rebuilt too often to expect another rebuild to help.
+    pub fn on_error(&mut self, stage: Stage, error: Error) -> Result<Action> {
+        let severity = classify(&error);
+        eprintln!("{stage} failed ({severity:?}): {error:#}");
+        self.recovering_since.get_or_insert((stage, Instant::now()));
+
+        if severity == Severity::Transient {
+            self.transient_in_a_row += 1;
+            if self.transient_in_a_row < MAX_TRANSIENT {
+                return Ok(Action::Skip);
+            }
+        }
+
+        let now = Instant::now();
+        self.rebuilds
+            .retain(|&time| now.duration_since(time) < REBUILD_WINDOW);
+        if self.rebuilds.len() >= MAX_REBUILDS {
+            return Err(error.context(format!(
+                "giving up after {MAX_REBUILDS} recoveries within {}s",
+                REBUILD_WINDOW.as_secs()
+            )));
+        }
+        self.rebuilds.push(now);
+        self.transient_in_a_row = 0;
+        Ok(Action::Rebuild)
+    }
+
+    /// Called once a frame went through the whole pipeline.
+    pub fn on_success(&mut self) {
+        self.transient_in_a_row = 0;
+        if let Some((stage, since)) = self.recovering_since.take() {
+            let elapsed = since.elapsed();
+            let note = if elapsed > RECOVERY_TARGET {
+                format!(", over the {}ms target", RECOVERY_TARGET.as_millis())
+            } else {
+                String::new()
+            };
+            println!(
+                "Recovered from {stage} failure in {:.1}ms{note}",
+                elapsed.as_secs_f64() * 1000.0
+            );
+        }
+    }
+
+    pub fn is_recovering(&self) -> bool {
+        self.recovering_since.is_some()
+    }
+}
+
+/// Creates the encoder from `frame` if there is none, e.g. at startup or
+/// after a rebuild. A new session continues at `next_pts` and starts with an
+/// IDR.
+pub fn prepare_encoder<'a, E: FrameEncoder>(
+    encoder: &'a mut Option<E>,
+    config: &E::Config,
+    next_pts: i64,
+    frame: &Arc<E::Frame>,
+) -> Result<&'a mut E> {
+    if encoder.is_none() {
+        let mut new_encoder = E::new(config, frame).context("Failed to create encoder")?;
+        new_encoder.set_next_pts(next_pts);
+        *encoder = Some(new_encoder);
+    }
+    Ok(encoder.as_mut().unwrap())
+}
+
+/// Encodes `frame` with `cursor` blended in, first creating the encoder if
+/// there is none.
+pub fn encode_frame<E: FrameEncoder>(
+    encoder: &mut Option<E>,
+    config: &E::Config,
+    next_pts: i64,
+    frame: Arc<E::Frame>,
+    cursor: Cursor,
+) -> Result<()> {
+    let encoder = prepare_encoder(encoder, config, next_pts, &frame)?;
+    encoder.set_cursor(cursor);
+    encoder.encode(frame)
+}
+
+/// Handles a pipeline error: drops the frame, or tears down the encoder and
+/// the capture pool so that both are recreated from the next frame.
+///
+/// The old encoder is drained as far as it still works, and `next_pts` is set
+/// to where it stopped, so the new session continues the timestamps.
+pub fn recover<E: FrameEncoder>(
+    recovery: &mut Recovery,
+    stage: Stage,
+    error: Error,
+    capture: &impl CaptureReset,
+    encoder: &mut Option<E>,
+    next_pts: &mut i64,
+) -> Result<Vec<Packet>> {
+    if recovery.on_error(stage, error)? == Action::Skip {
+        return Ok(Vec::new());
+    }
+    let mut salvaged = Vec::new();
+    if let Some(mut old) = encoder.take() {
+        *next_pts = old.next_pts();
+        salvaged = old.drain_packets().unwrap_or_default();
+    }
+    // If the device isn't back yet, the old pool keeps failing and we try
+    // again, until the rebuild budget runs out.
+    if let Err(e) = capture.reset() {
+        eprintln!("Failed to rebuild the capture pool: {e:#}");
+    }
+    Ok(salvaged)
+}
+
+/// Fails the `n`th call at a stage, for testing recovery.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct FaultSpec {
+    pub stage: Stage,
+    /// Fail every `every`th call.
+    pub every: u64,
+    pub severity: Severity,
+}
+
+impl FromStr for FaultSpec {
+    type Err = Error;
+
+    /// Parses `stage:every[:transient]`, e.g. `encode:300` to lose the
+    /// encoder every 300 frames.
+    fn from_str(value: &str) -> Result<Self> {
+        let mut parts = value.split(':');
+        let stage = parts.next().unwrap_or_default();
+        let stage = Stage::ALL
+            .into_iter()
+            .find(|s| s.name() == stage)
+            .ok_or_else(|| anyhow!("unknown stage '{stage}'"))?;
+        let every: u64 = parts
+            .next()
+            .ok_or_else(|| anyhow!("missing interval in '{value}'"))?
+            .parse()
+            .context("invalid interval")?;
+        if every == 0 {
+            bail!("interval must be at least 1");
+        }
+        let severity = match parts.next() {
+            None | Some("device") => Severity::Device,
+            Some("transient") => Severity::Transient,
+            Some(other) => bail!("unknown severity '{other}'"),
+        };
+        Ok(Self {
+            stage,
+            every,
+            severity,
+        })
+    }
+}
+
+#[derive(Debug)]
+pub struct InjectedFault {
+    stage: Stage,
+    severity: Severity,
+}
+
+impl fmt::Display for InjectedFault {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "injected {:?} fault at {}", self.severity, self.stage)
+    }
+}
+
+impl std::error::Error for InjectedFault {}
+
+pub struct FaultInjector {
+    specs: Vec<FaultSpec>,
+    calls: [AtomicU64; 3],
+}
+
+impl FaultInjector {
+    pub fn new(specs: Vec<FaultSpec>) -> Self {
+        Self {
+            specs,
+            calls: Default::default(),
+        }
+    }
+
+    pub fn check(&self, stage: Stage) -> Result<()> {
+        let index = Stage::ALL.iter().position(|&s| s == stage).unwrap();
+        let call = self.calls[index].fetch_add(1, Ordering::Relaxed) + 1;
+        match self
+            .specs
+            .iter()
+            .find(|spec| spec.stage == stage && call % spec.every == 0)
+        {
+            Some(spec) => Err(InjectedFault {
+                stage,
+                severity: spec.severity,
+            }
+            .into()),
+            None => Ok(()),
+        }
+    }
+}
+
+static FAULTS: OnceLock<FaultInjector> = OnceLock::new();
+
+/// Enables fault injection for the whole process.
+pub fn inject_faults(specs: Vec<FaultSpec>) {
+    if !specs.is_empty() {
+        FAULTS.get_or_init(|| FaultInjector::new(specs));
+    }
+}
+
+/// Returns an injected failure for `stage` when one is due.
+pub fn fault_point(stage: Stage) -> Result<()> {
+    match FAULTS.get() {
+        Some(faults) => faults.check(stage),
+        None => Ok(()),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_classify() {
+        assert_eq!(classify(&Error::from(Errno::EAGAIN)), Severity::Transient);
+        assert_eq!(
+            classify(
+                &Error::from(io::Error::from_raw_os_error(Errno::EIO as i32)).context("import")
+            ),
+            Severity::Device
+        );
+        assert_eq!(classify(&anyhow!("vaEndPicture failed")), Severity::Device);
+    }
+
+    #[test]
+    fn test_parse_fault_spec() {
+        let spec: FaultSpec = "encode:300".parse().unwrap();
+        assert_eq!(
+            spec,
+            FaultSpec {
+                stage: Stage::Encode,
+                every: 300,
+                severity: Severity::Device
+            }
+        );
+        let spec: FaultSpec = "import:7:transient".parse().unwrap();
+        assert_eq!(spec.severity, Severity::Transient);
+        assert!("encode".parse::<FaultSpec>().is_err());
+        assert!("upload:1".parse::<FaultSpec>().is_err());
+        assert!("encode:0".parse::<FaultSpec>().is_err());
+    }
+
+    /// Drives a mock pipeline with faults injected at every stage and checks
+    /// that each one is recovered from and frames keep coming.
+    #[test]
+    fn test_recovers_from_injected_faults() {
+        for stage in Stage::ALL {
+            for severity in [Severity::Transient, Severity::Device] {
+                let faults = FaultInjector::new(vec![FaultSpec {
+                    stage,
+                    every: 25,
+                    severity,
+                }]);
+                let mut recovery = Recovery::new();
+                let (mut encoded, mut rebuilds) = (0, 0);
+                for _ in 0..101 {
+                    let result = Stage::ALL.iter().try_for_each(|&s| faults.check(s));
+                    match result {
+                        Ok(()) => {
+                            recovery.on_success();
+                            encoded += 1;
+                        }
+                        Err(error) => {
+                            if recovery.on_error(stage, error).unwrap() == Action::Rebuild {
+                                rebuilds += 1;
+                            }
+                        }
+                    }
+                }
+                assert_eq!(encoded, 97, "{stage} {severity:?}");
+                let expected = if severity == Severity::Device { 4 } else { 0 };
+                assert_eq!(rebuilds, expected, "{stage} {severity:?}");
+                assert!(!recovery.is_recovering());
+            }
+        }
+    }
+
+    #[test]
+    fn test_gives_up_on_persistent_failure() {
+        let mut recovery = Recovery::new();
+        for _ in 0..MAX_REBUILDS {
+            assert_eq!(
+                recovery.on_error(Stage::Encode, anyhow!("lost")).unwrap(),
+                Action::Rebuild
+            );
+        }
+        assert!(recovery.on_error(Stage::Encode, anyhow!("lost")).is_err());
+
+        // Transient errors only escalate once they keep happening.
+        let mut recovery = Recovery::new();
+        for _ in 1..MAX_TRANSIENT {
+            let error = Error::from(Errno::EBUSY);
+            assert_eq!(
+                recovery.on_error(Stage::Import, error).unwrap(),
+                Action::Skip
+            );
+        }
+        let error = Error::from(Errno::EBUSY);
+        assert_eq!(
+            recovery.on_error(Stage::Import, error).unwrap(),
+            Action::Rebuild
+        );
+    }
+}
@@ -0,0 +1,81 @@
+use std::{collections::VecDeque, io::Write};
+
+use anyhow::Result;
+
+use crate::packet::Packet;
+
+/// Keeps the last `duration` frames of encoded packets in memory so they can
+/// be saved on demand.
+///
+/// The buffer is always trimmed at a keyframe boundary, so whatever is saved
+/// starts with an IDR and decodes on its own.
+pub struct ReplayBuffer {
+    duration: i64,
+    packets: VecDeque<Packet>,
+}
+
+impl ReplayBuffer {
+    /// `duration` is in frames (i.e. in units of the packet timestamps).
+    pub fn new(duration: i64) -> Self {
+        Self {
+            duration,
+            packets: VecDeque::new(),
+        }
+    }
+
+    /// Keeps a reference to `packet`; its data is shared, not copied.
+    pub fn push(&mut self, packet: &Packet) {
+        if self.packets.is_empty() && !packet.is_keyframe() {
+            // Nothing decodable until the first keyframe.
+            return;
+        }
+        let pts = packet.pts();
+        self.packets.push_back(packet.clone());
+
+        // Drop whole GOPs from the front while the next one still covers the
+        // requested duration.
+        while let Some(next_key) = self
+            .packets
+            .iter()
+            .skip(1)
+            .position(|p| p.is_keyframe())
+            .map(|i| i + 1)
+        {
+            if pts - self.packets[next_key].pts() + 1 < self.duration {
+                break;
+            }
+            self.packets.drain(..next_key);
+        }
+    }
+
+    pub fn clear(&mut self) {
+        self.packets.clear();
+    }
+
+    /// Writes the buffered packets, returning the number of frames written.
+    pub fn write_to(&self, writer: &mut impl Write) -> Result<usize> {
+        for packet in &self.packets {
+            writer.write_all(packet.data())?;
+        }
+        Ok(self.packets.len())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_trims_at_keyframes() {
+        let mut replay = ReplayBuffer::new(4);
+        // Leading non-keyframes are dropped.
+        replay.push(&Packet::from_bytes(vec![0], 0, false));
+        for pts in 1..=10 {
+            replay.push(&Packet::from_bytes(vec![pts as u8], pts, pts % 3 == 1));
+        }
+        let mut out = Vec::new();
+        replay.write_to(&mut out).unwrap();
+        // Keyframes at 1, 4, 7 and 10: 7..=10 still covers 4 frames.
+        assert_eq!(out, vec![7, 8, 9, 10]);
+    }
+}
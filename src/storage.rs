@@ -0,0 +1,407 @@
+//! Recording within a byte budget.
+//!
+//! Instead of one file that grows until the disk is full, the recording is
+//! written as segments that each start with an IDR, so every segment plays
+//! on its own and deleting the oldest one leaves a valid recording. The
+//! sink keeps the segments within the budget and within the free space of
+//! the filesystem, asks the encoder for a lower bitrate when that space
+//! would hold less than the minimum retention, and moves on to the next
+//! directory when the current one fails or can't keep up.
+//!
+//! Like any sink it runs on its own thread behind the fanout's queue, so a
+//! slow or full disk drops packets for this sink at worst, never stalls the
+//! encoder.
+
+use std::{
+    collections::VecDeque,
+    fs::{self, File},
+    io::Write,
+    path::{Path, PathBuf},
+    sync::{
+        atomic::{AtomicI64, Ordering},
+        Arc,
+    },
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, bail, Context, Result};
+use nix::{libc, sys::statvfs::statvfs};
+
+use crate::{fanout::Sink, packet::Packet};
+
+/// Free space left to the rest of the system on the target filesystem.
+const RESERVE: u64 = 256 << 20;
+
+/// Lowest bitrate the governor asks for, in bits/s.
+const MIN_BITRATE: i64 = 1_000_000;
+
+/// How often free space and write load are checked.
+const CHECK_INTERVAL: Duration = Duration::from_secs(1);
+
+/// Share of the time spent in write() above which a directory is too slow:
+/// the sink's queue would fill up and packets be dropped soon.
+const MAX_WRITE_LOAD: f64 = 0.8;
+
+pub struct StorageOptions {
+    /// Directories to write to, in order of preference.
+    pub dirs: Vec<PathBuf>,
+    /// File name prefix of the segments, `<name>-<n>.h264`.
+    pub name: String,
+    /// Bytes all segments may take together.
+    pub budget: u64,
+    /// Frames per segment. A segment ends at the first IDR after that.
+    pub segment_frames: i64,
+    /// Configured bitrate, which the governor only ever lowers.
+    pub bitrate: i64,
+    /// Seconds of video the budget should hold at least, before the
+    /// bitrate is lowered to make it fit.
+    pub min_retention: Duration,
+}
+
+/// Parses a size in bytes, accepting the binary `K`, `M`, `G` and `T`
+/// suffixes.
+pub fn parse_bytes(value: &str) -> Result<u64> {
+    let (digits, shift) = match value.as_bytes().last() {
+        Some(b'k' | b'K') => (&value[..value.len() - 1], 10),
+        Some(b'm' | b'M') => (&value[..value.len() - 1], 20),
+        Some(b'g' | b'G') => (&value[..value.len() - 1], 30),
+        Some(b't' | b'T') => (&value[..value.len() - 1], 40),
+        _ => (value, 0),
+    };
+    let bytes: u64 = digits
+        .parse()
+        .with_context(|| format!("invalid size '{value}'"))?;
+    if bytes == 0 {
+        bail!("size must be positive");
+    }
+    bytes
+        .checked_mul(1 << shift)
+        .ok_or_else(|| anyhow!("size '{value}' is too large"))
+}
+
+/// A bitrate the storage sink wants the encoder to switch to, picked up by
+/// the encode stage between frames.
+#[derive(Default)]
+pub struct BitrateRequest(AtomicI64);
+
+impl BitrateRequest {
+    fn set(&self, bitrate: i64) {
+        self.0.store(bitrate, Ordering::Relaxed);
+    }
+
+    /// Returns the bitrate asked for since the last call, if any.
+    pub fn take(&self) -> Option<i64> {
+        Some(self.0.swap(0, Ordering::Relaxed)).filter(|&bitrate| bitrate > 0)
+    }
+}
+
+struct Segment {
+    path: PathBuf,
+    bytes: u64,
+}
+
+struct OpenSegment {
+    file: File,
+    segment: Segment,
+    start_pts: i64,
+}
+
+pub struct SegmentSink {
+    options: StorageOptions,
+    bitrate: Arc<BitrateRequest>,
+    requested_bitrate: i64,
+    /// Index in `options.dirs` of the directory written to.
+    dir: usize,
+    current: Option<OpenSegment>,
+    /// Finished segments, oldest first.
+    closed: VecDeque<Segment>,
+    /// Bytes of every segment, including the open one.
+    total: u64,
+    /// Budget capped by the free space, updated every check.
+    effective_budget: u64,
+    next_index: u64,
+    deleted: u64,
+    /// After a failed write, packets are skipped up to the next IDR so the
+    /// next segment starts decodable.
+    waiting_for_keyframe: bool,
+    /// Set when the directory is too slow, to move on at the next IDR.
+    switch_dir: bool,
+    last_check: Instant,
+    busy: Duration,
+}
+
+impl SegmentSink {
+    pub fn new(options: StorageOptions, bitrate: Arc<BitrateRequest>) -> Result<Self> {
+        if options.dirs.is_empty() {
+            bail!("No directory to record to");
+        }
+        let mut sink = Self {
+            requested_bitrate: options.bitrate,
+            effective_budget: options.budget,
+            options,
+            bitrate,
+            dir: 0,
+            current: None,
+            closed: VecDeque::new(),
+            total: 0,
+            next_index: 0,
+            deleted: 0,
+            waiting_for_keyframe: false,
+            switch_dir: false,
+            last_check: Instant::now(),
+            busy: Duration::ZERO,
+        };
+        sink.check_space();
+        Ok(sink)
+    }
+
+    fn dir(&self) -> &Path {
+        &self.options.dirs[self.dir]
+    }
+
+    /// Starts a new segment, in the next directory that works if the
+    /// current one doesn't.
+    fn start_segment(&mut self, pts: i64) -> Result<()> {
+        self.close_segment();
+        if std::mem::take(&mut self.switch_dir) {
+            self.fail_over()?;
+        }
+        loop {
+            let path = self
+                .dir()
+                .join(format!("{}-{:05}.h264", self.options.name, self.next_index));
+            match File::create(&path) {
+                Ok(file) => {
+                    self.next_index += 1;
+                    self.current = Some(OpenSegment {
+                        file,
+                        segment: Segment { path, bytes: 0 },
+                        start_pts: pts,
+                    });
+                    return Ok(());
+                }
+                Err(e) => {
+                    eprintln!("Failed to create {}: {e}", path.display());
+                    self.fail_over()?;
+                }
+            }
+        }
+    }
+
+    fn close_segment(&mut self) {
+        if let Some(open) = self.current.take() {
+            if let Err(e) = open.file.sync_data() {
+                eprintln!("Failed to sync {}: {e}", open.segment.path.display());
+            }
+            self.closed.push_back(open.segment);
+        }
+    }
+
+    /// Moves on to the next directory.
+    fn fail_over(&mut self) -> Result<()> {
+        if self.dir + 1 == self.options.dirs.len() {
+            bail!("No directory left to record to");
+        }
+        self.dir += 1;
+        println!("Recording to {} from now on", self.dir().display());
+        self.check_space();
+        Ok(())
+    }
+
+    /// Handles a failed write by dropping the packet, cutting the segment
+    /// back to its last complete packet and starting over at the next IDR.
+    fn on_write_error(&mut self, error: std::io::Error) -> Result<()> {
+        let open = self.current.as_mut().unwrap();
+        eprintln!("Failed to write {}: {error}", open.segment.path.display());
+        // What made it to disk of the packet is garbage to a decoder.
+        open.file.set_len(open.segment.bytes).ok();
+        self.close_segment();
+        self.waiting_for_keyframe = true;
+        if error.raw_os_error() == Some(libc::ENOSPC) && !self.closed.is_empty() {
+            self.delete_oldest();
+        } else {
+            self.switch_dir = true;
+        }
+        Ok(())
+    }
+
+    fn delete_oldest(&mut self) {
+        let Some(segment) = self.closed.pop_front() else {
+            return;
+        };
+        if let Err(e) = fs::remove_file(&segment.path) {
+            eprintln!("Failed to delete {}: {e}", segment.path.display());
+        }
+        self.total -= segment.bytes;
+        self.deleted += 1;
+    }
+
+    /// Updates the budget from the free space on the current directory and
+    /// lowers the bitrate if it no longer holds the minimum retention.
+    fn check_space(&mut self) {
+        let available = match statvfs(self.dir()) {
+            Ok(stat) => stat.blocks_available() as u64 * stat.fragment_size() as u64,
+            Err(e) => {
+                eprintln!("Failed to get free space of {}: {e}", self.dir().display());
+                return;
+            }
+        };
+        let usable = (self.total + available).saturating_sub(RESERVE);
+        self.effective_budget = self.options.budget.min(usable);
+
+        let retention = self.options.min_retention.as_secs_f64();
+        let fitting = (self.effective_budget as f64 * 8.0 / retention) as i64;
+        // A bitrate already below the floor is kept as asked.
+        let bitrate = fitting.clamp(MIN_BITRATE.min(self.options.bitrate), self.options.bitrate);
+        // Small changes aren't worth restarting the encoder session.
+        if (bitrate - self.requested_bitrate).abs() * 10 > self.requested_bitrate {
+            println!(
+                "Storage: {} MiB usable, asking for {bitrate} bits/s",
+                self.effective_budget >> 20
+            );
+            self.requested_bitrate = bitrate;
+            self.bitrate.set(bitrate);
+        }
+    }
+}
+
+impl Sink for SegmentSink {
+    fn write(&mut self, packet: &Packet) -> Result<()> {
+        if self.waiting_for_keyframe && !packet.is_keyframe() {
+            return Ok(());
+        }
+        self.waiting_for_keyframe = false;
+        let segment_done = self.current.as_ref().map_or(true, |open| {
+            packet.pts() - open.start_pts >= self.options.segment_frames || self.switch_dir
+        });
+        if packet.is_keyframe() && segment_done {
+            self.start_segment(packet.pts())?;
+        }
+        let Some(open) = &mut self.current else {
+            // Only before the first IDR.
+            return Ok(());
+        };
+
+        let start = Instant::now();
+        match open.file.write_all(packet.data()) {
+            Ok(()) => {
+                open.segment.bytes += packet.len() as u64;
+                self.total += packet.len() as u64;
+                self.busy += start.elapsed();
+            }
+            Err(e) => return self.on_write_error(e),
+        }
+
+        while self.total > self.effective_budget && !self.closed.is_empty() {
+            self.delete_oldest();
+        }
+
+        let elapsed = self.last_check.elapsed();
+        if elapsed >= CHECK_INTERVAL {
+            let load = self.busy.as_secs_f64() / elapsed.as_secs_f64();
+            if load > MAX_WRITE_LOAD && !self.switch_dir {
+                eprintln!(
+                    "{} is too slow ({:.0}% of the time spent writing)",
+                    self.dir().display(),
+                    load * 100.0
+                );
+                // At the next IDR, so the current segment ends cleanly.
+                self.switch_dir = self.dir + 1 < self.options.dirs.len();
+            }
+            self.busy = Duration::ZERO;
+            self.last_check = Instant::now();
+            self.check_space();
+        }
+        Ok(())
+    }
+
+    fn finish(&mut self) -> Result<()> {
+        self.close_segment();
+        let seconds = self.total as f64 * 8.0 / self.requested_bitrate as f64;
+        println!(
+            "Kept {} segments, {} MiB (about {seconds:.0}s), deleted {} to stay within budget",
+            self.closed.len(),
+            self.total >> 20,
+            self.deleted,
+        );
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn options(dirs: Vec<PathBuf>, budget: u64) -> StorageOptions {
+        StorageOptions {
+            dirs,
+            name: "test".into(),
+            budget,
+            segment_frames: 4,
+            bitrate: 9_000_000,
+            min_retention: Duration::from_secs(1),
+        }
+    }
+
+    fn packets(count: i64) -> impl Iterator<Item = Packet> {
+        (0..count).map(|pts| Packet::from_bytes(vec![pts as u8; 100], pts, pts % 2 == 0))
+    }
+
+    #[test]
+    fn test_rotates_within_budget_and_fails_over() {
+        let root = std::env::temp_dir().join(format!("storage-{}", std::process::id()));
+        let dir = root.join("a");
+        fs::create_dir_all(&dir).unwrap();
+        // The first directory doesn't exist, so segments go to the second.
+        let mut sink = SegmentSink::new(
+            options(vec![root.join("missing"), dir.clone()], 1000),
+            Arc::new(BitrateRequest::default()),
+        )
+        .unwrap();
+        for packet in packets(40) {
+            sink.write(&packet).unwrap();
+        }
+        sink.finish().unwrap();
+
+        // Ten segments of 4 packets were written, the oldest deleted to
+        // keep within 1000 bytes.
+        let mut names: Vec<_> = fs::read_dir(&dir)
+            .unwrap()
+            .map(|entry| entry.unwrap().file_name().into_string().unwrap())
+            .collect();
+        names.sort();
+        assert_eq!(names, ["test-00008.h264", "test-00009.h264"]);
+        let last = fs::read(dir.join("test-00009.h264")).unwrap();
+        assert_eq!(last.len(), 400);
+        assert_eq!(last[0], 36);
+        fs::remove_dir_all(&root).unwrap();
+    }
+
+    #[test]
+    fn test_low_bitrate_with_budget() {
+        let dir = std::env::temp_dir().join(format!("storage-low-{}", std::process::id()));
+        fs::create_dir_all(&dir).unwrap();
+        let request = Arc::new(BitrateRequest::default());
+        // Below the floor, with a budget too small for any bitrate.
+        let mut low = options(vec![dir.clone()], 1000);
+        low.bitrate = 500_000;
+        let mut sink = SegmentSink::new(low, request.clone()).unwrap();
+        assert_eq!(request.take(), None);
+        sink.finish().unwrap();
+
+        // Above it, the budget pulls the bitrate down to the floor.
+        SegmentSink::new(options(vec![dir.clone()], 1000), request.clone()).unwrap();
+        assert_eq!(request.take(), Some(MIN_BITRATE));
+        fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn test_parse_bytes() {
+        assert_eq!(parse_bytes("512").unwrap(), 512);
+        assert_eq!(parse_bytes("2G").unwrap(), 2 << 30);
+        assert_eq!(parse_bytes("100m").unwrap(), 100 << 20);
+        assert!(parse_bytes("0").is_err());
+        assert!(parse_bytes("20000000T").is_err());
+        assert!(parse_bytes("lots").is_err());
+    }
+}
@@ -0,0 +1,815 @@
+//! A backend that runs entirely on the CPU, to test and benchmark the
+//! pipeline on machines without a render node.
+//!
+//! Surfaces are NV12 frames in system memory, taken from a fixed-size pool
+//! like the VA surface pool. The import and the encoder's VPP copy are
+//! memcpys, or bilinear scales when the sizes differ. The encoder
+//! emits a deterministic fake Annex B stream with one access unit per frame
+//! and an IDR every `framerate` frames and at the start of every session.
+//! Each step can be slowed down and made to fail, and the source can replay
+//! the buffer timing of a real capture from a trace.
+
+use std::{
+    collections::VecDeque,
+    io::Write,
+    ops::{Deref, DerefMut},
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc, Mutex, Weak,
+    },
+    thread::{self, JoinHandle},
+    time::{Duration, Instant},
+};
+
+use anyhow::{Error, Result};
+
+use crate::{
+    backend::{CaptureReset, EncoderConfig, FrameEncoder, FrameSource},
+    bitstream::BitstreamPool,
+    cursor::Cursor,
+    encode_ffmpeg::EncoderSettings,
+    frame_buffer::{FrameBuffer, FrameReader},
+    frametime::FrameTimes,
+    nv12,
+    packet::Packet,
+    rate,
+    record::Running,
+    recovery::{FaultInjector, Stage},
+    trace::TraceEvent,
+};
+
+/// Longest sleep while replaying a trace, so the source stops quickly.
+const REPLAY_POLL: Duration = Duration::from_millis(100);
+
+#[derive(Clone)]
+pub struct StubConfig {
+    pub settings: EncoderSettings,
+    pub width: u32,
+    pub height: u32,
+    /// Rate at which the source produces frames, like a game presenting.
+    pub source_fps: u32,
+    pub pool_size: usize,
+    pub import_latency: Duration,
+    pub encode_latency: Duration,
+    /// Frames the encoder holds on to before their packets come out.
+    pub encoder_delay: usize,
+    pub faults: Arc<FaultInjector>,
+    /// The game stops presenting for the second duration once the first
+    /// has passed, like a paused game.
+    pub pause: Option<(Duration, Duration)>,
+    /// Buffer arrivals and format changes to reproduce instead of presenting
+    /// at `source_fps`. The source stops presenting at the end of it.
+    pub trace: Option<Arc<[TraceEvent]>>,
+    /// Frames presented at `source_fps` before the source stops, so tests
+    /// can record a number of frames rather than for a time.
+    pub frames: Option<u64>,
+}
+
+impl StubConfig {
+    pub fn new(width: u32, height: u32, settings: EncoderSettings) -> Self {
+        Self {
+            settings,
+            width,
+            height,
+            source_fps: settings.framerate as u32,
+            pool_size: rate::pool_size(settings.framerate as u32),
+            import_latency: Duration::ZERO,
+            encode_latency: Duration::ZERO,
+            encoder_delay: 2,
+            faults: Arc::new(FaultInjector::new(Vec::new())),
+            pause: None,
+            trace: None,
+            frames: None,
+        }
+    }
+}
+
+impl EncoderConfig for StubConfig {
+    fn settings(&self) -> &EncoderSettings {
+        &self.settings
+    }
+
+    fn settings_mut(&mut self) -> &mut EncoderSettings {
+        &mut self.settings
+    }
+}
+
+/// An NV12 frame in system memory.
+pub struct StubSurface {
+    pub width: u32,
+    pub height: u32,
+    pub data: Vec<u8>,
+}
+
+impl StubSurface {
+    pub fn new(width: u32, height: u32) -> Self {
+        Self {
+            width,
+            height,
+            data: vec![0; width as usize * height as usize * 3 / 2],
+        }
+    }
+}
+
+/// Copies `src` into `dst`, scaling bilinearly like VPP if the sizes
+/// differ.
+pub fn blit(src: &StubSurface, dst: &mut StubSurface) {
+    if (src.width, src.height) == (dst.width, dst.height) {
+        dst.data.copy_from_slice(&src.data);
+        return;
+    }
+    nv12::scale(
+        &src.data,
+        (src.width as usize, src.height as usize),
+        &mut dst.data,
+        (dst.width as usize, dst.height as usize),
+    );
+}
+
+type FreeList = Mutex<Vec<StubSurface>>;
+
+/// A fixed set of surfaces, handed out until they are all in use.
+pub struct StubPool {
+    free: Arc<FreeList>,
+}
+
+impl StubPool {
+    pub fn new(width: u32, height: u32, size: usize) -> Self {
+        let surfaces = (0..size).map(|_| StubSurface::new(width, height)).collect();
+        Self {
+            free: Arc::new(Mutex::new(surfaces)),
+        }
+    }
+
+    pub fn get_surface(&self) -> Option<PooledStubSurface> {
+        let surface = self.free.lock().unwrap().pop()?;
+        Some(PooledStubSurface {
+            surface: Some(surface),
+            pool: Arc::downgrade(&self.free),
+        })
+    }
+}
+
+/// A surface that goes back to its pool when dropped, unless the pool has
+/// been replaced in the meantime.
+pub struct PooledStubSurface {
+    surface: Option<StubSurface>,
+    pool: Weak<FreeList>,
+}
+
+impl Deref for PooledStubSurface {
+    type Target = StubSurface;
+
+    fn deref(&self) -> &StubSurface {
+        self.surface.as_ref().unwrap()
+    }
+}
+
+impl DerefMut for PooledStubSurface {
+    fn deref_mut(&mut self) -> &mut StubSurface {
+        self.surface.as_mut().unwrap()
+    }
+}
+
+impl Drop for PooledStubSurface {
+    fn drop(&mut self) {
+        if let Some(pool) = self.pool.upgrade() {
+            pool.lock().unwrap().push(self.surface.take().unwrap());
+        }
+    }
+}
+
+struct SourceShared {
+    config: StubConfig,
+    /// Size of the frames presented, changed by format events of a trace.
+    size: Mutex<(u32, u32)>,
+    pool: Mutex<StubPool>,
+    frame_buffer: Arc<FrameBuffer<PooledStubSurface>>,
+    error: Mutex<Option<(Stage, Error)>>,
+    frame_times: Arc<FrameTimes>,
+    running: AtomicBool,
+    /// Cleared at the end of a trace, see [`StubSource::stop_at_end`]. Set
+    /// to None once the trace has ended.
+    on_end: Mutex<Option<Option<Running>>>,
+}
+
+impl SourceShared {
+    fn new_pool(&self) -> StubPool {
+        let (width, height) = *self.size.lock().unwrap();
+        StubPool::new(width, height, self.config.pool_size)
+    }
+
+    /// Imports one frame of the fake game into a pool surface, like the
+    /// PipeWire thread does with a DMABUF.
+    fn import(&self, game: &StubSurface) -> Result<(), (Stage, Error)> {
+        let faults = &self.config.faults;
+        faults
+            .check(Stage::Capture)
+            .map_err(|e| (Stage::Capture, e))?;
+        let Some(mut surface) = self.pool.lock().unwrap().get_surface() else {
+            // The encoder still holds every surface: drop the frame.
+            return Ok(());
+        };
+        faults
+            .check(Stage::Import)
+            .map_err(|e| (Stage::Import, e))?;
+        thread::sleep(self.config.import_latency);
+        blit(game, &mut surface);
+        self.frame_buffer.write(Arc::new(surface));
+        Ok(())
+    }
+}
+
+/// A fake game presenting frames at `source_fps`, or with the timing of a
+/// trace, on its own thread.
+pub struct StubSource {
+    shared: Arc<SourceShared>,
+    thread: Option<JoinHandle<()>>,
+}
+
+impl StubSource {
+    pub fn start(config: StubConfig) -> Result<Self> {
+        let pool = StubPool::new(config.width, config.height, config.pool_size);
+        let shared = Arc::new(SourceShared {
+            size: Mutex::new((config.width, config.height)),
+            config,
+            pool: Mutex::new(pool),
+            frame_buffer: Arc::new(FrameBuffer::new()),
+            error: Mutex::new(None),
+            frame_times: Arc::new(FrameTimes::new()),
+            running: AtomicBool::new(true),
+            on_end: Mutex::new(Some(None)),
+        });
+        let thread = thread::Builder::new().name("stub-capture".into()).spawn({
+            let shared = shared.clone();
+            move || {
+                match shared.config.trace.clone() {
+                    Some(trace) => replay(&shared, &trace),
+                    None => present(&shared),
+                }
+                if let Some(Some(running)) = shared.on_end.lock().unwrap().take() {
+                    running.stop();
+                }
+            }
+        })?;
+        Ok(Self {
+            shared,
+            thread: Some(thread),
+        })
+    }
+
+    /// Clears `running` once the whole trace has been replayed or all
+    /// `frames` have been presented, or at once if they already have.
+    pub fn stop_at_end(&self, running: Running) {
+        match self.shared.on_end.lock().unwrap().as_mut() {
+            Some(on_end) => *on_end = Some(running),
+            None => running.stop(),
+        }
+    }
+
+    /// Frame times of the fake game, from the trace's PTS when replaying.
+    pub fn frame_times(&self) -> Arc<FrameTimes> {
+        self.shared.frame_times.clone()
+    }
+}
+
+fn present(shared: &SourceShared) {
+    let config = &shared.config;
+    let mut game = StubSurface::new(config.width, config.height);
+    let frame_duration = Duration::from_secs_f64(1.0 / config.source_fps as f64);
+    let start = Instant::now();
+    let mut next_frame_time = start;
+    let mut index: u8 = 0;
+    let mut presented = 0;
+    while shared.running.load(Ordering::SeqCst) {
+        if config.frames.is_some_and(|frames| presented >= frames) {
+            return;
+        }
+        let paused = config
+            .pause
+            .is_some_and(|(after, length)| (after..after + length).contains(&start.elapsed()));
+        if !paused {
+            game.data.fill(index);
+            index = index.wrapping_add(1);
+            shared.frame_times.record(start.elapsed().as_nanos() as u64);
+            if let Err((stage, e)) = shared.import(&game) {
+                shared.error.lock().unwrap().get_or_insert((stage, e));
+            }
+            presented += 1;
+        }
+        next_frame_time += frame_duration;
+        thread::sleep(next_frame_time.saturating_duration_since(Instant::now()));
+    }
+}
+
+/// Presents a frame for every buffer of the trace, at the same times
+/// relative to its first event.
+fn replay(shared: &SourceShared, trace: &[TraceEvent]) {
+    let config = &shared.config;
+    let mut game = StubSurface::new(config.width, config.height);
+    let start = Instant::now();
+    let first = trace.first().map_or(0, TraceEvent::time_ns);
+    let mut index: u8 = 0;
+    for event in trace {
+        let due = start + Duration::from_nanos(event.time_ns().saturating_sub(first));
+        loop {
+            if !shared.running.load(Ordering::SeqCst) {
+                return;
+            }
+            let now = Instant::now();
+            if now >= due {
+                break;
+            }
+            thread::sleep((due - now).min(REPLAY_POLL));
+        }
+        match *event {
+            TraceEvent::Format { width, height, .. } => {
+                // NV12 needs even dimensions.
+                let size = ((width & !1).max(2), (height & !1).max(2));
+                if size != (game.width, game.height) {
+                    game = StubSurface::new(size.0, size.1);
+                    *shared.size.lock().unwrap() = size;
+                    let pool = shared.new_pool();
+                    *shared.pool.lock().unwrap() = pool;
+                    shared.frame_buffer.clear();
+                }
+            }
+            TraceEvent::Buffer { time_ns, pts_ns } => {
+                game.data.fill(index);
+                index = index.wrapping_add(1);
+                shared.frame_times.record(pts_ns.unwrap_or(time_ns));
+                if let Err((stage, e)) = shared.import(&game) {
+                    shared.error.lock().unwrap().get_or_insert((stage, e));
+                }
+            }
+            // Only the cursor moved: like capture, present the same frame
+            // again for it to be drawn over.
+            TraceEvent::Metadata { .. } => shared.frame_buffer.repeat(),
+        }
+    }
+}
+
+impl Drop for StubSource {
+    fn drop(&mut self) {
+        self.shared.running.store(false, Ordering::SeqCst);
+        if let Some(thread) = self.thread.take() {
+            thread.join().ok();
+        }
+    }
+}
+
+#[derive(Clone)]
+pub struct StubControl(Arc<SourceShared>);
+
+impl FrameSource for StubSource {
+    type Frame = PooledStubSurface;
+    type Control = StubControl;
+
+    fn read_frame(&self) -> Option<Arc<PooledStubSurface>> {
+        self.shared.frame_buffer.read()
+    }
+
+    fn subscribe(&self) -> FrameReader<PooledStubSurface> {
+        self.shared.frame_buffer.subscribe()
+    }
+
+    fn cursor(&self) -> Cursor {
+        Cursor::default()
+    }
+
+    fn take_error(&self) -> Option<(Stage, Error)> {
+        self.shared.error.lock().unwrap().take()
+    }
+
+    fn control(&self) -> StubControl {
+        StubControl(self.shared.clone())
+    }
+}
+
+impl CaptureReset for StubControl {
+    fn reset(&self) -> Result<()> {
+        let pool = self.0.new_pool();
+        *self.0.pool.lock().unwrap() = pool;
+        self.0.frame_buffer.clear();
+        Ok(())
+    }
+}
+
+/// An encoder session that copies each frame into its own surface and turns
+/// it into a fake access unit.
+pub struct StubEncoder {
+    config: StubConfig,
+    surface: StubSurface,
+    next_pts: i64,
+    frames_in_session: i64,
+    pending: VecDeque<Packet>,
+    bitstreams: BitstreamPool,
+}
+
+/// Upper bound on the size of a fake access unit.
+const ACCESS_UNIT_SIZE: usize = 64;
+
+/// A fake Annex B access unit: a slice NAL whose payload names the frame.
+/// The payload is ASCII so it never contains a start code.
+fn fake_access_unit(pts: i64, keyframe: bool, frame: &[u8], out: &mut Vec<u8>) {
+    // FNV-1a, so the same input always gives the same bitstream.
+    let checksum = frame.iter().fold(0xcbf29ce484222325u64, |hash, &byte| {
+        (hash ^ byte as u64).wrapping_mul(0x100000001b3)
+    });
+    let nal_type = if keyframe { 0x65 } else { 0x41 };
+    out.extend_from_slice(&[0, 0, 0, 1, nal_type]);
+    write!(out, "pts={pts} sum={checksum:016x}").unwrap();
+}
+
+impl FrameEncoder for StubEncoder {
+    type Frame = PooledStubSurface;
+    type Config = StubConfig;
+
+    fn new(config: &StubConfig, _first_frame: &Arc<PooledStubSurface>) -> Result<Self> {
+        Ok(Self {
+            config: config.clone(),
+            surface: StubSurface::new(config.width, config.height),
+            next_pts: 0,
+            frames_in_session: 0,
+            pending: VecDeque::new(),
+            bitstreams: BitstreamPool::new(config.settings.bitrate, config.settings.framerate),
+        })
+    }
+
+    fn next_pts(&self) -> i64 {
+        self.next_pts
+    }
+
+    fn set_next_pts(&mut self, pts: i64) {
+        self.next_pts = pts;
+    }
+
+    fn set_cursor(&mut self, _cursor: Cursor) {
+        // Nothing to blend on the CPU; the stub source has no cursor.
+    }
+
+    fn set_bitrate(&mut self, bitrate: i64) -> Result<()> {
+        // Fake access units don't depend on it, but the session restarts
+        // like a real one does.
+        self.config.settings.bitrate = bitrate;
+        self.frames_in_session = 0;
+        self.bitstreams
+            .retarget(bitrate, self.config.settings.framerate);
+        Ok(())
+    }
+
+    fn encode(&mut self, frame: Arc<PooledStubSurface>) -> Result<()> {
+        self.config.faults.check(Stage::Encode)?;
+        blit(&frame, &mut self.surface);
+        thread::sleep(self.config.encode_latency);
+        let gop = self.config.settings.framerate.max(1) as i64;
+        let keyframe = self.frames_in_session % gop == 0;
+        let mut data = self.bitstreams.take(ACCESS_UNIT_SIZE);
+        fake_access_unit(self.next_pts, keyframe, &self.surface.data, &mut data);
+        self.pending
+            .push_back(Packet::from_pooled(data, self.next_pts, keyframe));
+        self.next_pts += 1;
+        self.frames_in_session += 1;
+        Ok(())
+    }
+
+    fn poll_packet(&mut self) -> Result<Option<Packet>> {
+        if self.pending.len() > self.config.encoder_delay {
+            return Ok(self.pending.pop_front());
+        }
+        Ok(None)
+    }
+
+    fn drain_packets(&mut self) -> Result<Vec<Packet>> {
+        Ok(self.pending.drain(..).collect())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{
+        fanout::{FanOut, Sink},
+        frametime::FrameTimeSummary,
+        record::run_pipeline,
+        recovery::{FaultSpec, Severity},
+    };
+
+    struct Collect(Arc<Mutex<Vec<Packet>>>);
+
+    impl Sink for Collect {
+        fn write(&mut self, packet: &Packet) -> Result<()> {
+            self.0.lock().unwrap().push(packet.clone());
+            Ok(())
+        }
+    }
+
+    /// Records from a stub source for `duration` and returns the packets
+    /// written and the stats of the frames and packets edges.
+    fn record(config: StubConfig, duration: Duration) -> (Vec<Packet>, Vec<u64>) {
+        let (packets, dropped, _) = record_with(config, Some(duration), None);
+        (packets, dropped)
+    }
+
+    /// Like [`record`], or until the source stops presenting without a
+    /// `duration`, and also returns the frame times of the game.
+    fn record_with(
+        config: StubConfig,
+        duration: Option<Duration>,
+        idle_after: Option<Duration>,
+    ) -> (Vec<Packet>, Vec<u64>, FrameTimeSummary) {
+        let packets = Arc::new(Mutex::new(Vec::new()));
+        let mut fanout = FanOut::new();
+        fanout
+            .add("collect", 1024, Collect(packets.clone()))
+            .unwrap();
+        let source = StubSource::start(config.clone()).unwrap();
+        let running = Running::new(Arc::new(AtomicBool::new(true)));
+        let framerate = config.settings.framerate;
+        // Like --decimate, when the game presents faster than frames are
+        // encoded.
+        let decimate = config.source_fps / framerate as u32;
+        let stats = thread::scope(|s| {
+            match duration {
+                Some(duration) => {
+                    let running = running.clone();
+                    s.spawn(move || {
+                        thread::sleep(duration);
+                        running.stop();
+                    });
+                }
+                None => source.stop_at_end(running.clone()),
+            }
+            run_pipeline::<_, StubEncoder>(
+                &source,
+                config,
+                framerate,
+                decimate,
+                fanout,
+                Arc::default(),
+                idle_after,
+                None,
+                &running,
+            )
+            .unwrap()
+        });
+        let dropped = stats.iter().map(|(_, stats)| stats.dropped).collect();
+        let packets = packets.lock().unwrap().clone();
+        (packets, dropped, source.frame_times().total())
+    }
+
+    /// The value the game filled the 64x32 frame of `packet` with, which
+    /// tells presented frames apart since the encoder checksums it.
+    fn fill(packet: &Packet) -> Option<u8> {
+        (0..=255u8).find(|&fill| {
+            let mut data = Vec::new();
+            let frame = vec![fill; 64 * 32 * 3 / 2];
+            fake_access_unit(packet.pts(), packet.is_keyframe(), &frame, &mut data);
+            data == packet.data()
+        })
+    }
+
+    fn settings(framerate: i32) -> EncoderSettings {
+        EncoderSettings {
+            framerate,
+            ..Default::default()
+        }
+    }
+
+    #[test]
+    fn test_blit_copies_and_scales() {
+        let mut src = StubSurface::new(4, 2);
+        src.data = vec![1, 2, 3, 4, 5, 6, 7, 8, 10, 11, 12, 13];
+        let mut same = StubSurface::new(4, 2);
+        blit(&src, &mut same);
+        assert_eq!(same.data, src.data);
+
+        let mut half = StubSurface::new(2, 2);
+        blit(&src, &mut half);
+        assert_eq!(half.data, vec![2, 4, 6, 8, 11, 12]);
+    }
+
+    #[test]
+    fn test_encoder_is_deterministic() {
+        let config = StubConfig::new(8, 8, settings(3));
+        let pool = StubPool::new(8, 8, 1);
+        let encode = || {
+            let frame = Arc::new(pool.get_surface().unwrap());
+            let mut encoder = StubEncoder::new(&config, &frame).unwrap();
+            for _ in 0..4 {
+                encoder.encode(frame.clone()).unwrap();
+            }
+            encoder.drain_packets().unwrap()
+        };
+        let (first, second) = (encode(), encode());
+        let keyframes: Vec<bool> = first.iter().map(|p| p.is_keyframe()).collect();
+        assert_eq!(keyframes, vec![true, false, false, true]);
+        assert!(first.iter().zip(&second).all(|(a, b)| a.data() == b.data()));
+    }
+
+    #[test]
+    fn test_pipeline_on_stub() {
+        let (packets, dropped) = record(
+            StubConfig::new(64, 32, settings(240)),
+            Duration::from_millis(300),
+        );
+        assert!(packets.len() > 10);
+        assert!(packets[0].is_keyframe());
+        assert!(packets.windows(2).all(|w| w[1].pts() == w[0].pts() + 1));
+        assert_eq!(dropped[1], 0);
+    }
+
+    #[test]
+    fn test_sustains_120_fps() {
+        let mut config = StubConfig::new(64, 32, settings(120));
+        config.import_latency = Duration::from_millis(1);
+        config.encode_latency = Duration::from_millis(4);
+        config.frames = Some(120);
+        let (packets, dropped, _) = record_with(config, None, None);
+        // About a frame per presented one. Capture skips a tick when it
+        // runs late, which a loaded test machine may make it do a few times.
+        assert!(packets.len() >= 108, "{} packets", packets.len());
+        assert_eq!(dropped, vec![0, 0]);
+    }
+
+    #[test]
+    fn test_decimation_keeps_timestamps_continuous() {
+        // A 120 Hz game encoded at 60 fps.
+        let mut config = StubConfig::new(64, 32, settings(60));
+        config.source_fps = 120;
+        config.frames = Some(60);
+        let (packets, dropped, _) = record_with(config, None, None);
+        // Capture wakes for each presented frame, so half of them were
+        // encoded, but for the last one if it stopped first, and one again
+        // whenever the game was a frame interval late presenting.
+        assert!((29..=32).contains(&packets.len()), "{}", packets.len());
+        assert!(packets.windows(2).all(|w| w[1].pts() == w[0].pts() + 1));
+        assert_eq!(dropped, vec![0, 0]);
+
+        // Every other presented frame was encoded, or one read late in its
+        // place, which doesn't shift the ones after it.
+        let fills: Vec<u8> = packets.iter().map(|p| fill(p).unwrap()).collect();
+        let picks: Vec<usize> = (fills.iter())
+            .map(|&fill| fill.wrapping_sub(fills[0]) as usize / 2)
+            .collect();
+        assert!(
+            picks.windows(2).all(|w| w[1] == w[0] || w[1] == w[0] + 1),
+            "{fills:?}"
+        );
+        assert!(picks[picks.len() - 1] >= 28, "{fills:?}");
+    }
+
+    #[test]
+    fn test_slow_encoder_drops_frames_not_packets() {
+        let mut config = StubConfig::new(64, 32, settings(240));
+        config.encode_latency = Duration::from_millis(8);
+        let (packets, dropped) = record(config, Duration::from_millis(300));
+        // Capture can't wait for the encoder, so frames are dropped before
+        // encoding and the stream itself has no gaps.
+        assert!(dropped[0] > 0);
+        assert_eq!(dropped[1], 0);
+        assert!(packets.windows(2).all(|w| w[1].pts() == w[0].pts() + 1));
+    }
+
+    #[test]
+    fn test_recovers_on_stub() {
+        let mut config = StubConfig::new(64, 32, settings(240));
+        config.faults = Arc::new(FaultInjector::new(vec![FaultSpec {
+            stage: Stage::Encode,
+            every: 30,
+            severity: Severity::Device,
+        }]));
+        let (packets, _) = record(config, Duration::from_millis(300));
+        // Every rebuilt session starts with an IDR and continues the
+        // timestamps of the previous one.
+        let keyframes = packets.iter().filter(|p| p.is_keyframe()).count();
+        assert!(keyframes >= 2, "{keyframes} keyframes");
+        assert!(packets.windows(2).all(|w| w[1].pts() == w[0].pts() + 1));
+    }
+
+    #[test]
+    fn test_idle_suspends_and_resumes_with_idr() {
+        let mut config = StubConfig::new(64, 32, settings(100));
+        config.pause = Some((Duration::from_millis(200), Duration::from_millis(500)));
+        config.frames = Some(40);
+        let (packets, _, game) = record_with(config, None, Some(Duration::from_millis(100)));
+        // The pause shows up as one jump in timestamps, covering the time
+        // spent idle: the game's longest frame time but the 100 ms it took
+        // to notice. The first frame after it is an IDR.
+        let gaps: Vec<_> = packets
+            .windows(2)
+            .filter(|w| w[1].pts() != w[0].pts() + 1)
+            .collect();
+        assert_eq!(gaps.len(), 1, "{} gaps", gaps.len());
+        let jump = gaps[0][1].pts() - gaps[0][0].pts();
+        let idle = ((game.max_ms - 100.0) / 10.0).round() as i64;
+        assert!(
+            (jump - idle).abs() <= 3,
+            "jumped {jump} frames, idle for {idle}"
+        );
+        assert!(gaps[0][1].is_keyframe());
+        // That IDR is the first frame the game presented after the pause,
+        // not one held over from before it.
+        let (before, after) = (fill(&gaps[0][0]).unwrap(), fill(&gaps[0][1]).unwrap());
+        assert_eq!(after, before.wrapping_add(1));
+    }
+
+    #[test]
+    fn test_replay_follows_trace_and_ends() {
+        // 60 fps with a 250 ms stall halfway, then the game resizes.
+        let mut events = vec![TraceEvent::Format {
+            time_ns: 1_000,
+            width: 64,
+            height: 32,
+            format: 0,
+            framerate: (60, 1),
+        }];
+        let mut time = 1_000;
+        for i in 0..40 {
+            time += if i == 20 { 250_000_000 } else { 16_666_667 };
+            events.push(TraceEvent::Buffer {
+                time_ns: time,
+                pts_ns: Some(time),
+            });
+        }
+        events.push(TraceEvent::Format {
+            time_ns: time + 1_000_000,
+            width: 128,
+            height: 64,
+            format: 0,
+            framerate: (60, 1),
+        });
+        let mut config = StubConfig::new(64, 32, settings(60));
+        config.trace = Some(events.into());
+        let source = StubSource::start(config.clone()).unwrap();
+        let running = Running::new(Arc::new(AtomicBool::new(true)));
+        source.stop_at_end(running.clone());
+        let start = Instant::now();
+        run_pipeline::<_, StubEncoder>(
+            &source,
+            config,
+            60,
+            1,
+            FanOut::new(),
+            Arc::default(),
+            None,
+            None,
+            &running,
+        )
+        .unwrap();
+        assert!(start.elapsed() >= Duration::from_millis(900));
+
+        // The game's frame times come from the trace, not the replay.
+        let total = source.frame_times().total();
+        assert_eq!(total.frames, 39);
+        assert_eq!(total.hitches, 1);
+        assert!((240.0..260.0).contains(&total.max_ms), "{}", total.max_ms);
+        assert_eq!(*source.shared.size.lock().unwrap(), (128, 64));
+    }
+
+    #[test]
+    fn test_cursor_updates_keep_recording_awake() {
+        // A game that stops presenting after 100 ms while the cursor keeps
+        // moving over its last frame for 400 ms more.
+        let mut events = Vec::new();
+        for i in 1..=50u64 {
+            let time_ns = i * 10_000_000;
+            events.push(match i {
+                1..=10 => TraceEvent::Buffer {
+                    time_ns,
+                    pts_ns: Some(time_ns),
+                },
+                _ => TraceEvent::Metadata { time_ns },
+            });
+        }
+        let mut config = StubConfig::new(64, 32, settings(100));
+        config.trace = Some(events.into());
+        let source = StubSource::start(config.clone()).unwrap();
+        let running = Running::new(Arc::new(AtomicBool::new(true)));
+        source.stop_at_end(running.clone());
+        let packets = Arc::new(Mutex::new(Vec::new()));
+        let mut fanout = FanOut::new();
+        fanout
+            .add("collect", 1024, Collect(packets.clone()))
+            .unwrap();
+        run_pipeline::<_, StubEncoder>(
+            &source,
+            config,
+            100,
+            1,
+            fanout,
+            Arc::default(),
+            Some(Duration::from_millis(100)),
+            None,
+            &running,
+        )
+        .unwrap();
+
+        // Never idle for 100 ms, so never suspended: one session, one IDR,
+        // and the cursor updates were encoded as frames.
+        let packets = packets.lock().unwrap();
+        assert_eq!(packets.iter().filter(|p| p.is_keyframe()).count(), 1);
+        assert!(packets.windows(2).all(|w| w[1].pts() == w[0].pts() + 1));
+        assert!(packets.len() >= 40, "{} packets", packets.len());
+    }
+}
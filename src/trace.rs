@@ -0,0 +1,316 @@
+//! Traces of when capture received each buffer, to replay the exact timing
+//! of a real session through the stub backend.
+//!
+//! Frame-pacing bugs depend on when Gamescope delivers buffers, which no
+//! synthetic source reproduces. A trace records, for every buffer, when it
+//! arrived and the producer's PTS, plus every format negotiation, so a
+//! stutter seen in the field can be replayed through the whole pipeline as
+//! often as needed.
+//!
+//! The file is a magic followed by one record per event: a tag byte and
+//! LEB128 varints, with times as deltas to the previous event. A buffer
+//! takes at most nine bytes at usual rates, so an hour at 120 fps is under
+//! 4 MB.
+//! Recording encodes into memory on the capture thread and hands full chunks
+//! to the auxiliary executor to write.
+
+use std::{
+    fs::{self, File},
+    io::Write,
+    mem,
+    path::{Path, PathBuf},
+    sync::{Arc, Mutex},
+};
+
+use anyhow::{bail, Context, Result};
+
+use crate::executor::{Priority, Strand};
+
+const MAGIC: &[u8; 8] = b"GSTRACE1";
+
+const TAG_FORMAT: u8 = 0;
+const TAG_BUFFER: u8 = 1;
+const TAG_METADATA: u8 = 2;
+
+/// Encoded bytes kept before they are written out.
+const CHUNK_SIZE: usize = 64 * 1024;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum TraceEvent {
+    /// The stream's format was negotiated, at `time_ns` on
+    /// `CLOCK_MONOTONIC`.
+    Format {
+        time_ns: u64,
+        width: u32,
+        height: u32,
+        /// The SPA video format.
+        format: u32,
+        framerate: (u32, u32),
+    },
+    /// A buffer with a new frame arrived, with the producer's PTS if it set
+    /// one.
+    Buffer { time_ns: u64, pts_ns: Option<u64> },
+    /// A buffer that only updated metadata, like the cursor.
+    Metadata { time_ns: u64 },
+}
+
+impl TraceEvent {
+    pub fn time_ns(&self) -> u64 {
+        match *self {
+            TraceEvent::Format { time_ns, .. }
+            | TraceEvent::Buffer { time_ns, .. }
+            | TraceEvent::Metadata { time_ns } => time_ns,
+        }
+    }
+}
+
+fn put_varint(out: &mut Vec<u8>, mut value: u64) {
+    while value >= 0x80 {
+        out.push(value as u8 | 0x80);
+        value >>= 7;
+    }
+    out.push(value as u8);
+}
+
+fn get_varint(data: &mut &[u8]) -> Result<u64> {
+    let mut value = 0;
+    for shift in (0..64).step_by(7) {
+        let Some((&byte, rest)) = data.split_first() else {
+            bail!("Trace is truncated");
+        };
+        *data = rest;
+        value |= ((byte & 0x7f) as u64) << shift;
+        if byte & 0x80 == 0 {
+            return Ok(value);
+        }
+    }
+    bail!("Invalid varint in trace")
+}
+
+fn zigzag(value: i64) -> u64 {
+    ((value << 1) ^ (value >> 63)) as u64
+}
+
+fn unzigzag(value: u64) -> i64 {
+    (value >> 1) as i64 ^ -((value & 1) as i64)
+}
+
+/// Encodes events, each relative to the one before.
+#[derive(Default)]
+struct TraceEncoder {
+    last_time: u64,
+    last_pts: u64,
+}
+
+impl TraceEncoder {
+    fn encode(&mut self, event: &TraceEvent, out: &mut Vec<u8>) {
+        // Events come from one clock, but don't trust it to never step back.
+        let time = event.time_ns().max(self.last_time);
+        let delta = time - self.last_time;
+        self.last_time = time;
+        match *event {
+            TraceEvent::Format {
+                width,
+                height,
+                format,
+                framerate: (num, denom),
+                ..
+            } => {
+                out.push(TAG_FORMAT);
+                put_varint(out, delta);
+                for value in [width, height, format, num, denom] {
+                    put_varint(out, value as u64);
+                }
+            }
+            TraceEvent::Buffer { pts_ns, .. } => {
+                out.push(TAG_BUFFER);
+                put_varint(out, delta);
+                // Zero for none, otherwise one more than the zigzagged
+                // difference to the previous PTS.
+                match pts_ns {
+                    Some(pts) => {
+                        put_varint(out, zigzag(pts.wrapping_sub(self.last_pts) as i64) + 1);
+                        self.last_pts = pts;
+                    }
+                    None => put_varint(out, 0),
+                }
+            }
+            TraceEvent::Metadata { .. } => {
+                out.push(TAG_METADATA);
+                put_varint(out, delta);
+            }
+        }
+    }
+}
+
+/// Decodes a whole trace file's contents.
+pub fn decode(data: &[u8]) -> Result<Vec<TraceEvent>> {
+    let Some(mut data) = data.strip_prefix(MAGIC) else {
+        bail!("Not a capture trace");
+    };
+    let (mut time_ns, mut last_pts) = (0u64, 0u64);
+    let mut events = Vec::new();
+    while let Some((&tag, rest)) = data.split_first() {
+        data = rest;
+        time_ns += get_varint(&mut data)?;
+        events.push(match tag {
+            TAG_FORMAT => {
+                let mut next = || get_varint(&mut data).map(|value| value as u32);
+                TraceEvent::Format {
+                    time_ns,
+                    width: next()?,
+                    height: next()?,
+                    format: next()?,
+                    framerate: (next()?, next()?),
+                }
+            }
+            TAG_BUFFER => {
+                let pts_ns = match get_varint(&mut data)? {
+                    0 => None,
+                    delta => {
+                        last_pts = last_pts.wrapping_add(unzigzag(delta - 1) as u64);
+                        Some(last_pts)
+                    }
+                };
+                TraceEvent::Buffer { time_ns, pts_ns }
+            }
+            TAG_METADATA => TraceEvent::Metadata { time_ns },
+            tag => bail!("Unknown trace event {tag}"),
+        });
+    }
+    Ok(events)
+}
+
+pub fn read_trace(path: &Path) -> Result<Vec<TraceEvent>> {
+    let data = fs::read(path).with_context(|| format!("Failed to read {}", path.display()))?;
+    decode(&data).with_context(|| format!("Failed to read {}", path.display()))
+}
+
+struct Output {
+    path: PathBuf,
+    file: File,
+    /// The first write error, after which nothing more is written.
+    error: Option<anyhow::Error>,
+}
+
+/// Records events to a trace file. Recording only encodes into memory; the
+/// file is written on the auxiliary executor.
+pub struct TraceRecorder {
+    encoder: TraceEncoder,
+    chunk: Vec<u8>,
+    events: u64,
+    output: Arc<Mutex<Output>>,
+    writes: Strand,
+}
+
+impl TraceRecorder {
+    pub fn create(path: &Path) -> Result<Self> {
+        let file =
+            File::create(path).with_context(|| format!("Failed to create {}", path.display()))?;
+        let mut chunk = Vec::with_capacity(CHUNK_SIZE);
+        chunk.extend_from_slice(MAGIC);
+        Ok(Self {
+            encoder: TraceEncoder::default(),
+            chunk,
+            events: 0,
+            output: Arc::new(Mutex::new(Output {
+                path: path.to_owned(),
+                file,
+                error: None,
+            })),
+            writes: Strand::new(Priority::Background),
+        })
+    }
+
+    pub fn record(&mut self, event: TraceEvent) {
+        self.encoder.encode(&event, &mut self.chunk);
+        self.events += 1;
+        if self.chunk.len() >= CHUNK_SIZE {
+            self.write_chunk();
+        }
+    }
+
+    fn write_chunk(&mut self) {
+        let chunk = mem::replace(&mut self.chunk, Vec::with_capacity(CHUNK_SIZE));
+        let output = self.output.clone();
+        self.writes.push(move || {
+            let mut output = output.lock().unwrap();
+            if output.error.is_none() {
+                let path = output.path.display().to_string();
+                let written = output.file.write_all(&chunk);
+                output.error = written
+                    .with_context(|| format!("Failed to write {path}"))
+                    .err();
+            }
+        });
+    }
+
+    /// Writes what is left and waits for it.
+    pub fn finish(mut self) -> Result<()> {
+        self.write_chunk();
+        self.writes.wait_idle()?;
+        let mut output = self.output.lock().unwrap();
+        if let Some(e) = output.error.take() {
+            return Err(e);
+        }
+        println!(
+            "Recorded {} capture events to {}",
+            self.events,
+            output.path.display()
+        );
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_trace_round_trip() {
+        let events = vec![
+            TraceEvent::Format {
+                time_ns: 5_000_000_000,
+                width: 1280,
+                height: 800,
+                format: 23,
+                framerate: (90, 1),
+            },
+            TraceEvent::Buffer {
+                time_ns: 5_011_000_000,
+                pts_ns: Some(5_010_000_000),
+            },
+            TraceEvent::Metadata {
+                time_ns: 5_015_000_000,
+            },
+            // PTS going backwards and a producer that stops setting it.
+            TraceEvent::Buffer {
+                time_ns: 5_022_100_000,
+                pts_ns: Some(5_009_000_000),
+            },
+            TraceEvent::Buffer {
+                time_ns: 5_200_000_000,
+                pts_ns: None,
+            },
+        ];
+        let mut encoder = TraceEncoder::default();
+        let mut data = MAGIC.to_vec();
+        for event in &events {
+            encoder.encode(event, &mut data);
+        }
+        assert_eq!(decode(&data).unwrap(), events);
+        assert!(decode(&data[..data.len() - 1]).is_err());
+        assert!(decode(b"not a trace").is_err());
+
+        // A frame at a steady rate takes a few bytes.
+        let mut frame = Vec::new();
+        encoder.encode(
+            &TraceEvent::Buffer {
+                time_ns: 5_216_666_667,
+                pts_ns: Some(5_025_666_667),
+            },
+            &mut frame,
+        );
+        assert!(frame.len() <= 9, "{} bytes", frame.len());
+    }
+}
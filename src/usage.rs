@@ -0,0 +1,328 @@
+//! Accounting of the recorder's own resource usage: CPU time per thread,
+//! memory, and busy time of the GPU engines it submits work to.
+//!
+//! Everything is read from procfs. GPU usage comes from the `drm-engine-*`
+//! keys that DRM drivers expose in the fdinfo of each open render node, so
+//! only work submitted through our own fds is counted.
+
+use std::{
+    collections::{BTreeMap, HashMap},
+    fs::{self, OpenOptions},
+    io::Write,
+    path::Path,
+    sync::{Arc, Mutex},
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, Context, Result};
+use nix::{
+    sys::resource::{getrusage, UsageWho},
+    unistd::{sysconf, SysconfVar},
+};
+
+use crate::executor::{self, Priority};
+
+#[derive(Debug, Clone, Default, PartialEq)]
+struct ThreadTimes {
+    name: String,
+    user: Duration,
+    system: Duration,
+}
+
+/// Resource usage of the whole process at one point in time.
+struct Snapshot {
+    time: Instant,
+    /// Threads alive at the time, by tid.
+    threads: HashMap<u32, ThreadTimes>,
+    /// Includes threads that have exited.
+    user: Duration,
+    system: Duration,
+    rss_kib: u64,
+    peak_rss_kib: u64,
+    /// Busy time per engine, summed over DRM clients.
+    engines: BTreeMap<String, Duration>,
+}
+
+impl Snapshot {
+    fn take(ticks_per_second: u64) -> Result<Self> {
+        let time = Instant::now();
+        let usage = getrusage(UsageWho::RUSAGE_SELF)?;
+        let timeval = |tv: nix::sys::time::TimeVal| {
+            Duration::new(tv.tv_sec() as u64, tv.tv_usec() as u32 * 1000)
+        };
+
+        let mut threads = HashMap::new();
+        for entry in fs::read_dir("/proc/self/task")? {
+            let entry = entry?;
+            let Ok(tid) = entry.file_name().to_string_lossy().parse() else {
+                continue;
+            };
+            // Threads can exit while we iterate.
+            if let Ok(stat) = fs::read_to_string(entry.path().join("stat")) {
+                if let Some(times) = parse_thread_stat(&stat, ticks_per_second) {
+                    threads.insert(tid, times);
+                }
+            }
+        }
+
+        let status = fs::read_to_string("/proc/self/status")?;
+        Ok(Self {
+            time,
+            threads,
+            user: timeval(usage.user_time()),
+            system: timeval(usage.system_time()),
+            rss_kib: status_kib(&status, "VmRSS").unwrap_or_default(),
+            // ru_maxrss is in KiB on Linux.
+            peak_rss_kib: usage.max_rss() as u64,
+            engines: drm_engine_usage(),
+        })
+    }
+}
+
+/// Parses utime and stime from `/proc/<pid>/task/<tid>/stat`.
+fn parse_thread_stat(stat: &str, ticks_per_second: u64) -> Option<ThreadTimes> {
+    // The name is in parentheses and may itself contain spaces or parentheses.
+    let name = &stat[stat.find('(')? + 1..stat.rfind(')')?];
+    let fields: Vec<&str> = stat[stat.rfind(')')? + 1..].split_whitespace().collect();
+    // Fields 14 and 15 in proc(5), counting from the pid as 1.
+    let ticks = |index: usize| -> Option<Duration> {
+        let ticks: u64 = fields.get(index)?.parse().ok()?;
+        Some(Duration::from_nanos(
+            ticks * 1_000_000_000 / ticks_per_second,
+        ))
+    };
+    Some(ThreadTimes {
+        name: name.to_string(),
+        user: ticks(11)?,
+        system: ticks(12)?,
+    })
+}
+
+fn status_kib(status: &str, key: &str) -> Option<u64> {
+    status
+        .lines()
+        .find_map(|line| line.strip_prefix(key)?.strip_prefix(':'))?
+        .trim()
+        .strip_suffix("kB")?
+        .trim()
+        .parse()
+        .ok()
+}
+
+/// Sums the `drm-engine-*` busy times of all DRM fds we have open.
+///
+/// Several fds can refer to the same DRM client (e.g. after dup), so each
+/// `drm-client-id` is only counted once.
+fn drm_engine_usage() -> BTreeMap<String, Duration> {
+    let mut clients = HashMap::new();
+    let Ok(entries) = fs::read_dir("/proc/self/fdinfo") else {
+        return BTreeMap::new();
+    };
+    for entry in entries.flatten() {
+        if let Ok(fdinfo) = fs::read_to_string(entry.path()) {
+            if let Some((client, engines)) = parse_drm_fdinfo(&fdinfo) {
+                clients.insert(client, engines);
+            }
+        }
+    }
+    let mut total = BTreeMap::new();
+    for engines in clients.into_values() {
+        for (engine, busy) in engines {
+            *total.entry(engine).or_default() += busy;
+        }
+    }
+    total
+}
+
+/// Returns the client id and engine busy times of a DRM fd's fdinfo, or
+/// `None` if the fd isn't a DRM client.
+fn parse_drm_fdinfo(fdinfo: &str) -> Option<(String, Vec<(String, Duration)>)> {
+    let mut client = None;
+    let mut engines = Vec::new();
+    for line in fdinfo.lines() {
+        let Some((key, value)) = line.split_once(':') else {
+            continue;
+        };
+        let value = value.trim();
+        if key == "drm-client-id" {
+            client = Some(value.to_string());
+        } else if let Some(engine) = key.strip_prefix("drm-engine-") {
+            // Some drivers also list capacities as drm-engine-capacity-*.
+            if let Some(ns) = value.strip_suffix(" ns").and_then(|ns| ns.parse().ok()) {
+                engines.push((engine.to_string(), Duration::from_nanos(ns)));
+            }
+        }
+    }
+    Some((client?, engines))
+}
+
+fn percent(busy: Duration, wall: Duration) -> f64 {
+    busy.as_secs_f64() * 100.0 / wall.as_secs_f64().max(f64::EPSILON)
+}
+
+fn mib(kib: u64) -> f64 {
+    kib as f64 / 1024.0
+}
+
+/// Describes the usage between two snapshots.
+fn summarize(mode: &str, before: &Snapshot, after: &Snapshot) -> String {
+    let wall = after.time - before.time;
+    let user = after.user.saturating_sub(before.user);
+    let system = after.system.saturating_sub(before.system);
+    let mut summary = format!(
+        "[{mode}] cpu {:.1}% (user {:.1}%, sys {:.1}%), rss {:.1} MiB (peak {:.1} MiB)",
+        percent(user + system, wall),
+        percent(user, wall),
+        percent(system, wall),
+        mib(after.rss_kib),
+        mib(after.peak_rss_kib),
+    );
+    for (engine, busy) in &after.engines {
+        let busy = busy.saturating_sub(before.engines.get(engine).copied().unwrap_or_default());
+        summary += &format!(", gpu {engine} {:.1}%", percent(busy, wall));
+    }
+
+    // Threads are grouped by name, so e.g. all session threads add up.
+    let mut threads: BTreeMap<&str, Duration> = BTreeMap::new();
+    for (tid, times) in &after.threads {
+        let (user, system) = match before.threads.get(tid) {
+            Some(old) => (
+                times.user.saturating_sub(old.user),
+                times.system.saturating_sub(old.system),
+            ),
+            None => (times.user, times.system),
+        };
+        *threads.entry(&times.name).or_default() += user + system;
+    }
+    let mut threads: Vec<_> = threads.into_iter().collect();
+    threads.sort_by(|a, b| b.1.cmp(&a.1));
+    let threads: Vec<String> = threads
+        .iter()
+        .map(|(name, busy)| format!("{name} {:.1}%", percent(*busy, wall)))
+        .collect();
+    summary += &format!("\n  threads: {}", threads.join(", "));
+    summary
+}
+
+/// Reports resource usage periodically while a mode runs, and once more for
+/// the whole run when it finishes.
+pub struct UsageMonitor {
+    mode: &'static str,
+    ticks_per_second: u64,
+    start: Snapshot,
+    /// The last periodic snapshot, taken out to stop the reports.
+    last: Arc<Mutex<Option<Snapshot>>>,
+}
+
+impl UsageMonitor {
+    /// Starts monitoring. An `interval` of zero only reports at the end.
+    pub fn start(mode: &'static str, interval: Duration) -> Result<Self> {
+        let ticks_per_second = sysconf(SysconfVar::CLK_TCK)?
+            .ok_or_else(|| anyhow!("CLK_TCK is not available"))?
+            as u64;
+        let start = Snapshot::take(ticks_per_second)?;
+        let last = Arc::new(Mutex::new(None));
+        if !interval.is_zero() {
+            *last.lock().unwrap() = Some(Snapshot::take(ticks_per_second)?);
+            let last = last.clone();
+            executor::every(interval, Priority::Background, move || {
+                let mut last = last.lock().unwrap();
+                let Some(previous) = last.as_mut() else {
+                    return false;
+                };
+                match Snapshot::take(ticks_per_second) {
+                    Ok(snapshot) => {
+                        println!("{}", summarize(mode, previous, &snapshot));
+                        *previous = snapshot;
+                        if let Some(summary) = executor::summary() {
+                            println!("  {summary}");
+                        }
+                    }
+                    Err(e) => eprintln!("Failed to read resource usage: {e:#}"),
+                }
+                true
+            });
+        }
+        Ok(Self {
+            mode,
+            ticks_per_second,
+            start,
+            last,
+        })
+    }
+
+    /// Prints the usage of the whole run and, if `log` is set, appends it as
+    /// one `key=value` line so runs can be compared.
+    pub fn finish(self, log: Option<&Path>) -> Result<()> {
+        self.last.lock().unwrap().take();
+        let end = Snapshot::take(self.ticks_per_second)?;
+        println!("Total {}", summarize(self.mode, &self.start, &end));
+
+        let Some(path) = log else {
+            return Ok(());
+        };
+        let wall = end.time - self.start.time;
+        let mut line = format!(
+            "mode={} wall_s={:.3} user_s={:.3} sys_s={:.3} rss_kib={} peak_rss_kib={}",
+            self.mode,
+            wall.as_secs_f64(),
+            end.user.saturating_sub(self.start.user).as_secs_f64(),
+            end.system.saturating_sub(self.start.system).as_secs_f64(),
+            end.rss_kib,
+            end.peak_rss_kib,
+        );
+        for (engine, busy) in &end.engines {
+            let busy =
+                busy.saturating_sub(self.start.engines.get(engine).copied().unwrap_or_default());
+            line += &format!(" gpu_{engine}_s={:.3}", busy.as_secs_f64());
+        }
+        let mut file = OpenOptions::new()
+            .create(true)
+            .append(true)
+            .open(path)
+            .with_context(|| format!("Failed to open {}", path.display()))?;
+        writeln!(file, "{line}")?;
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_thread_stat() {
+        let stat = "4242 (sink-a (b)) S 1 4242 4242 0 -1 4194368 120 0 0 0 250 75 0 0 20 0 9 0";
+        let times = parse_thread_stat(stat, 100).unwrap();
+        assert_eq!(times.name, "sink-a (b)");
+        assert_eq!(times.user, Duration::from_millis(2500));
+        assert_eq!(times.system, Duration::from_millis(750));
+    }
+
+    #[test]
+    fn test_parse_drm_fdinfo() {
+        let fdinfo = "pos:\t0\nflags:\t02100002\ndrm-driver:\ti915\ndrm-client-id:\t17\n\
+                      drm-engine-render:\t1500000 ns\ndrm-engine-video:\t250 ns\n\
+                      drm-engine-capacity-video:\t2\n";
+        let (client, engines) = parse_drm_fdinfo(fdinfo).unwrap();
+        assert_eq!(client, "17");
+        assert_eq!(
+            engines,
+            vec![
+                ("render".to_string(), Duration::from_micros(1500)),
+                ("video".to_string(), Duration::from_nanos(250)),
+            ]
+        );
+        assert!(parse_drm_fdinfo("pos:\t0\nflags:\t02\n").is_none());
+    }
+
+    #[test]
+    fn test_snapshot_of_self() {
+        let ticks = sysconf(SysconfVar::CLK_TCK).unwrap().unwrap() as u64;
+        let before = Snapshot::take(ticks).unwrap();
+        let after = Snapshot::take(ticks).unwrap();
+        assert!(after.rss_kib > 0);
+        assert!(after.threads.len() >= 1);
+        assert!(summarize("test", &before, &after).starts_with("[test] cpu"));
+    }
+}
@@ -0,0 +1,130 @@
+//! Small helpers around VA-API operations that cros-libva doesn't wrap directly.
+
+use anyhow::{anyhow, Result};
+use cros_codecs::libva::{Display, Image, Surface, VAImageFormat};
+
+/// Largest frame the driver's H.264 encoder accepts, or `None` if it doesn't
+/// say.
+pub fn max_encode_size(display: &Display) -> Option<(u32, u32)> {
+    use cros_codecs::libva::*;
+
+    let mut attribs = [
+        VAConfigAttrib {
+            type_: VAConfigAttribType::VAConfigAttribMaxPictureWidth,
+            value: 0,
+        },
+        VAConfigAttrib {
+            type_: VAConfigAttribType::VAConfigAttribMaxPictureHeight,
+            value: 0,
+        },
+    ];
+    let ret = unsafe {
+        vaGetConfigAttributes(
+            display.handle(),
+            VAProfile::VAProfileH264ConstrainedBaseline,
+            VAEntrypoint::VAEntrypointEncSlice,
+            attribs.as_mut_ptr(),
+            attribs.len() as i32,
+        )
+    };
+    let [width, height] = attribs.map(|attrib| attrib.value);
+    if ret != VA_STATUS_SUCCESS as i32
+        || width == VA_ATTRIB_NOT_SUPPORTED
+        || height == VA_ATTRIB_NOT_SUPPORTED
+    {
+        return None;
+    }
+    Some((width, height))
+}
+
+/// Looks up the driver's NV12 image format, needed to map surfaces.
+pub fn nv12_image_format(display: &Display) -> Result<VAImageFormat> {
+    image_format(display, b"NV12")
+}
+
+pub fn image_format(display: &Display, fourcc: &[u8; 4]) -> Result<VAImageFormat> {
+    display
+        .query_image_formats()
+        .map_err(|e| anyhow!("Failed to query image formats: {e:?}"))?
+        .into_iter()
+        .find(|f| f.fourcc == u32::from_le_bytes(*fourcc))
+        .ok_or_else(|| {
+            anyhow!(
+                "Driver has no {} image format",
+                String::from_utf8_lossy(fourcc)
+            )
+        })
+}
+
+/// Maps an NV12 surface and passes each row of the Y plane, then each row of
+/// the UV plane, to `row`, without the pitch padding.
+///
+/// The surface's own memory is mapped when the driver supports
+/// vaDeriveImage; otherwise cros-libva falls back to vaGetImage.
+pub fn read_nv12(
+    surface: &Surface<()>,
+    format: VAImageFormat,
+    mut row: impl FnMut(&[u8]),
+) -> Result<()> {
+    let (width, height) = surface.size();
+    surface
+        .sync()
+        .map_err(|e| anyhow!("Failed to sync surface: {e:?}"))?;
+    let image = Image::create_from(surface, format, (width, height), (width, height))
+        .map_err(|e| anyhow!("Failed to map surface: {e:?}"))?;
+    let va_image = *image.image();
+    let data: &[u8] = image.as_ref();
+    let width = width as usize;
+    for (plane, rows) in [(0, height as usize), (1, height as usize / 2)] {
+        let offset = va_image.offsets[plane] as usize;
+        let pitch = va_image.pitches[plane] as usize;
+        for r in 0..rows {
+            let start = offset + r * pitch;
+            row(&data[start..start + width]);
+        }
+    }
+    Ok(())
+}
+
+/// Copies a tightly packed NV12 frame into a surface.
+///
+/// The frame is written directly into the mapped surface. If the mapping is
+/// a staging image, dropping it uploads it with vaPutImage.
+pub fn write_nv12(surface: &Surface<()>, format: VAImageFormat, frame: &[u8]) -> Result<()> {
+    let (width, height) = surface.size();
+    let mut image = Image::create_from(surface, format, (width, height), (width, height))
+        .map_err(|e| anyhow!("Failed to map surface: {e:?}"))?;
+    let va_image = *image.image();
+    let data: &mut [u8] = image.as_mut();
+    let (width, height) = (width as usize, height as usize);
+    for (plane, rows, src_offset) in [(0, height, 0), (1, height / 2, width * height)] {
+        let offset = va_image.offsets[plane] as usize;
+        let pitch = va_image.pitches[plane] as usize;
+        for r in 0..rows {
+            let dst = offset + r * pitch;
+            let src = src_offset + r * width;
+            data[dst..dst + width].copy_from_slice(&frame[src..src + width]);
+        }
+    }
+    Ok(())
+}
+
+/// Copies a tightly packed single-plane image, e.g. ARGB, into a surface.
+pub fn write_packed(
+    surface: &Surface<()>,
+    format: VAImageFormat,
+    bytes_per_pixel: usize,
+    data: &[u8],
+) -> Result<()> {
+    let (width, height) = surface.size();
+    let mut image = Image::create_from(surface, format, (width, height), (width, height))
+        .map_err(|e| anyhow!("Failed to map surface: {e:?}"))?;
+    let va_image = *image.image();
+    let mapped: &mut [u8] = image.as_mut();
+    let row_len = width as usize * bytes_per_pixel;
+    for (r, row) in data.chunks_exact(row_len).take(height as usize).enumerate() {
+        let dst = va_image.offsets[0] as usize + r * va_image.pitches[0] as usize;
+        mapped[dst..dst + row_len].copy_from_slice(row);
+    }
+    Ok(())
+}
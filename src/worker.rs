@@ -0,0 +1,176 @@
+use std::{
+    fs::File,
+    os::fd::OwnedFd,
+    path::Path,
+    sync::{
+        atomic::{AtomicBool, Ordering},
+        Arc,
+    },
+    time::{Duration, Instant},
+};
+
+use anyhow::{anyhow, Context, Result};
+use cros_codecs::{
+    backend::vaapi::surface_pool::VaSurfacePool,
+    decoder::FramePool,
+    libva::{Display, UsageHint, VA_RT_FORMAT_YUV420},
+    video_frame::generic_dma_video_frame::GenericDmaVideoFrame,
+    Fourcc, FrameLayout, PlaneLayout, Resolution,
+};
+
+use crate::{
+    encode_ffmpeg::{Encoder, EncoderSettings},
+    fanout::{FanOut, FileSink},
+    ipc::{monotonic_ns, wait_fence, FrameHeader, FrameSocket, LatencyStats},
+    rate,
+};
+
+/// How long a frame's fence may take to signal before the frame is dropped.
+const FENCE_TIMEOUT: Duration = Duration::from_millis(100);
+const REPORT_INTERVAL: Duration = Duration::from_secs(5);
+
+/// Encoder worker process: receives DMABUF frames from a `--serve-frames`
+/// capture process, imports them into its own VA display and encodes them.
+///
+/// `render_node` selects the GPU, so several workers can spread over
+/// different encoders.
+pub fn run(
+    socket_path: &Path,
+    output: &Path,
+    render_node: Option<&Path>,
+    settings: EncoderSettings,
+    running: Arc<AtomicBool>,
+) -> Result<()> {
+    let socket = FrameSocket::connect(socket_path)?;
+    let display = match render_node {
+        Some(path) => Display::open_drm_display(path)
+            .map_err(|e| anyhow!("Failed to open {}: {e:?}", path.display()))?,
+        None => Display::open().context("Failed to open VA display")?,
+    };
+    let mut fanout = FanOut::new();
+    fanout.add_primary(
+        "output",
+        2 * settings.framerate as usize,
+        FileSink::create(output)?,
+    )?;
+    let mut pool: Option<VaSurfacePool<()>> = None;
+    let mut encoder: Option<Encoder> = None;
+    let mut ipc_latency = LatencyStats::default();
+    let mut import_time = LatencyStats::default();
+    let mut fence_timeouts = 0;
+    let mut last_report = Instant::now();
+
+    while running.load(Ordering::SeqCst) {
+        let Some((header, fds)) = socket.recv_frame()? else {
+            println!("Capture process closed the connection");
+            break;
+        };
+        ipc_latency.add(monotonic_ns().saturating_sub(header.send_time_ns));
+
+        let import_start = Instant::now();
+        let resolution = Resolution {
+            width: header.width,
+            height: header.height,
+        };
+        if pool.as_ref().map(|p| p.coded_resolution()) != Some(resolution) {
+            let mut new_pool = VaSurfacePool::new(
+                display.clone(),
+                VA_RT_FORMAT_YUV420,
+                Some(UsageHint::USAGE_HINT_VPP_WRITE | UsageHint::USAGE_HINT_VPP_READ),
+                resolution,
+            );
+            new_pool
+                .add_frames(vec![(); rate::pool_size(settings.framerate as u32)])
+                .expect("Failed to add frames to pool");
+            pool = Some(new_pool);
+        }
+        let surface = pool
+            .as_mut()
+            .unwrap()
+            .get_surface()
+            .ok_or_else(|| anyhow!("Failed to get surface from pool"))?;
+        let imported = import_frame(&header, fds, std::borrow::Borrow::borrow(&surface))?;
+        // The capture side can recycle its surface as soon as we have our copy.
+        socket.send_release(header.seq)?;
+        if imported {
+            import_time.add(import_start.elapsed().as_nanos() as u64);
+            let frame = Arc::new(surface);
+            if encoder.is_none() {
+                encoder = Some(Encoder::new(settings, &frame).context("Failed to create encoder")?);
+            }
+            let encoder = encoder.as_mut().unwrap();
+            encoder.encode(frame)?;
+            while let Some(packet) = encoder.poll_packet()? {
+                fanout.send(&packet)?;
+            }
+        } else {
+            fence_timeouts += 1;
+        }
+
+        if last_report.elapsed() >= REPORT_INTERVAL {
+            if let Some(summary) = ipc_latency.take_summary() {
+                println!("Frame IPC latency: {summary}");
+            }
+            if let Some(summary) = import_time.take_summary() {
+                println!("Frame import: {summary}");
+            }
+            if fence_timeouts > 0 {
+                println!("Dropped {fence_timeouts} frames whose fence timed out");
+                fence_timeouts = 0;
+            }
+            last_report = Instant::now();
+        }
+    }
+
+    if let Some(mut encoder) = encoder {
+        for packet in encoder.drain_packets()? {
+            fanout.send(&packet)?;
+        }
+    }
+    fanout.finish()
+}
+
+/// Copies the frame into `surface`. Returns false if its fence didn't signal
+/// in time, in which case the frame is dropped rather than read while the
+/// GPU may still be writing it.
+fn import_frame(
+    header: &FrameHeader,
+    mut fds: Vec<OwnedFd>,
+    surface: &cros_codecs::libva::Surface<()>,
+) -> Result<bool> {
+    if header.has_fence != 0 {
+        let fence = fds.pop().ok_or_else(|| anyhow!("Missing frame fence"))?;
+        if !wait_fence(&fence, FENCE_TIMEOUT)? {
+            return Ok(false);
+        }
+    }
+    if fds.len() != header.num_objects as usize {
+        return Err(anyhow!(
+            "Expected {} DMABUF fds, got {}",
+            header.num_objects,
+            fds.len()
+        ));
+    }
+
+    let frame_layout = FrameLayout {
+        format: (Fourcc::from(header.fourcc), header.modifier),
+        size: Resolution {
+            width: header.width,
+            height: header.height,
+        },
+        planes: (0..header.num_planes as usize)
+            .map(|plane| PlaneLayout {
+                buffer_index: header.object_index[plane] as usize,
+                offset: header.offsets[plane] as usize,
+                stride: header.strides[plane] as usize,
+            })
+            .collect(),
+    };
+    let files = fds.into_iter().map(File::from).collect();
+    let dma_frame = GenericDmaVideoFrame::new(files, frame_layout)
+        .map_err(|e| anyhow!("Failed to create GenericDmaVideoFrame: {e:?}"))?;
+    dma_frame
+        .copy_to_surface(surface)
+        .map_err(|e| anyhow!("Failed to import frame: {e:?}"))?;
+    Ok(true)
+}